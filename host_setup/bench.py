@@ -0,0 +1,346 @@
+#!/usr/bin/env python3
+"""
+Benchmark driver for the firmware's benchmark mode (main/bench.c)
+
+Each test measures one leg of the bridge on its own:
+
+  loopback   host -> USB -> firmware echo -> USB -> host      (bridge stopped)
+  wifi-tx    firmware generates UDP frames onto WiFi          (bridge stopped)
+  wifi-sink  firmware counts UDP frames from WiFi and drops them
+             (bridge stopped; send traffic with "udp-send" from another host)
+  full       host -> TAP -> USB -> WiFi -> reflector and back (bridge running;
+             run "reflect" on a machine on the WiFi side)
+  cycles     CPU cycles the firmware spends per bridged frame in one direction
+             (bridge running; drive traffic meanwhile, e.g. with "full")
+
+The loopback test opens the USB tty directly, so stop bridge_usb.py first.
+wifi-tx and wifi-sink go through the bridge's control socket when it is
+running, or the tty otherwise. Every test reports packets per second,
+Mbit/s and latency (or cycle count) percentiles.
+"""
+
+import argparse
+import select
+import socket
+import struct
+import sys
+import time
+
+import esp_frame
+from bridge_usb import CTL_SOCKET
+from esp_ctl import CtlError, DeviceLink, open_link
+
+BENCH_MODE_USB_LOOPBACK = 1
+BENCH_MODE_WIFI_TX = 2
+BENCH_MODE_WIFI_SINK = 3
+BENCH_MODE_CYCLES_USB = 4
+BENCH_MODE_CYCLES_WIFI = 5
+
+# main/bench.h
+BENCH_START = struct.Struct("<BBHII6s4s4sHH")
+BENCH_RESULT = struct.Struct("<BBHIIIIIIIII")
+
+# Test payloads start with a sequence number and a send timestamp
+PROBE = struct.Struct("<IQ")
+
+DEFAULT_PORT = 5201
+
+
+def bench_start(link, mode, payload_len=0, duration_ms=0, rate_pps=0,
+                dst_mac=b"\0" * 6, src_ip=b"\0" * 4, dst_ip=b"\0" * 4,
+                src_port=0, dst_port=0):
+    body = BENCH_START.pack(mode, 0, payload_len, duration_ms, rate_pps,
+                            dst_mac, src_ip, dst_ip, src_port, dst_port)
+    link.request(esp_frame.CMD_BENCH_START, body)
+
+
+def bench_result(link, stop=False):
+    cmd = esp_frame.CMD_BENCH_STOP if stop else esp_frame.CMD_BENCH_RESULT
+    fields = BENCH_RESULT.unpack(link.request(cmd)[:BENCH_RESULT.size])
+    keys = ("mode", "running", "reserved", "elapsed_us", "packets", "bytes",
+            "errors", "samples", "p50", "p90", "p99", "max")
+    return dict(zip(keys, fields))
+
+
+def device_wait(link, seconds):
+    """Sleep, printing device logs if the tty is ours"""
+    deadline = time.monotonic() + seconds
+    while True:
+        left = deadline - time.monotonic()
+        if left <= 0:
+            return
+        if isinstance(link, DeviceLink):
+            link.poll(min(left, 0.5))
+        else:
+            time.sleep(min(left, 0.5))
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0.0
+    return sorted_values[(len(sorted_values) - 1) * p // 100]
+
+
+def report(title, packets, nbytes, seconds, latencies_us, lost=None, unit="latency"):
+    seconds = max(seconds, 1e-9)
+    lat = sorted(latencies_us)
+    print(f"{title}:")
+    print(f"  {packets} packets in {seconds:.3f} s: "
+          f"{packets / seconds:.0f} pps, {nbytes * 8 / seconds / 1e6:.2f} Mbit/s")
+    if lost is not None:
+        print(f"  lost: {lost}")
+    if lat:
+        print(f"  {unit} (us): p50 {percentile(lat, 50):.0f}  p90 {percentile(lat, 90):.0f}  "
+              f"p99 {percentile(lat, 99):.0f}  max {lat[-1]:.0f}  ({len(lat)} samples)")
+
+
+def report_device(title, res, unit, scale="us"):
+    print(f"{title} (device side):")
+    seconds = max(res["elapsed_us"] / 1e6, 1e-9)
+    print(f"  {res['packets']} packets, {res['errors']} errors in {seconds:.3f} s: "
+          f"{res['packets'] / seconds:.0f} pps, {res['bytes'] * 8 / seconds / 1e6:.2f} Mbit/s")
+    if res["samples"]:
+        print(f"  {unit} ({scale}): p50 {res['p50']}  p90 {res['p90']}  p99 {res['p99']}  "
+              f"max {res['max']}  ({res['samples']} samples)")
+
+
+def probe(seq, size):
+    head = PROBE.pack(seq, time.monotonic_ns())
+    return head + bytes(max(size - len(head), 0))
+
+
+def run_pipelined(send, recv, count, window, size, timeout=1.0):
+    """
+    Keep up to window probes in flight until count have been sent and the
+    rest answered or given up on after timeout. Returns
+    (received, bytes, seconds, rtts_us).
+    """
+    sent = received = nbytes = inflight = 0
+    rtts = []
+    start = last_rx = last_ok = time.monotonic()
+    while sent < count or inflight:
+        while sent < count and inflight < window:
+            send(probe(sent, size))
+            sent += 1
+            inflight += 1
+        payloads = [p for p in recv(0.1) if len(p) >= PROBE.size]
+        now = time.monotonic()
+        if payloads:
+            done_ns = time.monotonic_ns()
+            for payload in payloads:
+                _, t_ns = PROBE.unpack_from(payload)
+                rtts.append((done_ns - t_ns) / 1000)
+                nbytes += len(payload)
+            received += len(payloads)
+            inflight = max(inflight - len(payloads), 0)
+            last_rx = last_ok = now
+        elif now - last_rx > timeout:
+            # Whatever is still outstanding is lost
+            inflight = 0
+            last_rx = now
+    return received, nbytes, last_ok - start, rtts
+
+
+def cmd_loopback(args):
+    link = DeviceLink(args.dev, args.crc)
+    try:
+        bench_start(link, BENCH_MODE_USB_LOOPBACK)
+
+        def recv(timeout):
+            _, data = link.poll(timeout)
+            data, link.data = link.data + data, []
+            return data
+
+        received, nbytes, seconds, rtts = run_pipelined(
+            lambda p: link.write(link.encoder.encode(p)), recv,
+            args.count, args.window, args.size)
+        res = bench_result(link, stop=True)
+    finally:
+        link.close()
+    # Each frame crosses the link twice
+    report("USB loopback", received, nbytes * 2, seconds, rtts,
+           lost=args.count - received, unit="round trip")
+    report_device("USB loopback", res, "header to echo")
+
+
+def parse_mac(text):
+    return bytes(int(b, 16) for b in text.split(":"))
+
+
+def cmd_wifi_tx(args):
+    link = open_link(args.socket, args.dev, args.crc)
+    try:
+        bench_start(link, BENCH_MODE_WIFI_TX, payload_len=args.size,
+                    duration_ms=int(args.duration * 1000), rate_pps=args.rate,
+                    dst_mac=parse_mac(args.dst_mac),
+                    src_ip=socket.inet_aton(args.src_ip),
+                    dst_ip=socket.inet_aton(args.dst_ip),
+                    src_port=args.port, dst_port=args.port)
+        while True:
+            device_wait(link, 0.5)
+            res = bench_result(link)
+            if not res["running"]:
+                break
+    finally:
+        link.close()
+    report_device("WiFi UDP generator", res, "driver TX call")
+
+
+def cmd_wifi_sink(args):
+    link = open_link(args.socket, args.dev, args.crc)
+    try:
+        bench_start(link, BENCH_MODE_WIFI_SINK, dst_port=args.port)
+        print(f"Counting UDP port {args.port} for {args.duration} s...")
+        device_wait(link, args.duration)
+        res = bench_result(link, stop=True)
+    finally:
+        link.close()
+    report_device("WiFi UDP sink", res, "inter-arrival gap")
+
+
+def cmd_cycles(args):
+    mode = BENCH_MODE_CYCLES_USB if args.dir == "usb" else BENCH_MODE_CYCLES_WIFI
+    link = open_link(args.socket, args.dev, args.crc)
+    try:
+        bench_start(link, mode)
+        print(f"Profiling {args.dir} -> {'wifi' if args.dir == 'usb' else 'usb'} "
+              f"for {args.duration} s; send traffic through the bridge now...")
+        device_wait(link, args.duration)
+        res = bench_result(link, stop=True)
+    finally:
+        link.close()
+    report_device("Bridge data path", res, "cycles per frame", scale="cycles")
+    if res["samples"]:
+        print(f"  p50 {res['p50'] / args.mhz:.1f} us of CPU per frame at {args.mhz} MHz")
+
+
+def cmd_full(args):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.connect((args.target, args.port))
+    sock.setblocking(False)
+
+    def recv(timeout):
+        out = []
+        r, _, _ = select.select([sock], [], [], timeout)
+        while r:
+            try:
+                out.append(sock.recv(65536))
+            except BlockingIOError:
+                break
+        return out
+
+    received, nbytes, seconds, rtts = run_pipelined(
+        sock.send, recv, args.count, args.window, args.size)
+    sock.close()
+    report(f"Full path via {args.target}", received, nbytes * 2, seconds, rtts,
+           lost=args.count - received, unit="round trip")
+
+
+def cmd_reflect(args):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("", args.port))
+    print(f"Reflecting UDP on port {args.port}")
+    while True:
+        data, peer = sock.recvfrom(65536)
+        sock.sendto(data, peer)
+
+
+def cmd_udp_send(args):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.connect((args.target, args.port))
+    interval = 1.0 / args.rate if args.rate else 0
+    start = time.monotonic()
+    seq = 0
+    while time.monotonic() - start < args.duration:
+        sock.send(probe(seq, args.size))
+        seq += 1
+        if interval:
+            delay = start + seq * interval - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+    seconds = time.monotonic() - start
+    report("UDP sender", seq, seq * args.size, seconds, [])
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="ESP32 WiFi USB adapter benchmark")
+    sub = parser.add_subparsers(dest="test", required=True)
+
+    def device_opts(p, socket_ok=True):
+        p.add_argument("--dev", "-d", default=None,
+                       help="USB serial device (default: auto-detect)")
+        p.add_argument("--crc", action="store_true",
+                       help="Append a CRC-32 to frames sent to the ESP32")
+        if socket_ok:
+            p.add_argument("--socket", "-s", default=CTL_SOCKET,
+                           help="Control socket of a running bridge_usb.py")
+
+    p = sub.add_parser("loopback", help="USB link round trip (firmware echoes frames)")
+    device_opts(p, socket_ok=False)
+    p.add_argument("--size", type=int, default=1400, help="Frame size in bytes")
+    p.add_argument("--count", type=int, default=10000, help="Frames to send")
+    p.add_argument("--window", type=int, default=8, help="Frames in flight")
+    p.set_defaults(func=cmd_loopback)
+
+    p = sub.add_parser("wifi-tx", help="Firmware UDP generator onto WiFi")
+    device_opts(p)
+    p.add_argument("--src-ip", required=True, help="Source IP for generated frames")
+    p.add_argument("--dst-ip", required=True, help="Destination IP")
+    p.add_argument("--dst-mac", required=True,
+                   help="Next-hop MAC (the destination or the gateway)")
+    p.add_argument("--port", type=int, default=DEFAULT_PORT, help="UDP port")
+    p.add_argument("--size", type=int, default=1472, help="UDP payload bytes")
+    p.add_argument("--rate", type=int, default=0, help="Packets per second (0: unlimited)")
+    p.add_argument("--duration", type=float, default=5.0, help="Seconds")
+    p.set_defaults(func=cmd_wifi_tx)
+
+    p = sub.add_parser("wifi-sink", help="Firmware counts UDP frames from WiFi")
+    device_opts(p)
+    p.add_argument("--port", type=int, default=DEFAULT_PORT, help="UDP port to count")
+    p.add_argument("--duration", type=float, default=10.0, help="Seconds")
+    p.set_defaults(func=cmd_wifi_sink)
+
+    p = sub.add_parser("full", help="Round trip through the running bridge")
+    p.add_argument("target", help="Host running 'bench.py reflect' on the WiFi side")
+    p.add_argument("--port", type=int, default=DEFAULT_PORT, help="UDP port")
+    p.add_argument("--size", type=int, default=1400, help="UDP payload bytes")
+    p.add_argument("--count", type=int, default=10000, help="Probes to send")
+    p.add_argument("--window", type=int, default=8, help="Probes in flight")
+    p.set_defaults(func=cmd_full)
+
+    p = sub.add_parser("cycles", help="CPU cycles per frame inside the running bridge")
+    device_opts(p)
+    p.add_argument("--dir", choices=("usb", "wifi"), default="usb",
+                   help="Frames from USB (to WiFi) or from WiFi (to USB)")
+    p.add_argument("--duration", type=float, default=10.0, help="Seconds")
+    p.add_argument("--mhz", type=int, default=160, help="CPU clock, for the time per frame")
+    p.set_defaults(func=cmd_cycles)
+
+    p = sub.add_parser("reflect", help="UDP echo server for the full-path test")
+    p.add_argument("--port", type=int, default=DEFAULT_PORT, help="UDP port")
+    p.set_defaults(func=cmd_reflect)
+
+    p = sub.add_parser("udp-send", help="UDP traffic source for the sink test")
+    p.add_argument("target", help="Address the adapter's host uses on the WiFi network")
+    p.add_argument("--port", type=int, default=DEFAULT_PORT, help="UDP port")
+    p.add_argument("--size", type=int, default=1472, help="UDP payload bytes")
+    p.add_argument("--rate", type=int, default=0, help="Packets per second (0: unlimited)")
+    p.add_argument("--duration", type=float, default=10.0, help="Seconds")
+    p.set_defaults(func=cmd_udp_send)
+
+    return parser.parse_args()
+
+
+def main():
+    args = parse_args()
+    try:
+        args.func(args)
+    except KeyboardInterrupt:
+        print()
+    except (OSError, CtlError) as e:
+        print(f"Error: {e}", file=sys.stderr)
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
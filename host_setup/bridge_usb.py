@@ -4,24 +4,67 @@ USB to TAP Bridge
 Bridges data between ESP32 USB serial and TAP interface
 """
 
-import serial
 import struct
-import socket
 import select
 import sys
 import os
 import fcntl
 import argparse
 import glob
+import errno
+import termios
+import re
+import socket
+import subprocess
+import threading
+import time
+import tty
+
+import esp_config
+import esp_frame
+import esp_gso
 
 TAP_IF = "esp0"           # safer than tap0, less likely to conflict
-BAUDRATE = 921600         # High speed for network traffic
 ESPRESSIF_USB_VID = "303a"  # Espressif vendor ID (seed XIAO ESP32-C3 uses this)
 
 # TUN/TAP ioctl constants
 TUNSETIFF = 0x400454ca
+TUNSETOFFLOAD = 0x400454d0
+TUNSETVNETHDRSZ = 0x400454d8
 IFF_TAP = 0x0002
+IFF_MULTI_QUEUE = 0x0100
 IFF_NO_PI = 0x1000
+IFF_VNET_HDR = 0x4000
+TUN_F_CSUM = 0x01
+TUN_F_TSO4 = 0x02
+TUN_F_TSO6 = 0x04
+TUN_F_TSO_ECN = 0x08
+
+# Frames read from TAP in one go are packed into a single USB write, up to
+# this many bytes (a multiple of the 64-byte USB bulk packet size)
+USB_BATCH_BYTES = 4096
+# Largest single read from the tty; several framed packets per syscall
+USB_READ_BYTES = 65536
+# Largest TAP read in vnet mode: a 64 KB GSO super-frame plus its header
+TAP_GSO_READ_BYTES = 65536 + esp_gso.VNET_HDR_LEN
+# Keepalive window for the device's flow control: it repeats a pause every
+# 20 ms (CTRL_FLOW_REFRESH_MS) while the queue is full, and the TAP resumes
+# on its own only once no pause has arrived for this long, so a lost resume
+# or a reset device cannot stall it
+FLOW_PAUSE_MAX = 0.05
+
+
+def ctl_socket_path(tap_if):
+    """Control requests from esp_ctl.py / bench.py are relayed through this socket"""
+    return f"/run/{tap_if}-bridge.sock"
+
+
+CTL_SOCKET = ctl_socket_path(TAP_IF)
+
+
+def tap_name(index):
+    """Interface of the index-th adapter with --all: esp0, esp1, ..."""
+    return f"{TAP_IF[:-1]}{index}"
 
 
 def parse_args():
@@ -32,6 +75,69 @@ def parse_args():
         help="USB serial device (e.g. /dev/ttyACM1). "
              "If omitted, auto-detect ESP32 (VID 303a) on /dev/ttyACM*"
     )
+    parser.add_argument(
+        "--tap",
+        default=None,
+        help=f"TAP interface to create (default: {TAP_IF})"
+    )
+    parser.add_argument(
+        "--all",
+        action="store_true",
+        help=f"Bridge every ESP32 found, each in its own process, as "
+             f"{tap_name(0)}, {tap_name(1)}, ... in USB port order "
+             f"(see setup_routing.py --multipath)"
+    )
+    parser.add_argument(
+        "--crc",
+        action="store_true",
+        help="Append a CRC-32 to every frame sent to the ESP32"
+    )
+    parser.add_argument(
+        "--vnet",
+        action="store_true",
+        help="Open the TAP with IFF_VNET_HDR and enable checksum/TSO offload; "
+             "the kernel hands over 64 KB TCP super-frames which the bridge "
+             "segments, so each TAP read moves many packets"
+    )
+    parser.add_argument(
+        "--device-gso",
+        action="store_true",
+        help="With --vnet, send super-frames and partial checksums to the "
+             "ESP32 as they are and let it segment them (firmware built with "
+             "CONFIG_BRIDGE_GSO); not combinable with --crc"
+    )
+    parser.add_argument(
+        "--ctl-socket",
+        default=None,
+        help=f"Unix socket for control requests (default: {ctl_socket_path('<tap>')}); "
+             "'none' disables it"
+    )
+    parser.add_argument(
+        "--queues", "-q",
+        type=int,
+        default=1,
+        help="Number of TAP queues (IFF_MULTI_QUEUE), each served by its own "
+             "thread (default: 1, single-threaded epoll loop)"
+    )
+    parser.add_argument(
+        "--config",
+        action="append",
+        default=[],
+        metavar="NAME=VALUE",
+        help="Apply a firmware setting before bridging (repeatable; see "
+             "esp_ctl.py config)"
+    )
+    parser.add_argument(
+        "--config-file",
+        metavar="PROFILE",
+        help="Apply the settings of a JSON profile before bridging; "
+             "--config entries override it"
+    )
+    parser.add_argument(
+        "--save-config",
+        action="store_true",
+        help="Also store the --config/--config-file settings on the ESP32"
+    )
     return parser.parse_args()
 
 
@@ -59,15 +165,22 @@ def find_usb_parent_sysfs(tty_path):
     return None
 
 
-def detect_esp32_acm():
+def _port_key(sysfs_usb):
+    """Sort key for a USB device path such as 1-2.10: by hub port, numerically"""
+    name = os.path.basename(sysfs_usb)
+    return [int(p) if p.isdigit() else p for p in re.split(r"(\d+)", name)]
+
+
+def detect_esp32_acms():
     """
-    Auto-detect ESP32 (Espressif VID 303a) among /dev/ttyACM* devices.
-    Returns path string or None.
+    Find every ESP32 (Espressif VID 303a) among /dev/ttyACM* devices.
+    Returns their paths in USB port order, so a board keeps its place (and
+    interface name with --all) across reboots and re-enumeration.
     """
     candidates = sorted(glob.glob("/dev/ttyACM*"))
     if not candidates:
         print("Auto-detect: no /dev/ttyACM* devices found")
-        return None
+        return []
 
     print("Auto-detect: scanning /dev/ttyACM* for ESP32 (VID 303a)...")
     esp_ports = []
@@ -87,9 +200,19 @@ def detect_esp32_acm():
             print(f"  {dev}: failed to read idVendor/idProduct")
             continue
 
-        print(f"  {dev}: VID={vid}, PID={pid}")
+        print(f"  {dev}: VID={vid}, PID={pid}, port {os.path.basename(sysfs_usb)}")
         if vid == ESPRESSIF_USB_VID:
-            esp_ports.append(dev)
+            esp_ports.append((_port_key(sysfs_usb), dev))
+
+    return [dev for _, dev in sorted(esp_ports)]
+
+
+def detect_esp32_acm():
+    """
+    Auto-detect ESP32 (Espressif VID 303a) among /dev/ttyACM* devices.
+    Returns path string or None.
+    """
+    esp_ports = detect_esp32_acms()
 
     if len(esp_ports) == 1:
         print(f"Auto-detect: selected {esp_ports[0]} (Espressif VID 303a)")
@@ -98,20 +221,513 @@ def detect_esp32_acm():
         print("Auto-detect: multiple ESP32-like devices found:")
         for p in esp_ports:
             print(f"  - {p}")
-        print("Using the first one; specify --dev explicitly if this is wrong.")
+        print("Using the first one; specify --dev explicitly if this is wrong "
+              "(or --all to bridge all of them).")
         return esp_ports[0]
-    else:
-        print("Auto-detect: no ESP32 (VID 303a) found on /dev/ttyACM*")
-        print("Falling back to first /dev/ttyACM* device.")
-        return candidates[0]
 
+    candidates = sorted(glob.glob("/dev/ttyACM*"))
+    if not candidates:
+        return None
+    print("Auto-detect: no ESP32 (VID 303a) found on /dev/ttyACM*")
+    print("Falling back to first /dev/ttyACM* device.")
+    return candidates[0]
+
+
+def create_tap(name=TAP_IF, vnet=False, queues=1):
+    """Create and configure TAP interface; returns one fd per queue"""
+    flags = IFF_TAP | IFF_NO_PI
+    if vnet:
+        flags |= IFF_VNET_HDR
+    if queues > 1:
+        flags |= IFF_MULTI_QUEUE
+
+    fds = []
+    try:
+        for _ in range(queues):
+            tap_fd = os.open("/dev/net/tun", os.O_RDWR)
+            fds.append(tap_fd)
+            ifr = struct.pack('16sH', name.encode(), flags)
+            fcntl.ioctl(tap_fd, TUNSETIFF, ifr)
+            if vnet:
+                fcntl.ioctl(tap_fd, TUNSETVNETHDRSZ, struct.pack("i", esp_gso.VNET_HDR_LEN))
+                fcntl.ioctl(tap_fd, TUNSETOFFLOAD,
+                            TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN)
+    except OSError:
+        for fd in fds:
+            os.close(fd)
+        raise
+    return fds
+
+
+def open_tty(path, blocking=False):
+    """Open the USB CDC-ACM tty as a raw byte pipe"""
+    fd = os.open(path, os.O_RDWR | os.O_NOCTTY | os.O_NONBLOCK)
+    tty.setraw(fd)
+    attrs = termios.tcgetattr(fd)
+    attrs[3] &= ~termios.ECHO
+    termios.tcsetattr(fd, termios.TCSANOW, attrs)
+    termios.tcflush(fd, termios.TCIOFLUSH)
+    os.set_blocking(fd, blocking)
+    return fd
 
-def create_tap():
-    """Create and configure TAP interface"""
-    tap_fd = os.open("/dev/net/tun", os.O_RDWR)
-    ifr = struct.pack('16sH', TAP_IF.encode(), IFF_TAP | IFF_NO_PI)
-    fcntl.ioctl(tap_fd, TUNSETIFF, ifr)
-    return tap_fd
+
+def print_device_log(payload):
+    """Firmware log lines arrive as TYPE_LOG frames, one line per frame"""
+    sys.stderr.write(payload.decode("utf-8", "replace"))
+    sys.stderr.flush()
+
+
+def flow_paused(payload):
+    """Return the pause state from a CMD_FLOW notification, else None"""
+    if len(payload) < esp_frame.CTRL_HDR.size + esp_frame.FLOW_BODY.size:
+        return None
+    if payload[0] != esp_frame.CMD_FLOW:
+        return None
+    paused, _, _ = esp_frame.FLOW_BODY.unpack_from(payload, esp_frame.CTRL_HDR.size)
+    return bool(paused)
+
+
+def configure_device(fd, body, crc=False, timeout=2.0):
+    """Send one CONFIG_SET on the tty before bridging and wait for its answer"""
+    encoder = esp_frame.Encoder(crc=crc)
+    decoder = esp_frame.Decoder()
+    view = memoryview(encoder.encode(esp_frame.ctrl_encode(esp_frame.CMD_CONFIG_SET, 1, body),
+                                     esp_frame.TYPE_CTRL))
+    while view:
+        select.select([], [fd], [])
+        try:
+            view = view[os.write(fd, view):]
+        except BlockingIOError:
+            pass
+    deadline = time.monotonic() + timeout
+    while True:
+        left = deadline - time.monotonic()
+        r, _, _ = select.select([fd], [], [], max(left, 0))
+        if not r:
+            raise TimeoutError("No answer to the config request")
+        try:
+            chunk = os.read(fd, 65536)
+        except BlockingIOError:
+            continue
+        if not chunk:
+            raise OSError(errno.ENODEV, "USB device disconnected")
+        # Frames from WiFi that arrive before the TAP exists have nowhere to go
+        for ftype, _, payload in decoder.feed(chunk):
+            if ftype == esp_frame.TYPE_LOG:
+                print_device_log(payload)
+            elif ftype == esp_frame.TYPE_CTRL:
+                cmd, status, tag, _ = esp_frame.ctrl_decode(payload)
+                if cmd == esp_frame.CMD_CONFIG_SET | esp_frame.CTRL_RESPONSE and tag == 1:
+                    if status:
+                        raise ValueError("Device refused the settings: "
+                                         + esp_frame.CTRL_STATUS.get(status, str(status)))
+                    return
+
+
+class CtlServer:
+    """
+    Relays control requests between local clients and the firmware.
+
+    Clients connect over a SOCK_SEQPACKET Unix socket and send bare control
+    payloads (esp_frame.ctrl_encode). Each request is given a bridge-wide
+    tag before it goes to the device, and the response is routed back to
+    the client with its own tag restored.
+    """
+
+    def __init__(self, path):
+        self.path = path
+        if os.path.exists(path):
+            os.unlink(path)
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+        self.sock.bind(path)
+        os.chmod(path, 0o660)
+        self.sock.listen(8)
+        self.sock.setblocking(False)
+        self.clients = {}
+        self.pending = {}
+        self.tag = 0
+        self.lock = threading.Lock()
+
+    def fileno(self):
+        return self.sock.fileno()
+
+    def close(self):
+        for conn in self.clients.values():
+            conn.close()
+        self.sock.close()
+        try:
+            os.unlink(self.path)
+        except OSError:
+            pass
+
+    def accept(self):
+        """Accept a client; returns its fd"""
+        conn, _ = self.sock.accept()
+        conn.setblocking(False)
+        self.clients[conn.fileno()] = conn
+        return conn.fileno()
+
+    def drop(self, fd):
+        conn = self.clients.pop(fd)
+        with self.lock:
+            for tag in [t for t, (c, _) in self.pending.items() if c is conn]:
+                del self.pending[tag]
+        conn.close()
+
+    def read_requests(self, fd):
+        """
+        Read what a client sent. Returns (payloads to send to the device,
+        closed); the caller drops the client when closed is set.
+        """
+        conn = self.clients[fd]
+        out = []
+        while True:
+            try:
+                msg = conn.recv(65536)
+            except BlockingIOError:
+                return out, False
+            except OSError:
+                return out, True
+            if not msg:
+                return out, True
+            if len(msg) < esp_frame.CTRL_HDR.size:
+                continue
+            cmd, _, client_tag, body = esp_frame.ctrl_decode(msg)
+            with self.lock:
+                self.tag = (self.tag + 1) & 0xFFFF
+                self.pending[self.tag] = (conn, client_tag)
+                out.append(esp_frame.ctrl_encode(cmd, self.tag, body))
+
+    def deliver(self, payload):
+        """Route a control response from the device to its client"""
+        if len(payload) < esp_frame.CTRL_HDR.size:
+            return
+        cmd, status, tag, body = esp_frame.ctrl_decode(payload)
+        with self.lock:
+            entry = self.pending.pop(tag, None)
+        if entry is None:
+            return
+        conn, client_tag = entry
+        try:
+            conn.send(esp_frame.CTRL_HDR.pack(cmd, status, client_tag) + body)
+        except OSError:
+            pass
+
+    def serve(self, send):
+        """Blocking loop for the threaded bridge; send() writes one payload"""
+        while True:
+            r, _, _ = select.select([self.sock] + list(self.clients.values()), [], [])
+            for obj in r:
+                if obj is self.sock:
+                    self.accept()
+                    continue
+                payloads, closed = self.read_requests(obj.fileno())
+                for p in payloads:
+                    send(p)
+                if closed:
+                    self.drop(obj.fileno())
+
+
+class TapPort:
+    """One TAP queue, optionally carrying virtio-net headers"""
+
+    def __init__(self, fd, vnet=False, device_gso=False):
+        self.fd = fd
+        self.vnet = vnet
+        self.device_gso = device_gso
+        self.buf = bytearray(TAP_GSO_READ_BYTES if vnet else esp_frame.MAX_PAYLOAD)
+        self.view = memoryview(self.buf)
+
+    def read_frames(self):
+        """
+        One read from the queue. Returns a list of (frame type, payload)
+        pairs (more than one for a GSO super-frame segmented here), or None
+        if nothing was pending.
+        """
+        try:
+            n = os.readv(self.fd, [self.buf])
+        except BlockingIOError:
+            return None
+        if n == 0:
+            return None
+        if not self.vnet:
+            return [(esp_frame.TYPE_DATA, self.view[:n])]
+        buf = self.view[:n]
+        if self.device_gso and n <= esp_frame.MAX_VNET_PAYLOAD and esp_gso.needs_offload(buf):
+            # The device segments it; one USB frame instead of dozens
+            return [(esp_frame.TYPE_VNET, buf)]
+        return [(esp_frame.TYPE_DATA, f) for f in esp_gso.frames_from_vnet(buf)]
+
+    def write(self, payload):
+        try:
+            if self.vnet:
+                os.writev(self.fd, [esp_gso.VNET_HDR_NONE, payload])
+            else:
+                os.write(self.fd, payload)
+        except BlockingIOError:
+            pass   # TAP queue full: drop, as a NIC would
+
+
+class Bridge:
+    """
+    Event-driven USB <-> TAP pump.
+
+    Both descriptors are non-blocking and multiplexed with epoll, so the
+    process sleeps until either side has data and forwards it immediately.
+    Reads go into preallocated buffers. When the tty cannot take more data
+    the TAP side is paused (EPOLLOUT on the tty resumes it), which leaves
+    the backlog in the kernel TAP queue instead of in this process.
+    """
+
+    def __init__(self, tty_fd, tap, crc=False, ctl=None):
+        self.tty_fd = tty_fd
+        self.tap = tap
+        self.ctl = ctl
+        self.encoder = esp_frame.Encoder(crc=crc)
+        self.decoder = esp_frame.Decoder()
+        self.usb_buf = bytearray(USB_READ_BYTES)
+        self.usb_view = memoryview(self.usb_buf)
+        self.pending = bytearray()   # framed bytes the tty has not accepted yet
+        self.ep = select.epoll()
+        self.ep.register(tty_fd, select.EPOLLIN)
+        self.ep.register(tap.fd, select.EPOLLIN)
+        if ctl:
+            self.ep.register(ctl.fileno(), select.EPOLLIN)
+        self.tap_paused = False
+        self.tty_out = False
+        self.device_paused = False   # flow control from the firmware
+        self.pause_deadline = 0.0
+
+    def close(self):
+        self.ep.close()
+
+    def _usb_readable(self):
+        while True:
+            try:
+                n = os.readv(self.tty_fd, [self.usb_buf])
+            except BlockingIOError:
+                return
+            if n == 0:
+                raise OSError(errno.ENODEV, "USB device disconnected")
+            for ftype, _, payload in self.decoder.feed(self.usb_view[:n]):
+                if ftype == esp_frame.TYPE_DATA:
+                    self.tap.write(payload)
+                elif ftype == esp_frame.TYPE_LOG:
+                    print_device_log(payload)
+                elif ftype == esp_frame.TYPE_CTRL:
+                    self._usb_ctrl(payload)
+
+    def _usb_ctrl(self, payload):
+        paused = flow_paused(payload)
+        if paused is not None:
+            self.device_paused = paused
+            self.pause_deadline = time.monotonic() + FLOW_PAUSE_MAX
+            self._update_tap()
+        elif self.ctl:
+            self.ctl.deliver(payload)
+
+    def _update_tap(self):
+        # Stop reading the TAP while the tty is backed up or the device
+        # asked us to; the kernel queues frames meanwhile
+        paused = bool(self.pending) or self.device_paused
+        if paused != self.tap_paused:
+            self.ep.modify(self.tap.fd, 0 if paused else select.EPOLLIN)
+            self.tap_paused = paused
+
+    def _tap_readable(self):
+        burst = []
+        size = 0
+        while size < USB_BATCH_BYTES:
+            frames = self.tap.read_frames()
+            if frames is None:
+                break
+            for ftype, frame in frames:
+                framed = self.encoder.encode(frame, ftype)
+                burst.append(framed)
+                size += len(framed)
+        if burst:
+            self.pending += b"".join(burst)
+            self._usb_flush()
+
+    def _usb_flush(self):
+        while self.pending:
+            try:
+                n = os.write(self.tty_fd, self.pending)
+            except BlockingIOError:
+                break
+            del self.pending[:n]
+
+        tty_out = bool(self.pending)
+        if tty_out != self.tty_out:
+            self.ep.modify(self.tty_fd, select.EPOLLIN | (select.EPOLLOUT if tty_out else 0))
+            self.tty_out = tty_out
+        self._update_tap()
+
+    def run(self):
+        while True:
+            timeout = -1
+            if self.device_paused:
+                timeout = max(self.pause_deadline - time.monotonic(), 0)
+                if timeout == 0:
+                    self.device_paused = False
+                    self._update_tap()
+                    timeout = -1
+            for fd, events in self.ep.poll(timeout):
+                if events & (select.EPOLLERR | select.EPOLLHUP) and fd == self.tty_fd:
+                    raise OSError(errno.ENODEV, "USB device disconnected")
+                if fd == self.tty_fd:
+                    if events & select.EPOLLOUT:
+                        self._usb_flush()
+                    if events & select.EPOLLIN:
+                        self._usb_readable()
+                elif fd == self.tap.fd and events & select.EPOLLIN:
+                    self._tap_readable()
+                elif self.ctl and fd == self.ctl.fileno():
+                    self.ep.register(self.ctl.accept(), select.EPOLLIN)
+                elif self.ctl and fd in self.ctl.clients:
+                    self._ctl_readable(fd)
+
+    def _ctl_readable(self, fd):
+        payloads, closed = self.ctl.read_requests(fd)
+        for p in payloads:
+            self.pending += self.encoder.encode(p, esp_frame.TYPE_CTRL)
+        if closed:
+            self.ep.unregister(fd)
+            self.ctl.drop(fd)
+        if payloads:
+            self._usb_flush()
+
+
+class ThreadedBridge:
+    """
+    Multi-queue variant: one blocking reader thread per TAP queue, plus one
+    for the tty. Queue threads frame their packets and write them to the
+    tty under a lock so bursts from different queues never interleave.
+    """
+
+    def __init__(self, tty_fd, taps, crc=False, ctl=None):
+        self.tty_fd = tty_fd
+        self.taps = taps
+        self.ctl = ctl
+        self.encoder = esp_frame.Encoder(crc=crc)
+        self.decoder = esp_frame.Decoder()
+        self.tx_lock = threading.Lock()
+        self.flow = threading.Event()   # cleared while the device is paused
+        self.flow.set()
+        self.pause_deadline = 0.0
+        self.error = None
+        self.done = threading.Event()
+
+    def close(self):
+        pass
+
+    def _fail(self, e):
+        if self.error is None:
+            self.error = e
+        self.done.set()
+
+    def _usb_reader(self):
+        buf = bytearray(USB_READ_BYTES)
+        view = memoryview(buf)
+        tap = self.taps[0]
+        try:
+            while True:
+                n = os.readv(self.tty_fd, [buf])
+                if n == 0:
+                    raise OSError(errno.ENODEV, "USB device disconnected")
+                for ftype, _, payload in self.decoder.feed(view[:n]):
+                    if ftype == esp_frame.TYPE_DATA:
+                        tap.write(payload)
+                    elif ftype == esp_frame.TYPE_LOG:
+                        print_device_log(payload)
+                    elif ftype == esp_frame.TYPE_CTRL:
+                        paused = flow_paused(payload)
+                        if paused is True:
+                            self.pause_deadline = time.monotonic() + FLOW_PAUSE_MAX
+                            self.flow.clear()
+                        elif paused is False:
+                            self.flow.set()
+                        elif self.ctl:
+                            self.ctl.deliver(payload)
+        except OSError as e:
+            self._fail(e)
+
+    def _wait_flow(self):
+        # Each refresh from the device moves the deadline on
+        while not self.flow.is_set():
+            left = self.pause_deadline - time.monotonic()
+            if left <= 0:
+                return
+            self.flow.wait(left)
+
+    def _tap_reader(self, tap):
+        try:
+            while True:
+                self._wait_flow()
+                frames = tap.read_frames()
+                if not frames:
+                    continue
+                with self.tx_lock:
+                    burst = b"".join(self.encoder.encode(f, t) for t, f in frames)
+                    self._write_all(burst)
+        except OSError as e:
+            self._fail(e)
+
+    # Caller holds tx_lock
+    def _write_all(self, buf):
+        view = memoryview(buf)
+        while view:
+            n = os.write(self.tty_fd, view)
+            view = view[n:]
+
+    def _send_ctrl(self, payload):
+        with self.tx_lock:
+            self._write_all(self.encoder.encode(payload, esp_frame.TYPE_CTRL))
+
+    def _ctl_server(self):
+        try:
+            self.ctl.serve(self._send_ctrl)
+        except OSError as e:
+            self._fail(e)
+
+    def run(self):
+        threads = [threading.Thread(target=self._usb_reader, daemon=True)]
+        threads += [threading.Thread(target=self._tap_reader, args=(t,), daemon=True)
+                    for t in self.taps]
+        if self.ctl:
+            threads.append(threading.Thread(target=self._ctl_server, daemon=True))
+        for t in threads:
+            t.start()
+        self.done.wait()
+        raise self.error
+
+
+def run_all(args):
+    """One bridge process per adapter; they share the remaining options"""
+    if args.dev or args.tap or args.ctl_socket:
+        print("Error: --all picks --dev, --tap and --ctl-socket for each adapter")
+        sys.exit(1)
+    devs = detect_esp32_acms()
+    if not devs:
+        print("Error: no ESP32 (VID 303a) found")
+        sys.exit(1)
+
+    argv = [a for a in sys.argv[1:] if a != "--all"]
+    procs = []
+    for i, dev in enumerate(devs):
+        print(f"Starting bridge {tap_name(i)} on {dev}")
+        procs.append(subprocess.Popen([sys.executable, os.path.abspath(__file__), *argv,
+                                       "--dev", dev, "--tap", tap_name(i)]))
+    # Ctrl+C reaches the children too; each stops on its own
+    status = 0
+    for p in procs:
+        while True:
+            try:
+                status = max(status, p.wait())
+                break
+            except KeyboardInterrupt:
+                continue
+    sys.exit(status)
 
 
 def main():
@@ -121,6 +737,26 @@ def main():
         sys.exit(1)
 
     args = parse_args()
+    if args.all:
+        run_all(args)
+    tap_if = args.tap or TAP_IF
+    ctl_socket = args.ctl_socket or ctl_socket_path(tap_if)
+    if args.queues < 1:
+        print("Error: --queues must be at least 1")
+        sys.exit(1)
+    if args.device_gso and (not args.vnet or args.crc):
+        print("Error: --device-gso needs --vnet and cannot be used with --crc")
+        sys.exit(1)
+
+    config_body = None
+    if args.config or args.config_file:
+        try:
+            settings = esp_config.load_profile(args.config_file) if args.config_file else {}
+            settings.update(esp_config.parse_assignments(args.config))
+            config_body = esp_config.encode_set(settings, args.save_config)
+        except (OSError, ValueError) as e:
+            print(f"Error: {e}")
+            sys.exit(1)
 
     # Decide which USB device to use
     if args.dev:
@@ -132,55 +768,80 @@ def main():
             print("Failed to auto-detect any suitable /dev/ttyACM* device.")
             sys.exit(1)
 
+    threaded = args.queues > 1
+
     print("ESP32 WiFi Adapter - USB Bridge")
     print("=" * 40)
     print(f"Using USB device: {usb_dev}")
-    print(f"Using TAP interface: {TAP_IF}")
+    print(f"Using TAP interface: {tap_if}")
+    if args.vnet:
+        print("vnet header mode: checksum/TSO offload enabled"
+              + (", segmented on the device" if args.device_gso else ""))
+    if threaded:
+        print(f"Multi-queue mode: {args.queues} queues")
 
     # Open USB serial
     try:
-        ser = serial.Serial(usb_dev, BAUDRATE, timeout=0.1)
+        tty_fd = open_tty(usb_dev, blocking=threaded)
         print(f"Connected to {usb_dev}")
     except Exception as e:
         print(f"Error opening {usb_dev}: {e}")
         sys.exit(1)
 
+    if config_body:
+        try:
+            configure_device(tty_fd, config_body, crc=args.crc)
+            print("Firmware settings applied" + (" and saved" if args.save_config else ""))
+        except (OSError, ValueError) as e:
+            print(f"Error applying firmware settings: {e}")
+            os.close(tty_fd)
+            sys.exit(1)
+
     # Create TAP interface
     try:
-        tap_fd = create_tap()
-        print(f"TAP interface {TAP_IF} created")
+        tap_fds = create_tap(tap_if, vnet=args.vnet, queues=args.queues)
+        print(f"TAP interface {tap_if} created")
         print("Note: configure IP/routes for this interface separately (e.g. via setup_tap.sh)")
     except Exception as e:
         print(f"Error creating TAP interface: {e}")
         print("Make sure /dev/net/tun exists (sudo modprobe tun)")
-        ser.close()
+        os.close(tty_fd)
         sys.exit(1)
 
+    ctl = None
+    if ctl_socket != "none":
+        try:
+            ctl = CtlServer(ctl_socket)
+            print(f"Control socket: {ctl_socket}")
+        except OSError as e:
+            print(f"Warning: control socket unavailable: {e}")
+
     print("Bridge running... (Ctrl+C to stop)")
 
+    if threaded:
+        taps = [TapPort(fd, vnet=args.vnet, device_gso=args.device_gso) for fd in tap_fds]
+        bridge = ThreadedBridge(tty_fd, taps, crc=args.crc, ctl=ctl)
+    else:
+        os.set_blocking(tap_fds[0], False)
+        bridge = Bridge(tty_fd, TapPort(tap_fds[0], vnet=args.vnet, device_gso=args.device_gso),
+                        crc=args.crc, ctl=ctl)
     try:
-        while True:
-            # Check for data from USB
-            if ser.in_waiting > 0:
-                data = ser.read(ser.in_waiting)
-                if data:
-                    os.write(tap_fd, data)
-
-            # Check for data from TAP
-            ready, _, _ = select.select([tap_fd], [], [], 0.1)
-            if ready:
-                data = os.read(tap_fd, 1500)  # Ethernet MTU
-                if data:
-                    ser.write(data)
-
+        bridge.run()
     except KeyboardInterrupt:
         print("\nStopping bridge...")
+    except OSError as e:
+        print(f"\nBridge error: {e}")
     finally:
-        ser.close()
-        os.close(tap_fd)
-        print("Bridge stopped")
+        decoder = bridge.decoder
+        bridge.close()
+        if ctl:
+            ctl.close()
+        os.close(tty_fd)
+        for fd in tap_fds:
+            os.close(fd)
+        print(f"Bridge stopped (skipped {decoder.skipped_bytes} bytes, "
+              f"{decoder.crc_errors} CRC errors, {decoder.seq_gaps} sequence gaps)")
 
 
 if __name__ == "__main__":
     main()
-
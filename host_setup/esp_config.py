@@ -0,0 +1,208 @@
+#!/usr/bin/env python3
+"""
+Runtime settings of the ESP32 WiFi USB adapter
+
+Encodes and decodes the entries of the CONFIG_GET / CONFIG_SET control
+commands (main/bridge_config.h). Settings are handled as a dict of name to
+value, the same shape as a JSON profile file, so one profile can be pushed
+to many adapters and read back from each of them.
+"""
+
+import ipaddress
+import json
+import struct
+
+# key(1) len(2, LE) value
+ENTRY = struct.Struct("<BH")
+F_SAVE = 0x01
+
+# main/tx_sched.h tx_class_t; main/pkt_filter.c buckets
+TX_CLASSES = ["ctrl", "vo", "vi", "be", "bk"]
+FILTER_BUCKETS = ["mdns", "group", "bucket2", "bucket3"]
+WIFI_PS = ["none", "min", "max"]
+
+# main/pkt_filter.h pkt_filter_rule_t
+FILTER_RULE = struct.Struct("<BBHBBH4sB3x")
+RULE_DIRS = {"usb->wifi": 0x01, "wifi->usb": 0x02, "both": 0x03}
+RULE_DST = ["any", "group", "bcast"]
+RULE_ACTIONS = ["pass", "drop", "limit", "arp_proxy"]
+
+# name -> (key, kind); main/bridge_config.h
+KEYS = {
+    "wifi_ssid": (0x01, "str"),
+    "wifi_password": (0x02, "str"),
+    "wifi_ps": (0x03, "ps"),
+    "reconnect_max": (0x04, "u32"),
+    "tx_qos": (0x10, "bool"),
+    "tx_depth": (0x11, "depth"),
+    "filter_rules": (0x20, "rules"),
+    "filter_rates": (0x21, "rates"),
+}
+NAMES = {key: name for name, (key, _) in KEYS.items()}
+
+
+class ConfigError(ValueError):
+    pass
+
+
+def _int(v):
+    return v if isinstance(v, int) else int(str(v), 0)
+
+
+def _list(v, names, what):
+    """Per-class/bucket values as a list, a {name: value} dict or "a,b,c" text"""
+    if isinstance(v, dict):
+        unknown = [k for k in v if k not in names]
+        if unknown:
+            raise ConfigError(f"Unknown {what} {unknown[0]}; use {', '.join(names)}")
+        return [_int(v[n]) for n in names]
+    if isinstance(v, str):
+        v = v.split(",")
+    if len(v) != len(names):
+        raise ConfigError(f"Need {len(names)} values ({', '.join(names)})")
+    return [_int(x) for x in v]
+
+
+def _enum(v, names, what):
+    if isinstance(v, str) and v in names:
+        return names.index(v)
+    n = _int(v)
+    if not 0 <= n < len(names):
+        raise ConfigError(f"Unknown {what} {v}; use {', '.join(names)}")
+    return n
+
+
+def _rule(r):
+    try:
+        dirs = RULE_DIRS[r.get("dirs", "both")]
+    except KeyError:
+        raise ConfigError(f"Unknown rule dirs {r['dirs']}; use {', '.join(RULE_DIRS)}")
+    ip = ipaddress.IPv4Address(r.get("ip", "0.0.0.0")).packed
+    return FILTER_RULE.pack(dirs, _enum(r.get("dst", "any"), RULE_DST, "rule dst"),
+                            _int(r.get("ethertype", 0)), _int(r.get("ip_proto", 0)),
+                            _enum(r.get("action", "drop"), RULE_ACTIONS, "rule action"),
+                            _int(r.get("port", 0)), ip,
+                            _enum(r.get("bucket", 0), FILTER_BUCKETS, "bucket"))
+
+
+def encode_value(name, value):
+    """Value bytes for a setting given as JSON data or command line text"""
+    if name not in KEYS:
+        raise ConfigError(f"Unknown setting {name}; use {', '.join(KEYS)}")
+    kind = KEYS[name][1]
+    try:
+        if kind == "str":
+            return str(value).encode()
+        if kind == "ps":
+            return bytes([_enum(value, WIFI_PS, "power save mode")])
+        if kind == "u32":
+            return struct.pack("<I", _int(value))
+        if kind == "bool":
+            if isinstance(value, str):
+                value = value.lower() in ("1", "on", "yes", "true")
+            return bytes([1 if value else 0])
+        if kind == "depth":
+            return bytes(_list(value, TX_CLASSES, "class"))
+        if kind == "rates":
+            return struct.pack(f"<{len(FILTER_BUCKETS)}H", *_list(value, FILTER_BUCKETS, "bucket"))
+        if isinstance(value, str):
+            value = json.loads(value)
+        return b"".join(_rule(r) for r in value)
+    except (ValueError, TypeError, struct.error) as e:
+        if isinstance(e, ConfigError):
+            raise
+        raise ConfigError(f"Bad value for {name}: {e}")
+
+
+def decode_value(name, raw):
+    """JSON data for a setting's value bytes, as accepted by encode_value()"""
+    kind = KEYS[name][1]
+    if kind == "str":
+        return raw.decode(errors="replace")
+    if kind == "ps":
+        return WIFI_PS[raw[0]] if raw[0] < len(WIFI_PS) else raw[0]
+    if kind == "u32":
+        return struct.unpack("<I", raw)[0]
+    if kind == "bool":
+        return bool(raw[0])
+    if kind == "depth":
+        return dict(zip(TX_CLASSES, raw))
+    if kind == "rates":
+        return dict(zip(FILTER_BUCKETS, struct.unpack(f"<{len(raw) // 2}H", raw)))
+    rules = []
+    for off in range(0, len(raw) - FILTER_RULE.size + 1, FILTER_RULE.size):
+        dirs, dst, ethertype, proto, action, port, ip, bucket = FILTER_RULE.unpack_from(raw, off)
+        r = {"dirs": next((k for k, v in RULE_DIRS.items() if v == dirs), dirs),
+             "action": RULE_ACTIONS[action] if action < len(RULE_ACTIONS) else action}
+        if dst:
+            r["dst"] = RULE_DST[dst] if dst < len(RULE_DST) else dst
+        if ethertype:
+            r["ethertype"] = f"0x{ethertype:04x}"
+        if proto:
+            r["ip_proto"] = proto
+        if port:
+            r["port"] = port
+        if ip != bytes(4):
+            r["ip"] = str(ipaddress.IPv4Address(ip))
+        if action == RULE_ACTIONS.index("limit"):
+            r["bucket"] = FILTER_BUCKETS[bucket] if bucket < len(FILTER_BUCKETS) else bucket
+        rules.append(r)
+    return rules
+
+
+def encode_set(settings, save=False):
+    """CONFIG_SET body for a {name: value} dict"""
+    body = bytearray([F_SAVE if save else 0])
+    for name, value in settings.items():
+        raw = encode_value(name, value)
+        body += ENTRY.pack(KEYS[name][0], len(raw)) + raw
+    return bytes(body)
+
+
+def encode_get(names=()):
+    """CONFIG_GET body; no names asks for every setting"""
+    unknown = [n for n in names if n not in KEYS]
+    if unknown:
+        raise ConfigError(f"Unknown setting {unknown[0]}; use {', '.join(KEYS)}")
+    return bytes(KEYS[n][0] for n in names)
+
+
+def decode_entries(body):
+    """{name: value} from a CONFIG_GET response"""
+    settings = {}
+    off = 0
+    while off + ENTRY.size <= len(body):
+        key, length = ENTRY.unpack_from(body, off)
+        off += ENTRY.size
+        raw = body[off:off + length]
+        off += length
+        name = NAMES.get(key)
+        # The password reads back empty; leaving it out keeps the result
+        # usable as a profile
+        if name and name != "wifi_password":
+            settings[name] = decode_value(name, raw)
+    return settings
+
+
+def parse_assignments(items):
+    """{name: text} from "name=value" strings"""
+    settings = {}
+    for item in items:
+        name, sep, value = item.partition("=")
+        if not sep:
+            raise ConfigError(f"Expected name=value, got {item}")
+        if value.startswith("@"):
+            with open(value[1:]) as f:
+                value = f.read()
+        settings[name.strip()] = value
+    return settings
+
+
+def load_profile(path):
+    """{name: value} from a JSON profile file"""
+    with open(path) as f:
+        settings = json.load(f)
+    if not isinstance(settings, dict):
+        raise ConfigError(f"{path}: expected a JSON object of settings")
+    return settings
+
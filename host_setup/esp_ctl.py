@@ -0,0 +1,396 @@
+#!/usr/bin/env python3
+"""
+Control channel client for the ESP32 WiFi USB adapter
+
+Talks to the firmware's control task (main/bridge_ctrl.c) either through
+the control socket of a running bridge_usb.py, or directly over the USB
+tty when no bridge is running.
+"""
+
+import argparse
+import json
+import os
+import select
+import socket
+import struct
+import sys
+import time
+
+import esp_config
+import esp_frame
+import pcapng
+from bridge_usb import (CTL_SOCKET, ctl_socket_path, detect_esp32_acm, open_tty,
+                        print_device_log)
+
+# Order of bridge_drop_t / bridge_dir_t / bridge_queue_t in main/bridge_stats.h
+DIR_NAMES = ["usb->wifi", "wifi->usb"]
+DROP_NAMES = ["not_connected", "bad_size", "queue_full", "tx_fail", "bad_frame", "no_buffer",
+              "ack_merged", "no_route", "filtered", "rate_limit"]
+QUEUE_NAMES = ["wifi_tx", "wifi_rx", "tx_ctrl", "tx_vo", "tx_vi", "tx_be", "tx_bk", "usb_tx"]
+TASK_STATES = ["running", "ready", "blocked", "suspended", "deleted"]
+
+# main/pkt_capture.h: capture point -> (interface, direction)
+CAPTURE_POINTS = {
+    "usb-in": (0, "usb", pcapng.INBOUND),
+    "wifi-out": (1, "wifi", pcapng.OUTBOUND),
+    "wifi-in": (2, "wifi", pcapng.INBOUND),
+    "usb-out": (3, "usb", pcapng.OUTBOUND),
+}
+CAPTURE_START = struct.Struct("<HBB")
+CAPTURE_START_RESP = struct.Struct("<qHH")
+CAPTURE_READ_HDR = struct.Struct("<IHBB")
+CAPTURE_REC = struct.Struct("<qHBB")
+CAPTURE_IDLE_POLL = 0.02    # seconds between reads of an empty ring
+
+
+class CtlError(RuntimeError):
+    pass
+
+
+def _check_response(cmd, status, body):
+    if status:
+        name = esp_frame.CTRL_STATUS.get(status, str(status))
+        raise CtlError(f"Command 0x{cmd:02x} failed: {name}")
+    return body
+
+
+class SocketLink:
+    """Control requests through bridge_usb.py's control socket"""
+
+    def __init__(self, path=CTL_SOCKET):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+        self.sock.connect(path)
+        self.tag = 0
+
+    def close(self):
+        self.sock.close()
+
+    def request(self, cmd, body=b"", timeout=2.0):
+        self.tag = (self.tag + 1) & 0xFFFF
+        self.sock.send(esp_frame.ctrl_encode(cmd, self.tag, body))
+        deadline = time.monotonic() + timeout
+        while True:
+            left = deadline - time.monotonic()
+            r, _, _ = select.select([self.sock], [], [], max(left, 0))
+            if not r:
+                raise TimeoutError(f"No response to command 0x{cmd:02x}")
+            msg = self.sock.recv(65536)
+            if not msg:
+                raise OSError("Bridge closed the control socket")
+            rcmd, status, tag, rbody = esp_frame.ctrl_decode(msg)
+            if rcmd == cmd | esp_frame.CTRL_RESPONSE and tag == self.tag:
+                return _check_response(cmd, status, rbody)
+
+
+class DeviceLink:
+    """Framed access to the firmware over the USB tty (bridge not running)"""
+
+    def __init__(self, dev=None, crc=False):
+        path = dev or detect_esp32_acm()
+        if path is None:
+            raise SystemExit("No ESP32 device found; use --dev")
+        self.fd = open_tty(path, blocking=False)
+        self.encoder = esp_frame.Encoder(crc=crc)
+        self.decoder = esp_frame.Decoder()
+        self.tag = 0
+        self.data = []
+
+    def close(self):
+        os.close(self.fd)
+
+    def write(self, buf):
+        view = memoryview(buf)
+        while view:
+            select.select([], [self.fd], [])
+            try:
+                n = os.write(self.fd, view)
+            except BlockingIOError:
+                continue
+            view = view[n:]
+
+    def poll(self, timeout):
+        """Read for up to timeout seconds; returns (ctrl frames, data frames)"""
+        ctrl = []
+        data = []
+        r, _, _ = select.select([self.fd], [], [], timeout)
+        if not r:
+            return ctrl, data
+        while True:
+            try:
+                chunk = os.read(self.fd, 65536)
+            except BlockingIOError:
+                break
+            if not chunk:
+                raise OSError("USB device disconnected")
+            for ftype, _, payload in self.decoder.feed(chunk):
+                if ftype == esp_frame.TYPE_DATA:
+                    data.append(payload)
+                elif ftype == esp_frame.TYPE_CTRL:
+                    ctrl.append(payload)
+                elif ftype == esp_frame.TYPE_LOG:
+                    print_device_log(payload)
+        return ctrl, data
+
+    def request(self, cmd, body=b"", timeout=2.0):
+        """Send a control request and return the response body"""
+        self.tag = (self.tag + 1) & 0xFFFF
+        self.write(self.encoder.encode(esp_frame.ctrl_encode(cmd, self.tag, body),
+                                       esp_frame.TYPE_CTRL))
+        deadline = time.monotonic() + timeout
+        while True:
+            left = deadline - time.monotonic()
+            if left <= 0:
+                raise TimeoutError(f"No response to command 0x{cmd:02x}")
+            ctrl, data = self.poll(left)
+            self.data += data
+            for payload in ctrl:
+                rcmd, status, tag, rbody = esp_frame.ctrl_decode(payload)
+                if rcmd == cmd | esp_frame.CTRL_RESPONSE and tag == self.tag:
+                    return _check_response(cmd, status, rbody)
+
+
+def open_link(socket_path=CTL_SOCKET, dev=None, crc=False):
+    """Prefer a running bridge's socket; fall back to the tty"""
+    if dev is None and os.path.exists(socket_path):
+        try:
+            return SocketLink(socket_path)
+        except OSError:
+            pass
+    return DeviceLink(dev, crc)
+
+
+def decode_stats(body):
+    version, n_dirs, n_drops, n_queues = struct.unpack_from("<BBBB", body)
+    if version != 1:
+        raise CtlError(f"Unsupported stats version {version}")
+    (uptime_us,) = struct.unpack_from("<q", body, 4)
+    off = 12
+    dirs = []
+    for d in range(n_dirs):
+        packets, nbytes = struct.unpack_from("<IQ", body, off)
+        off += 12
+        drops = struct.unpack_from(f"<{n_drops}I", body, off)
+        off += 4 * n_drops
+        names = [DROP_NAMES[r] if r < len(DROP_NAMES) else f"drop{r}" for r in range(n_drops)]
+        dirs.append({
+            "name": DIR_NAMES[d] if d < len(DIR_NAMES) else f"dir{d}",
+            "packets": packets,
+            "bytes": nbytes,
+            "drops": dict(zip(names, drops)),
+        })
+    queues = []
+    for q in range(n_queues):
+        size, high_water = struct.unpack_from("<HH", body, off)
+        off += 4
+        queues.append({
+            "name": QUEUE_NAMES[q] if q < len(QUEUE_NAMES) else f"queue{q}",
+            "size": size,
+            "high_water": high_water,
+        })
+    total, in_use, pool_hw, _, alloc_fail = struct.unpack_from("<HHHHI", body, off)
+    pool = {"total": total, "in_use": in_use, "high_water": pool_hw, "alloc_fail": alloc_fail}
+    return {"uptime_us": uptime_us, "dirs": dirs, "queues": queues, "pool": pool}
+
+
+def decode_tasks(body):
+    total, count = struct.unpack_from("<II", body)
+    tasks = []
+    off = 8
+    for _ in range(count):
+        name, prio, state, _, stack_free, runtime = struct.unpack_from("<16sBBHII", body, off)
+        off += 28
+        tasks.append({
+            "name": name.split(b"\0", 1)[0].decode(errors="replace"),
+            "priority": prio,
+            "state": TASK_STATES[state] if state < len(TASK_STATES) else str(state),
+            "stack_free": stack_free,
+            "runtime": runtime,
+        })
+    return total, tasks
+
+
+def print_stats(stats):
+    print(f"uptime {stats['uptime_us'] / 1e6:.1f} s")
+    for d in stats["dirs"]:
+        drops = ", ".join(f"{k} {v}" for k, v in d["drops"].items() if v) or "none"
+        print(f"  {d['name']:10} {d['packets']:>10} packets {d['bytes']:>14} bytes  drops: {drops}")
+    for q in stats["queues"]:
+        print(f"  queue {q['name']:8} high water {q['high_water']}/{q['size']}")
+    p = stats["pool"]
+    print(f"  pool     {p['in_use']}/{p['total']} in use, high water {p['high_water']}, "
+          f"{p['alloc_fail']} allocation failures")
+
+
+def print_tasks(total, tasks):
+    print(f"{'task':16} {'prio':>4} {'state':9} {'stack free':>10} {'cpu':>6}")
+    for t in sorted(tasks, key=lambda t: -t["runtime"]):
+        cpu = 100.0 * t["runtime"] / total if total else 0.0
+        print(f"{t['name']:16} {t['priority']:>4} {t['state']:9} {t['stack_free']:>10} {cpu:>5.1f}%")
+
+
+def cmd_ping(link, args):
+    start = time.monotonic()
+    link.request(esp_frame.CMD_PING, b"ping")
+    print(f"pong in {(time.monotonic() - start) * 1000:.1f} ms")
+
+
+def cmd_stats(link, args):
+    while True:
+        print_stats(decode_stats(link.request(esp_frame.CMD_STATS)))
+        if args.tasks:
+            print_tasks(*decode_tasks(link.request(esp_frame.CMD_TASKS)))
+        if not args.watch:
+            break
+        time.sleep(args.watch)
+        print()
+
+
+def cmd_reset(link, args):
+    link.request(esp_frame.CMD_STATS_RESET)
+    print("Counters reset")
+
+
+def cmd_capture(link, args):
+    names = args.points.split(",") if args.points else list(CAPTURE_POINTS)
+    unknown = [n for n in names if n not in CAPTURE_POINTS]
+    if unknown:
+        raise CtlError(f"Unknown capture point {unknown[0]}; use {', '.join(CAPTURE_POINTS)}")
+    mask = 0
+    for n in names:
+        mask |= 1 << CAPTURE_POINTS[n][0]
+
+    uptime_us, snaplen, _ = CAPTURE_START_RESP.unpack_from(
+        link.request(esp_frame.CMD_CAPTURE_START, CAPTURE_START.pack(args.snaplen, mask, 0)))
+    # Device timestamps count from boot; anchor them to the host clock
+    offset_us = time.time_ns() // 1000 - uptime_us
+    deadline = time.monotonic() + args.duration if args.duration else None
+    frames = dropped = 0
+
+    with open(args.write, "wb") as f:
+        out = pcapng.Writer(f)
+        ifaces = {
+            "usb": out.add_interface("usb", "Host side of the adapter", snaplen),
+            "wifi": out.add_interface("wifi", "WiFi station interface", snaplen),
+        }
+        by_point = {point: (ifaces[iface], direction)
+                    for point, iface, direction in CAPTURE_POINTS.values()}
+        print(f"Capturing {', '.join(names)} ({snaplen} bytes per frame) to {args.write}; "
+              f"Ctrl-C to stop")
+
+        def read():
+            body = link.request(esp_frame.CMD_CAPTURE_READ)
+            lost, count, _, _ = CAPTURE_READ_HDR.unpack_from(body)
+            off = CAPTURE_READ_HDR.size
+            for _ in range(count):
+                ts, orig_len, point, caplen = CAPTURE_REC.unpack_from(body, off)
+                off += CAPTURE_REC.size
+                iface, direction = by_point.get(point, (ifaces["usb"], 0))
+                out.packet(iface, ts + offset_us, body[off:off + caplen], orig_len, direction)
+                off += caplen
+            return count, lost
+
+        try:
+            while deadline is None or time.monotonic() < deadline:
+                count, dropped = read()
+                frames += count
+                if count == 0:
+                    time.sleep(CAPTURE_IDLE_POLL)
+        except KeyboardInterrupt:
+            print()
+        # What was recorded before the stop is still in the ring
+        link.request(esp_frame.CMD_CAPTURE_STOP)
+        while True:
+            count, dropped = read()
+            frames += count
+            if count == 0:
+                break
+
+    print(f"{frames} frames written, {dropped} dropped on the device (ring full)")
+
+
+def cmd_config(link, args):
+    if args.action == "reset":
+        link.request(esp_frame.CMD_CONFIG_RESET)
+        print("Saved settings erased; build defaults apply from the next boot")
+        return
+    if args.action == "set":
+        settings = esp_config.load_profile(args.file) if args.file else {}
+        settings.update(esp_config.parse_assignments(args.settings))
+        if not settings:
+            raise CtlError("Nothing to set; give name=value or --file")
+        link.request(esp_frame.CMD_CONFIG_SET, esp_config.encode_set(settings, args.save))
+        print(f"Applied {', '.join(settings)}" + (" and saved" if args.save else ""))
+        return
+    body = link.request(esp_frame.CMD_CONFIG_GET, esp_config.encode_get(args.settings))
+    settings = esp_config.decode_entries(body)
+    if args.json:
+        print(json.dumps(settings, indent=2))
+        return
+    for name, value in settings.items():
+        if isinstance(value, (list, dict)):
+            value = json.dumps(value)
+        print(f"{name:14} {value}")
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="ESP32 WiFi USB adapter control")
+    parser.add_argument("--socket", "-s", default=CTL_SOCKET,
+                        help=f"bridge_usb.py control socket (default: {CTL_SOCKET})")
+    parser.add_argument("--tap", "-i", default=None,
+                        help="Talk to the bridge of this interface (e.g. esp1 with bridge_usb.py --all)")
+    parser.add_argument("--dev", "-d", default=None,
+                        help="Talk to this tty directly instead (bridge not running)")
+    parser.add_argument("--crc", action="store_true",
+                        help="Append a CRC-32 to frames sent over the tty")
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    p = sub.add_parser("ping", help="Check the control channel")
+    p.set_defaults(func=cmd_ping)
+
+    p = sub.add_parser("stats", help="Show frame, drop, queue and pool counters")
+    p.add_argument("--tasks", "-t", action="store_true", help="Also show per-task CPU and stack")
+    p.add_argument("--watch", "-w", type=float, default=0, help="Repeat every N seconds")
+    p.set_defaults(func=cmd_stats)
+
+    p = sub.add_parser("reset", help="Zero the counters")
+    p.set_defaults(func=cmd_reset)
+
+    p = sub.add_parser("capture", help="Capture frame headers to a pcapng file")
+    p.add_argument("--write", "-w", required=True, help="Output file (pcapng)")
+    p.add_argument("--snaplen", type=int, default=0,
+                   help="Bytes kept per frame (default: the firmware's maximum)")
+    p.add_argument("--points", default="",
+                   help=f"Comma-separated subset of {','.join(CAPTURE_POINTS)} (default: all)")
+    p.add_argument("--duration", type=float, default=0, help="Seconds (default: until Ctrl-C)")
+    p.set_defaults(func=cmd_capture)
+
+    p = sub.add_parser("config", help="Read or change settings at run time")
+    p.add_argument("action", choices=["get", "set", "reset"])
+    p.add_argument("settings", nargs="*",
+                   help="get: setting names (default: all); set: name=value, "
+                        "name=@file reads the value from a file")
+    p.add_argument("--file", "-f", help="set: JSON profile of settings, as written by get --json")
+    p.add_argument("--save", action="store_true",
+                   help="set: also store the settings on the device for the next boot")
+    p.add_argument("--json", action="store_true", help="get: print a JSON profile")
+    p.set_defaults(func=cmd_config)
+
+    return parser.parse_args()
+
+
+def main():
+    args = parse_args()
+    link = open_link(ctl_socket_path(args.tap) if args.tap else args.socket, args.dev, args.crc)
+    try:
+        args.func(link, args)
+    except KeyboardInterrupt:
+        print()
+    except (OSError, CtlError, ValueError) as e:
+        print(f"Error: {e}", file=sys.stderr)
+        sys.exit(1)
+    finally:
+        link.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+"""
+Serial framing protocol shared with the ESP32 firmware (main/frame_proto.h)
+
+Every frame is an 8-byte header, the payload, and an optional CRC-32:
+
+    magic(1) type(1) len(2, LE) seq(2, LE) reserved(1) check(1)
+
+check = 0x5A ^ bytes 0..6. Several frames may be packed back to back into
+a single USB write; a receiver resynchronises by hunting for the magic byte.
+"""
+
+import struct
+import zlib
+
+MAGIC = 0xE5
+CHECK_SEED = 0x5A
+HDR_LEN = 8
+CRC_LEN = 4
+MAX_PAYLOAD = 1520
+
+TYPE_MASK = 0x0F
+TYPE_DATA = 0x00
+TYPE_CTRL = 0x01
+TYPE_LOG = 0x02       # device log text
+TYPE_VNET = 0x03      # virtio-net header + frame, to the device (main/gso.h)
+
+# Largest TYPE_VNET payload: anything bigger is segmented on the host
+MAX_VNET_PAYLOAD = 0xFFFF
+
+F_CRC = 0x80
+
+# Control messages (TYPE_CTRL payloads, main/bridge_ctrl.h):
+#     cmd(1) status(1) tag(2, LE) body
+CTRL_HDR = struct.Struct("<BBH")
+CTRL_RESPONSE = 0x80
+
+CMD_PING = 0x01
+CMD_BENCH_START = 0x10
+CMD_BENCH_STOP = 0x11
+CMD_BENCH_RESULT = 0x12
+CMD_STATS = 0x20
+CMD_TASKS = 0x21
+CMD_STATS_RESET = 0x22
+CMD_CAPTURE_START = 0x40
+CMD_CAPTURE_STOP = 0x41
+CMD_CAPTURE_READ = 0x42
+CMD_CONFIG_GET = 0x50      # settings: host_setup/esp_config.py
+CMD_CONFIG_SET = 0x51
+CMD_CONFIG_RESET = 0x52
+
+# Notifications from the device (tag 0, never answered)
+CMD_FLOW = 0x30
+# paused(1) reserved(1) credits(2, LE)
+FLOW_BODY = struct.Struct("<BBH")
+
+CTRL_STATUS = {
+    0: "ok",
+    1: "unknown command",
+    2: "invalid argument",
+    3: "invalid state",
+    4: "failed",
+}
+
+_HDR = struct.Struct("<BBHHB")
+_CRC = struct.Struct("<I")
+
+
+def _check(hdr7):
+    c = CHECK_SEED
+    for b in hdr7:
+        c ^= b
+    return c
+
+
+def encode(payload, seq, ftype=TYPE_DATA, crc=False):
+    """Return one framed payload as bytes"""
+    if crc:
+        ftype |= F_CRC
+    hdr = _HDR.pack(MAGIC, ftype, len(payload), seq & 0xFFFF, 0)
+    parts = [hdr, bytes((_check(hdr),)), payload]
+    if crc:
+        parts.append(_CRC.pack(zlib.crc32(payload)))
+    return b"".join(parts)
+
+
+class Encoder:
+    """
+    Frames payloads with a running sequence number. Only data frames are
+    sequenced (others carry 0), so messages never show up as gaps.
+    """
+
+    def __init__(self, crc=False):
+        self.crc = crc
+        self.seq = 0
+
+    def encode(self, payload, ftype=TYPE_DATA):
+        if ftype != TYPE_DATA:
+            return encode(payload, 0, ftype, self.crc)
+        frame = encode(payload, self.seq, ftype, self.crc)
+        self.seq = (self.seq + 1) & 0xFFFF
+        return frame
+
+
+class Decoder:
+    """
+    Incremental stream decoder.
+
+    feed() accepts arbitrary chunks and returns a list of complete
+    (type, seq, payload) tuples; partial frames are kept for the next call.
+    Bytes that are not part of a valid frame (e.g. boot messages) are skipped
+    and counted in skipped_bytes.
+    """
+
+    def __init__(self):
+        self.buf = bytearray()
+        self.skipped_bytes = 0
+        self.crc_errors = 0
+        self.seq_gaps = 0
+        self._expected_seq = None
+
+    def feed(self, data):
+        self.buf += data
+        frames = []
+        buf = self.buf
+        pos = 0
+        end = len(buf)
+
+        while True:
+            start = buf.find(MAGIC, pos)
+            if start < 0:
+                self.skipped_bytes += end - pos
+                pos = end
+                break
+            self.skipped_bytes += start - pos
+            pos = start
+            if end - pos < HDR_LEN:
+                break
+
+            magic, ftype, length, seq, _ = _HDR.unpack_from(buf, pos)
+            if buf[pos + 7] != _check(buf[pos:pos + 7]) or length > MAX_PAYLOAD:
+                self.skipped_bytes += 1
+                pos += 1
+                continue
+
+            trailer = CRC_LEN if ftype & F_CRC else 0
+            total = HDR_LEN + length + trailer
+            if end - pos < total:
+                break
+
+            payload = bytes(buf[pos + HDR_LEN:pos + HDR_LEN + length])
+            pos += total
+
+            if trailer:
+                (crc,) = _CRC.unpack_from(buf, pos - CRC_LEN)
+                if crc != zlib.crc32(payload):
+                    self.crc_errors += 1
+                    continue
+
+            if ftype & TYPE_MASK == TYPE_DATA:
+                if self._expected_seq is not None and seq != self._expected_seq:
+                    self.seq_gaps += 1
+                self._expected_seq = (seq + 1) & 0xFFFF
+
+            frames.append((ftype & TYPE_MASK, seq, payload))
+
+        del buf[:pos]
+        return frames
+
+
+def ctrl_encode(cmd, tag, body=b""):
+    """Return a control request payload (to be framed as TYPE_CTRL)"""
+    return CTRL_HDR.pack(cmd, 0, tag & 0xFFFF) + body
+
+
+def ctrl_decode(payload):
+    """Split a control payload into (cmd, status, tag, body)"""
+    cmd, status, tag = CTRL_HDR.unpack_from(payload)
+    return cmd, status, tag, payload[CTRL_HDR.size:]
@@ -0,0 +1,155 @@
+#!/usr/bin/env python3
+"""
+virtio-net header handling for TAP devices opened with IFF_VNET_HDR
+
+With offloads enabled through TUNSETOFFLOAD the kernel hands the bridge
+TCP super-frames (up to 64 KB) and frames whose L4 checksum is left to the
+"device". This module splits those into MSS-sized Ethernet frames with
+valid checksums before they are sent over the 1500-byte USB link.
+"""
+
+import struct
+
+VNET_HDR = struct.Struct("<BBHHHH")   # flags, gso_type, hdr_len, gso_size, csum_start, csum_offset
+VNET_HDR_LEN = VNET_HDR.size
+VNET_HDR_NONE = bytes(VNET_HDR_LEN)
+
+VIRTIO_NET_HDR_F_NEEDS_CSUM = 0x01
+
+VIRTIO_NET_HDR_GSO_NONE = 0
+VIRTIO_NET_HDR_GSO_TCPV4 = 1
+VIRTIO_NET_HDR_GSO_TCPV6 = 4
+VIRTIO_NET_HDR_GSO_ECN = 0x80
+
+ETH_HLEN = 14
+MAX_FRAME = 1514        # largest frame the firmware sends (main/wifi_bridge.h)
+ETH_P_IP = 0x0800
+ETH_P_IPV6 = 0x86DD
+IPPROTO_TCP = 6
+
+TCP_FIN = 0x01
+TCP_PSH = 0x08
+TCP_CWR = 0x80
+
+
+def csum_add(data):
+    """One's complement sum of data as 16-bit big-endian words (not inverted)"""
+    if len(data) & 1:
+        data = bytes(data) + b"\0"
+    # 2**16 == 1 (mod 0xFFFF), so the folded word sum is the value mod 0xFFFF
+    x = int.from_bytes(data, "big")
+    s = x % 0xFFFF
+    if s == 0 and x:
+        s = 0xFFFF
+    return s
+
+
+def csum_fold(*sums):
+    s = 0
+    for v in sums:
+        s += v
+    while s > 0xFFFF:
+        s = (s & 0xFFFF) + (s >> 16)
+    return s
+
+
+def _write_csum(frame, offset, value):
+    csum = ~value & 0xFFFF
+    frame[offset] = csum >> 8
+    frame[offset + 1] = csum & 0xFF
+
+
+def complete_csum(frame, csum_start, csum_offset):
+    """
+    Finish a CHECKSUM_PARTIAL frame in place: the checksum field already
+    holds the pseudo-header sum, so sum everything from csum_start on.
+    """
+    _write_csum(frame, csum_start + csum_offset, csum_add(frame[csum_start:]))
+
+
+def _pseudo_v4(ip, l4_len):
+    return csum_add(bytes(ip[12:20]) + struct.pack("!BBH", 0, IPPROTO_TCP, l4_len))
+
+
+def _pseudo_v6(ip, l4_len):
+    return csum_add(bytes(ip[8:40]) + struct.pack("!IxxxB", l4_len, IPPROTO_TCP))
+
+
+def segment_tcp(frame, l3_off, l4_off, mss, v6):
+    """Split a TCP super-frame into a list of MSS-sized frames"""
+    tcp_hlen = (frame[l4_off + 12] >> 4) * 4
+    hdr_end = l4_off + tcp_hlen
+    header = frame[:hdr_end]
+    payload = memoryview(frame)[hdr_end:]
+    (seq,) = struct.unpack_from("!I", frame, l4_off + 4)
+    flags = frame[l4_off + 13]
+    ip_id = 0 if v6 else struct.unpack_from("!H", frame, l3_off + 4)[0]
+
+    segments = []
+    total = len(payload)
+    offset = 0
+    while offset < total:
+        chunk = payload[offset:offset + mss]
+        last = offset + len(chunk) >= total
+        seg = bytearray(header)
+        seg += chunk
+        l4_len = tcp_hlen + len(chunk)
+
+        if v6:
+            struct.pack_into("!H", seg, l3_off + 4, l4_len)
+        else:
+            ihl = (seg[l3_off] & 0x0F) * 4
+            struct.pack_into("!HH", seg, l3_off + 2, ihl + l4_len, (ip_id + len(segments)) & 0xFFFF)
+            struct.pack_into("!H", seg, l3_off + 10, 0)
+            _write_csum(seg, l3_off + 10, csum_add(seg[l3_off:l3_off + ihl]))
+
+        struct.pack_into("!I", seg, l4_off + 4, (seq + offset) & 0xFFFFFFFF)
+        seg_flags = flags
+        if not last:
+            seg_flags &= ~(TCP_FIN | TCP_PSH)
+        if offset:
+            seg_flags &= ~TCP_CWR
+        seg[l4_off + 13] = seg_flags
+
+        struct.pack_into("!H", seg, l4_off + 16, 0)
+        pseudo = _pseudo_v6(seg[l3_off:], l4_len) if v6 else _pseudo_v4(seg[l3_off:], l4_len)
+        _write_csum(seg, l4_off + 16, csum_fold(pseudo, csum_add(seg[l4_off:])))
+
+        segments.append(bytes(seg))
+        offset += len(chunk)
+    return segments
+
+
+def needs_offload(buf):
+    """True if the frame behind the virtio-net header needs segmenting or a checksum"""
+    flags, gso_type = buf[0], buf[1]
+    return gso_type != VIRTIO_NET_HDR_GSO_NONE or bool(flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+
+
+def frames_from_vnet(buf):
+    """
+    Turn one TAP read (virtio-net header + frame) into ready-to-send
+    Ethernet frames. Returns a list; unknown GSO types are dropped.
+    """
+    flags, gso_type, _, gso_size, csum_start, csum_offset = VNET_HDR.unpack_from(buf)
+    frame = bytearray(buf[VNET_HDR_LEN:])
+    gso = gso_type & ~VIRTIO_NET_HDR_GSO_ECN
+
+    if gso == VIRTIO_NET_HDR_GSO_NONE:
+        if flags & VIRTIO_NET_HDR_F_NEEDS_CSUM:
+            complete_csum(frame, csum_start, csum_offset)
+        return [bytes(frame)]
+
+    if gso in (VIRTIO_NET_HDR_GSO_TCPV4, VIRTIO_NET_HDR_GSO_TCPV6) and gso_size:
+        # csum_start always points at the TCP header for GSO frames
+        l3_off = ETH_HLEN
+        if struct.unpack_from("!H", frame, 12)[0] == 0x8100:
+            l3_off += 4
+        # A VLAN tag or TCP options can push a full-MSS segment past the
+        # firmware's limit; shorter segments are still valid TCP
+        tcp_hlen = (frame[csum_start + 12] >> 4) * 4
+        mss = min(gso_size, MAX_FRAME - csum_start - tcp_hlen)
+        return segment_tcp(frame, l3_off, csum_start, mss,
+                           gso == VIRTIO_NET_HDR_GSO_TCPV6)
+
+    return []
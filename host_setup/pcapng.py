@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+"""
+Minimal pcapng writer for captures taken on the adapter (esp_ctl.py capture)
+
+Writes a section header, one interface description per interface and an
+enhanced packet block per frame, with microsecond timestamps and the
+frame direction in epb_flags. Wireshark and tcpdump read the result.
+"""
+
+import struct
+
+LINKTYPE_ETHERNET = 1
+
+BT_SHB = 0x0A0D0D0A
+BT_IDB = 0x00000001
+BT_EPB = 0x00000006
+BYTE_ORDER_MAGIC = 0x1A2B3C4D
+
+OPT_END = 0
+OPT_COMMENT = 1
+OPT_SHB_USERAPPL = 4
+OPT_IF_NAME = 2
+OPT_IF_DESCRIPTION = 3
+OPT_EPB_FLAGS = 2
+
+INBOUND = 1
+OUTBOUND = 2
+
+
+def _pad(data):
+    return data + b"\0" * (-len(data) % 4)
+
+
+def _options(opts):
+    out = b""
+    for code, value in opts:
+        out += struct.pack("<HH", code, len(value)) + _pad(value)
+    if out:
+        out += struct.pack("<HH", OPT_END, 0)
+    return out
+
+
+def _block(block_type, body):
+    length = 12 + len(body)
+    return struct.pack("<II", block_type, length) + body + struct.pack("<I", length)
+
+
+class Writer:
+    """Interfaces must all be added before the first packet"""
+
+    def __init__(self, f, application="esp_ctl.py"):
+        self.f = f
+        self.interfaces = 0
+        body = struct.pack("<IHHq", BYTE_ORDER_MAGIC, 1, 0, -1)
+        body += _options([(OPT_SHB_USERAPPL, application.encode())])
+        self.f.write(_block(BT_SHB, body))
+
+    def add_interface(self, name, description="", snaplen=0, linktype=LINKTYPE_ETHERNET):
+        """Returns the interface id for packet()"""
+        opts = [(OPT_IF_NAME, name.encode())]
+        if description:
+            opts.append((OPT_IF_DESCRIPTION, description.encode()))
+        body = struct.pack("<HHI", linktype, 0, snaplen) + _options(opts)
+        self.f.write(_block(BT_IDB, body))
+        self.interfaces += 1
+        return self.interfaces - 1
+
+    def packet(self, interface, timestamp_us, data, orig_len=None, direction=0, comment=None):
+        if orig_len is None:
+            orig_len = len(data)
+        opts = []
+        if direction:
+            opts.append((OPT_EPB_FLAGS, struct.pack("<I", direction)))
+        if comment:
+            opts.append((OPT_COMMENT, comment.encode()))
+        body = struct.pack("<IIIII", interface, (timestamp_us >> 32) & 0xFFFFFFFF,
+                           timestamp_us & 0xFFFFFFFF, len(data), orig_len)
+        body += _pad(bytes(data)) + _options(opts)
+        self.f.write(_block(BT_EPB, body))
@@ -9,11 +9,17 @@ import sys
 import subprocess
 import argparse
 import json
+import re
+
+import esp_config
+import esp_ctl
+import esp_frame
 
 ESP0_IF = "esp0"
 ESP0_GATEWAY = "192.168.7.1"
 HOST_IP = "192.168.7.2"
 ROUTES_FILE = "/tmp/esp32_routes_backup.json"
+MPTCP_TABLE_BASE = 100      # --mptcp: routing table of espN is 100 + N
 
 
 def check_root():
@@ -205,6 +211,128 @@ def test_connectivity():
         print("✗ Cannot reach internet (ESP32 may not be connected to WiFi)")
 
 
+def esp_interfaces():
+    """Existing esp0, esp1, ... interfaces in index order"""
+    result = run_command("ip -o link show", check=False, capture_output=True)
+    names = re.findall(r"^\d+: (esp\d+)[:@]", result.stdout, re.M) if result.returncode == 0 else []
+    return sorted(names, key=lambda n: int(n[3:]))
+
+
+def interface_address(ifname):
+    """First IPv4 address of an interface, or None"""
+    result = run_command(f"ip -4 -o addr show dev {ifname}", check=False, capture_output=True)
+    m = re.search(r"inet (\d+\.\d+\.\d+\.\d+)", result.stdout) if result.returncode == 0 else None
+    return m.group(1) if m else None
+
+
+def interface_gateway(ifname):
+    """Gateway a DHCP client learned on the interface, else the adapter's"""
+    result = run_command(f"ip -4 route show default dev {ifname}", check=False,
+                         capture_output=True)
+    m = re.search(r"via (\S+)", result.stdout) if result.returncode == 0 else None
+    return m.group(1) if m else ESP0_GATEWAY
+
+
+def setup_multipath_route(ifaces, gateways, weights, metric=None):
+    """One default route over several adapters, balanced per flow"""
+    missing = [i for i in ifaces if not interface_exists(i)]
+    if missing:
+        print(f"Error: Interface {missing[0]} does not exist")
+        print("Run setup_tap.py --all first to create the interfaces")
+        return False
+
+    backup_routes()
+
+    # DHCP clients on the adapters may each have added one
+    for _ in range(len(ifaces) + 1):
+        result = run_command("ip route show default", check=False, capture_output=True)
+        if result.returncode != 0 or not result.stdout.strip():
+            break
+        print("Removing existing default route...")
+        run_command("ip route del default", check=False)
+
+    # Hash on addresses and ports: the packets of a TCP or UDP flow stay on
+    # one adapter (no reordering), different flows spread by weight
+    run_command("sysctl -qw net.ipv4.fib_multipath_hash_policy=1")
+    metric_str = f" metric {metric}" if metric else ""
+    hops = " ".join(f"nexthop via {gateways[i]} dev {i} weight {w}"
+                    for i, w in zip(ifaces, weights))
+    run_command(f"ip route add default{metric_str} {hops}")
+    print("✓ Set multipath default route: "
+          + ", ".join(f"{i} (weight {w})" for i, w in zip(ifaces, weights)))
+    return True
+
+
+def setup_mptcp(ifaces, gateways):
+    """
+    Source routing and MPTCP endpoints, so that an MPTCP connection opens a
+    subflow over every adapter instead of being hashed onto one of them
+    """
+    run_command("sysctl -qw net.mptcp.enabled=1")
+    run_command("ip mptcp endpoint flush", check=False)
+    run_command(f"ip mptcp limits set subflow {len(ifaces)} add_addr_accepted {len(ifaces)}")
+    for ifname in ifaces:
+        addr = interface_address(ifname)
+        if not addr:
+            print(f"✗ {ifname} has no IPv4 address; skipped for MPTCP")
+            continue
+        table = MPTCP_TABLE_BASE + int(ifname[3:])
+        run_command(f"ip route replace default via {gateways[ifname]} dev {ifname} "
+                    f"table {table}")
+        run_command(f"ip rule del from {addr} table {table}", check=False)
+        run_command(f"ip rule add from {addr} table {table}")
+        run_command(f"ip mptcp endpoint add {addr} dev {ifname} subflow")
+        print(f"✓ MPTCP subflows from {addr} go through {ifname} (table {table})")
+    return True
+
+
+def remove_multipath(ifaces):
+    """Undo setup_multipath_route() and setup_mptcp()"""
+    result = run_command("ip route show default", check=False, capture_output=True)
+    if result.returncode == 0 and "nexthop" in result.stdout:
+        run_command("ip route del default", check=False)
+        print("✓ Removed multipath default route")
+    run_command("ip mptcp endpoint flush", check=False)
+    for ifname in ifaces:
+        table = MPTCP_TABLE_BASE + int(ifname[3:])
+        addr = interface_address(ifname)
+        if addr:
+            run_command(f"ip rule del from {addr} table {table}", check=False)
+        run_command(f"ip route flush table {table}", check=False)
+    return True
+
+
+def apply_config(args, ifaces):
+    """Push firmware settings through the control socket of each bridge"""
+    try:
+        settings = esp_config.load_profile(args.config_file) if args.config_file else {}
+        settings.update(esp_config.parse_assignments(args.config))
+        body = esp_config.encode_set(settings, args.save_config)
+    except (OSError, ValueError) as e:
+        print(f"✗ Failed to apply firmware settings: {e}")
+        return False
+
+    ok = True
+    for ifname in ifaces:
+        try:
+            # With several adapters only a running bridge identifies one
+            if len(ifaces) > 1:
+                link = esp_ctl.SocketLink(esp_ctl.ctl_socket_path(ifname))
+            else:
+                link = esp_ctl.open_link(esp_ctl.ctl_socket_path(ifname))
+            try:
+                link.request(esp_frame.CMD_CONFIG_SET, body)
+            finally:
+                link.close()
+        except (OSError, ValueError, esp_ctl.CtlError) as e:
+            print(f"✗ {ifname}: failed to apply firmware settings: {e}")
+            ok = False
+            continue
+        print(f"✓ {ifname}: firmware settings applied: {', '.join(settings)}"
+              + (" (saved)" if args.save_config else ""))
+    return ok
+
+
 def parse_args():
     """Parse command line arguments"""
     parser = argparse.ArgumentParser(
@@ -226,6 +354,15 @@ Examples:
 
   # Test connectivity
   sudo python3 setup_routing.py --test
+
+  # Apply a firmware profile, keep it across reboots, then route through esp0
+  sudo python3 setup_routing.py --config-file fast.json --save-config --default
+
+  # Spread flows over every adapter (bridge_usb.py --all), esp0 getting twice the share
+  sudo python3 setup_routing.py --multipath --weights 2,1,1
+
+  # Same, and let MPTCP connections use all adapters at once
+  sudo python3 setup_routing.py --multipath --mptcp
         """
     )
     
@@ -277,6 +414,58 @@ Examples:
         help="Show backup route information (manual restore may be needed)"
     )
     
+    parser.add_argument(
+        "--multipath",
+        action="store_true",
+        help="Default route over several adapters, balanced per flow by weight"
+    )
+    
+    parser.add_argument(
+        "--interfaces", "-i",
+        metavar="IF,IF,...",
+        help="Adapters for --multipath, --remove-multipath and --config "
+             "(default: every espN for the multipath options, else esp0)"
+    )
+    
+    parser.add_argument(
+        "--weights", "-w",
+        metavar="W,W,...",
+        help="--multipath: relative share of new flows per interface (default: equal)"
+    )
+    
+    parser.add_argument(
+        "--mptcp",
+        action="store_true",
+        help="--multipath: also add per-interface source routes and MPTCP "
+             "endpoints, so one MPTCP connection uses every adapter"
+    )
+    
+    parser.add_argument(
+        "--remove-multipath",
+        action="store_true",
+        help="Remove the multipath default route and the MPTCP setup"
+    )
+    
+    parser.add_argument(
+        "--config",
+        action="append",
+        default=[],
+        metavar="NAME=VALUE",
+        help="Apply a firmware setting first (repeatable; see esp_ctl.py config)"
+    )
+    
+    parser.add_argument(
+        "--config-file",
+        metavar="PROFILE",
+        help="Apply the settings of a JSON profile first"
+    )
+    
+    parser.add_argument(
+        "--save-config",
+        action="store_true",
+        help="Also store the applied settings on the ESP32"
+    )
+    
     return parser.parse_args()
 
 
@@ -284,6 +473,46 @@ def main():
     check_root()
     args = parse_args()
     
+    if args.interfaces:
+        ifaces = args.interfaces.split(",")
+    elif args.multipath or args.remove_multipath:
+        ifaces = esp_interfaces()
+        if not ifaces:
+            print("Error: no espN interfaces found; run setup_tap.py --all first")
+            sys.exit(1)
+    else:
+        ifaces = [ESP0_IF]
+    
+    if args.config or args.config_file:
+        if not apply_config(args, ifaces):
+            sys.exit(1)
+        if not (args.show or args.test or args.restore or args.remove_default or
+                args.remove_route or args.default or args.route or args.multipath or
+                args.remove_multipath):
+            return
+    
+    if args.remove_multipath:
+        remove_multipath(ifaces)
+        show_routes()
+        return
+    
+    if args.multipath:
+        try:
+            weights = [int(w) for w in args.weights.split(",")] if args.weights else [1] * len(ifaces)
+        except ValueError:
+            weights = []
+        if len(weights) != len(ifaces) or min(weights) < 1:
+            print(f"Error: --weights needs {len(ifaces)} positive integers for {', '.join(ifaces)}")
+            sys.exit(1)
+        # Before the old default routes, which may hold them, are removed
+        gateways = {i: interface_gateway(i) for i in ifaces}
+        if not setup_multipath_route(ifaces, gateways, weights, metric=args.metric):
+            sys.exit(1)
+        if args.mptcp:
+            setup_mptcp(ifaces, gateways)
+        show_routes()
+        return
+    
     if args.show:
         show_routes()
         return
@@ -322,6 +551,7 @@ def main():
     print("\nQuick start:")
     print("  sudo python3 setup_routing.py --default  # Route all traffic through ESP32")
     print("  sudo python3 setup_routing.py --show     # Show current routes")
+    print("  sudo python3 setup_routing.py --multipath  # Spread flows over all adapters")
 
 
 if __name__ == "__main__":
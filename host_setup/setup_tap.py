@@ -9,10 +9,12 @@ import sys
 import subprocess
 import glob
 import argparse
+import re
 
 TAP_IF = "esp0"
 USB_DEV = None  # Will be auto-detected if not specified
 IP_ADDR = "192.168.7.1"
+ROUTER_HOST_IP = "192.168.7.2"  # firmware in NAT router mode is 192.168.7.1
 NETMASK = "255.255.255.0"
 ESPRESSIF_USB_VID = "303a"
 
@@ -49,15 +51,22 @@ def find_usb_parent_sysfs(tty_path):
     return None
 
 
-def detect_esp32_acm():
+def _port_key(sysfs_usb):
+    """Sort key for a USB device path such as 1-2.10: by hub port, numerically"""
+    name = os.path.basename(sysfs_usb)
+    return [int(p) if p.isdigit() else p for p in re.split(r"(\d+)", name)]
+
+
+def detect_esp32_acms():
     """
-    Auto-detect ESP32 (Espressif VID 303a) among /dev/ttyACM* devices.
-    Returns path string or None.
+    Find every ESP32 (Espressif VID 303a) among /dev/ttyACM* devices.
+    Returns their paths in USB port order, the order bridge_usb.py --all
+    numbers its interfaces in.
     """
     candidates = sorted(glob.glob("/dev/ttyACM*"))
     if not candidates:
         print("Auto-detect: no /dev/ttyACM* devices found")
-        return None
+        return []
 
     print("Auto-detect: scanning /dev/ttyACM* for ESP32 (VID 303a)...")
     esp_ports = []
@@ -77,9 +86,19 @@ def detect_esp32_acm():
             print(f"  {dev}: failed to read idVendor/idProduct")
             continue
 
-        print(f"  {dev}: VID={vid}, PID={pid}")
+        print(f"  {dev}: VID={vid}, PID={pid}, port {os.path.basename(sysfs_usb)}")
         if vid == ESPRESSIF_USB_VID:
-            esp_ports.append(dev)
+            esp_ports.append((_port_key(sysfs_usb), dev))
+
+    return [dev for _, dev in sorted(esp_ports)]
+
+
+def detect_esp32_acm():
+    """
+    Auto-detect ESP32 (Espressif VID 303a) among /dev/ttyACM* devices.
+    Returns path string or None.
+    """
+    esp_ports = detect_esp32_acms()
 
     if len(esp_ports) == 1:
         print(f"Auto-detect: selected {esp_ports[0]} (Espressif VID 303a)")
@@ -88,12 +107,32 @@ def detect_esp32_acm():
         print("Auto-detect: multiple ESP32-like devices found:")
         for p in esp_ports:
             print(f"  - {p}")
-        print("Using the first one; specify --dev explicitly if this is wrong.")
+        print("Using the first one; specify --dev explicitly if this is wrong "
+              "(or --all to set up all of them).")
         return esp_ports[0]
-    else:
-        print("Auto-detect: no ESP32 (VID 303a) found on /dev/ttyACM*")
-        print("Falling back to first /dev/ttyACM* device.")
-        return candidates[0]
+
+    candidates = sorted(glob.glob("/dev/ttyACM*"))
+    if not candidates:
+        return None
+    print("Auto-detect: no ESP32 (VID 303a) found on /dev/ttyACM*")
+    print("Falling back to first /dev/ttyACM* device.")
+    return candidates[0]
+
+
+def tap_name(index):
+    """Interface of the index-th adapter, as bridge_usb.py --all names it"""
+    return f"{TAP_IF[:-1]}{index}"
+
+
+def tap_address(index, router=False):
+    """
+    Host address on the index-th adapter's link: one apart per adapter,
+    so each link has its own source address for multipath and MPTCP. A
+    router-mode adapter translates any 192.168.7.0/24 host address.
+    """
+    octets = (ROUTER_HOST_IP if router else IP_ADDR).split(".")
+    octets[3] = str(int(octets[3]) + index)
+    return ".".join(octets)
 
 
 def run_command(cmd, check=True, capture_output=False):
@@ -135,16 +174,16 @@ def interface_exists(ifname):
     return result.returncode == 0
 
 
-def create_tap_interface():
+def create_tap_interface(ip_addr=IP_ADDR, name=TAP_IF):
     """Create and configure TAP interface"""
-    if interface_exists(TAP_IF):
-        print(f"TAP interface {TAP_IF} already exists")
+    if interface_exists(name):
+        print(f"TAP interface {name} already exists")
         return
 
-    print(f"Creating TAP interface: {TAP_IF}")
-    run_command(f"ip tuntap add mode tap {TAP_IF}")
-    run_command(f"ip addr add {IP_ADDR}/24 dev {TAP_IF}")
-    run_command(f"ip link set {TAP_IF} up")
+    print(f"Creating TAP interface: {name}")
+    run_command(f"ip tuntap add mode tap {name}")
+    run_command(f"ip addr add {ip_addr}/24 dev {name}")
+    run_command(f"ip link set {name} up")
     print("TAP interface created and configured")
 
 
@@ -172,6 +211,18 @@ def parse_args():
         help="USB serial device (e.g. /dev/ttyACM1). "
              "If omitted, auto-detect ESP32 (VID 303a) on /dev/ttyACM*"
     )
+    parser.add_argument(
+        "--router",
+        action="store_true",
+        help=f"Firmware built in NAT router mode: use {ROUTER_HOST_IP} and "
+             f"leave {IP_ADDR} to the adapter"
+    )
+    parser.add_argument(
+        "--all",
+        action="store_true",
+        help=f"Set up one interface per ESP32 found ({tap_name(0)}, {tap_name(1)}, ...), "
+             "for bridge_usb.py --all"
+    )
     return parser.parse_args()
 
 
@@ -185,33 +236,46 @@ def main():
     # Parse arguments
     args = parse_args()
 
-    # Auto-detect USB device if not specified
-    usb_dev = args.dev
-    if not usb_dev:
-        usb_dev = detect_esp32_acm()
+    # Auto-detect USB device(s) if not specified
+    if args.all:
+        if args.dev:
+            print("Error: --all and --dev cannot be combined")
+            sys.exit(1)
+        usb_devs = detect_esp32_acms()
+        if not usb_devs:
+            print("Error: no ESP32 (VID 303a) found")
+            sys.exit(1)
+    else:
+        usb_dev = args.dev or detect_esp32_acm()
         if not usb_dev:
             print("Error: Could not auto-detect ESP32 USB device")
             print("Please specify --dev manually: --dev /dev/ttyACM1")
             sys.exit(1)
+        usb_devs = [usb_dev]
 
     # Check if TUN module is loaded
     check_tun_module()
 
-    # Create TAP interface
-    create_tap_interface()
-
-    # Check if USB device exists
-    check_usb_device(usb_dev)
+    # Create TAP interfaces
+    names = [tap_name(i) if args.all else TAP_IF for i in range(len(usb_devs))]
+    for i, (name, usb_dev) in enumerate(zip(names, usb_devs)):
+        create_tap_interface(tap_address(i, args.router), name)
+        check_usb_device(usb_dev)
 
     print("")
     print("Setup complete!")
-    print(f"TAP interface: {TAP_IF}")
-    print(f"IP address: {IP_ADDR}")
-    print(f"USB device: {usb_dev}")
+    for i, (name, usb_dev) in enumerate(zip(names, usb_devs)):
+        print(f"TAP interface: {name}")
+        print(f"IP address: {tap_address(i, args.router)}")
+        print(f"USB device: {usb_dev}")
+    if args.all and len(names) > 1:
+        print("")
+        print("Start the bridges with: sudo python3 bridge_usb.py --all")
+        print("Spread traffic over them with: sudo python3 setup_routing.py --multipath")
     print("")
     print("To remove the interface later, run:")
-    print(f"  sudo ip tuntap del mode tap {TAP_IF}")
-
+    for name in names:
+        print(f"  sudo ip tuntap del mode tap {name}")
 
 if __name__ == "__main__":
     main()
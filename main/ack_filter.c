@@ -0,0 +1,159 @@
+/*
+ * TCP ACK Filter
+ * Recognises pure cumulative ACKs so a newer one can replace a queued one
+ * of the same flow on the USB -> WiFi path
+ */
+
+#include <string.h>
+
+#include "ack_filter.h"
+
+#define ETH_HDR_LEN         14
+#define ETH_TYPE_IPV4       0x0800
+#define ETH_TYPE_VLAN       0x8100
+#define ETH_TYPE_IPV6       0x86DD
+#define IP_PROTO_TCP        6
+
+#define TCP_PSH             0x08
+#define TCP_ACK             0x10
+
+#define TCP_OPT_EOL         0
+#define TCP_OPT_NOP         1
+#define TCP_OPT_TS          8
+#define TCP_OPT_TS_LEN      10
+
+static inline uint16_t rd16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t rd32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Anything but NOP and timestamps may carry state a newer ACK does not repeat
+static bool options_mergeable(const uint8_t *opt, uint16_t len)
+{
+    uint16_t i = 0;
+
+    while (i < len) {
+        if (opt[i] == TCP_OPT_EOL) {
+            return true;
+        }
+        if (opt[i] == TCP_OPT_NOP) {
+            i++;
+            continue;
+        }
+        if (opt[i] != TCP_OPT_TS || i + 1 >= len || opt[i + 1] != TCP_OPT_TS_LEN) {
+            return false;
+        }
+        i += TCP_OPT_TS_LEN;
+    }
+    return i == len;
+}
+
+// FNV-1a over the address pair and the ports
+static uint32_t flow_hash(const uint8_t *addrs, uint16_t addr_len, const uint8_t *ports)
+{
+    uint32_t h = 2166136261u;
+
+    for (uint16_t i = 0; i < addr_len; i++) {
+        h = (h ^ addrs[i]) * 16777619u;
+    }
+    for (int i = 0; i < 4; i++) {
+        h = (h ^ ports[i]) * 16777619u;
+    }
+    return h ? h : 1;
+}
+
+bool ack_filter_parse(const uint8_t *frame, uint16_t len, ack_filter_key_t *key)
+{
+    uint16_t off = ETH_HDR_LEN;
+    uint16_t ethertype = rd16(frame + 12);
+
+    key->flow = 0;
+
+    if (ethertype == ETH_TYPE_VLAN && len >= ETH_HDR_LEN + 4) {
+        ethertype = rd16(frame + 16);
+        off += 4;
+    }
+
+    const uint8_t *l3 = frame + off;
+    uint16_t l3_len = len - off;
+    const uint8_t *tcp;
+    uint16_t tcp_len;
+    const uint8_t *addrs;
+    uint16_t addr_len;
+
+    if (ethertype == ETH_TYPE_IPV4) {
+        if (l3_len < 20) {
+            return false;
+        }
+        uint16_t ihl = (l3[0] & 0x0f) * 4;
+        uint16_t ip_len = rd16(l3 + 2);
+        if (l3[9] != IP_PROTO_TCP || ihl < 20 || ip_len < ihl || ip_len > l3_len ||
+            (rd16(l3 + 6) & 0x3fff) != 0) {     // fragments never merge
+            return false;
+        }
+        tcp = l3 + ihl;
+        tcp_len = ip_len - ihl;
+        addrs = l3 + 12;
+        addr_len = 8;
+        key->ipv6 = 0;
+    } else if (ethertype == ETH_TYPE_IPV6) {
+        if (l3_len < 40) {
+            return false;
+        }
+        uint16_t payload_len = rd16(l3 + 4);
+        if (l3[6] != IP_PROTO_TCP || payload_len > l3_len - 40) {
+            return false;
+        }
+        tcp = l3 + 40;
+        tcp_len = payload_len;
+        addrs = l3 + 8;
+        addr_len = 32;
+        key->ipv6 = 1;
+    } else {
+        return false;
+    }
+
+    if (tcp_len < 20) {
+        return false;
+    }
+    uint16_t doff = (tcp[12] >> 4) * 4;
+    uint8_t flags = tcp[13];
+    if (doff < 20 || doff != tcp_len || !(flags & TCP_ACK) || (flags & ~(TCP_ACK | TCP_PSH)) ||
+        (tcp[12] & 0x0f) != 0 || !options_mergeable(tcp + 20, doff - 20)) {
+        return false;
+    }
+
+    key->ack = rd32(tcp + 8);
+    key->win = rd16(tcp + 14);
+    key->l3_off = off;
+    key->flow = flow_hash(addrs, addr_len, tcp);
+    return true;
+}
+
+bool ack_filter_supersedes(const ack_filter_key_t *newer, const uint8_t *newer_frame,
+                           const ack_filter_key_t *older, const uint8_t *older_frame)
+{
+    if (newer->flow == 0 || newer->flow != older->flow || newer->ipv6 != older->ipv6) {
+        return false;
+    }
+
+    int32_t advance = (int32_t)(newer->ack - older->ack);
+    if (advance < 0 || (advance == 0 && newer->win == older->win)) {
+        return false;
+    }
+
+    // The hash matched; confirm addresses and ports byte for byte
+    const uint8_t *n = newer_frame + newer->l3_off;
+    const uint8_t *o = older_frame + older->l3_off;
+    if (newer->ipv6) {
+        return memcmp(n + 8, o + 8, 32) == 0 && memcmp(n + 40, o + 40, 4) == 0;
+    }
+    uint16_t n_ihl = (n[0] & 0x0f) * 4;
+    uint16_t o_ihl = (o[0] & 0x0f) * 4;
+    return memcmp(n + 12, o + 12, 8) == 0 && memcmp(n + n_ihl, o + o_ihl, 4) == 0;
+}
@@ -0,0 +1,49 @@
+#ifndef ACK_FILTER_H
+#define ACK_FILTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief What the filter needs to know about a queued pure ACK
+ */
+typedef struct {
+    uint32_t flow;      // hash of addresses and ports; 0: not mergeable
+    uint32_t ack;       // acknowledgment number
+    uint16_t win;       // raw window field
+    uint8_t l3_off;     // offset of the IP header in the frame
+    uint8_t ipv6;       // 1 for IPv6, 0 for IPv4
+} ack_filter_key_t;
+
+/**
+ * @brief Check whether a frame is a TCP ACK that a later one may replace
+ *
+ * Only pure cumulative ACKs qualify: no payload, no flags besides ACK and
+ * PSH (so no SYN/FIN/RST/URG/ECE/CWR), and no options other than NOP and
+ * timestamps. In particular, ACKs carrying SACK blocks are never merged.
+ *
+ * @param frame Ethernet frame
+ * @param len Frame length
+ * @param key Filled in; key->flow is 0 when the frame does not qualify
+ * @return true if the frame qualifies
+ */
+bool ack_filter_parse(const uint8_t *frame, uint16_t len, ack_filter_key_t *key);
+
+/**
+ * @brief Check whether a new ACK makes a queued one redundant
+ *
+ * True when both belong to the same flow and the new one either
+ * acknowledges more data or, for the same acknowledgment number, carries
+ * a different window (a window update). Duplicate ACKs, which drive the
+ * sender's fast retransmit, are never merged.
+ *
+ * @param newer Key of the new ACK
+ * @param newer_frame New ACK frame
+ * @param older Key of the queued ACK
+ * @param older_frame Queued ACK frame
+ * @return true if the queued ACK can be replaced by the new one
+ */
+bool ack_filter_supersedes(const ack_filter_key_t *newer, const uint8_t *newer_frame,
+                           const ack_filter_key_t *older, const uint8_t *older_frame);
+
+#endif // ACK_FILTER_H
@@ -0,0 +1,354 @@
+/*
+ * Benchmark Mode
+ * Device-side traffic generator, sink and USB reflector for measuring
+ * each leg of the bridge on its own
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "esp_private/wifi.h"
+
+#include "bench.h"
+#include "bridge_ctrl.h"
+#include "wifi_bridge.h"
+#include "pkt_pool.h"
+#include "bridge_tasks.h"
+
+static const char *TAG = "bench";
+
+// Latency samples kept per test; later samples overwrite the oldest
+#define BENCH_MAX_SAMPLES   1024
+
+#define ETH_HDR_LEN         14
+#define IP_HDR_LEN          20
+#define UDP_HDR_LEN         8
+#define UDP_FRAME_OVERHEAD  (ETH_HDR_LEN + IP_HDR_LEN + UDP_HDR_LEN)
+#define UDP_MAX_PAYLOAD     (1500 - IP_HDR_LEN - UDP_HDR_LEN)
+#define UDP_MIN_PAYLOAD     12      // sequence number and timestamp
+
+// The generator yields at least this often so lower priority tasks run
+#define BENCH_TX_BURST      64
+
+volatile uint8_t g_bench_mode = BENCH_MODE_OFF;
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t s_last_mode = BENCH_MODE_OFF;
+static int64_t s_start_us = 0;
+static int64_t s_end_us = 0;
+static uint32_t s_packets = 0;
+static uint32_t s_bytes = 0;
+static uint32_t s_errors = 0;
+static uint32_t s_sample_count = 0;
+static uint32_t s_samples[BENCH_MAX_SAMPLES];
+static uint32_t s_sorted[BENCH_MAX_SAMPLES];
+
+static uint16_t s_sink_port = 0;
+static int64_t s_sink_last_us = 0;
+
+static bench_start_req_t s_tx_req;
+static TaskHandle_t s_tx_task = NULL;
+
+void bench_account(uint16_t len, bool ok, uint32_t latency_us)
+{
+    portENTER_CRITICAL_SAFE(&s_lock);
+    if (ok) {
+        s_packets++;
+        s_bytes += len;
+    } else {
+        s_errors++;
+    }
+    s_samples[s_sample_count % BENCH_MAX_SAMPLES] = latency_us;
+    s_sample_count++;
+    portEXIT_CRITICAL_SAFE(&s_lock);
+}
+
+bool bench_wifi_sink(const uint8_t *frame, uint16_t len)
+{
+    if (g_bench_mode != BENCH_MODE_WIFI_SINK || len < UDP_FRAME_OVERHEAD) {
+        return false;
+    }
+
+    const uint8_t *ip = frame + ETH_HDR_LEN;
+    if (frame[12] != 0x08 || frame[13] != 0x00 || (ip[0] >> 4) != 4 || ip[9] != 17) {
+        return false;
+    }
+    const uint8_t *udp = ip + (ip[0] & 0x0f) * 4;
+    if (udp + UDP_HDR_LEN > frame + len || ((udp[2] << 8) | udp[3]) != s_sink_port) {
+        return false;
+    }
+
+    int64_t now = esp_timer_get_time();
+    uint32_t gap = s_sink_last_us ? (uint32_t)(now - s_sink_last_us) : 0;
+    s_sink_last_us = now;
+    bench_account(len, true, gap);
+    return true;
+}
+
+static void put_be16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    put_be16(p, v >> 16);
+    put_be16(p + 2, v & 0xffff);
+}
+
+static uint16_t ip_checksum(const uint8_t *hdr, size_t len)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < len; i += 2) {
+        sum += (hdr[i] << 8) | hdr[i + 1];
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum & 0xffff;
+}
+
+// Build the Ethernet/IPv4/UDP template; only the payload changes per frame
+static uint16_t build_udp_frame(uint8_t *frame, const bench_start_req_t *req)
+{
+    uint16_t payload_len = req->payload_len;
+    uint8_t *ip = frame + ETH_HDR_LEN;
+    uint8_t *udp = ip + IP_HDR_LEN;
+
+    memcpy(frame, req->dst_mac, 6);
+    esp_wifi_get_mac(WIFI_IF_STA, frame + 6);
+    put_be16(frame + 12, 0x0800);
+
+    memset(ip, 0, IP_HDR_LEN);
+    ip[0] = 0x45;
+    put_be16(ip + 2, IP_HDR_LEN + UDP_HDR_LEN + payload_len);
+    put_be16(ip + 6, 0x4000);       // DF, so the ID may stay 0
+    ip[8] = 64;
+    ip[9] = 17;
+    memcpy(ip + 12, req->src_ip, 4);
+    memcpy(ip + 16, req->dst_ip, 4);
+    put_be16(ip + 10, ip_checksum(ip, IP_HDR_LEN));
+
+    put_be16(udp, req->src_port);
+    put_be16(udp + 2, req->dst_port);
+    put_be16(udp + 4, UDP_HDR_LEN + payload_len);
+    put_be16(udp + 6, 0);           // no UDP checksum (allowed for IPv4)
+
+    memset(udp + UDP_HDR_LEN, 0, payload_len);
+    return UDP_FRAME_OVERHEAD + payload_len;
+}
+
+static void bench_tx_task(void *arg)
+{
+    uint8_t *frame = pkt_pool_alloc();
+    if (frame == NULL) {
+        ESP_LOGE(TAG, "No buffer for generated frames");
+        g_bench_mode = BENCH_MODE_OFF;
+        s_end_us = esp_timer_get_time();
+        s_tx_task = NULL;
+        vTaskDelete(NULL);
+        return;
+    }
+
+    const bench_start_req_t *req = &s_tx_req;
+    uint16_t len = build_udp_frame(frame, req);
+    uint8_t *payload = frame + UDP_FRAME_OVERHEAD;
+    int64_t deadline = s_start_us + (int64_t)req->duration_ms * 1000;
+    uint32_t seq = 0;
+
+    ESP_LOGI(TAG, "Generating %u-byte UDP frames for %lu ms",
+             req->payload_len, (unsigned long)req->duration_ms);
+
+    while (g_bench_mode == BENCH_MODE_WIFI_TX) {
+        int64_t now = esp_timer_get_time();
+        if (now >= deadline) {
+            break;
+        }
+
+        if (req->rate_pps) {
+            uint64_t due = (uint64_t)req->rate_pps * (now - s_start_us) / 1000000;
+            if (seq >= due) {
+                vTaskDelay(1);
+                continue;
+            }
+        }
+
+        // Receivers can compute loss and one-way delay from these
+        put_be32(payload, seq);
+        put_be32(payload + 4, (uint32_t)(now >> 32));
+        put_be32(payload + 8, (uint32_t)now);
+
+        esp_err_t err = esp_wifi_internal_tx(WIFI_IF_STA, frame, len);
+        bench_account(len, err == ESP_OK, (uint32_t)(esp_timer_get_time() - now));
+        seq++;
+
+        if (err != ESP_OK || (seq % BENCH_TX_BURST) == 0) {
+            // Out of driver buffers, or time to let others run
+            vTaskDelay(1);
+        }
+    }
+
+    pkt_pool_free(frame);
+    if (g_bench_mode == BENCH_MODE_WIFI_TX) {
+        g_bench_mode = BENCH_MODE_OFF;
+        s_end_us = esp_timer_get_time();
+    }
+    ESP_LOGI(TAG, "Generator finished after %lu frames", (unsigned long)seq);
+    s_tx_task = NULL;
+    vTaskDelete(NULL);
+}
+
+static void bench_reset(uint8_t mode)
+{
+    portENTER_CRITICAL_SAFE(&s_lock);
+    s_last_mode = mode;
+    s_packets = 0;
+    s_bytes = 0;
+    s_errors = 0;
+    s_sample_count = 0;
+    s_sink_last_us = 0;
+    s_start_us = esp_timer_get_time();
+    s_end_us = 0;
+    portEXIT_CRITICAL_SAFE(&s_lock);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_fill_result(bench_result_t *res)
+{
+    portENTER_CRITICAL_SAFE(&s_lock);
+    int64_t end = s_end_us ? s_end_us : esp_timer_get_time();
+    res->mode = s_last_mode;
+    res->running = g_bench_mode != BENCH_MODE_OFF;
+    res->reserved = 0;
+    res->elapsed_us = s_start_us ? (uint32_t)(end - s_start_us) : 0;
+    res->packets = s_packets;
+    res->bytes = s_bytes;
+    res->errors = s_errors;
+    uint32_t n = s_sample_count < BENCH_MAX_SAMPLES ? s_sample_count : BENCH_MAX_SAMPLES;
+    memcpy(s_sorted, s_samples, n * sizeof(s_sorted[0]));
+    portEXIT_CRITICAL_SAFE(&s_lock);
+
+    // Only the control task gets here, so s_sorted needs no lock
+    res->samples = n;
+    res->lat_p50_us = res->lat_p90_us = res->lat_p99_us = res->lat_max_us = 0;
+    if (n > 0) {
+        qsort(s_sorted, n, sizeof(s_sorted[0]), cmp_u32);
+        res->lat_p50_us = s_sorted[(n - 1) * 50 / 100];
+        res->lat_p90_us = s_sorted[(n - 1) * 90 / 100];
+        res->lat_p99_us = s_sorted[(n - 1) * 99 / 100];
+        res->lat_max_us = s_sorted[n - 1];
+    }
+}
+
+static esp_err_t bench_start(const bench_start_req_t *req)
+{
+    if (g_bench_mode != BENCH_MODE_OFF || s_tx_task != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    switch (req->mode) {
+    case BENCH_MODE_USB_LOOPBACK:
+    case BENCH_MODE_CYCLES_USB:
+    case BENCH_MODE_CYCLES_WIFI:
+        break;
+    case BENCH_MODE_WIFI_SINK:
+        s_sink_port = req->dst_port;
+        break;
+    case BENCH_MODE_WIFI_TX:
+        if (req->payload_len < UDP_MIN_PAYLOAD || req->payload_len > UDP_MAX_PAYLOAD ||
+            req->duration_ms == 0) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        if (!wifi_bridge_is_connected()) {
+            return ESP_ERR_INVALID_STATE;
+        }
+        s_tx_req = *req;
+        break;
+    default:
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    bench_reset(req->mode);
+    g_bench_mode = req->mode;
+
+    if (req->mode == BENCH_MODE_WIFI_TX &&
+        xTaskCreatePinnedToCore(bench_tx_task, "bench_tx", 3072, NULL,
+                                CONFIG_BRIDGE_TASK_WIFI_TX_PRIO, &s_tx_task,
+                                BRIDGE_TASK_CORE) != pdPASS) {
+        g_bench_mode = BENCH_MODE_OFF;
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI(TAG, "Benchmark mode %u started", req->mode);
+    return ESP_OK;
+}
+
+static esp_err_t ctrl_bench_start(const uint8_t *req, uint16_t req_len,
+                                  uint8_t *resp, uint16_t *resp_len)
+{
+    bench_start_req_t start;
+    if (req_len < sizeof(start)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(&start, req, sizeof(start));
+    *resp_len = 0;
+    return bench_start(&start);
+}
+
+static esp_err_t ctrl_bench_stop(const uint8_t *req, uint16_t req_len,
+                                 uint8_t *resp, uint16_t *resp_len)
+{
+    if (g_bench_mode != BENCH_MODE_OFF) {
+        g_bench_mode = BENCH_MODE_OFF;
+        s_end_us = esp_timer_get_time();
+        ESP_LOGI(TAG, "Benchmark stopped");
+    }
+
+    bench_result_t res;
+    bench_fill_result(&res);
+    memcpy(resp, &res, sizeof(res));
+    *resp_len = sizeof(res);
+    return ESP_OK;
+}
+
+static esp_err_t ctrl_bench_result(const uint8_t *req, uint16_t req_len,
+                                   uint8_t *resp, uint16_t *resp_len)
+{
+    bench_result_t res;
+    bench_fill_result(&res);
+    memcpy(resp, &res, sizeof(res));
+    *resp_len = sizeof(res);
+    return ESP_OK;
+}
+
+esp_err_t bench_init(void)
+{
+    bridge_ctrl_register(CTRL_CMD_BENCH_START, ctrl_bench_start);
+    bridge_ctrl_register(CTRL_CMD_BENCH_STOP, ctrl_bench_stop);
+    bridge_ctrl_register(CTRL_CMD_BENCH_RESULT, ctrl_bench_result);
+
+#if CONFIG_BRIDGE_BENCH_BOOT_USB_LOOPBACK || CONFIG_BRIDGE_BENCH_BOOT_WIFI_SINK
+    bench_start_req_t boot = {
+#if CONFIG_BRIDGE_BENCH_BOOT_USB_LOOPBACK
+        .mode = BENCH_MODE_USB_LOOPBACK,
+#else
+        .mode = BENCH_MODE_WIFI_SINK,
+        .dst_port = CONFIG_BRIDGE_BENCH_SINK_PORT,
+#endif
+    };
+    return bench_start(&boot);
+#else
+    return ESP_OK;
+#endif
+}
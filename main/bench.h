@@ -0,0 +1,116 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "esp_err.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+
+// Benchmark modes (CTRL_CMD_BENCH_START body, bench_start_req_t.mode)
+#define BENCH_MODE_OFF          0
+#define BENCH_MODE_USB_LOOPBACK 1   // echo data frames back inside usb_rx_task
+#define BENCH_MODE_WIFI_TX      2   // generate UDP frames on the STA interface
+#define BENCH_MODE_WIFI_SINK    3   // count and drop UDP frames from the STA
+#define BENCH_MODE_CYCLES_USB   4   // bridge as usual, profiling USB -> WiFi
+#define BENCH_MODE_CYCLES_WIFI  5   // bridge as usual, profiling WiFi -> USB
+
+/*
+ * Wire formats of the benchmark control messages (little endian). The
+ * meaning of the latency fields depends on the mode:
+ *   USB_LOOPBACK  header received to echo queued for USB TX, per frame
+ *   WIFI_TX       time spent in esp_wifi_internal_tx(), per frame
+ *   WIFI_SINK     gap between consecutive received frames
+ *   CYCLES_USB    CPU cycles in usb_rx_task from the frame read in to it
+ *                 queued for WiFi TX (in cycles, not microseconds)
+ *   CYCLES_WIFI   CPU cycles in wifi_rx_task from the frame taken off the
+ *                 RX ring to it queued for USB TX (likewise)
+ * The cycle counter runs on while another task preempts the measured one,
+ * so the high percentiles include that; p50 is the per-frame cost.
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t mode;           // BENCH_MODE_*
+    uint8_t reserved;
+    uint16_t payload_len;   // WIFI_TX: UDP payload bytes
+    uint32_t duration_ms;   // WIFI_TX: run time; other modes run until stopped
+    uint32_t rate_pps;      // WIFI_TX: 0 = as fast as the driver accepts
+    uint8_t dst_mac[6];     // WIFI_TX: next hop (usually the gateway)
+    uint8_t src_ip[4];      // WIFI_TX: source address for generated frames
+    uint8_t dst_ip[4];      // WIFI_TX: destination address
+    uint16_t src_port;      // WIFI_TX: UDP source port
+    uint16_t dst_port;      // WIFI_TX: UDP destination; WIFI_SINK: port counted
+} bench_start_req_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t mode;           // mode of the last test
+    uint8_t running;        // 1 while the test is still going
+    uint16_t reserved;
+    uint32_t elapsed_us;
+    uint32_t packets;
+    uint32_t bytes;
+    uint32_t errors;
+    uint32_t samples;       // latency samples behind the percentiles
+    uint32_t lat_p50_us;
+    uint32_t lat_p90_us;
+    uint32_t lat_p99_us;
+    uint32_t lat_max_us;
+} bench_result_t;
+
+#if CONFIG_BRIDGE_BENCH
+
+extern volatile uint8_t g_bench_mode;
+
+/**
+ * @brief Register the benchmark control commands and apply the boot mode
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t bench_init(void);
+
+/**
+ * @brief Account one frame to the running test
+ *
+ * @param len Frame length
+ * @param ok false if the frame was dropped or failed
+ * @param latency_us Latency sample for this frame
+ */
+void bench_account(uint16_t len, bool ok, uint32_t latency_us);
+
+/**
+ * @brief Consume a frame received from WiFi if the sink test wants it
+ *
+ * @param frame Ethernet frame
+ * @param len Frame length
+ * @return true if the frame was counted and must be dropped
+ */
+bool bench_wifi_sink(const uint8_t *frame, uint16_t len);
+
+static inline bool bench_mode_is(uint8_t mode)
+{
+    return g_bench_mode == mode;
+}
+
+#else
+
+static inline esp_err_t bench_init(void)
+{
+    return ESP_OK;
+}
+
+static inline void bench_account(uint16_t len, bool ok, uint32_t latency_us)
+{
+}
+
+static inline bool bench_wifi_sink(const uint8_t *frame, uint16_t len)
+{
+    return false;
+}
+
+// Constant false: benchmark hooks in the data path compile away
+static inline bool bench_mode_is(uint8_t mode)
+{
+    return false;
+}
+
+#endif // CONFIG_BRIDGE_BENCH
+
+#endif // BENCH_H
@@ -0,0 +1,489 @@
+/*
+ * Runtime Configuration
+ * Settings changed by the host over the control channel, applied live and
+ * optionally kept in NVS
+ */
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_wifi.h"
+#include "nvs.h"
+
+#include "bridge_config.h"
+#include "wifi_bridge.h"
+#include "wifi_config.h"
+#include "tx_sched.h"
+#include "pkt_filter.h"
+#if CONFIG_BRIDGE_USB_SERIAL_JTAG
+#include "bridge_ctrl.h"
+#endif
+
+static const char *TAG = "bridge_config";
+
+#define NVS_NAMESPACE       "bridge_cfg"
+#define ENTRY_HDR_LEN       3           // key(1) len(2)
+#define VALUE_MAX           (PKT_FILTER_MAX_RULES * sizeof(pkt_filter_rule_t))
+#define RECONNECT_MAX_MS    3600000
+#define FILTER_RATE_MAX     10000
+
+// Classification is compiled out without BRIDGE_TX_QOS
+#if CONFIG_BRIDGE_TX_QOS
+#define QOS_MAX             1
+#else
+#define QOS_MAX             0
+#endif
+
+typedef struct {
+    uint8_t key;
+    const char *name;           // also the NVS key
+    // Whether the value would be accepted; nothing changes
+    esp_err_t (*check)(const uint8_t *value, uint16_t len);
+    // Only called with values check() accepted
+    esp_err_t (*apply)(const uint8_t *value, uint16_t len);
+    // Current value; returns its length
+    uint16_t (*get)(uint8_t *value);
+} config_item_t;
+
+static char s_ssid[33];
+static char s_password[65];
+static bool s_cred_changed;         // apply() staged new credentials
+
+static inline uint16_t rd16le(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline void wr16le(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static esp_err_t ssid_check(const uint8_t *value, uint16_t len)
+{
+    return len >= 1 && len < sizeof(s_ssid) ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+static esp_err_t ssid_apply(const uint8_t *value, uint16_t len)
+{
+    memcpy(s_ssid, value, len);
+    s_ssid[len] = '\0';
+    s_cred_changed = true;
+    return ESP_OK;
+}
+
+static uint16_t ssid_get(uint8_t *value)
+{
+    uint16_t len = strlen(s_ssid);
+    memcpy(value, s_ssid, len);
+    return len;
+}
+
+// Open network, a WPA passphrase or a 64-digit PSK
+static esp_err_t password_check(const uint8_t *value, uint16_t len)
+{
+    return len == 0 || (len >= 8 && len < sizeof(s_password)) ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+static esp_err_t password_apply(const uint8_t *value, uint16_t len)
+{
+    memcpy(s_password, value, len);
+    s_password[len] = '\0';
+    s_cred_changed = true;
+    return ESP_OK;
+}
+
+static uint16_t password_get(uint8_t *value)
+{
+    return 0;
+}
+
+static esp_err_t ps_check(const uint8_t *value, uint16_t len)
+{
+    if (len != 1) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return value[0] <= WIFI_PS_MAX_MODEM ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+static esp_err_t ps_apply(const uint8_t *value, uint16_t len)
+{
+    return esp_wifi_set_ps((wifi_ps_type_t)value[0]);
+}
+
+static uint16_t ps_get(uint8_t *value)
+{
+    wifi_ps_type_t type = WIFI_PS_NONE;
+
+    esp_wifi_get_ps(&type);
+    value[0] = type;
+    return 1;
+}
+
+static esp_err_t reconnect_check(const uint8_t *value, uint16_t len)
+{
+    uint32_t ms;
+
+    if (len != sizeof(ms)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(&ms, value, sizeof(ms));
+    return ms >= WIFI_BACKOFF_MIN_MS && ms <= RECONNECT_MAX_MS ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+static esp_err_t reconnect_apply(const uint8_t *value, uint16_t len)
+{
+    uint32_t ms;
+
+    memcpy(&ms, value, sizeof(ms));
+    return wifi_bridge_set_backoff_max(ms);
+}
+
+static uint16_t reconnect_get(uint8_t *value)
+{
+    uint32_t ms = wifi_bridge_get_backoff_max();
+
+    memcpy(value, &ms, sizeof(ms));
+    return sizeof(ms);
+}
+
+static esp_err_t qos_check(const uint8_t *value, uint16_t len)
+{
+    if (len != 1) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return value[0] <= QOS_MAX ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+static esp_err_t qos_apply(const uint8_t *value, uint16_t len)
+{
+    return tx_sched_set_qos(value[0]);
+}
+
+static uint16_t qos_get(uint8_t *value)
+{
+    value[0] = tx_sched_qos_enabled();
+    return 1;
+}
+
+static esp_err_t depth_check(const uint8_t *value, uint16_t len)
+{
+    if (len != TX_CLASS_MAX) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    for (int c = 0; c < TX_CLASS_MAX; c++) {
+        uint8_t max;
+        tx_sched_get_depth(c, &max);
+        if (value[c] == 0 || value[c] > max) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t depth_apply(const uint8_t *value, uint16_t len)
+{
+    for (int c = 0; c < TX_CLASS_MAX; c++) {
+        esp_err_t ret = tx_sched_set_depth(c, value[c]);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+    }
+    return ESP_OK;
+}
+
+static uint16_t depth_get(uint8_t *value)
+{
+    for (int c = 0; c < TX_CLASS_MAX; c++) {
+        value[c] = tx_sched_get_depth(c, NULL);
+    }
+    return TX_CLASS_MAX;
+}
+
+#if CONFIG_BRIDGE_FILTER
+static esp_err_t rules_check(const uint8_t *value, uint16_t len)
+{
+    pkt_filter_rule_t rules[PKT_FILTER_MAX_RULES];
+
+    if (len % sizeof(rules[0]) != 0 || len > sizeof(rules)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(rules, value, len);
+    return pkt_filter_rules_valid(rules, len / sizeof(rules[0]));
+}
+
+static esp_err_t rules_apply(const uint8_t *value, uint16_t len)
+{
+    pkt_filter_rule_t rules[PKT_FILTER_MAX_RULES];
+
+    memcpy(rules, value, len);
+    return pkt_filter_set_rules(rules, len / sizeof(rules[0]));
+}
+
+static uint16_t rules_get(uint8_t *value)
+{
+    pkt_filter_rule_t rules[PKT_FILTER_MAX_RULES];
+    size_t count = pkt_filter_get_rules(rules, PKT_FILTER_MAX_RULES);
+
+    memcpy(value, rules, count * sizeof(rules[0]));
+    return count * sizeof(rules[0]);
+}
+
+static esp_err_t rates_check(const uint8_t *value, uint16_t len)
+{
+    if (len != 2 * PKT_FILTER_BUCKETS) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    for (int b = 0; b < PKT_FILTER_BUCKETS; b++) {
+        if (rd16le(value + 2 * b) > FILTER_RATE_MAX) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t rates_apply(const uint8_t *value, uint16_t len)
+{
+    for (int b = 0; b < PKT_FILTER_BUCKETS; b++) {
+        esp_err_t ret = pkt_filter_set_rate(b, rd16le(value + 2 * b));
+        if (ret != ESP_OK) {
+            return ret;
+        }
+    }
+    return ESP_OK;
+}
+
+static uint16_t rates_get(uint8_t *value)
+{
+    for (int b = 0; b < PKT_FILTER_BUCKETS; b++) {
+        wr16le(value + 2 * b, pkt_filter_get_rate(b));
+    }
+    return 2 * PKT_FILTER_BUCKETS;
+}
+#endif // CONFIG_BRIDGE_FILTER
+
+static const config_item_t s_items[] = {
+    { CONFIG_KEY_WIFI_SSID, "wifi_ssid", ssid_check, ssid_apply, ssid_get },
+    { CONFIG_KEY_WIFI_PASSWORD, "wifi_password", password_check, password_apply, password_get },
+    { CONFIG_KEY_WIFI_PS, "wifi_ps", ps_check, ps_apply, ps_get },
+    { CONFIG_KEY_RECONNECT_MAX, "reconnect_max", reconnect_check, reconnect_apply, reconnect_get },
+    { CONFIG_KEY_TX_QOS, "tx_qos", qos_check, qos_apply, qos_get },
+    { CONFIG_KEY_TX_DEPTH, "tx_depth", depth_check, depth_apply, depth_get },
+#if CONFIG_BRIDGE_FILTER
+    { CONFIG_KEY_FILTER_RULES, "filter_rules", rules_check, rules_apply, rules_get },
+    { CONFIG_KEY_FILTER_RATES, "filter_rates", rates_check, rates_apply, rates_get },
+#endif
+};
+
+#define NUM_ITEMS (sizeof(s_items) / sizeof(s_items[0]))
+
+static const config_item_t *find_item(uint8_t key)
+{
+    for (size_t i = 0; i < NUM_ITEMS; i++) {
+        if (s_items[i].key == key) {
+            return &s_items[i];
+        }
+    }
+    return NULL;
+}
+
+const char *bridge_config_ssid(void)
+{
+    return s_ssid;
+}
+
+const char *bridge_config_password(void)
+{
+    return s_password;
+}
+
+#if CONFIG_BRIDGE_USB_SERIAL_JTAG
+
+// Walk the entries of a SET body: 1 for an entry, 0 at the end, -1 if the
+// next one is cut short
+static int next_entry(const uint8_t **p, const uint8_t *end, uint8_t *key,
+                      const uint8_t **value, uint16_t *len)
+{
+    if (*p == end) {
+        return 0;
+    }
+    if (end - *p < ENTRY_HDR_LEN || end - *p - ENTRY_HDR_LEN < rd16le(*p + 1)) {
+        return -1;
+    }
+    *key = (*p)[0];
+    *len = rd16le(*p + 1);
+    *value = *p + ENTRY_HDR_LEN;
+    *p += ENTRY_HDR_LEN + *len;
+    return 1;
+}
+
+static esp_err_t save_entries(const uint8_t *body, const uint8_t *end)
+{
+    nvs_handle_t nvs;
+    const uint8_t *p = body;
+    const uint8_t *value;
+    uint16_t len;
+    uint8_t key;
+
+    esp_err_t ret = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    while (ret == ESP_OK && next_entry(&p, end, &key, &value, &len) > 0) {
+        ret = nvs_set_blob(nvs, find_item(key)->name, value, len);
+    }
+    if (ret == ESP_OK) {
+        ret = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return ret;
+}
+
+static esp_err_t ctrl_config_get(const uint8_t *req, uint16_t req_len,
+                                 uint8_t *resp, uint16_t *resp_len)
+{
+    uint8_t value[VALUE_MAX];
+    uint16_t off = 0;
+    size_t count = req_len ? req_len : NUM_ITEMS;
+
+    for (size_t i = 0; i < count; i++) {
+        const config_item_t *item = req_len ? find_item(req[i]) : &s_items[i];
+        if (item == NULL) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        uint16_t len = item->get(value);
+        if (off + ENTRY_HDR_LEN + len > *resp_len) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        resp[off] = item->key;
+        wr16le(resp + off + 1, len);
+        memcpy(resp + off + ENTRY_HDR_LEN, value, len);
+        off += ENTRY_HDR_LEN + len;
+    }
+    *resp_len = off;
+    return ESP_OK;
+}
+
+static esp_err_t ctrl_config_set(const uint8_t *req, uint16_t req_len,
+                                 uint8_t *resp, uint16_t *resp_len)
+{
+    const uint8_t *end = req + req_len;
+    const uint8_t *p;
+    const uint8_t *value;
+    uint16_t len;
+    uint8_t key;
+    int more;
+
+    *resp_len = 0;
+    if (req_len < 1) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint8_t flags = req[0];
+
+    // All or nothing: check every entry before applying the first
+    p = req + 1;
+    while ((more = next_entry(&p, end, &key, &value, &len)) > 0) {
+        const config_item_t *item = find_item(key);
+        if (item == NULL) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        esp_err_t ret = item->check(value, len);
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "%s rejected: %s", item->name, esp_err_to_name(ret));
+            return ret;
+        }
+    }
+    if (more < 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // Saved before anything is applied, so a failed save leaves the live
+    // settings as they were
+    if (flags & CONFIG_F_SAVE) {
+        esp_err_t ret = save_entries(req + 1, end);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to save: %s", esp_err_to_name(ret));
+            return ret;
+        }
+    }
+
+    s_cred_changed = false;
+    p = req + 1;
+    while (next_entry(&p, end, &key, &value, &len) > 0) {
+        const config_item_t *item = find_item(key);
+        esp_err_t ret = item->apply(value, len);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to apply %s: %s", item->name, esp_err_to_name(ret));
+            return ret;
+        }
+        ESP_LOGI(TAG, "%s set", item->name);
+    }
+    // Once for both SSID and password
+    if (s_cred_changed) {
+        ESP_LOGI(TAG, "Connecting to WiFi: %s", s_ssid);
+        wifi_bridge_connect(s_ssid, s_password);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t ctrl_config_reset(const uint8_t *req, uint16_t req_len,
+                                   uint8_t *resp, uint16_t *resp_len)
+{
+    nvs_handle_t nvs;
+
+    *resp_len = 0;
+    esp_err_t ret = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (ret == ESP_OK) {
+        ret = nvs_erase_all(nvs);
+        if (ret == ESP_OK) {
+            ret = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    if (ret == ESP_OK) {
+        ESP_LOGI(TAG, "Saved settings erased; defaults apply after a restart");
+    }
+    return ret;
+}
+
+#endif // CONFIG_BRIDGE_USB_SERIAL_JTAG
+
+static void load_saved(void)
+{
+    uint8_t value[VALUE_MAX];
+    nvs_handle_t nvs;
+
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return;                 // nothing saved yet
+    }
+    for (size_t i = 0; i < NUM_ITEMS; i++) {
+        const config_item_t *item = &s_items[i];
+        size_t len = sizeof(value);
+        if (nvs_get_blob(nvs, item->name, value, &len) != ESP_OK) {
+            continue;
+        }
+        // Saved by a build with other limits, or with features since removed
+        if (item->check(value, len) != ESP_OK || item->apply(value, len) != ESP_OK) {
+            ESP_LOGW(TAG, "Saved %s not applicable, ignored", item->name);
+            continue;
+        }
+        ESP_LOGI(TAG, "Saved %s applied", item->name);
+    }
+    nvs_close(nvs);
+}
+
+esp_err_t bridge_config_init(void)
+{
+    strlcpy(s_ssid, WIFI_SSID, sizeof(s_ssid));
+    strlcpy(s_password, WIFI_PASSWORD, sizeof(s_password));
+    load_saved();
+    // The first connect picks the saved credentials up itself
+    s_cred_changed = false;
+
+#if CONFIG_BRIDGE_USB_SERIAL_JTAG
+    bridge_ctrl_register(CTRL_CMD_CONFIG_GET, ctrl_config_get);
+    bridge_ctrl_register(CTRL_CMD_CONFIG_SET, ctrl_config_set);
+    bridge_ctrl_register(CTRL_CMD_CONFIG_RESET, ctrl_config_reset);
+#endif
+    return ESP_OK;
+}
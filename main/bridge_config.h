@@ -0,0 +1,70 @@
+#ifndef BRIDGE_CONFIG_H
+#define BRIDGE_CONFIG_H
+
+#include "esp_err.h"
+#include <stdint.h>
+
+/*
+ * Settings the host can change at run time (mirrored by
+ * host_setup/esp_frame.py CONFIG_KEYS). Values are little endian.
+ *
+ *   key   name            value
+ *   0x01  wifi_ssid       1-32 bytes, no terminator
+ *   0x02  wifi_password   0-64 bytes; write only, reads back empty
+ *   0x03  wifi_ps         u8 wifi_ps_type_t: 0 none, 1 min modem, 2 max modem
+ *   0x04  reconnect_max   u32 longest reconnect backoff step, ms
+ *   0x10  tx_qos          u8 1: classify WiFi TX traffic, 0: one FIFO
+ *   0x11  tx_depth        u8 per tx_class_t: frames each class accepts
+ *   0x20  filter_rules    pkt_filter_rule_t[0..PKT_FILTER_MAX_RULES]
+ *   0x21  filter_rates    u16 per pkt_filter bucket: frames/s, 0 unlimited
+ *
+ * Settings take effect at once; new credentials reconnect the station.
+ * Saved settings are applied again at boot, before the first connect.
+ *
+ * CTRL_CMD_CONFIG_GET: body is a list of keys, empty for all of them.
+ * Answered with one entry per key: key(1) len(2) value(len).
+ *
+ * CTRL_CMD_CONFIG_SET: flags(1) CONFIG_F_*, then entries as above. Every
+ * entry is checked, then saved if CONFIG_F_SAVE is set, before any is
+ * applied; on an error the live settings do not change. A save that fails
+ * part way can leave some of the entries in NVS for the next boot.
+ *
+ * CTRL_CMD_CONFIG_RESET: no body. Forgets all saved settings; the
+ * compiled-in defaults return at the next boot.
+ */
+#define CONFIG_KEY_WIFI_SSID        0x01
+#define CONFIG_KEY_WIFI_PASSWORD    0x02
+#define CONFIG_KEY_WIFI_PS          0x03
+#define CONFIG_KEY_RECONNECT_MAX    0x04
+#define CONFIG_KEY_TX_QOS           0x10
+#define CONFIG_KEY_TX_DEPTH         0x11
+#define CONFIG_KEY_FILTER_RULES     0x20
+#define CONFIG_KEY_FILTER_RATES     0x21
+
+#define CONFIG_F_SAVE               0x01    // also store the entries in NVS
+
+/**
+ * @brief Apply the settings saved in NVS and register the config commands
+ *
+ * Call after wifi_bridge_init() and before wifi_bridge_connect(). A
+ * setting that no longer fits this build is skipped with a warning.
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t bridge_config_init(void);
+
+/**
+ * @brief SSID to connect to: the saved one, else WIFI_SSID
+ *
+ * @return NUL-terminated SSID
+ */
+const char *bridge_config_ssid(void);
+
+/**
+ * @brief Password to connect with: the saved one, else WIFI_PASSWORD
+ *
+ * @return NUL-terminated password
+ */
+const char *bridge_config_password(void);
+
+#endif // BRIDGE_CONFIG_H
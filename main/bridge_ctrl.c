@@ -0,0 +1,201 @@
+/*
+ * Control Channel
+ * Dispatches control messages from the host to registered handlers
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+
+#include "bridge_ctrl.h"
+#include "usb_cdc_ecm.h"
+#include "frame_proto.h"
+#include "pkt_pool.h"
+
+static const char *TAG = "bridge_ctrl";
+
+#define CTRL_QUEUE_SIZE     4
+#define CTRL_MAX_CMDS       CTRL_CMD_RESPONSE
+
+// Queue entries are host requests, or notifications with data == NULL and
+// the command in len
+static QueueHandle_t s_ctrl_queue = NULL;
+static bridge_ctrl_handler_t s_handlers[CTRL_MAX_CMDS];
+static bridge_ctrl_notifier_t s_notifiers[CTRL_MAX_CMDS];
+static bridge_ctrl_sent_t s_sent[CTRL_MAX_CMDS];
+static volatile bool s_notify_pending[CTRL_MAX_CMDS];
+
+static esp_err_t ctrl_ping(const uint8_t *req, uint16_t req_len,
+                           uint8_t *resp, uint16_t *resp_len)
+{
+    // Echo the body so the host can check the round trip
+    if (req_len > *resp_len) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(resp, req, req_len);
+    *resp_len = req_len;
+    return ESP_OK;
+}
+
+static uint8_t ctrl_status(esp_err_t err)
+{
+    switch (err) {
+    case ESP_OK:
+        return CTRL_ST_OK;
+    case ESP_ERR_NOT_SUPPORTED:
+        return CTRL_ST_UNKNOWN_CMD;
+    case ESP_ERR_INVALID_ARG:
+    case ESP_ERR_INVALID_SIZE:
+        return CTRL_ST_INVALID_ARG;
+    case ESP_ERR_INVALID_STATE:
+        return CTRL_ST_INVALID_STATE;
+    default:
+        return CTRL_ST_FAIL;
+    }
+}
+
+// Called from the USB RX task; takes ownership of the pool buffer
+static void ctrl_rx(uint8_t *data, uint16_t len)
+{
+    pkt_desc_t desc = {
+        .data = data,
+        .len = len,
+    };
+
+    if (len < CTRL_HDR_LEN || xQueueSend(s_ctrl_queue, &desc, 0) != pdTRUE) {
+        pkt_pool_free(data);
+    }
+}
+
+static void ctrl_send_notification(uint8_t cmd)
+{
+    uint8_t msg[CTRL_HDR_LEN + 16];
+
+    // Clear first so a change while the body is built queues another send
+    s_notify_pending[cmd] = false;
+    uint16_t len = s_notifiers[cmd](msg + CTRL_HDR_LEN, sizeof(msg) - CTRL_HDR_LEN);
+
+    msg[0] = cmd;
+    msg[1] = CTRL_ST_OK;
+    msg[2] = 0;
+    msg[3] = 0;
+
+    if (usb_cdc_ecm_send_msg(FRAME_TYPE_CTRL, msg, CTRL_HDR_LEN + len) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to send notification 0x%02x", cmd);
+        return;
+    }
+    if (s_sent[cmd] != NULL) {
+        s_sent[cmd](msg + CTRL_HDR_LEN, len);
+    }
+}
+
+static void ctrl_task(void *arg)
+{
+    pkt_desc_t desc;
+    ESP_LOGI(TAG, "Control task started");
+
+    while (1) {
+        if (xQueueReceive(s_ctrl_queue, &desc, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+
+        if (desc.data == NULL) {
+            ctrl_send_notification(desc.len);
+            continue;
+        }
+
+        uint8_t cmd = desc.data[0];
+        uint8_t tag_lo = desc.data[2];
+        uint8_t tag_hi = desc.data[3];
+
+        uint8_t *resp = pkt_pool_alloc();
+        if (resp == NULL) {
+            ESP_LOGW(TAG, "No buffer for response to command 0x%02x", cmd);
+            pkt_desc_free(&desc);
+            continue;
+        }
+
+        uint16_t resp_len = PKT_BUF_MAX_FRAME - CTRL_HDR_LEN;
+        esp_err_t err = ESP_ERR_NOT_SUPPORTED;
+        if (cmd < CTRL_MAX_CMDS && s_handlers[cmd] != NULL) {
+            err = s_handlers[cmd](desc.data + CTRL_HDR_LEN, desc.len - CTRL_HDR_LEN,
+                                  resp + CTRL_HDR_LEN, &resp_len);
+        }
+        if (err != ESP_OK) {
+            resp_len = 0;
+        }
+        // Hand the request buffer back before the (possibly slow) send
+        pkt_desc_free(&desc);
+
+        resp[0] = cmd | CTRL_CMD_RESPONSE;
+        resp[1] = ctrl_status(err);
+        resp[2] = tag_lo;
+        resp[3] = tag_hi;
+
+        if (usb_cdc_ecm_send_msg(FRAME_TYPE_CTRL, resp, CTRL_HDR_LEN + resp_len) != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to send response to command 0x%02x", cmd);
+        }
+        pkt_pool_free(resp);
+    }
+}
+
+esp_err_t bridge_ctrl_register(uint8_t cmd, bridge_ctrl_handler_t handler)
+{
+    if (cmd >= CTRL_MAX_CMDS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_handlers[cmd] = handler;
+    return ESP_OK;
+}
+
+esp_err_t bridge_ctrl_register_notifier(uint8_t cmd, bridge_ctrl_notifier_t notifier,
+                                        bridge_ctrl_sent_t sent)
+{
+    if (cmd >= CTRL_MAX_CMDS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_sent[cmd] = sent;
+    s_notifiers[cmd] = notifier;
+    return ESP_OK;
+}
+
+esp_err_t bridge_ctrl_notify(uint8_t cmd)
+{
+    if (cmd >= CTRL_MAX_CMDS || s_notifiers[cmd] == NULL || s_ctrl_queue == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_notify_pending[cmd]) {
+        return ESP_OK;
+    }
+
+    s_notify_pending[cmd] = true;
+    pkt_desc_t desc = {
+        .data = NULL,
+        .len = cmd,
+    };
+    if (xQueueSend(s_ctrl_queue, &desc, 0) != pdTRUE) {
+        s_notify_pending[cmd] = false;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t bridge_ctrl_init(void)
+{
+    s_ctrl_queue = xQueueCreate(CTRL_QUEUE_SIZE, sizeof(pkt_desc_t));
+    if (s_ctrl_queue == NULL) {
+        ESP_LOGE(TAG, "Failed to create control queue");
+        return ESP_FAIL;
+    }
+
+    if (xTaskCreate(ctrl_task, "bridge_ctrl", CONFIG_BRIDGE_TASK_CTRL_STACK, NULL,
+                    CONFIG_BRIDGE_TASK_CTRL_PRIO, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create control task");
+        return ESP_FAIL;
+    }
+
+    bridge_ctrl_register(CTRL_CMD_PING, ctrl_ping);
+    return usb_cdc_ecm_register_ctrl_callback(ctrl_rx);
+}
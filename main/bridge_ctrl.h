@@ -0,0 +1,140 @@
+#ifndef BRIDGE_CTRL_H
+#define BRIDGE_CTRL_H
+
+#include "esp_err.h"
+#include <stdint.h>
+
+/*
+ * Control messages travel in FRAME_TYPE_CTRL frames (mirrored by
+ * host_setup/esp_frame.py). Each payload starts with a 4-byte header:
+ *
+ *   0      cmd       CTRL_CMD_*; responses set CTRL_CMD_RESPONSE
+ *   1      status    CTRL_ST_* in responses, 0 in requests
+ *   2..3   tag       chosen by the host and echoed, little endian
+ *
+ * followed by a command-specific body. All multi-byte fields are little
+ * endian. Every request gets exactly one response.
+ *
+ * The device also sends notifications on its own: they use a command code
+ * without CTRL_CMD_RESPONSE, status 0 and tag 0, and are never answered.
+ */
+#define CTRL_HDR_LEN            4
+#define CTRL_CMD_RESPONSE       0x80
+
+#define CTRL_CMD_PING           0x01
+#define CTRL_CMD_BENCH_START    0x10
+#define CTRL_CMD_BENCH_STOP     0x11
+#define CTRL_CMD_BENCH_RESULT   0x12
+#define CTRL_CMD_STATS          0x20
+#define CTRL_CMD_TASKS          0x21
+#define CTRL_CMD_STATS_RESET    0x22
+#define CTRL_CMD_CAPTURE_START  0x40    // body: pkt_capture_start_req_t
+#define CTRL_CMD_CAPTURE_STOP   0x41
+#define CTRL_CMD_CAPTURE_READ   0x42
+#define CTRL_CMD_CONFIG_GET     0x50    // see bridge_config.h
+#define CTRL_CMD_CONFIG_SET     0x51
+#define CTRL_CMD_CONFIG_RESET   0x52
+
+// Notifications
+#define CTRL_CMD_FLOW           0x30    // body: ctrl_flow_t
+
+#define CTRL_ST_OK              0
+#define CTRL_ST_UNKNOWN_CMD     1
+#define CTRL_ST_INVALID_ARG     2
+#define CTRL_ST_INVALID_STATE   3
+#define CTRL_ST_FAIL            4
+
+/**
+ * @brief CTRL_CMD_FLOW body: USB-to-WiFi flow control
+ *
+ * Sent when the WiFi TX queue crosses its pause or resume watermark, and
+ * repeated every CTRL_FLOW_REFRESH_MS while paused. The host stops reading
+ * its TAP device while paused, and resumes on its own only if the refresh
+ * stops arriving.
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t paused;         // 1: stop sending data frames, 0: resume
+    uint8_t reserved;
+    uint16_t credits;       // free TX queue slots when the message was built
+} ctrl_flow_t;
+
+#define CTRL_FLOW_REFRESH_MS    20  // below bridge_usb.py FLOW_PAUSE_MAX
+
+/**
+ * @brief Handler for one control command
+ *
+ * Runs in the control task, so it may block briefly.
+ *
+ * @param req Request body (after the header)
+ * @param req_len Length of req
+ * @param resp Response body to fill in
+ * @param resp_len In: capacity of resp. Out: bytes written
+ * @return esp_err_t ESP_OK on success; other codes become a CTRL_ST_* status
+ */
+typedef esp_err_t (*bridge_ctrl_handler_t)(const uint8_t *req, uint16_t req_len,
+                                           uint8_t *resp, uint16_t *resp_len);
+
+/**
+ * @brief Start the control task and attach it to the USB transport
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t bridge_ctrl_init(void);
+
+/**
+ * @brief Register the handler for a command
+ *
+ * @param cmd CTRL_CMD_* (below CTRL_CMD_RESPONSE)
+ * @param handler Handler function
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t bridge_ctrl_register(uint8_t cmd, bridge_ctrl_handler_t handler);
+
+/**
+ * @brief Builds the body of a notification
+ *
+ * Runs in the control task when the notification is sent, so it reports
+ * the state at that moment rather than when bridge_ctrl_notify() was called.
+ *
+ * @param body Body to fill in
+ * @param max Capacity of body
+ * @return Body length
+ */
+typedef uint16_t (*bridge_ctrl_notifier_t)(uint8_t *body, uint16_t max);
+
+/**
+ * @brief Told that a notification reached the USB transport
+ *
+ * Runs in the control task, only after the send succeeded; a failed send
+ * is not reported, so the caller's state still says the host has not
+ * heard and it can notify again.
+ *
+ * @param body Body that was sent, as built by the notifier
+ * @param len Length of body
+ */
+typedef void (*bridge_ctrl_sent_t)(const uint8_t *body, uint16_t len);
+
+/**
+ * @brief Register the body builder for a notification
+ *
+ * @param cmd CTRL_CMD_* notification code
+ * @param notifier Body builder
+ * @param sent Called after each successful send, or NULL
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t bridge_ctrl_register_notifier(uint8_t cmd, bridge_ctrl_notifier_t notifier,
+                                        bridge_ctrl_sent_t sent);
+
+/**
+ * @brief Schedule a notification to the host
+ *
+ * Never blocks, so it may be called from the data path. Requests made
+ * before the control task gets to the notification are merged into one.
+ *
+ * @param cmd CTRL_CMD_* notification code
+ * @return esp_err_t ESP_OK if the notification is pending; ESP_ERR_NO_MEM
+ *         if the control queue is full (call again later)
+ */
+esp_err_t bridge_ctrl_notify(uint8_t cmd);
+
+#endif // BRIDGE_CTRL_H
@@ -0,0 +1,235 @@
+/*
+ * Bridge Statistics
+ * Per-direction frame, byte and drop counters, queue high-water marks and
+ * per-task CPU/stack figures for finding where a slowdown comes from
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "bridge_stats.h"
+#include "pkt_pool.h"
+#if CONFIG_BRIDGE_USB_SERIAL_JTAG
+#include "bridge_ctrl.h"
+#endif
+
+static const char *TAG = "bridge_stats";
+
+#define STATS_WIRE_VERSION  1
+
+// Updated with relaxed atomics from the USB, WiFi driver and bridge tasks;
+// the C3 has no atomic instructions, so these are short critical sections
+static uint32_t s_packets[BRIDGE_DIR_MAX];
+static uint64_t s_bytes[BRIDGE_DIR_MAX];
+static uint32_t s_drops[BRIDGE_DIR_MAX][BRIDGE_DROP_MAX];
+static uint16_t s_queue_size[BRIDGE_QUEUE_MAX];
+static uint16_t s_queue_high_water[BRIDGE_QUEUE_MAX];
+
+void bridge_stats_count(bridge_dir_t dir, uint16_t len)
+{
+    __atomic_fetch_add(&s_packets[dir], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s_bytes[dir], len, __ATOMIC_RELAXED);
+}
+
+void bridge_stats_drop(bridge_dir_t dir, bridge_drop_t reason)
+{
+    __atomic_fetch_add(&s_drops[dir][reason], 1, __ATOMIC_RELAXED);
+}
+
+void bridge_stats_queue_init(bridge_queue_t queue, uint16_t size)
+{
+    s_queue_size[queue] = size;
+}
+
+void bridge_stats_queue_depth(bridge_queue_t queue, uint32_t depth)
+{
+    uint16_t cur = __atomic_load_n(&s_queue_high_water[queue], __ATOMIC_RELAXED);
+    while (depth > cur &&
+           !__atomic_compare_exchange_n(&s_queue_high_water[queue], &cur, (uint16_t)depth,
+                                        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+esp_err_t bridge_stats_get(bridge_stats_t *stats)
+{
+    if (stats == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    stats->uptime_us = esp_timer_get_time();
+    for (int d = 0; d < BRIDGE_DIR_MAX; d++) {
+        stats->dir[d].packets = __atomic_load_n(&s_packets[d], __ATOMIC_RELAXED);
+        stats->dir[d].bytes = __atomic_load_n(&s_bytes[d], __ATOMIC_RELAXED);
+        for (int r = 0; r < BRIDGE_DROP_MAX; r++) {
+            stats->dir[d].drops[r] = __atomic_load_n(&s_drops[d][r], __ATOMIC_RELAXED);
+        }
+    }
+    for (int q = 0; q < BRIDGE_QUEUE_MAX; q++) {
+        stats->queue[q].size = s_queue_size[q];
+        stats->queue[q].high_water = __atomic_load_n(&s_queue_high_water[q], __ATOMIC_RELAXED);
+    }
+    pkt_pool_get_stats(&stats->pool);
+    return ESP_OK;
+}
+
+esp_err_t bridge_stats_get_tasks(bridge_task_stats_t *tasks, size_t max, size_t *count,
+                                 uint32_t *total_runtime)
+{
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY
+    UBaseType_t n = uxTaskGetNumberOfTasks();
+    TaskStatus_t *status = malloc(n * sizeof(TaskStatus_t));
+    if (status == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    configRUN_TIME_COUNTER_TYPE total = 0;
+    n = uxTaskGetSystemState(status, n, &total);
+
+    size_t out = 0;
+    for (UBaseType_t i = 0; i < n && out < max; i++, out++) {
+        bridge_task_stats_t *t = &tasks[out];
+        strlcpy(t->name, status[i].pcTaskName, sizeof(t->name));
+        t->priority = status[i].uxCurrentPriority;
+        t->state = status[i].eCurrentState;
+        // The watermark is in stack words on this port
+        t->stack_free = status[i].usStackHighWaterMark * sizeof(StackType_t);
+        t->runtime = status[i].ulRunTimeCounter;
+    }
+    free(status);
+
+    *count = out;
+    *total_runtime = total;
+    return ESP_OK;
+#else
+    *count = 0;
+    *total_runtime = 0;
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+void bridge_stats_reset(void)
+{
+    for (int d = 0; d < BRIDGE_DIR_MAX; d++) {
+        __atomic_store_n(&s_packets[d], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s_bytes[d], 0, __ATOMIC_RELAXED);
+        for (int r = 0; r < BRIDGE_DROP_MAX; r++) {
+            __atomic_store_n(&s_drops[d][r], 0, __ATOMIC_RELAXED);
+        }
+    }
+    for (int q = 0; q < BRIDGE_QUEUE_MAX; q++) {
+        __atomic_store_n(&s_queue_high_water[q], 0, __ATOMIC_RELAXED);
+    }
+    ESP_LOGI(TAG, "Counters reset");
+}
+
+#if CONFIG_BRIDGE_USB_SERIAL_JTAG
+
+static uint8_t *put_le(uint8_t *p, uint64_t v, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        *p++ = v >> (8 * i);
+    }
+    return p;
+}
+
+/*
+ * CTRL_CMD_STATS response, little endian:
+ *   version(1) n_dirs(1) n_drops(1) n_queues(1) uptime_us(8)
+ *   per direction: packets(4) bytes(8) drops(4 * n_drops)
+ *   per queue: size(2) high_water(2)
+ *   pool: total(2) in_use(2) high_water(2) reserved(2) alloc_fail(4)
+ */
+static esp_err_t ctrl_stats(const uint8_t *req, uint16_t req_len,
+                            uint8_t *resp, uint16_t *resp_len)
+{
+    bridge_stats_t stats;
+    bridge_stats_get(&stats);
+
+    uint8_t *p = resp;
+    *p++ = STATS_WIRE_VERSION;
+    *p++ = BRIDGE_DIR_MAX;
+    *p++ = BRIDGE_DROP_MAX;
+    *p++ = BRIDGE_QUEUE_MAX;
+    p = put_le(p, stats.uptime_us, 8);
+    for (int d = 0; d < BRIDGE_DIR_MAX; d++) {
+        p = put_le(p, stats.dir[d].packets, 4);
+        p = put_le(p, stats.dir[d].bytes, 8);
+        for (int r = 0; r < BRIDGE_DROP_MAX; r++) {
+            p = put_le(p, stats.dir[d].drops[r], 4);
+        }
+    }
+    for (int q = 0; q < BRIDGE_QUEUE_MAX; q++) {
+        p = put_le(p, stats.queue[q].size, 2);
+        p = put_le(p, stats.queue[q].high_water, 2);
+    }
+    p = put_le(p, stats.pool.total, 2);
+    p = put_le(p, stats.pool.in_use, 2);
+    p = put_le(p, stats.pool.high_water, 2);
+    p = put_le(p, 0, 2);
+    p = put_le(p, stats.pool.alloc_fail, 4);
+
+    *resp_len = p - resp;
+    return ESP_OK;
+}
+
+/*
+ * CTRL_CMD_TASKS response, little endian:
+ *   total_runtime(4) count(4)
+ *   per task: name(16) priority(1) state(1) reserved(2) stack_free(4) runtime(4)
+ */
+#define TASK_WIRE_LEN   28
+
+static esp_err_t ctrl_tasks(const uint8_t *req, uint16_t req_len,
+                            uint8_t *resp, uint16_t *resp_len)
+{
+    size_t max = (*resp_len - 8) / TASK_WIRE_LEN;
+    bridge_task_stats_t *tasks = malloc(max * sizeof(bridge_task_stats_t));
+    if (tasks == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    size_t count;
+    uint32_t total;
+    esp_err_t ret = bridge_stats_get_tasks(tasks, max, &count, &total);
+    if (ret == ESP_OK) {
+        uint8_t *p = resp;
+        p = put_le(p, total, 4);
+        p = put_le(p, count, 4);
+        for (size_t i = 0; i < count; i++) {
+            memcpy(p, tasks[i].name, sizeof(tasks[i].name));
+            p += sizeof(tasks[i].name);
+            *p++ = tasks[i].priority;
+            *p++ = tasks[i].state;
+            p = put_le(p, 0, 2);
+            p = put_le(p, tasks[i].stack_free, 4);
+            p = put_le(p, tasks[i].runtime, 4);
+        }
+        *resp_len = p - resp;
+    }
+    free(tasks);
+    return ret;
+}
+
+static esp_err_t ctrl_stats_reset(const uint8_t *req, uint16_t req_len,
+                                  uint8_t *resp, uint16_t *resp_len)
+{
+    bridge_stats_reset();
+    *resp_len = 0;
+    return ESP_OK;
+}
+
+#endif // CONFIG_BRIDGE_USB_SERIAL_JTAG
+
+esp_err_t bridge_stats_init(void)
+{
+#if CONFIG_BRIDGE_USB_SERIAL_JTAG
+    bridge_ctrl_register(CTRL_CMD_STATS, ctrl_stats);
+    bridge_ctrl_register(CTRL_CMD_TASKS, ctrl_tasks);
+    bridge_ctrl_register(CTRL_CMD_STATS_RESET, ctrl_stats_reset);
+#endif
+    return ESP_OK;
+}
@@ -0,0 +1,138 @@
+#ifndef BRIDGE_STATS_H
+#define BRIDGE_STATS_H
+
+#include "esp_err.h"
+#include <stdint.h>
+#include <stddef.h>
+
+#include "pkt_pool.h"
+
+typedef enum {
+    BRIDGE_DIR_USB_TO_WIFI = 0,
+    BRIDGE_DIR_WIFI_TO_USB,
+    BRIDGE_DIR_MAX
+} bridge_dir_t;
+
+// Append only: the order is part of the control protocol
+typedef enum {
+    BRIDGE_DROP_NOT_CONNECTED = 0,  // WiFi link down
+    BRIDGE_DROP_BAD_SIZE,           // runt or oversized frame
+    BRIDGE_DROP_QUEUE_FULL,         // bridge queue full
+    BRIDGE_DROP_TX_FAIL,            // WiFi driver or USB write rejected it
+    BRIDGE_DROP_BAD_FRAME,          // USB framing: CRC mismatch or truncated
+    BRIDGE_DROP_NO_BUFFER,          // packet pool empty
+    BRIDGE_DROP_ACK_MERGED,         // TCP ACK replaced by a newer one
+    BRIDGE_DROP_NO_ROUTE,           // router mode: not routable or no NAT mapping
+    BRIDGE_DROP_FILTERED,           // matched a pkt_filter drop rule
+    BRIDGE_DROP_RATE_LIMIT,         // over a pkt_filter rate limit
+    BRIDGE_DROP_MAX
+} bridge_drop_t;
+
+// Append only, like bridge_drop_t
+typedef enum {
+    BRIDGE_QUEUE_WIFI_TX = 0,       // USB -> WiFi TX task, all classes
+    BRIDGE_QUEUE_WIFI_RX,           // WiFi driver -> USB writer
+    BRIDGE_QUEUE_TX_CTRL,           // TX scheduler classes (tx_class_t)
+    BRIDGE_QUEUE_TX_VO,
+    BRIDGE_QUEUE_TX_VI,
+    BRIDGE_QUEUE_TX_BE,
+    BRIDGE_QUEUE_TX_BK,
+    BRIDGE_QUEUE_USB_TX,            // batches waiting for the USB TX task
+    BRIDGE_QUEUE_MAX
+} bridge_queue_t;
+
+typedef struct {
+    uint32_t packets;               // frames delivered
+    uint64_t bytes;                 // bytes delivered
+    uint32_t drops[BRIDGE_DROP_MAX];
+} bridge_dir_stats_t;
+
+typedef struct {
+    uint16_t size;                  // capacity
+    uint16_t high_water;            // deepest fill seen
+} bridge_queue_stats_t;
+
+typedef struct {
+    int64_t uptime_us;
+    bridge_dir_stats_t dir[BRIDGE_DIR_MAX];
+    bridge_queue_stats_t queue[BRIDGE_QUEUE_MAX];
+    pkt_pool_stats_t pool;
+} bridge_stats_t;
+
+typedef struct {
+    char name[16];
+    uint8_t priority;
+    uint8_t state;                  // eTaskState
+    uint32_t stack_free;            // bytes never used, since start
+    uint32_t runtime;               // run time stats clock ticks
+} bridge_task_stats_t;
+
+/**
+ * @brief Register the statistics control commands
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t bridge_stats_init(void);
+
+/**
+ * @brief Count a frame delivered in one direction
+ *
+ * @param dir Direction
+ * @param len Frame length
+ */
+void bridge_stats_count(bridge_dir_t dir, uint16_t len);
+
+/**
+ * @brief Count a dropped frame
+ *
+ * @param dir Direction
+ * @param reason Drop point
+ */
+void bridge_stats_drop(bridge_dir_t dir, bridge_drop_t reason);
+
+/**
+ * @brief Declare a queue's capacity
+ *
+ * @param queue Queue
+ * @param size Capacity in entries
+ */
+void bridge_stats_queue_init(bridge_queue_t queue, uint16_t size);
+
+/**
+ * @brief Record a queue's fill level after an enqueue
+ *
+ * @param queue Queue
+ * @param depth Entries now queued
+ */
+void bridge_stats_queue_depth(bridge_queue_t queue, uint32_t depth);
+
+/**
+ * @brief Snapshot all counters
+ *
+ * Counters are read one by one, so values taken under load may be a few
+ * frames apart from each other.
+ *
+ * @param stats Receives the snapshot
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t bridge_stats_get(bridge_stats_t *stats);
+
+/**
+ * @brief Snapshot per-task CPU time and stack watermarks
+ *
+ * @param tasks Destination array
+ * @param max Capacity of tasks
+ * @param count Receives the number of entries written
+ * @param total_runtime Receives the run time clock total, for percentages
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NOT_SUPPORTED without
+ *         CONFIG_FREERTOS_USE_TRACE_FACILITY
+ */
+esp_err_t bridge_stats_get_tasks(bridge_task_stats_t *tasks, size_t max, size_t *count,
+                                 uint32_t *total_runtime);
+
+/**
+ * @brief Zero the frame, drop and high-water counters
+ */
+void bridge_stats_reset(void);
+
+#endif // BRIDGE_STATS_H
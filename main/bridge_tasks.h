@@ -0,0 +1,30 @@
+#ifndef BRIDGE_TASKS_H
+#define BRIDGE_TASKS_H
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+// Core affinity for the data path tasks (WiFi USB Adapter -> Task layout)
+#if defined(CONFIG_BRIDGE_TASK_CORE) && CONFIG_BRIDGE_TASK_CORE >= 0
+#define BRIDGE_TASK_CORE    CONFIG_BRIDGE_TASK_CORE
+#else
+#define BRIDGE_TASK_CORE    tskNO_AFFINITY
+#endif
+
+// The WiFi driver task runs at configMAX_PRIORITIES - 2 and must be able to
+// preempt the bridge, or its RX callback and TX completions stall
+#define BRIDGE_WIFI_DRIVER_PRIO (configMAX_PRIORITIES - 2)
+
+_Static_assert(CONFIG_BRIDGE_TASK_USB_RX_PRIO < BRIDGE_WIFI_DRIVER_PRIO,
+               "USB RX task must run below the WiFi driver");
+_Static_assert(CONFIG_BRIDGE_TASK_WIFI_TX_PRIO < BRIDGE_WIFI_DRIVER_PRIO,
+               "WiFi TX task must run below the WiFi driver");
+_Static_assert(CONFIG_BRIDGE_TASK_WIFI_RX_PRIO < BRIDGE_WIFI_DRIVER_PRIO,
+               "WiFi RX task must run below the WiFi driver");
+#ifdef CONFIG_BRIDGE_TASK_USB_TX_PRIO
+_Static_assert(CONFIG_BRIDGE_TASK_USB_TX_PRIO < BRIDGE_WIFI_DRIVER_PRIO,
+               "USB TX task must run below the WiFi driver");
+#endif
+
+#endif // BRIDGE_TASKS_H
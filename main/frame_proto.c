@@ -0,0 +1,46 @@
+/*
+ * Serial Framing Protocol
+ * Header encode/decode for frames carried over the USB-Serial-JTAG stream
+ */
+
+#include "esp_rom_crc.h"
+
+#include "frame_proto.h"
+
+static uint8_t frame_hdr_check(const uint8_t *hdr)
+{
+    uint8_t check = FRAME_CHECK_SEED;
+    for (int i = 0; i < FRAME_HDR_LEN - 1; i++) {
+        check ^= hdr[i];
+    }
+    return check;
+}
+
+void frame_hdr_build(uint8_t *hdr, uint8_t type, uint16_t len, uint16_t seq)
+{
+    hdr[0] = FRAME_MAGIC;
+    hdr[1] = type;
+    hdr[2] = len & 0xff;
+    hdr[3] = len >> 8;
+    hdr[4] = seq & 0xff;
+    hdr[5] = seq >> 8;
+    hdr[6] = 0;
+    hdr[7] = frame_hdr_check(hdr);
+}
+
+bool frame_hdr_parse(const uint8_t *hdr, uint8_t *type, uint16_t *len, uint16_t *seq)
+{
+    if (hdr[0] != FRAME_MAGIC || hdr[7] != frame_hdr_check(hdr)) {
+        return false;
+    }
+
+    *type = hdr[1];
+    *len = hdr[2] | (hdr[3] << 8);
+    *seq = hdr[4] | (hdr[5] << 8);
+    return true;
+}
+
+uint32_t frame_crc32(const uint8_t *data, size_t len)
+{
+    return esp_rom_crc32_le(0, data, len);
+}
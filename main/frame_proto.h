@@ -0,0 +1,67 @@
+#ifndef FRAME_PROTO_H
+#define FRAME_PROTO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Framing used on the USB-Serial-JTAG byte stream (mirrored by
+ * host_setup/esp_frame.py). Every frame is an 8-byte header followed by
+ * the payload and, if FRAME_F_CRC is set, a CRC-32 of the payload:
+ *
+ *   0      magic     FRAME_MAGIC
+ *   1      type      FRAME_TYPE_* | FRAME_F_*
+ *   2..3   len       payload length, little endian
+ *   4..5   seq       per-direction sequence number, little endian
+ *   6      reserved  0
+ *   7      check     FRAME_CHECK_SEED ^ bytes 0..6
+ *
+ * Several frames may be packed back to back into one USB write. The
+ * header check byte lets a receiver resynchronise after garbage by
+ * hunting for the next magic byte.
+ */
+#define FRAME_MAGIC         0xE5
+#define FRAME_CHECK_SEED    0x5A
+#define FRAME_HDR_LEN       8
+#define FRAME_CRC_LEN       4
+
+#define FRAME_TYPE_MASK     0x0F
+#define FRAME_TYPE_DATA     0x00    // Ethernet frame
+#define FRAME_TYPE_CTRL     0x01    // control message
+#define FRAME_TYPE_LOG      0x02    // log text, device to host only
+#define FRAME_TYPE_VNET     0x03    // virtio-net header + frame, host to device (gso.h)
+
+#define FRAME_F_CRC         0x80    // payload is followed by a CRC-32
+
+/**
+ * @brief Write a frame header
+ *
+ * @param hdr Destination, FRAME_HDR_LEN bytes
+ * @param type FRAME_TYPE_* ORed with FRAME_F_* flags
+ * @param len Payload length
+ * @param seq Sequence number
+ */
+void frame_hdr_build(uint8_t *hdr, uint8_t type, uint16_t len, uint16_t seq);
+
+/**
+ * @brief Validate and decode a frame header
+ *
+ * @param hdr FRAME_HDR_LEN bytes starting with FRAME_MAGIC
+ * @param type Receives the type byte (type and flags)
+ * @param len Receives the payload length
+ * @param seq Receives the sequence number
+ * @return true if the magic and check byte are valid
+ */
+bool frame_hdr_parse(const uint8_t *hdr, uint8_t *type, uint16_t *len, uint16_t *seq);
+
+/**
+ * @brief CRC-32 (IEEE 802.3, same as zlib.crc32) used for FRAME_F_CRC
+ *
+ * @param data Payload
+ * @param len Payload length
+ * @return CRC value, transmitted little endian
+ */
+uint32_t frame_crc32(const uint8_t *data, size_t len);
+
+#endif // FRAME_PROTO_H
@@ -0,0 +1,216 @@
+/*
+ * Segmentation Offload
+ * Splits TCP super-frames from the host into MSS-sized frames and fills in
+ * the checksums the host left to the device
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#include "gso.h"
+#include "inet_csum.h"
+#include "pkt_pool.h"
+#include "tx_sched.h"
+#include "wifi_bridge.h"
+
+static const char *TAG = "gso";
+
+#define ETH_HDR_LEN         14
+#define ETH_TYPE_VLAN       0x8100
+#define IP_PROTO_TCP        6
+#define UDP_CSUM_OFFSET     6
+
+#define TCP_FIN             0x01
+#define TCP_PSH             0x08
+#define TCP_CWR             0x80
+
+// Upper bound on waiting for the WiFi TX queue between two segments; after
+// that the segment is queued anyway and the scheduler's drop policy applies
+#define GSO_ROOM_WAIT_MS    100
+
+_Static_assert(sizeof(gso_vnet_hdr_t) == 10, "virtio-net header is 10 bytes");
+
+static inline uint16_t rd16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline void wr16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static inline uint32_t rd32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void wr32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+// A super-frame is many times the TX queue; feed it at the rate WiFi drains
+// instead of dropping its tail
+static uint8_t *gso_alloc(void)
+{
+    uint8_t *buf;
+
+    for (int waited = 0; tx_sched_depth() >= TX_SCHED_LIMIT && waited < GSO_ROOM_WAIT_MS;
+         waited += portTICK_PERIOD_MS) {
+        vTaskDelay(1);
+    }
+    while ((buf = pkt_pool_alloc()) == NULL) {
+        vTaskDelay(1);
+    }
+    return buf;
+}
+
+// Frame without GSO: finish the checksum the host left partial
+static esp_err_t gso_csum(const gso_vnet_hdr_t *vh, uint16_t len, gso_read_t read,
+                          gso_out_t out, uint32_t *consumed)
+{
+    uint32_t field = (uint32_t)vh->csum_start + vh->csum_offset;
+
+    if (len > WIFI_BRIDGE_MAX_FRAME) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if ((vh->flags & GSO_F_NEEDS_CSUM) && (vh->csum_start < ETH_HDR_LEN || field + 2 > len)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint8_t *frame = gso_alloc();
+    if (!read(frame, len)) {
+        pkt_pool_free(frame);
+        return ESP_ERR_TIMEOUT;
+    }
+    *consumed = len;
+
+    if (vh->flags & GSO_F_NEEDS_CSUM) {
+        uint16_t csum = inet_csum_fold(inet_csum_add(0, frame + vh->csum_start,
+                                                     len - vh->csum_start));
+        // A zero UDP checksum means none was computed
+        if (csum == 0 && vh->csum_offset == UDP_CSUM_OFFSET) {
+            csum = 0xffff;
+        }
+        wr16(frame + field, csum);
+    }
+    out(frame, len);
+    return ESP_OK;
+}
+
+esp_err_t gso_rx(const gso_vnet_hdr_t *vh, uint32_t len, gso_read_t read, gso_out_t out,
+                 uint32_t *consumed)
+{
+    uint8_t hdr[GSO_MAX_HDR];
+    uint8_t type = vh->gso_type & ~GSO_TYPE_ECN;
+    uint16_t l4 = vh->csum_start;
+    uint16_t l3 = ETH_HDR_LEN;
+
+    *consumed = 0;
+    if (type == GSO_TYPE_NONE) {
+        return gso_csum(vh, len, read, out, consumed);
+    }
+    if (type != GSO_TYPE_TCPV4 && type != GSO_TYPE_TCPV6) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    bool v6 = type == GSO_TYPE_TCPV6;
+
+    // Up to the fixed TCP header first; its data offset gives the rest
+    if (l4 + 20 > GSO_MAX_HDR || l4 + 20u > len) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!read(hdr, l4 + 20)) {
+        return ESP_ERR_TIMEOUT;
+    }
+    *consumed = l4 + 20;
+
+    if (rd16(hdr + 12) == ETH_TYPE_VLAN) {
+        l3 += 4;
+    }
+    uint16_t tcp_hlen = (hdr[l4 + 12] >> 4) * 4;
+    uint16_t hdr_len = l4 + tcp_hlen;
+    uint16_t ihl = v6 ? 40 : (hdr[l3] & 0x0f) * 4;
+    if (l4 < l3 + ihl || tcp_hlen < 20 || hdr_len > GSO_MAX_HDR || hdr_len > len ||
+        (!v6 && (ihl < 20 || hdr[l3 + 9] != IP_PROTO_TCP))) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (vh->gso_size == 0 || hdr_len >= WIFI_BRIDGE_MAX_FRAME) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    // Segments must pass the send path's size check. A VLAN tag or IP
+    // options can push an MSS-sized segment past it; shorter segments are
+    // still valid TCP
+    uint16_t mss = vh->gso_size;
+    if (hdr_len + mss > WIFI_BRIDGE_MAX_FRAME) {
+        mss = WIFI_BRIDGE_MAX_FRAME - hdr_len;
+    }
+    if (tcp_hlen > 20) {
+        if (!read(hdr + l4 + 20, tcp_hlen - 20)) {
+            return ESP_ERR_TIMEOUT;
+        }
+        *consumed = hdr_len;
+    }
+
+    // Constant over all segments: the addresses and the protocol
+    uint32_t pseudo = v6 ? inet_csum_add(0, hdr + l3 + 8, 32) :
+                      inet_csum_add(0, hdr + l3 + 12, 8);
+    pseudo += IP_PROTO_TCP;
+
+    uint32_t seq = rd32(hdr + l4 + 4);
+    uint16_t ip_id = v6 ? 0 : rd16(hdr + l3 + 4);
+    uint8_t flags = hdr[l4 + 13];
+    uint32_t payload = len - hdr_len;
+    uint32_t off = 0;
+    uint16_t segs = 0;
+
+    while (off < payload) {
+        uint16_t n = payload - off < mss ? payload - off : mss;
+        bool last = off + n == payload;
+
+        uint8_t *frame = gso_alloc();
+        memcpy(frame, hdr, hdr_len);
+        if (!read(frame + hdr_len, n)) {
+            pkt_pool_free(frame);
+            return ESP_ERR_TIMEOUT;
+        }
+        *consumed += n;
+
+        uint16_t l4_len = tcp_hlen + n;
+        if (v6) {
+            // Extension headers between the IPv6 header and TCP stay as they are
+            wr16(frame + l3 + 4, l4 - l3 - 40 + l4_len);
+        } else {
+            wr16(frame + l3 + 2, l4 - l3 + l4_len);
+            wr16(frame + l3 + 4, ip_id + segs);
+            wr16(frame + l3 + 10, 0);
+            wr16(frame + l3 + 10, inet_csum_fold(inet_csum_add(0, frame + l3, ihl)));
+        }
+
+        uint8_t *tcp = frame + l4;
+        wr32(tcp + 4, seq + off);
+        uint8_t seg_flags = flags;
+        if (!last) {
+            seg_flags &= ~(TCP_FIN | TCP_PSH);
+        }
+        if (off) {
+            seg_flags &= ~TCP_CWR;
+        }
+        tcp[13] = seg_flags;
+        wr16(tcp + 16, 0);
+        wr16(tcp + 16, inet_csum_fold(inet_csum_add(pseudo + l4_len, tcp, l4_len)));
+
+        out(frame, hdr_len + n);
+        off += n;
+        segs++;
+    }
+
+    ESP_LOGV(TAG, "%lu bytes in %u segments", (unsigned long)payload, segs);
+    return ESP_OK;
+}
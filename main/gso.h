@@ -0,0 +1,76 @@
+#ifndef GSO_H
+#define GSO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+/*
+ * virtio-net header in front of the Ethernet frame of a FRAME_TYPE_VNET
+ * frame, as the Linux TAP driver hands it out with IFF_VNET_HDR (little
+ * endian; host_setup/esp_gso.py VNET_HDR).
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t flags;          // GSO_F_*
+    uint8_t gso_type;       // GSO_TYPE_*, optionally | GSO_TYPE_ECN
+    uint16_t hdr_len;       // ignored: TAP reports its linear length here
+    uint16_t gso_size;      // payload bytes per TCP segment
+    uint16_t csum_start;    // offset of the L4 header in the frame
+    uint16_t csum_offset;   // offset of the L4 checksum from csum_start
+} gso_vnet_hdr_t;
+
+#define GSO_F_NEEDS_CSUM    0x01    // L4 checksum field holds the pseudo-header sum
+
+#define GSO_TYPE_NONE       0
+#define GSO_TYPE_TCPV4      1
+#define GSO_TYPE_TCPV6      4
+#define GSO_TYPE_ECN        0x80
+
+// Ethernet, one VLAN tag, IPv4 with options and TCP with options
+#define GSO_MAX_HDR         (14 + 4 + 60 + 60)
+
+/**
+ * @brief Read exactly len bytes of the frame
+ *
+ * @return false if the stream stalled; the frame is lost
+ */
+typedef bool (*gso_read_t)(uint8_t *buf, uint16_t len);
+
+/**
+ * @brief Take a finished frame; ownership of the pool buffer moves along
+ */
+typedef esp_err_t (*gso_out_t)(uint8_t *frame, uint16_t len);
+
+#if CONFIG_BRIDGE_GSO
+
+/**
+ * @brief Turn one virtio-net frame into ready-to-send Ethernet frames
+ *
+ * Frames without GSO get their checksum completed if asked for. TCP
+ * super-frames are read a segment at a time straight behind a copy of
+ * their headers in a pool buffer, so their size is bounded only by the
+ * frame length field; every segment gets its own IP length, ID and
+ * checksum, TCP sequence number, flags and checksum. Segments are cut
+ * shorter than gso_size where needed to stay within WIFI_BRIDGE_MAX_FRAME
+ * (a VLAN tag or options on a full-MSS segment). Waits for pool
+ * buffers and WiFi TX queue room, leaving the rest of the frame in the
+ * USB ring meanwhile.
+ *
+ * @param vh virtio-net header, already read
+ * @param len Length of the Ethernet frame following the header
+ * @param read Source of the frame bytes
+ * @param out Called for every finished frame
+ * @param consumed Receives the frame bytes read; on an error other than
+ *                 ESP_ERR_TIMEOUT the caller skips the rest
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NOT_SUPPORTED for GSO types
+ *         other than TCP, ESP_ERR_INVALID_SIZE or ESP_ERR_INVALID_ARG for
+ *         frames whose headers or offsets do not fit, ESP_ERR_TIMEOUT if
+ *         read failed
+ */
+esp_err_t gso_rx(const gso_vnet_hdr_t *vh, uint32_t len, gso_read_t read, gso_out_t out,
+                 uint32_t *consumed);
+
+#endif // CONFIG_BRIDGE_GSO
+
+#endif // GSO_H
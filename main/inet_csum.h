@@ -0,0 +1,64 @@
+#ifndef INET_CSUM_H
+#define INET_CSUM_H
+
+#include <stdint.h>
+
+/**
+ * @brief Add big-endian 16-bit words to a one's complement sum
+ *
+ * @param sum Running sum
+ * @param data Data; an odd trailing byte is padded with zero
+ * @param len Length in bytes
+ * @return Updated sum, not folded
+ */
+static inline uint32_t inet_csum_add(uint32_t sum, const uint8_t *data, uint16_t len)
+{
+    uint16_t i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += (data[i] << 8) | data[i + 1];
+    }
+    if (i < len) {
+        sum += data[i] << 8;
+    }
+    return sum;
+}
+
+/**
+ * @brief Fold a sum to 16 bits and complement it
+ *
+ * @param sum Running sum from inet_csum_add()
+ * @return Checksum, host byte order
+ */
+static inline uint16_t inet_csum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+/**
+ * @brief Update a stored checksum for changed bytes (RFC 1624)
+ *
+ * @param csum Checksum field in the packet, big-endian
+ * @param from Old bytes
+ * @param to New bytes
+ * @param len Number of bytes changed; even, at an even offset from the
+ * start of the checksummed data
+ */
+static inline void inet_csum_replace(uint8_t *csum, const uint8_t *from, const uint8_t *to,
+                                     uint16_t len)
+{
+    uint32_t sum = (uint16_t)~((csum[0] << 8) | csum[1]);
+
+    for (uint16_t i = 0; i < len; i += 2) {
+        sum += (uint16_t)~((from[i] << 8) | from[i + 1]);
+        sum += (to[i] << 8) | to[i + 1];
+    }
+    uint16_t result = inet_csum_fold(sum);
+    csum[0] = result >> 8;
+    csum[1] = result & 0xff;
+}
+
+#endif // INET_CSUM_H
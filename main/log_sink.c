@@ -0,0 +1,111 @@
+/*
+ * Log Sink
+ * Keeps ESP_LOGx output off the byte stream that carries packet data
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#include "log_sink.h"
+#include "usb_cdc_ecm.h"
+#include "frame_proto.h"
+
+static const char *TAG = "log_sink";
+
+// Longer lines are truncated
+#define LOG_LINE_MAX    192
+
+static vprintf_like_t s_console_vprintf = vprintf;
+
+#if CONFIG_BRIDGE_LOG_SINK_MEMORY
+static char s_ring[CONFIG_BRIDGE_LOG_SINK_MEMORY_SIZE];
+static size_t s_ring_head = 0;     // next write position
+static size_t s_ring_len = 0;      // bytes currently held
+static portMUX_TYPE s_ring_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Append, overwriting the oldest text when full
+static void ring_write(const char *text, size_t len)
+{
+    if (len > sizeof(s_ring)) {
+        text += len - sizeof(s_ring);
+        len = sizeof(s_ring);
+    }
+
+    portENTER_CRITICAL_SAFE(&s_ring_lock);
+    size_t first = sizeof(s_ring) - s_ring_head;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(s_ring + s_ring_head, text, first);
+    memcpy(s_ring, text + first, len - first);
+    s_ring_head = (s_ring_head + len) % sizeof(s_ring);
+    s_ring_len += len;
+    if (s_ring_len > sizeof(s_ring)) {
+        s_ring_len = sizeof(s_ring);
+    }
+    portEXIT_CRITICAL_SAFE(&s_ring_lock);
+}
+#endif
+
+#if !CONFIG_BRIDGE_LOG_SINK_CONSOLE
+static int log_sink_vprintf(const char *fmt, va_list args)
+{
+    char line[LOG_LINE_MAX];
+    va_list console_args;
+    va_copy(console_args, args);
+    int n = vsnprintf(line, sizeof(line), fmt, args);
+    if (n <= 0) {
+        va_end(console_args);
+        return n;
+    }
+    size_t len = n < (int)sizeof(line) ? (size_t)n : sizeof(line) - 1;
+
+#if CONFIG_BRIDGE_LOG_SINK_FRAMED
+    // Never blocks. Fails while this task is inside the USB TX path (a log
+    // from there would deadlock on the TX lock) or when the host is not
+    // reading; such lines fall back to the console
+    if (usb_cdc_ecm_send_msg(FRAME_TYPE_LOG, (const uint8_t *)line, len) != ESP_OK) {
+        n = s_console_vprintf(fmt, console_args);
+    }
+#elif CONFIG_BRIDGE_LOG_SINK_MEMORY
+    ring_write(line, len);
+#endif
+    va_end(console_args);
+    return n;
+}
+#endif
+
+esp_err_t log_sink_init(void)
+{
+#if CONFIG_BRIDGE_LOG_SINK_CONSOLE
+    return ESP_OK;
+#else
+    s_console_vprintf = esp_log_set_vprintf(log_sink_vprintf);
+#if CONFIG_BRIDGE_LOG_SINK_FRAMED
+    ESP_LOGI(TAG, "Logging to the host as framed messages");
+#else
+    ESP_LOGI(TAG, "Logging to a %d-byte memory buffer", CONFIG_BRIDGE_LOG_SINK_MEMORY_SIZE);
+#endif
+    return ESP_OK;
+#endif
+}
+
+size_t log_sink_read(char *buf, size_t max)
+{
+#if CONFIG_BRIDGE_LOG_SINK_MEMORY
+    portENTER_CRITICAL_SAFE(&s_ring_lock);
+    size_t len = s_ring_len < max ? s_ring_len : max;
+    size_t tail = (s_ring_head + sizeof(s_ring) - s_ring_len) % sizeof(s_ring);
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = s_ring[(tail + i) % sizeof(s_ring)];
+    }
+    s_ring_len -= len;
+    portEXIT_CRITICAL_SAFE(&s_ring_lock);
+    return len;
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,27 @@
+#ifndef LOG_SINK_H
+#define LOG_SINK_H
+
+#include "esp_err.h"
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief Redirect ESP_LOGx output according to CONFIG_BRIDGE_LOG_SINK
+ *
+ * Call once the USB transport is up. Lines logged before that, or from
+ * inside the USB TX path, go to the console.
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t log_sink_init(void);
+
+/**
+ * @brief Read and consume buffered log text (memory sink only)
+ *
+ * @param buf Destination buffer
+ * @param max Size of buf
+ * @return Number of bytes copied; 0 when empty or not in memory mode
+ */
+size_t log_sink_read(char *buf, size_t max);
+
+#endif // LOG_SINK_H
@@ -0,0 +1,363 @@
+/*
+ * MAC Translation
+ * Lets USB clients with their own MAC addresses share the single STA MAC
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+
+#include "mac_nat.h"
+#include "inet_csum.h"
+
+static const char *TAG = "mac_nat";
+
+#define ETH_HDR_LEN         14
+#define ETH_TYPE_IPV4       0x0800
+#define ETH_TYPE_ARP        0x0806
+#define ETH_TYPE_VLAN       0x8100
+#define ETH_TYPE_IPV6       0x86DD
+
+#define IP_PROTO_UDP        17
+#define IP_PROTO_ICMPV6     58
+
+#define ARP_LEN             28
+#define ARP_SHA             8
+#define ARP_SPA             14
+#define ARP_THA             18
+#define ARP_TPA             24
+
+#define DHCP_SERVER_PORT    67
+#define DHCP_CLIENT_PORT    68
+#define DHCP_FLAGS          10      // from the start of the DHCP message
+#define DHCP_CHADDR         28
+#define DHCP_FLAG_BROADCAST 0x8000
+#define BOOTREQUEST         1
+
+#define ND_OPT_SLLA         1
+#define ND_OPT_TLLA         2
+
+#define TABLE_MASK          (MAC_NAT_TABLE_SIZE - 1)
+#define MAX_PROBE           4       // slots searched per lookup
+
+_Static_assert((MAC_NAT_TABLE_SIZE & TABLE_MASK) == 0, "MAC_NAT_TABLE_SIZE must be a power of two");
+
+typedef struct {
+    uint32_t ip;            // network byte order; 0: empty
+    uint8_t mac[6];
+    uint32_t seen;          // tick of the last frame from this client
+} nat_entry_t;
+
+// Entries are never removed, only overwritten, so a lookup can stop at the
+// first empty slot. Only the TX task writes; the lock keeps the RX task
+// from reading a half-written entry.
+static nat_entry_t s_table[MAC_NAT_TABLE_SIZE];
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint8_t s_sta_mac[6];
+static uint8_t s_default_mac[6];        // most recent client; under s_lock
+static volatile bool s_default_valid;
+
+static inline uint16_t rd16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline void wr16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static inline uint32_t rd_ip(const uint8_t *p)
+{
+    uint32_t ip;
+    memcpy(&ip, p, sizeof(ip));
+    return ip;
+}
+
+static inline uint32_t slot_of(uint32_t ip)
+{
+    return (ip * 2654435761u) >> 16;
+}
+
+// Client MAC for a destination IPv4 address (NULL: the default client)
+static void resolve(const uint8_t *ip_field, uint8_t mac[6])
+{
+    const uint8_t *found = s_default_mac;
+
+    portENTER_CRITICAL(&s_lock);
+    if (ip_field != NULL) {
+        uint32_t ip = rd_ip(ip_field);
+        uint32_t h = slot_of(ip);
+        for (int i = 0; i < MAX_PROBE; i++) {
+            const nat_entry_t *e = &s_table[(h + i) & TABLE_MASK];
+            if (e->ip == ip) {
+                found = e->mac;
+                break;
+            }
+            if (e->ip == 0) {
+                break;
+            }
+        }
+    }
+    memcpy(mac, found, 6);
+    portEXIT_CRITICAL(&s_lock);
+}
+
+static void table_learn(uint32_t ip, const uint8_t mac[6])
+{
+    uint32_t h = slot_of(ip);
+    uint32_t now = xTaskGetTickCount();
+    nat_entry_t *victim = NULL;
+
+    // Unspecified, multicast or broadcast sources are never learned; the
+    // first octet is the low byte on this little-endian target
+    if (ip == 0 || (ip & 0xf0) == 0xe0 || ip == 0xffffffff) {
+        return;
+    }
+
+    // Reads need no lock: this task is the only writer
+    for (int i = 0; i < MAX_PROBE; i++) {
+        nat_entry_t *e = &s_table[(h + i) & TABLE_MASK];
+        if (e->ip == ip) {
+            e->seen = now;
+            if (memcmp(e->mac, mac, 6) == 0) {
+                return;
+            }
+            victim = e;
+            break;
+        }
+        if (e->ip == 0) {
+            victim = e;
+            break;
+        }
+        if (victim == NULL || (int32_t)(e->seen - victim->seen) < 0) {
+            victim = e;
+        }
+    }
+
+    const uint8_t *a = (const uint8_t *)&ip;
+    ESP_LOGI(TAG, "USB client %d.%d.%d.%d at " MACSTR, a[0], a[1], a[2], a[3], MAC2STR(mac));
+
+    portENTER_CRITICAL(&s_lock);
+    victim->ip = ip;
+    memcpy(victim->mac, mac, 6);
+    victim->seen = now;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+// Point the ND link-layer address options of an outgoing ICMPv6 message at
+// the STA MAC, so neighbours resolve the client to an address the AP knows
+static void tx_ndp(uint8_t *icmp, uint16_t icmp_len, const uint8_t *client)
+{
+    uint16_t off;
+
+    if (icmp_len < 8) {
+        return;
+    }
+    switch (icmp[0]) {
+    case 133: off = 8; break;       // router solicitation
+    case 134: off = 16; break;      // router advertisement
+    case 135:                       // neighbour solicitation
+    case 136: off = 24; break;      // neighbour advertisement
+    case 137: off = 40; break;      // redirect
+    default: return;
+    }
+
+    while (off + 8 <= icmp_len) {
+        uint8_t *opt = icmp + off;
+        uint16_t opt_len = opt[1] * 8;
+        if (opt_len == 0 || off + opt_len > icmp_len) {
+            return;
+        }
+        if ((opt[0] == ND_OPT_SLLA || opt[0] == ND_OPT_TLLA) && opt_len == 8 &&
+            memcmp(opt + 2, client, 6) == 0) {
+            inet_csum_replace(icmp + 2, opt + 2, s_sta_mac, 6);
+            memcpy(opt + 2, s_sta_mac, 6);
+        }
+        off += opt_len;
+    }
+}
+
+// A DHCP server answers a client without an address at its chaddr, which
+// the AP would never forward to the station; ask for a broadcast instead
+static void tx_dhcp(uint8_t *udp, uint16_t udp_len)
+{
+    uint8_t *dhcp = udp + 8;
+
+    if (udp_len < 8 + DHCP_CHADDR + 6 || dhcp[0] != BOOTREQUEST) {
+        return;
+    }
+
+    uint16_t flags = rd16(dhcp + DHCP_FLAGS);
+    if (flags & DHCP_FLAG_BROADCAST) {
+        return;
+    }
+
+    uint8_t from[2], to[2];
+    wr16(from, flags);
+    wr16(to, flags | DHCP_FLAG_BROADCAST);
+    if (rd16(udp + 6) != 0) {
+        inet_csum_replace(udp + 6, from, to, 2);
+        if (rd16(udp + 6) == 0) {
+            wr16(udp + 6, 0xffff);
+        }
+    }
+    memcpy(dhcp + DHCP_FLAGS, to, 2);
+}
+
+esp_err_t mac_nat_init(const uint8_t sta_mac[6])
+{
+    if (sta_mac == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    memcpy(s_sta_mac, sta_mac, 6);
+    memset(s_table, 0, sizeof(s_table));
+    s_default_valid = false;
+    return ESP_OK;
+}
+
+void mac_nat_tx(uint8_t *frame, uint16_t len)
+{
+    uint8_t *src = frame + 6;
+    uint16_t off = ETH_HDR_LEN;
+    uint16_t ethertype = rd16(frame + 12);
+    uint8_t client[6];
+
+    if (memcmp(src, s_sta_mac, 6) == 0) {
+        return;
+    }
+    memcpy(client, src, 6);
+    memcpy(src, s_sta_mac, 6);
+
+    if (!s_default_valid || memcmp(s_default_mac, client, 6) != 0) {
+        portENTER_CRITICAL(&s_lock);
+        memcpy(s_default_mac, client, 6);
+        portEXIT_CRITICAL(&s_lock);
+        s_default_valid = true;
+    }
+
+    if (ethertype == ETH_TYPE_VLAN && len >= ETH_HDR_LEN + 4) {
+        ethertype = rd16(frame + 16);
+        off += 4;
+    }
+    uint8_t *l3 = frame + off;
+    uint16_t l3_len = len - off;
+
+    if (ethertype == ETH_TYPE_ARP) {
+        if (l3_len < ARP_LEN || rd16(l3 + 2) != ETH_TYPE_IPV4 || l3[4] != 6 || l3[5] != 4) {
+            return;
+        }
+        table_learn(rd_ip(l3 + ARP_SPA), client);
+        if (memcmp(l3 + ARP_SHA, client, 6) == 0) {
+            memcpy(l3 + ARP_SHA, s_sta_mac, 6);
+        }
+    } else if (ethertype == ETH_TYPE_IPV4) {
+        if (l3_len < 20) {
+            return;
+        }
+        table_learn(rd_ip(l3 + 12), client);
+
+        uint16_t ihl = (l3[0] & 0x0f) * 4;
+        uint16_t ip_len = rd16(l3 + 2);
+        if (l3[9] != IP_PROTO_UDP || ihl < 20 || ip_len < ihl + 8 || ip_len > l3_len ||
+            (rd16(l3 + 6) & 0x3fff) != 0) {
+            return;
+        }
+        uint8_t *udp = l3 + ihl;
+        if (rd16(udp) == DHCP_CLIENT_PORT && rd16(udp + 2) == DHCP_SERVER_PORT) {
+            tx_dhcp(udp, ip_len - ihl);
+        }
+    } else if (ethertype == ETH_TYPE_IPV6) {
+        if (l3_len < 40 || l3[6] != IP_PROTO_ICMPV6) {
+            return;
+        }
+        uint16_t payload_len = rd16(l3 + 4);
+        if (payload_len <= l3_len - 40) {
+            tx_ndp(l3 + 40, payload_len, client);
+        }
+    }
+}
+
+void mac_nat_rx(uint8_t *frame, uint16_t len)
+{
+    uint16_t off = ETH_HDR_LEN;
+    uint16_t ethertype = rd16(frame + 12);
+    bool to_sta = memcmp(frame, s_sta_mac, 6) == 0;
+
+    if (!s_default_valid) {
+        return;
+    }
+
+    if (ethertype == ETH_TYPE_VLAN && len >= ETH_HDR_LEN + 4) {
+        ethertype = rd16(frame + 16);
+        off += 4;
+    }
+    uint8_t *l3 = frame + off;
+    uint16_t l3_len = len - off;
+
+    if (ethertype == ETH_TYPE_ARP) {
+        if (l3_len < ARP_LEN || rd16(l3 + 2) != ETH_TYPE_IPV4 || l3[4] != 6 || l3[5] != 4) {
+            if (to_sta) {
+                resolve(NULL, frame);
+            }
+            return;
+        }
+        bool tha_sta = memcmp(l3 + ARP_THA, s_sta_mac, 6) == 0;
+        if (to_sta || tha_sta) {
+            uint8_t mac[6];
+            resolve(l3 + ARP_TPA, mac);
+            if (to_sta) {
+                memcpy(frame, mac, 6);
+            }
+            if (tha_sta) {
+                memcpy(l3 + ARP_THA, mac, 6);
+            }
+        }
+        return;
+    }
+
+    if (!to_sta) {
+        return;
+    }
+
+    if (ethertype == ETH_TYPE_IPV4 && l3_len >= 20) {
+        uint16_t ihl = (l3[0] & 0x0f) * 4;
+        // A unicast DHCP reply is for chaddr; the client has no address yet
+        if (l3[9] == IP_PROTO_UDP && ihl >= 20 && l3_len >= ihl + 8 + DHCP_CHADDR + 6 &&
+            rd16(l3 + ihl) == DHCP_SERVER_PORT && rd16(l3 + ihl + 2) == DHCP_CLIENT_PORT) {
+            memcpy(frame, l3 + ihl + 8 + DHCP_CHADDR, 6);
+            return;
+        }
+        resolve(l3 + 16, frame);
+        return;
+    }
+
+    resolve(NULL, frame);
+}
+
+bool mac_nat_is_client(const uint8_t ip_field[4], uint32_t max_age_ms)
+{
+    uint32_t ip = rd_ip(ip_field);
+    uint32_t h = slot_of(ip);
+    uint32_t now = xTaskGetTickCount();
+    bool found = false;
+
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < MAX_PROBE; i++) {
+        const nat_entry_t *e = &s_table[(h + i) & TABLE_MASK];
+        if (e->ip == ip) {
+            found = now - e->seen <= pdMS_TO_TICKS(max_age_ms);
+            break;
+        }
+        if (e->ip == 0) {
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return found;
+}
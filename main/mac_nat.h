@@ -0,0 +1,64 @@
+#ifndef MAC_NAT_H
+#define MAC_NAT_H
+
+#include "esp_err.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief Size of the client IP table; a power of two
+ */
+#define MAC_NAT_TABLE_SIZE  32
+
+/**
+ * @brief Set up MAC translation for a station address
+ *
+ * A station may only transmit with its own MAC, so every frame from USB
+ * leaves with the STA MAC and frames for the STA MAC are handed back to
+ * the USB client that owns the destination IPv4 address. Client addresses
+ * are learned from outgoing IPv4 and ARP traffic into a fixed-size,
+ * open-addressed table; unknown destinations and non-IPv4 traffic go to
+ * the client seen most recently.
+ *
+ * @param sta_mac MAC address of the STA interface
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t mac_nat_init(const uint8_t sta_mac[6]);
+
+/**
+ * @brief Translate a frame travelling from USB to WiFi, in place
+ *
+ * Rewrites the source MAC, the ARP sender address and IPv6 neighbour
+ * discovery link-layer options to the STA MAC, and sets the broadcast flag
+ * in DHCP requests so the server's reply reaches the station. Checksums
+ * are updated incrementally. Call from one task only.
+ *
+ * @param frame Ethernet frame
+ * @param len Frame length
+ */
+void mac_nat_tx(uint8_t *frame, uint16_t len);
+
+/**
+ * @brief Translate a frame travelling from WiFi to USB, in place
+ *
+ * Frames addressed to the STA MAC get the owning client's MAC as their
+ * destination, and ARP replies get it as their target hardware address.
+ * Broadcast and multicast frames are left alone. Call from one task only.
+ *
+ * @param frame Ethernet frame
+ * @param len Frame length
+ */
+void mac_nat_rx(uint8_t *frame, uint16_t len);
+
+/**
+ * @brief Check whether an IPv4 address belongs to a USB client
+ *
+ * Safe from any task.
+ *
+ * @param ip Address, network byte order
+ * @param max_age_ms Only count clients heard from this recently
+ * @return true if a client sent from the address within max_age_ms
+ */
+bool mac_nat_is_client(const uint8_t ip[4], uint32_t max_age_ms);
+
+#endif // MAC_NAT_H
@@ -19,15 +19,17 @@
 #include "wifi_bridge.h"
 #include "usb_cdc_ecm.h"
 #include "wifi_config.h"
+#include "pkt_pool.h"
+#include "pkt_trace.h"
+#include "log_sink.h"
+#include "bridge_ctrl.h"
+#include "bench.h"
+#include "pkt_capture.h"
+#include "bridge_stats.h"
+#include "bridge_config.h"
 
 static const char *TAG = "main";
 
-// Wrapper function to bridge USB RX to WiFi
-static void usb_rx_to_wifi_callback(const uint8_t *data, uint16_t len)
-{
-    wifi_bridge_send_to_wifi(data, len);
-}
-
 void app_main(void)
 {
     ESP_LOGI(TAG, "ESP32-C3 WiFi USB Adapter starting...");
@@ -40,10 +42,23 @@ void app_main(void)
     }
     ESP_ERROR_CHECK(ret);
 
-    // Initialize network interface
+    // The pure bridge never starts lwIP; the event loop is still needed
+    // for WiFi events
+#if !CONFIG_BRIDGE_MODE_PURE_L2
     ESP_ERROR_CHECK(esp_netif_init());
+#endif
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
+    // Packet buffers are shared by both directions
+    if (pkt_pool_init() != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to allocate packet pool");
+        return;
+    }
+
+    if (pkt_trace_init() != ESP_OK) {
+        ESP_LOGW(TAG, "Packet trace dump trigger unavailable");
+    }
+
     // Initialize WiFi bridge first (needed for packet routing)
     ESP_LOGI(TAG, "Initializing WiFi bridge...");
     if (wifi_bridge_init() != ESP_OK) {
@@ -58,12 +73,28 @@ void app_main(void)
         return;
     }
 
-    // Register USB RX callback to bridge packets to WiFi
-    usb_cdc_ecm_register_rx_callback(usb_rx_to_wifi_callback);
+    // Keep logs off the data pipe from here on
+    log_sink_init();
+
+#if CONFIG_BRIDGE_USB_SERIAL_JTAG
+    // Control messages from the host share the serial link
+    if (bridge_ctrl_init() != ESP_OK) {
+        ESP_LOGW(TAG, "Control channel unavailable");
+    } else {
+        bridge_stats_init();
+        if (bench_init() != ESP_OK) {
+            ESP_LOGW(TAG, "Benchmark mode unavailable");
+        }
+        pkt_capture_init();
+    }
+#endif
+
+    // Saved settings, credentials included, apply before the first connect
+    bridge_config_init();
 
     // Start WiFi connection
-    ESP_LOGI(TAG, "Connecting to WiFi: %s", WIFI_SSID);
-    wifi_bridge_connect(WIFI_SSID, WIFI_PASSWORD);
+    ESP_LOGI(TAG, "Connecting to WiFi: %s", bridge_config_ssid());
+    wifi_bridge_connect(bridge_config_ssid(), bridge_config_password());
 
     ESP_LOGI(TAG, "Initialization complete. Bridge is running.");
 }
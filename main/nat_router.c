@@ -0,0 +1,908 @@
+/*
+ * NAT Router
+ * Serves the USB link as 192.168.7.1 and translates its clients' traffic
+ * to the station address
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "sdkconfig.h"
+
+#include "nat_router.h"
+#include "inet_csum.h"
+
+static const char *TAG = "nat_router";
+
+// Addresses are kept in network byte order; the first octet is the low
+// byte on this little-endian target
+#define IPV4(a, b, c, d)    ((uint32_t)(a) | ((uint32_t)(b) << 8) | \
+                             ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+#define LAN_NET             IPV4(192, 168, 7, 0)
+#define LAN_MASK            IPV4(255, 255, 255, 0)
+#define LAN_ROUTER          IPV4(192, 168, 7, 1)
+#define LAN_BROADCAST       IPV4(192, 168, 7, 255)
+#define DHCP_POOL_FIRST     2           // host part of the first lease
+#define DHCP_LEASES         4
+#define DHCP_LEASE_TIME     43200       // seconds
+
+#define ETH_HDR_LEN         14
+#define ETH_TYPE_IPV4       0x0800
+#define ETH_TYPE_ARP        0x0806
+#define ARP_LEN             28
+#define ARP_FRAME_LEN       60          // minimum Ethernet frame, no FCS
+
+#define IP_PROTO_ICMP       1
+#define IP_PROTO_TCP        6
+#define IP_PROTO_UDP        17
+#define ICMP_ECHO_REPLY     0
+#define ICMP_ECHO           8
+
+#define TCP_FIN             0x01
+#define TCP_SYN             0x02
+#define TCP_RST             0x04
+
+#define DHCP_SERVER_PORT    67
+#define DHCP_CLIENT_PORT    68
+#define BOOTP_LEN           236
+#define BOOTP_MIN_LEN       300         // RFC 1542 minimum, padded
+#define DHCP_MAGIC          0x63825363
+#define DHCP_FLAG_BROADCAST 0x8000
+
+#define DHCPDISCOVER        1
+#define DHCPOFFER           2
+#define DHCPREQUEST         3
+#define DHCPACK             5
+#define DHCPNAK             6
+#define DHCPINFORM          8
+
+#define OPT_PAD             0
+#define OPT_SUBNET_MASK     1
+#define OPT_ROUTER          3
+#define OPT_DNS             6
+#define OPT_REQUESTED_IP    50
+#define OPT_LEASE_TIME      51
+#define OPT_MSG_TYPE        53
+#define OPT_SERVER_ID       54
+#define OPT_END             255
+
+// Connection table: entry i owns external port NAT_PORT_BASE + i, which
+// stays below lwIP's ephemeral range (0xc000) so the station's own sockets
+// never collide with a mapping
+#define CT_ENTRIES          CONFIG_BRIDGE_NAT_ENTRIES
+#define CT_MASK             (CT_ENTRIES - 1)
+#define CT_SLOTS            (CT_ENTRIES * 2)
+#define CT_SLOT_MASK        (CT_SLOTS - 1)
+#define CT_SCAN             16          // entries examined per allocation
+#define NAT_PORT_BASE       32768
+
+_Static_assert((CT_ENTRIES & CT_MASK) == 0, "BRIDGE_NAT_ENTRIES must be a power of two");
+_Static_assert(NAT_PORT_BASE + CT_ENTRIES <= 0xc000, "NAT ports overlap lwIP's ephemeral range");
+
+#define CT_TIMEOUT_TCP_NEW      pdMS_TO_TICKS(75 * 1000)
+#define CT_TIMEOUT_TCP_EST      pdMS_TO_TICKS(7440 * 1000)     // RFC 5382
+#define CT_TIMEOUT_TCP_CLOSING  pdMS_TO_TICKS(10 * 1000)
+#define CT_TIMEOUT_UDP          pdMS_TO_TICKS(120 * 1000)      // RFC 4787
+#define CT_TIMEOUT_ICMP         pdMS_TO_TICKS(60 * 1000)
+
+#define NEIGH_SIZE          16          // on-link WiFi neighbours, direct mapped
+#define ARP_RETRY           pdMS_TO_TICKS(1000)
+
+enum {
+    CT_NEW = 0,             // only outbound packets seen
+    CT_ESTABLISHED,         // the remote end has answered
+    CT_CLOSING,             // FIN or RST seen
+};
+
+typedef struct {
+    uint32_t int_ip;        // client address
+    uint32_t ext_ip;        // remote address
+    uint16_t int_port;      // client port or ICMP identifier; network order
+    uint16_t ext_port;      // remote port; 0 for ICMP
+    uint8_t proto;          // 0: free
+    uint8_t state;
+    uint16_t home;          // preferred slot in s_index
+    uint32_t last;          // tick of the last packet
+} ct_entry_t;
+
+typedef struct {
+    uint32_t ip;
+    uint8_t mac[6];
+} neigh_t;
+
+// Only the TX task changes the index and claims entries. s_lock covers
+// everything the RX task or the driver callback touch: entry contents,
+// neighbours, leases and the uplink.
+static ct_entry_t s_ct[CT_ENTRIES];
+static uint16_t s_index[CT_SLOTS];      // entry + 1; 0: empty
+static uint32_t s_hand;                 // next entry the allocator examines
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint8_t s_sta_mac[6];
+static uint8_t s_lan_mac[6];            // the router's MAC on the USB link
+static uint8_t s_client_mac[6];         // last client seen, for unknown addresses
+
+static volatile uint32_t s_sta_ip;
+static uint32_t s_netmask;
+static uint32_t s_gw;
+static uint32_t s_dns;
+static uint32_t s_mapped_ip;            // address the table was built for
+static volatile bool s_flush;           // uplink changed; TX task clears the table
+
+static uint8_t s_gw_mac[6];
+static bool s_gw_valid;
+static neigh_t s_neigh[NEIGH_SIZE];
+static uint32_t s_arp_target;
+static uint32_t s_arp_tick;
+
+static struct {
+    uint8_t mac[6];
+    bool bound;
+} s_leases[DHCP_LEASES];
+
+static inline uint16_t rd16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline void wr16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static inline uint32_t rd_ip(const uint8_t *p)
+{
+    uint32_t ip;
+    memcpy(&ip, p, sizeof(ip));
+    return ip;
+}
+
+static inline void wr_ip(uint8_t *p, uint32_t ip)
+{
+    memcpy(p, &ip, sizeof(ip));
+}
+
+static inline bool on_lan(uint32_t ip)
+{
+    return (ip & LAN_MASK) == LAN_NET;
+}
+
+static inline int lease_of(uint32_t ip)
+{
+    int host = (int)(ip >> 24) - DHCP_POOL_FIRST;
+    return on_lan(ip) && host >= 0 && host < DHCP_LEASES ? host : -1;
+}
+
+static inline uint32_t lease_ip(int lease)
+{
+    return LAN_NET | ((uint32_t)(DHCP_POOL_FIRST + lease) << 24);
+}
+
+static inline uint32_t tuple_hash(uint8_t proto, uint32_t int_ip, uint16_t int_port,
+                                  uint32_t ext_ip, uint16_t ext_port)
+{
+    uint32_t h = int_ip * 0x9e3779b1u;
+
+    h ^= ext_ip * 0x85ebca6bu;
+    h ^= (((uint32_t)int_port << 16) | ext_port) * 0xc2b2ae35u;
+    h ^= proto;
+    h ^= h >> 16;
+    return h & CT_SLOT_MASK;
+}
+
+static bool ct_expired(const ct_entry_t *e, uint32_t now)
+{
+    uint32_t timeout;
+
+    switch (e->proto) {
+    case IP_PROTO_TCP:
+        timeout = e->state == CT_ESTABLISHED ? CT_TIMEOUT_TCP_EST :
+                  e->state == CT_CLOSING ? CT_TIMEOUT_TCP_CLOSING : CT_TIMEOUT_TCP_NEW;
+        break;
+    case IP_PROTO_UDP:
+        timeout = CT_TIMEOUT_UDP;
+        break;
+    default:
+        timeout = CT_TIMEOUT_ICMP;
+        break;
+    }
+    return now - e->last > timeout;
+}
+
+static int ct_find(uint8_t proto, uint32_t int_ip, uint16_t int_port,
+                   uint32_t ext_ip, uint16_t ext_port, uint32_t home)
+{
+    // The index is never more than half full, so an empty slot ends the probe
+    for (uint32_t slot = home; s_index[slot] != 0; slot = (slot + 1) & CT_SLOT_MASK) {
+        const ct_entry_t *e = &s_ct[s_index[slot] - 1];
+        if (e->int_ip == int_ip && e->ext_ip == ext_ip && e->int_port == int_port &&
+            e->ext_port == ext_port && e->proto == proto) {
+            return s_index[slot] - 1;
+        }
+    }
+    return -1;
+}
+
+// Remove an entry from the index by shifting later members of its probe
+// run back, so lookups never need tombstones
+static void ct_unindex(uint32_t entry)
+{
+    uint32_t slot = s_ct[entry].home;
+
+    while (s_index[slot] != entry + 1) {
+        slot = (slot + 1) & CT_SLOT_MASK;
+    }
+
+    uint32_t hole = slot;
+    for (uint32_t next = (hole + 1) & CT_SLOT_MASK; s_index[next] != 0;
+         next = (next + 1) & CT_SLOT_MASK) {
+        uint32_t home = s_ct[s_index[next] - 1].home;
+        // Move it unless its home lies cyclically in (hole, next]
+        if (((next - home) & CT_SLOT_MASK) >= ((next - hole) & CT_SLOT_MASK)) {
+            s_index[hole] = s_index[next];
+            hole = next;
+        }
+    }
+    s_index[hole] = 0;
+}
+
+// A free or expired entry near the clock hand, or failing that the least
+// recently used of the ones examined
+static uint32_t ct_alloc(uint32_t now)
+{
+    uint32_t victim = s_hand;
+
+    for (int n = 0; n < CT_SCAN; n++) {
+        uint32_t i = (s_hand + n) & CT_MASK;
+        const ct_entry_t *e = &s_ct[i];
+        if (e->proto == 0 || ct_expired(e, now)) {
+            victim = i;
+            break;
+        }
+        if ((int32_t)(e->last - s_ct[victim].last) < 0) {
+            victim = i;
+        }
+    }
+    s_hand = (victim + 1) & CT_MASK;
+
+    if (s_ct[victim].proto != 0) {
+        ct_unindex(victim);
+        portENTER_CRITICAL(&s_lock);
+        s_ct[victim].proto = 0;
+        portEXIT_CRITICAL(&s_lock);
+    }
+    return victim;
+}
+
+static void ct_flush(void)
+{
+    s_flush = false;
+    memset(s_index, 0, sizeof(s_index));
+    portENTER_CRITICAL(&s_lock);
+    memset(s_ct, 0, sizeof(s_ct));
+    portEXIT_CRITICAL(&s_lock);
+    s_hand = 0;
+}
+
+static void tcp_track(ct_entry_t *e, uint8_t flags)
+{
+    if (flags & (TCP_FIN | TCP_RST)) {
+        e->state = CT_CLOSING;
+    }
+}
+
+// Replace an IPv4 address and the checksums that cover it
+static void set_addr(uint8_t *ip, uint8_t *field, uint32_t addr, uint8_t *l4_csum, bool udp)
+{
+    uint8_t to[4];
+
+    wr_ip(to, addr);
+    inet_csum_replace(ip + 10, field, to, 4);
+    if (l4_csum != NULL && !(udp && rd16(l4_csum) == 0)) {
+        inet_csum_replace(l4_csum, field, to, 4);
+        if (udp && rd16(l4_csum) == 0) {
+            wr16(l4_csum, 0xffff);
+        }
+    }
+    memcpy(field, to, 4);
+}
+
+static void set_port(uint8_t *field, uint16_t port, uint8_t *l4_csum, bool udp)
+{
+    uint8_t to[2];
+
+    memcpy(to, &port, 2);
+    if (!(udp && rd16(l4_csum) == 0)) {
+        inet_csum_replace(l4_csum, field, to, 2);
+        if (udp && rd16(l4_csum) == 0) {
+            wr16(l4_csum, 0xffff);
+        }
+    }
+    memcpy(field, to, 2);
+}
+
+static bool dec_ttl(uint8_t *ip)
+{
+    if (ip[8] <= 1) {
+        return false;
+    }
+    uint8_t from[2] = { ip[8], ip[9] };
+    ip[8]--;
+    inet_csum_replace(ip + 10, from, ip + 8, 2);
+    return true;
+}
+
+static void fill_ip_header(uint8_t *ip, uint16_t total_len, uint8_t proto, uint32_t src, uint32_t dst)
+{
+    ip[0] = 0x45;
+    ip[1] = 0;
+    wr16(ip + 2, total_len);
+    wr16(ip + 4, 0);
+    wr16(ip + 6, 0);
+    ip[8] = 64;
+    ip[9] = proto;
+    wr16(ip + 10, 0);
+    wr_ip(ip + 12, src);
+    wr_ip(ip + 16, dst);
+    wr16(ip + 10, inet_csum_fold(inet_csum_add(0, ip, 20)));
+}
+
+static uint16_t build_arp(uint8_t *frame, uint16_t op, const uint8_t *dst_mac,
+                          const uint8_t *sha, uint32_t spa, const uint8_t *tha, uint32_t tpa)
+{
+    static const uint8_t arp_hdr[6] = { 0x00, 0x01, 0x08, 0x00, 6, 4 };
+    uint8_t *arp = frame + ETH_HDR_LEN;
+
+    memcpy(frame, dst_mac, 6);
+    memcpy(frame + 6, sha, 6);
+    wr16(frame + 12, ETH_TYPE_ARP);
+    memcpy(arp, arp_hdr, sizeof(arp_hdr));
+    wr16(arp + 6, op);
+    memcpy(arp + 8, sha, 6);
+    wr_ip(arp + 14, spa);
+    memcpy(arp + 18, tha, 6);
+    wr_ip(arp + 24, tpa);
+    memset(arp + ARP_LEN, 0, ARP_FRAME_LEN - ETH_HDR_LEN - ARP_LEN);
+    return ARP_FRAME_LEN;
+}
+
+static int dhcp_lease_for(const uint8_t *chaddr)
+{
+    int free_lease = -1;
+
+    for (int i = 0; i < DHCP_LEASES; i++) {
+        if (s_leases[i].bound && memcmp(s_leases[i].mac, chaddr, 6) == 0) {
+            return i;
+        }
+        if (!s_leases[i].bound && free_lease < 0) {
+            free_lease = i;
+        }
+    }
+    return free_lease;
+}
+
+static uint8_t *put_opt(uint8_t *p, uint8_t code, const void *data, uint8_t len)
+{
+    p[0] = code;
+    p[1] = len;
+    memcpy(p + 2, data, len);
+    return p + 2 + len;
+}
+
+// Answer a DHCP message from a client; returns the reply length or 0
+static uint16_t dhcp_serve(uint8_t *frame, uint8_t *udp, uint16_t udp_len, uint16_t cap)
+{
+    uint8_t *bootp = udp + 8;
+    uint16_t bootp_len = udp_len - 8;
+
+    if (udp_len < 8 + BOOTP_LEN + 4 || bootp[0] != 1 || bootp[1] != 1 || bootp[2] != 6 ||
+        rd16(bootp + BOOTP_LEN) != (DHCP_MAGIC >> 16) ||
+        rd16(bootp + BOOTP_LEN + 2) != (DHCP_MAGIC & 0xffff)) {
+        return 0;
+    }
+
+    uint8_t type = 0;
+    uint32_t requested = 0, server_id = 0;
+    for (uint16_t i = BOOTP_LEN + 4; i < bootp_len && bootp[i] != OPT_END;) {
+        if (bootp[i] == OPT_PAD) {
+            i++;
+            continue;
+        }
+        if (i + 2 > bootp_len || i + 2 + bootp[i + 1] > bootp_len) {
+            break;
+        }
+        uint8_t *val = bootp + i + 2;
+        uint8_t len = bootp[i + 1];
+        if (bootp[i] == OPT_MSG_TYPE && len == 1) {
+            type = val[0];
+        } else if (bootp[i] == OPT_REQUESTED_IP && len == 4) {
+            requested = rd_ip(val);
+        } else if (bootp[i] == OPT_SERVER_ID && len == 4) {
+            server_id = rd_ip(val);
+        }
+        i += 2 + len;
+    }
+
+    uint8_t chaddr[6];
+    memcpy(chaddr, bootp + 28, 6);
+    int lease = dhcp_lease_for(chaddr);
+    uint8_t reply;
+    uint32_t yiaddr = 0;
+
+    switch (type) {
+    case DHCPDISCOVER:
+        if (lease < 0) {
+            ESP_LOGW(TAG, "No free lease for " MACSTR, MAC2STR(chaddr));
+            return 0;
+        }
+        reply = DHCPOFFER;
+        yiaddr = lease_ip(lease);
+        break;
+    case DHCPREQUEST:
+        if (server_id != 0 && server_id != LAN_ROUTER) {
+            return 0;       // the client chose another server
+        }
+        if (requested == 0) {
+            requested = rd_ip(bootp + 12);      // renewing: ciaddr
+        }
+        if (lease >= 0 && requested == lease_ip(lease)) {
+            reply = DHCPACK;
+            yiaddr = requested;
+        } else {
+            reply = DHCPNAK;
+        }
+        break;
+    case DHCPINFORM:
+        reply = DHCPACK;
+        break;
+    default:
+        return 0;           // release and decline keep the MAC's lease
+    }
+
+    if ((uint32_t)ETH_HDR_LEN + 20 + 8 + BOOTP_MIN_LEN > cap) {
+        return 0;
+    }
+
+    // Build the reply over the request: the BOOTP header stays, addresses
+    // and options are rewritten
+    uint8_t *ip = frame + ETH_HDR_LEN;
+    uint8_t *out_udp = ip + 20;
+    if (out_udp != udp) {
+        memmove(out_udp, udp, 8 + BOOTP_LEN + 4);
+    }
+    bootp = out_udp + 8;
+    uint16_t flags = rd16(bootp + 10);
+    bootp[0] = 2;           // BOOTREPLY
+    bootp[3] = 0;
+    wr16(bootp + 8, 0);
+    wr_ip(bootp + 16, yiaddr);
+    wr_ip(bootp + 20, 0);
+    memset(bootp + 44, 0, BOOTP_LEN - 44);
+
+    uint32_t value;
+    uint8_t *p = bootp + BOOTP_LEN + 4;
+    p = put_opt(p, OPT_MSG_TYPE, &reply, 1);
+    p = put_opt(p, OPT_SERVER_ID, &(uint32_t){ LAN_ROUTER }, 4);
+    if (reply != DHCPNAK) {
+        if (reply != DHCPACK || type != DHCPINFORM) {
+            value = __builtin_bswap32(DHCP_LEASE_TIME);
+            p = put_opt(p, OPT_LEASE_TIME, &value, 4);
+        }
+        p = put_opt(p, OPT_SUBNET_MASK, &(uint32_t){ LAN_MASK }, 4);
+        p = put_opt(p, OPT_ROUTER, &(uint32_t){ LAN_ROUTER }, 4);
+        portENTER_CRITICAL(&s_lock);
+        value = s_dns;
+        portEXIT_CRITICAL(&s_lock);
+        if (value != 0) {
+            p = put_opt(p, OPT_DNS, &value, 4);
+        }
+    }
+    *p++ = OPT_END;
+    bootp_len = p - bootp;
+    if (bootp_len < BOOTP_MIN_LEN) {
+        memset(p, OPT_PAD, BOOTP_MIN_LEN - bootp_len);
+        bootp_len = BOOTP_MIN_LEN;
+    }
+
+    if (reply == DHCPOFFER || reply == DHCPACK) {
+        if (yiaddr != 0 && !s_leases[lease].bound) {
+            ESP_LOGI(TAG, "Lease 192.168.7.%d to " MACSTR, DHCP_POOL_FIRST + lease, MAC2STR(chaddr));
+        }
+        if (yiaddr != 0) {
+            portENTER_CRITICAL(&s_lock);
+            memcpy(s_leases[lease].mac, chaddr, 6);
+            s_leases[lease].bound = true;
+            portEXIT_CRITICAL(&s_lock);
+        }
+    }
+
+    // RFC 2131 4.1: unicast to a configured client, broadcast when asked
+    // to or for a NAK, otherwise unicast to chaddr and the new address
+    if (reply == DHCPNAK) {
+        wr_ip(bootp + 12, 0);
+    }
+    uint32_t ciaddr = rd_ip(bootp + 12);
+    bool bcast = reply == DHCPNAK || (ciaddr == 0 && (flags & DHCP_FLAG_BROADCAST));
+    uint32_t dst = bcast ? 0xffffffff : ciaddr != 0 ? ciaddr : yiaddr;
+    static const uint8_t bcast_mac[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+    udp_len = 8 + bootp_len;
+    wr16(out_udp, DHCP_SERVER_PORT);
+    wr16(out_udp + 2, DHCP_CLIENT_PORT);
+    wr16(out_udp + 4, udp_len);
+    wr16(out_udp + 6, 0);
+    fill_ip_header(ip, 20 + udp_len, IP_PROTO_UDP, LAN_ROUTER, dst);
+
+    uint32_t sum = inet_csum_add(0, ip + 12, 8);
+    sum += IP_PROTO_UDP + udp_len;
+    uint16_t csum = inet_csum_fold(inet_csum_add(sum, out_udp, udp_len));
+    wr16(out_udp + 6, csum ? csum : 0xffff);
+
+    memcpy(frame, bcast ? bcast_mac : chaddr, 6);
+    memcpy(frame + 6, s_lan_mac, 6);
+    wr16(frame + 12, ETH_TYPE_IPV4);
+    return ETH_HDR_LEN + 20 + udp_len;
+}
+
+// Frames addressed to the router itself: ARP, ping and DHCP
+static nat_router_verdict_t serve_local(uint8_t *frame, uint16_t *len, uint16_t cap)
+{
+    uint8_t *l3 = frame + ETH_HDR_LEN;
+    uint16_t l3_len = *len - ETH_HDR_LEN;
+
+    if (rd16(frame + 12) == ETH_TYPE_ARP) {
+        if (l3_len < ARP_LEN || rd16(l3 + 6) != 1 || rd_ip(l3 + 24) != LAN_ROUTER) {
+            return NAT_ROUTER_DROP;
+        }
+        uint8_t sha[6];
+        memcpy(sha, l3 + 8, 6);
+        *len = build_arp(frame, 2, sha, s_lan_mac, LAN_ROUTER, sha, rd_ip(l3 + 14));
+        return NAT_ROUTER_REPLY;
+    }
+
+    uint16_t ihl = (l3[0] & 0x0f) * 4;
+    uint16_t ip_len = rd16(l3 + 2);
+    uint8_t *l4 = l3 + ihl;
+
+    if (l3[9] == IP_PROTO_UDP && ip_len >= ihl + 8 && rd16(l4 + 2) == DHCP_SERVER_PORT) {
+        *len = dhcp_serve(frame, l4, ip_len - ihl, cap);
+        return *len ? NAT_ROUTER_REPLY : NAT_ROUTER_DROP;
+    }
+
+    if (l3[9] == IP_PROTO_ICMP && rd_ip(l3 + 16) == LAN_ROUTER && ip_len >= ihl + 8 &&
+        l4[0] == ICMP_ECHO) {
+        uint8_t from[2] = { l4[0], l4[1] };
+        l4[0] = ICMP_ECHO_REPLY;
+        inet_csum_replace(l4 + 2, from, l4, 2);
+        memcpy(l3 + 16, l3 + 12, 4);                // swapping keeps the IP checksum
+        wr_ip(l3 + 12, LAN_ROUTER);
+        memcpy(frame, frame + 6, 6);
+        memcpy(frame + 6, s_lan_mac, 6);
+        *len = ETH_HDR_LEN + ip_len;
+        return NAT_ROUTER_REPLY;
+    }
+    return NAT_ROUTER_DROP;
+}
+
+static bool neigh_lookup(uint32_t ip, uint8_t mac[6])
+{
+    bool found = false;
+
+    portENTER_CRITICAL(&s_lock);
+    if (ip == s_gw && s_gw_valid) {
+        memcpy(mac, s_gw_mac, 6);
+        found = true;
+    } else {
+        const neigh_t *n = &s_neigh[(ip >> 24) & (NEIGH_SIZE - 1)];
+        if (n->ip == ip) {
+            memcpy(mac, n->mac, 6);
+            found = true;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return found;
+}
+
+esp_err_t nat_router_init(const uint8_t sta_mac[6])
+{
+    if (sta_mac == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    memcpy(s_sta_mac, sta_mac, 6);
+    // A locally administered sibling of the STA MAC for the USB side
+    memcpy(s_lan_mac, sta_mac, 6);
+    s_lan_mac[0] ^= 0x02;
+    memset(s_leases, 0, sizeof(s_leases));
+    s_sta_ip = 0;
+    s_mapped_ip = 0;
+    ct_flush();
+    return ESP_OK;
+}
+
+void nat_router_set_uplink(uint32_t ip, uint32_t netmask, uint32_t gw, uint32_t dns)
+{
+    portENTER_CRITICAL(&s_lock);
+    // Losing the lease briefly keeps the mappings; a new address voids them
+    if (ip != 0 && ip != s_mapped_ip) {
+        s_mapped_ip = ip;
+        s_flush = true;
+    }
+    s_sta_ip = ip;
+    s_netmask = netmask;
+    if (gw != s_gw) {
+        s_gw_valid = false;
+    }
+    s_gw = gw;
+    s_dns = dns;
+    memset(s_neigh, 0, sizeof(s_neigh));
+    portEXIT_CRITICAL(&s_lock);
+}
+
+nat_router_verdict_t nat_router_tx(uint8_t *frame, uint16_t *len, uint16_t cap)
+{
+    uint16_t ethertype = rd16(frame + 12);
+    uint8_t *l3 = frame + ETH_HDR_LEN;
+    uint16_t l3_len = *len - ETH_HDR_LEN;
+
+    if (s_flush) {
+        ct_flush();
+    }
+
+    if (ethertype == ETH_TYPE_ARP) {
+        return serve_local(frame, len, cap);
+    }
+    if (ethertype != ETH_TYPE_IPV4 || l3_len < 20) {
+        return NAT_ROUTER_DROP;         // no IPv6 or other protocols on the uplink
+    }
+
+    uint16_t ihl = (l3[0] & 0x0f) * 4;
+    uint16_t ip_len = rd16(l3 + 2);
+    if ((l3[0] >> 4) != 4 || ihl < 20 || ip_len < ihl || ip_len > l3_len) {
+        return NAT_ROUTER_DROP;
+    }
+    *len = ETH_HDR_LEN + ip_len;        // strip Ethernet padding
+
+    uint32_t src = rd_ip(l3 + 12);
+    uint32_t dst = rd_ip(l3 + 16);
+
+    int lease = lease_of(src);
+    if (lease >= 0 && !(s_leases[lease].bound && memcmp(s_leases[lease].mac, frame + 6, 6) == 0)) {
+        // A client with a static address in the pool
+        portENTER_CRITICAL(&s_lock);
+        memcpy(s_leases[lease].mac, frame + 6, 6);
+        s_leases[lease].bound = true;
+        portEXIT_CRITICAL(&s_lock);
+    }
+    if (memcmp(s_client_mac, frame + 6, 6) != 0) {
+        portENTER_CRITICAL(&s_lock);
+        memcpy(s_client_mac, frame + 6, 6);
+        portEXIT_CRITICAL(&s_lock);
+    }
+
+    // Broadcasts from the host stay on the USB link
+    if (dst == LAN_ROUTER || dst == 0xffffffff || dst == LAN_BROADCAST) {
+        return serve_local(frame, len, cap);
+    }
+    if (!on_lan(src) || on_lan(dst) || (dst & 0xf0) == 0xe0 || (rd16(l3 + 6) & 0x3fff) != 0) {
+        return NAT_ROUTER_DROP;         // multicast and fragments are not translated
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    uint32_t sta_ip = s_sta_ip;
+    uint32_t netmask = s_netmask;
+    uint32_t gw = s_gw;
+    portEXIT_CRITICAL(&s_lock);
+    if (sta_ip == 0) {
+        return NAT_ROUTER_DROP;
+    }
+
+    uint8_t proto = l3[9];
+    uint8_t *l4 = l3 + ihl;
+    uint16_t l4_len = ip_len - ihl;
+    uint16_t int_port, ext_port = 0;
+    uint8_t *port_field;
+    uint8_t *csum;
+    bool udp = proto == IP_PROTO_UDP;
+
+    if (proto == IP_PROTO_TCP && l4_len >= 20) {
+        port_field = l4;
+        csum = l4 + 16;
+    } else if (udp && l4_len >= 8) {
+        port_field = l4;
+        csum = l4 + 6;
+    } else if (proto == IP_PROTO_ICMP && l4_len >= 8 && l4[0] == ICMP_ECHO) {
+        port_field = l4 + 4;
+        csum = l4 + 2;
+    } else {
+        return NAT_ROUTER_DROP;
+    }
+    memcpy(&int_port, port_field, 2);
+    if (proto != IP_PROTO_ICMP) {
+        memcpy(&ext_port, l4 + 2, 2);
+    }
+
+    // Next hop on the WiFi side, resolved before a mapping is spent on it
+    uint32_t next_hop = ((dst ^ sta_ip) & netmask) == 0 ? dst : gw;
+    uint8_t next_mac[6];
+    if (!neigh_lookup(next_hop, next_mac)) {
+        uint32_t now = xTaskGetTickCount();
+        if (next_hop == s_arp_target && now - s_arp_tick < ARP_RETRY) {
+            return NAT_ROUTER_DROP;
+        }
+        s_arp_target = next_hop;
+        s_arp_tick = now;
+        static const uint8_t bcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+        static const uint8_t zero[6] = { 0 };
+        *len = build_arp(frame, 1, bcast, s_sta_mac, sta_ip, zero, next_hop);
+        return NAT_ROUTER_RESOLVE;
+    }
+
+    if (!dec_ttl(l3)) {
+        return NAT_ROUTER_DROP;
+    }
+
+    uint32_t now = xTaskGetTickCount();
+    uint32_t home = tuple_hash(proto, src, int_port, dst, ext_port);
+    int entry = ct_find(proto, src, int_port, dst, ext_port, home);
+    if (entry < 0) {
+        entry = ct_alloc(now);
+        ct_entry_t fresh = {
+            .int_ip = src,
+            .ext_ip = dst,
+            .int_port = int_port,
+            .ext_port = ext_port,
+            .proto = proto,
+            .state = CT_NEW,
+            .home = home,
+            .last = now,
+        };
+        portENTER_CRITICAL(&s_lock);
+        s_ct[entry] = fresh;
+        portEXIT_CRITICAL(&s_lock);
+
+        uint32_t slot = home;
+        while (s_index[slot] != 0) {
+            slot = (slot + 1) & CT_SLOT_MASK;
+        }
+        s_index[slot] = entry + 1;
+    } else {
+        portENTER_CRITICAL(&s_lock);
+        if (ct_expired(&s_ct[entry], now)) {
+            s_ct[entry].state = CT_NEW;
+        }
+        s_ct[entry].last = now;
+        portEXIT_CRITICAL(&s_lock);
+    }
+    if (proto == IP_PROTO_TCP) {
+        portENTER_CRITICAL(&s_lock);
+        tcp_track(&s_ct[entry], l4[13]);
+        portEXIT_CRITICAL(&s_lock);
+    }
+
+    uint8_t *pseudo_csum = proto == IP_PROTO_ICMP ? NULL : csum;
+    set_addr(l3, l3 + 12, sta_ip, pseudo_csum, udp);
+    set_port(port_field, __builtin_bswap16(NAT_PORT_BASE + entry), csum, udp);
+
+    memcpy(frame, next_mac, 6);
+    memcpy(frame + 6, s_sta_mac, 6);
+    return NAT_ROUTER_FORWARD;
+}
+
+bool nat_router_rx_match(const uint8_t *frame, uint16_t len)
+{
+    if (len < ETH_HDR_LEN + 20 || rd16(frame + 12) != ETH_TYPE_IPV4) {
+        return false;
+    }
+
+    const uint8_t *l3 = frame + ETH_HDR_LEN;
+    uint16_t ihl = (l3[0] & 0x0f) * 4;
+    if (s_sta_ip == 0 || rd_ip(l3 + 16) != s_sta_ip || ihl < 20 ||
+        len < ETH_HDR_LEN + ihl + 8 || (rd16(l3 + 6) & 0x3fff) != 0) {
+        return false;
+    }
+
+    const uint8_t *l4 = l3 + ihl;
+    uint16_t port;
+    if (l3[9] == IP_PROTO_TCP || l3[9] == IP_PROTO_UDP) {
+        port = rd16(l4 + 2);
+    } else if (l3[9] == IP_PROTO_ICMP && l4[0] == ICMP_ECHO_REPLY) {
+        port = rd16(l4 + 4);
+    } else {
+        return false;
+    }
+    return port >= NAT_PORT_BASE && port < NAT_PORT_BASE + CT_ENTRIES;
+}
+
+bool nat_router_rx(uint8_t *frame, uint16_t len)
+{
+    uint8_t *l3 = frame + ETH_HDR_LEN;
+    uint16_t ihl = (l3[0] & 0x0f) * 4;
+    uint16_t ip_len = rd16(l3 + 2);
+    uint8_t proto = l3[9];
+    uint8_t *l4 = l3 + ihl;
+
+    if (ip_len < ihl + 8 || ip_len > len - ETH_HDR_LEN || (proto == IP_PROTO_TCP && ip_len < ihl + 20)) {
+        return false;
+    }
+
+    uint8_t *port_field = proto == IP_PROTO_ICMP ? l4 + 4 : l4 + 2;
+    uint8_t *csum = proto == IP_PROTO_TCP ? l4 + 16 : proto == IP_PROTO_UDP ? l4 + 6 : l4 + 2;
+    uint32_t entry = rd16(port_field) - NAT_PORT_BASE;
+    if (entry >= CT_ENTRIES) {
+        return false;
+    }
+    uint32_t remote = rd_ip(l3 + 12);
+    uint16_t remote_port = 0;
+    if (proto != IP_PROTO_ICMP) {
+        memcpy(&remote_port, l4, 2);
+    }
+
+    // Only the remote end of the mapping may use it
+    uint32_t int_ip;
+    uint16_t int_port;
+    uint8_t dst_mac[6];
+    bool ok;
+    uint32_t now = xTaskGetTickCount();
+
+    portENTER_CRITICAL(&s_lock);
+    ct_entry_t *e = &s_ct[entry];
+    ok = e->proto == proto && e->ext_ip == remote && e->ext_port == remote_port;
+    if (ok) {
+        int_ip = e->int_ip;
+        int_port = e->int_port;
+        e->last = now;
+        if (proto == IP_PROTO_TCP) {
+            if (e->state == CT_NEW) {
+                e->state = CT_ESTABLISHED;
+            }
+            tcp_track(e, l4[13]);
+        }
+        int lease = lease_of(int_ip);
+        memcpy(dst_mac, lease >= 0 && s_leases[lease].bound ? s_leases[lease].mac : s_client_mac, 6);
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (!ok || !dec_ttl(l3)) {
+        return false;
+    }
+
+    bool udp = proto == IP_PROTO_UDP;
+    set_addr(l3, l3 + 16, int_ip, proto == IP_PROTO_ICMP ? NULL : csum, udp);
+    set_port(port_field, int_port, csum, udp);
+
+    memcpy(frame, dst_mac, 6);
+    memcpy(frame + 6, s_lan_mac, 6);
+    return true;
+}
+
+void nat_router_snoop(const uint8_t *frame, uint16_t len)
+{
+    if (len < ETH_HDR_LEN + ARP_LEN || rd16(frame + 12) != ETH_TYPE_ARP) {
+        return;
+    }
+
+    const uint8_t *arp = frame + ETH_HDR_LEN;
+    const uint8_t *sha = arp + 8;
+    uint32_t spa = rd_ip(arp + 14);
+    if (rd16(arp + 2) != ETH_TYPE_IPV4 || arp[4] != 6 || arp[5] != 4 || (sha[0] & 0x01)) {
+        return;
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    if (s_sta_ip != 0 && spa != 0 && ((spa ^ s_sta_ip) & s_netmask) == 0) {
+        if (spa == s_gw) {
+            memcpy(s_gw_mac, sha, 6);
+            s_gw_valid = true;
+        } else {
+            neigh_t *n = &s_neigh[(spa >> 24) & (NEIGH_SIZE - 1)];
+            n->ip = spa;
+            memcpy(n->mac, sha, 6);
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
@@ -0,0 +1,87 @@
+#ifndef NAT_ROUTER_H
+#define NAT_ROUTER_H
+
+#include "esp_err.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief What to do with a frame from USB after nat_router_tx()
+ */
+typedef enum {
+    NAT_ROUTER_FORWARD = 0,     // translated; send it on WiFi
+    NAT_ROUTER_REPLY,           // replaced by the router's answer; send it to USB
+    NAT_ROUTER_RESOLVE,         // replaced by an ARP request; send it on WiFi,
+                                // the original frame is dropped
+    NAT_ROUTER_DROP,            // not routable
+} nat_router_verdict_t;
+
+/**
+ * @brief Set up the router
+ *
+ * The router answers ARP, ping and DHCP for 192.168.7.1 on the USB link,
+ * leases 192.168.7.2 onwards (the addresses setup_routing.py assumes) and
+ * translates the TCP, UDP and ICMP echo traffic of its clients to the
+ * station's address. Each mapping owns one external port,
+ * 32768 + its slot in the connection table, so replies from WiFi reach
+ * their entry without a search; outgoing frames find theirs through an
+ * open-addressed index at most half full.
+ *
+ * @param sta_mac MAC address of the STA interface
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t nat_router_init(const uint8_t sta_mac[6]);
+
+/**
+ * @brief Set the station's addresses, or take the uplink down
+ *
+ * Mappings survive the link going down; a different address drops them.
+ *
+ * @param ip Station address, network byte order; 0 when the link is down
+ * @param netmask Netmask, network byte order
+ * @param gw Default gateway, network byte order
+ * @param dns DNS server handed to DHCP clients, network byte order; 0 for none
+ */
+void nat_router_set_uplink(uint32_t ip, uint32_t netmask, uint32_t gw, uint32_t dns);
+
+/**
+ * @brief Route a frame from USB, in place (WiFi TX task only)
+ *
+ * @param frame Ethernet frame
+ * @param len Frame length; updated when the frame is replaced
+ * @param cap Space available at frame
+ * @return What to do with the frame
+ */
+nat_router_verdict_t nat_router_tx(uint8_t *frame, uint16_t *len, uint16_t cap);
+
+/**
+ * @brief Check whether a frame from WiFi belongs to a NAT mapping
+ *
+ * Stateless and cheap enough for the WiFi driver's RX callback. Frames
+ * that do not match are for the station's own IP stack.
+ *
+ * @param frame Ethernet frame
+ * @param len Frame length
+ * @return true if nat_router_rx() should handle it
+ */
+bool nat_router_rx_match(const uint8_t *frame, uint16_t len);
+
+/**
+ * @brief Translate a frame from WiFi for its USB client, in place
+ * (WiFi RX task only)
+ *
+ * @param frame Ethernet frame accepted by nat_router_rx_match()
+ * @param len Frame length
+ * @return true to send it to USB, false to drop it
+ */
+bool nat_router_rx(uint8_t *frame, uint16_t len);
+
+/**
+ * @brief Learn neighbour MAC addresses from ARP on the WiFi side
+ *
+ * @param frame Ethernet frame received on WiFi
+ * @param len Frame length
+ */
+void nat_router_snoop(const uint8_t *frame, uint16_t len);
+
+#endif // NAT_ROUTER_H
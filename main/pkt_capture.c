@@ -0,0 +1,153 @@
+/*
+ * Packet Capture
+ * Truncated copies of bridged frames, read by the host as pcapng
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "pkt_capture.h"
+#include "bridge_ctrl.h"
+
+static const char *TAG = "pkt_capture";
+
+#define CAPTURE_SLOTS       CONFIG_BRIDGE_PKT_CAPTURE_SLOTS
+#define CAPTURE_MASK        (CAPTURE_SLOTS - 1)
+#define CAPTURE_SNAPLEN     CONFIG_BRIDGE_PKT_CAPTURE_SNAPLEN
+#define CAPTURE_SLOT_SIZE   (sizeof(pkt_capture_rec_t) + CAPTURE_SNAPLEN)
+
+_Static_assert((CAPTURE_SLOTS & CAPTURE_MASK) == 0, "Capture ring size must be a power of two");
+_Static_assert(CAPTURE_SNAPLEN <= UINT8_MAX, "caplen is one byte");
+
+volatile uint8_t g_pkt_capture_points = 0;
+
+// Fixed-size slots, filled and emptied under s_lock. A slot copy is a few
+// dozen word stores, short enough to do with interrupts masked, which
+// keeps writers in the WiFi driver task and the bridge tasks from ever
+// seeing a half-written record.
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t s_ring[CAPTURE_SLOTS][CAPTURE_SLOT_SIZE];
+static uint32_t s_head = 0;         // next slot written
+static uint32_t s_tail = 0;         // next slot read
+static uint32_t s_dropped = 0;
+static uint8_t s_snaplen = CAPTURE_SNAPLEN;
+
+void pkt_capture_record(uint8_t point, const uint8_t *frame, uint16_t len)
+{
+    pkt_capture_rec_t rec = {
+        .timestamp_us = esp_timer_get_time(),
+        .orig_len = len,
+        .point = point,
+        .caplen = len < s_snaplen ? len : s_snaplen,
+    };
+
+    portENTER_CRITICAL_SAFE(&s_lock);
+    if (s_head - s_tail >= CAPTURE_SLOTS) {
+        // Keep the older records: a capture with a gap at the end is
+        // easier to read than one with holes throughout
+        s_dropped++;
+    } else {
+        uint8_t *slot = s_ring[s_head & CAPTURE_MASK];
+        memcpy(slot, &rec, sizeof(rec));
+        memcpy(slot + sizeof(rec), frame, rec.caplen);
+        s_head++;
+    }
+    portEXIT_CRITICAL_SAFE(&s_lock);
+}
+
+static esp_err_t ctrl_capture_start(const uint8_t *req, uint16_t req_len,
+                                    uint8_t *resp, uint16_t *resp_len)
+{
+    pkt_capture_start_req_t start;
+    pkt_capture_start_resp_t res;
+
+    if (req_len < sizeof(start) || *resp_len < sizeof(res)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(&start, req, sizeof(start));
+
+    uint8_t points = start.points ? start.points : (1 << PKT_CAPTURE_POINTS) - 1;
+    if (points & ~((1 << PKT_CAPTURE_POINTS) - 1)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Writers check the points first, so none is inside the ring while it
+    // is reset
+    g_pkt_capture_points = 0;
+    portENTER_CRITICAL_SAFE(&s_lock);
+    s_head = 0;
+    s_tail = 0;
+    s_dropped = 0;
+    s_snaplen = start.snaplen == 0 || start.snaplen > CAPTURE_SNAPLEN ?
+                CAPTURE_SNAPLEN : start.snaplen;
+    portEXIT_CRITICAL_SAFE(&s_lock);
+
+    res.uptime_us = esp_timer_get_time();
+    res.snaplen = s_snaplen;
+    res.reserved = 0;
+    g_pkt_capture_points = points;
+
+    ESP_LOGI(TAG, "Capture started: points 0x%x, %u bytes per frame", points, res.snaplen);
+    memcpy(resp, &res, sizeof(res));
+    *resp_len = sizeof(res);
+    return ESP_OK;
+}
+
+static esp_err_t ctrl_capture_stop(const uint8_t *req, uint16_t req_len,
+                                   uint8_t *resp, uint16_t *resp_len)
+{
+    if (g_pkt_capture_points) {
+        g_pkt_capture_points = 0;
+        ESP_LOGI(TAG, "Capture stopped, %lu frames dropped", (unsigned long)s_dropped);
+    }
+    *resp_len = 0;
+    return ESP_OK;
+}
+
+static esp_err_t ctrl_capture_read(const uint8_t *req, uint16_t req_len,
+                                   uint8_t *resp, uint16_t *resp_len)
+{
+    pkt_capture_read_hdr_t hdr = { 0 };
+    uint16_t off = sizeof(hdr);
+
+    if (*resp_len < off) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // One record per lock, so writers are never held off for long
+    while (1) {
+        portENTER_CRITICAL_SAFE(&s_lock);
+        if (s_tail == s_head) {
+            portEXIT_CRITICAL_SAFE(&s_lock);
+            break;
+        }
+        const uint8_t *slot = s_ring[s_tail & CAPTURE_MASK];
+        uint16_t n = sizeof(pkt_capture_rec_t) + ((const pkt_capture_rec_t *)slot)->caplen;
+        if (off + n > *resp_len) {
+            portEXIT_CRITICAL_SAFE(&s_lock);
+            break;
+        }
+        memcpy(resp + off, slot, n);
+        s_tail++;
+        portEXIT_CRITICAL_SAFE(&s_lock);
+
+        off += n;
+        hdr.count++;
+    }
+
+    hdr.dropped = s_dropped;
+    hdr.active = g_pkt_capture_points != 0;
+    memcpy(resp, &hdr, sizeof(hdr));
+    *resp_len = off;
+    return ESP_OK;
+}
+
+esp_err_t pkt_capture_init(void)
+{
+    bridge_ctrl_register(CTRL_CMD_CAPTURE_START, ctrl_capture_start);
+    bridge_ctrl_register(CTRL_CMD_CAPTURE_STOP, ctrl_capture_stop);
+    bridge_ctrl_register(CTRL_CMD_CAPTURE_READ, ctrl_capture_read);
+    return ESP_OK;
+}
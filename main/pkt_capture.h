@@ -0,0 +1,97 @@
+#ifndef PKT_CAPTURE_H
+#define PKT_CAPTURE_H
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+// Capture points; host_setup/esp_ctl.py maps each to a pcapng interface
+// and direction
+#define PKT_CAPTURE_USB_IN      0   // frame read from the host
+#define PKT_CAPTURE_WIFI_OUT    1   // frame handed to the WiFi driver
+#define PKT_CAPTURE_WIFI_IN     2   // frame received from the WiFi driver
+#define PKT_CAPTURE_USB_OUT     3   // frame queued for the host
+#define PKT_CAPTURE_POINTS      4
+
+/*
+ * Wire formats of the capture control messages (little endian).
+ *
+ * CTRL_CMD_CAPTURE_START: pkt_capture_start_req_t, answered with
+ * pkt_capture_start_resp_t. Empties the ring and starts recording;
+ * a running capture is restarted.
+ *
+ * CTRL_CMD_CAPTURE_STOP: no body. Records already taken stay readable.
+ *
+ * CTRL_CMD_CAPTURE_READ: no body. Answered with pkt_capture_read_hdr_t
+ * followed by as many records as fit, oldest first; every record is a
+ * pkt_capture_rec_t followed by caplen bytes of the frame.
+ */
+typedef struct __attribute__((packed)) {
+    uint16_t snaplen;       // bytes kept per frame; 0: the configured maximum
+    uint8_t points;         // bit n: record PKT_CAPTURE point n; 0: all
+    uint8_t reserved;
+} pkt_capture_start_req_t;
+
+typedef struct __attribute__((packed)) {
+    int64_t uptime_us;      // esp_timer time the capture started
+    uint16_t snaplen;       // effective snap length
+    uint16_t reserved;
+} pkt_capture_start_resp_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t dropped;       // frames not recorded since the start: ring full
+    uint16_t count;         // records in this response
+    uint8_t active;         // 1 while recording
+    uint8_t reserved;
+} pkt_capture_read_hdr_t;
+
+typedef struct __attribute__((packed)) {
+    int64_t timestamp_us;   // esp_timer time
+    uint16_t orig_len;      // frame length on the wire
+    uint8_t point;          // PKT_CAPTURE_*
+    uint8_t caplen;         // frame bytes that follow
+} pkt_capture_rec_t;
+
+#if CONFIG_BRIDGE_PKT_CAPTURE
+
+extern volatile uint8_t g_pkt_capture_points;
+
+/**
+ * @brief Register the capture control commands
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t pkt_capture_init(void);
+
+/**
+ * @brief Copy the head of a frame into the capture ring
+ *
+ * Safe from any task; never blocks. When the host has not read the ring
+ * in time the frame is only counted as dropped.
+ *
+ * @param point PKT_CAPTURE_* capture point
+ * @param frame Ethernet frame
+ * @param len Frame length
+ */
+void pkt_capture_record(uint8_t point, const uint8_t *frame, uint16_t len);
+
+// One load and test per frame while no capture is running
+#define PKT_CAPTURE(point, frame, len) do {                        \
+        if (g_pkt_capture_points & (1 << (point))) {                \
+            pkt_capture_record((point), (frame), (len));            \
+        }                                                           \
+    } while (0)
+
+#else
+
+// Compiled out: arguments are not evaluated
+#define PKT_CAPTURE(point, frame, len) do { } while (0)
+
+static inline esp_err_t pkt_capture_init(void)
+{
+    return ESP_OK;
+}
+
+#endif // CONFIG_BRIDGE_PKT_CAPTURE
+
+#endif // PKT_CAPTURE_H
@@ -0,0 +1,345 @@
+/*
+ * Packet Filter
+ * Drops and rate-limits broadcast and multicast chatter in both directions
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "pkt_filter.h"
+
+static const char *TAG = "pkt_filter";
+
+#define ETH_HDR_LEN         14
+#define ETH_TYPE_IPV4       0x0800
+#define ETH_TYPE_ARP        0x0806
+#define ETH_TYPE_VLAN       0x8100
+#define ETH_TYPE_IPV6       0x86DD
+
+#define IP_PROTO_TCP        6
+#define IP_PROTO_UDP        17
+
+#define DHCP_CLIENT_PORT    68
+#define SSDP_PORT           1900
+#define MDNS_PORT           5353
+
+#define BUCKET_MDNS         0
+#define BUCKET_GROUP        1
+
+// Token counts are kept in thousandths so slow rates still refill every
+// few milliseconds
+#define TOKEN               1000
+#define MIN_BURST           4
+
+typedef struct {
+    uint32_t rate;          // frames per second; 0: unlimited
+    uint32_t burst;         // frames
+} bucket_cfg_t;
+
+typedef struct {
+    uint32_t tokens;        // in 1/TOKEN frames
+    int64_t last_us;
+} bucket_state_t;
+
+typedef struct {
+    uint16_t ethertype;
+    uint8_t proto;
+    uint16_t dst_port;
+    const uint8_t *dst_ip;  // IPv4 only
+} frame_info_t;
+
+static const pkt_filter_rule_t s_default_rules[] = {
+#if CONFIG_BRIDGE_FILTER_ARP_PROXY
+    {
+        .dirs = PKT_FILTER_DIR(BRIDGE_DIR_WIFI_TO_USB),
+        .dst = PKT_FILTER_DST_GROUP,
+        .ethertype = ETH_TYPE_ARP,
+        .action = PKT_FILTER_ARP_PROXY,
+    },
+#endif
+    // Never limited: losing these breaks the host's connectivity. DHCP
+    // replies are broadcast because mac_nat asks the server to
+    {
+        .dirs = PKT_FILTER_DIRS_BOTH,
+        .dst = PKT_FILTER_DST_GROUP,
+        .ethertype = ETH_TYPE_ARP,
+        .action = PKT_FILTER_PASS,
+    },
+    {
+        .dirs = PKT_FILTER_DIR(BRIDGE_DIR_WIFI_TO_USB),
+        .dst = PKT_FILTER_DST_GROUP,
+        .ip_proto = IP_PROTO_UDP,
+        .dst_port = DHCP_CLIENT_PORT,
+        .action = PKT_FILTER_PASS,
+    },
+#if CONFIG_BRIDGE_FILTER_SSDP
+    {
+        .dirs = PKT_FILTER_DIRS_BOTH,
+        .dst = PKT_FILTER_DST_GROUP,
+        .ip_proto = IP_PROTO_UDP,
+        .dst_port = SSDP_PORT,
+        .action = PKT_FILTER_DROP,
+    },
+#endif
+    {
+        .dirs = PKT_FILTER_DIRS_BOTH,
+        .dst = PKT_FILTER_DST_GROUP,
+        .ip_proto = IP_PROTO_UDP,
+        .dst_port = MDNS_PORT,
+        .action = PKT_FILTER_LIMIT,
+        .bucket = BUCKET_MDNS,
+    },
+    // Everything else sent to a group: ND, LLMNR, NetBIOS, ...
+    {
+        .dirs = PKT_FILTER_DIRS_BOTH,
+        .dst = PKT_FILTER_DST_GROUP,
+        .action = PKT_FILTER_LIMIT,
+        .bucket = BUCKET_GROUP,
+    },
+};
+
+_Static_assert(sizeof(s_default_rules) / sizeof(s_default_rules[0]) <= PKT_FILTER_MAX_RULES,
+               "Too many default filter rules");
+
+// Rules and bucket settings change from the control task; the lock is only
+// taken for frames that get past the unicast test
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static pkt_filter_rule_t s_rules[PKT_FILTER_MAX_RULES];
+static size_t s_rule_count;
+static bool s_unicast_rules;        // some rule can match a unicast frame
+
+static bucket_cfg_t s_buckets[PKT_FILTER_BUCKETS];
+// Per direction, so each has a single writer
+static bucket_state_t s_bucket_state[BRIDGE_DIR_MAX][PKT_FILTER_BUCKETS];
+
+static inline uint16_t rd16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static void parse(const uint8_t *frame, uint16_t len, frame_info_t *fi)
+{
+    uint16_t off = ETH_HDR_LEN;
+    const uint8_t *l4 = NULL;
+    uint16_t l4_len = 0;
+
+    fi->ethertype = rd16(frame + 12);
+    fi->proto = 0;
+    fi->dst_port = 0;
+    fi->dst_ip = NULL;
+
+    if (fi->ethertype == ETH_TYPE_VLAN && len >= ETH_HDR_LEN + 4) {
+        fi->ethertype = rd16(frame + 16);
+        off += 4;
+    }
+
+    const uint8_t *l3 = frame + off;
+    uint16_t l3_len = len - off;
+
+    if (fi->ethertype == ETH_TYPE_IPV4 && l3_len >= 20) {
+        uint16_t ihl = (l3[0] & 0x0f) * 4;
+        fi->proto = l3[9];
+        fi->dst_ip = l3 + 16;
+        // Later fragments carry no ports
+        if (ihl >= 20 && l3_len >= ihl && (rd16(l3 + 6) & 0x1fff) == 0) {
+            l4 = l3 + ihl;
+            l4_len = l3_len - ihl;
+        }
+    } else if (fi->ethertype == ETH_TYPE_IPV6 && l3_len >= 40) {
+        // Extension headers are not followed; the multicast protocols
+        // filtered here do not use them
+        fi->proto = l3[6];
+        l4 = l3 + 40;
+        l4_len = l3_len - 40;
+    }
+
+    if (l4 != NULL && l4_len >= 4 && (fi->proto == IP_PROTO_UDP || fi->proto == IP_PROTO_TCP)) {
+        fi->dst_port = rd16(l4 + 2);
+    }
+}
+
+static bool rule_matches(const pkt_filter_rule_t *r, bridge_dir_t dir, const uint8_t *frame,
+                         const frame_info_t *fi)
+{
+    static const uint8_t any_ip[4] = { 0 };
+    static const uint8_t bcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+    if (!(r->dirs & PKT_FILTER_DIR(dir))) {
+        return false;
+    }
+    if ((r->dst == PKT_FILTER_DST_GROUP && !(frame[0] & 1)) ||
+        (r->dst == PKT_FILTER_DST_BCAST && memcmp(frame, bcast, 6) != 0)) {
+        return false;
+    }
+    if ((r->ethertype && r->ethertype != fi->ethertype) ||
+        (r->ip_proto && r->ip_proto != fi->proto) ||
+        (r->dst_port && r->dst_port != fi->dst_port)) {
+        return false;
+    }
+    if (memcmp(r->dst_ip, any_ip, 4) != 0 &&
+        (fi->dst_ip == NULL || memcmp(r->dst_ip, fi->dst_ip, 4) != 0)) {
+        return false;
+    }
+    return true;
+}
+
+static bool bucket_take(bridge_dir_t dir, uint8_t bucket)
+{
+    const bucket_cfg_t *cfg = &s_buckets[bucket];
+    bucket_state_t *st = &s_bucket_state[dir][bucket];
+
+    if (cfg->rate == 0) {
+        return true;
+    }
+
+    int64_t now = esp_timer_get_time();
+    uint64_t tokens = st->tokens + (uint64_t)(now - st->last_us) * cfg->rate / 1000;
+    uint64_t cap = (uint64_t)cfg->burst * TOKEN;
+    st->last_us = now;
+    if (tokens > cap) {
+        tokens = cap;
+    }
+    if (tokens < TOKEN) {
+        st->tokens = tokens;
+        return false;
+    }
+    st->tokens = tokens - TOKEN;
+    return true;
+}
+
+pkt_filter_verdict_t pkt_filter_check(bridge_dir_t dir, const uint8_t *frame, uint16_t len)
+{
+    frame_info_t fi;
+
+    if (!(frame[0] & 1) && !s_unicast_rules) {
+        return PKT_FILTER_PASS;
+    }
+
+    parse(frame, len, &fi);
+    pkt_filter_verdict_t verdict = PKT_FILTER_PASS;
+    portENTER_CRITICAL(&s_lock);
+    for (size_t i = 0; i < s_rule_count; i++) {
+        const pkt_filter_rule_t *r = &s_rules[i];
+        if (!rule_matches(r, dir, frame, &fi)) {
+            continue;
+        }
+        if (r->action == PKT_FILTER_LIMIT) {
+            verdict = bucket_take(dir, r->bucket) ? PKT_FILTER_PASS : PKT_FILTER_LIMIT;
+        } else {
+            verdict = r->action;
+        }
+        break;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return verdict;
+}
+
+// Caller holds s_lock or runs before the data path starts
+static void set_bucket(uint8_t bucket, uint32_t rate)
+{
+    s_buckets[bucket].rate = rate;
+    s_buckets[bucket].burst = rate > MIN_BURST ? rate : MIN_BURST;
+}
+
+// Caller holds s_lock or runs before the data path starts
+static void load_rules(const pkt_filter_rule_t *rules, size_t count)
+{
+    memcpy(s_rules, rules, count * sizeof(rules[0]));
+    s_rule_count = count;
+    s_unicast_rules = false;
+    for (size_t i = 0; i < count; i++) {
+        if (s_rules[i].dst == PKT_FILTER_DST_ANY) {
+            s_unicast_rules = true;
+        }
+    }
+}
+
+static bool rule_valid(const pkt_filter_rule_t *r)
+{
+    if ((r->dirs & ~PKT_FILTER_DIRS_BOTH) || r->dst > PKT_FILTER_DST_BCAST ||
+        r->bucket >= PKT_FILTER_BUCKETS) {
+        return false;
+    }
+    switch (r->action) {
+    case PKT_FILTER_PASS:
+    case PKT_FILTER_DROP:
+    case PKT_FILTER_LIMIT:
+        return true;
+#if CONFIG_BRIDGE_FILTER_ARP_PROXY
+    case PKT_FILTER_ARP_PROXY:
+        // The proxy answers requests from the WiFi side only
+        return r->dirs == PKT_FILTER_DIR(BRIDGE_DIR_WIFI_TO_USB) && r->ethertype == ETH_TYPE_ARP;
+#endif
+    default:
+        return false;
+    }
+}
+
+esp_err_t pkt_filter_rules_valid(const pkt_filter_rule_t *rules, size_t count)
+{
+    if (count > PKT_FILTER_MAX_RULES) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!rule_valid(&rules[i])) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t pkt_filter_set_rules(const pkt_filter_rule_t *rules, size_t count)
+{
+    esp_err_t ret = pkt_filter_rules_valid(rules, count);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    load_rules(rules, count);
+    portEXIT_CRITICAL(&s_lock);
+    ESP_LOGI(TAG, "%d rules loaded", (int)count);
+    return ESP_OK;
+}
+
+size_t pkt_filter_get_rules(pkt_filter_rule_t *rules, size_t max)
+{
+    portENTER_CRITICAL(&s_lock);
+    size_t count = s_rule_count < max ? s_rule_count : max;
+    memcpy(rules, s_rules, count * sizeof(rules[0]));
+    portEXIT_CRITICAL(&s_lock);
+    return count;
+}
+
+esp_err_t pkt_filter_set_rate(uint8_t bucket, uint32_t rate)
+{
+    if (bucket >= PKT_FILTER_BUCKETS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    portENTER_CRITICAL(&s_lock);
+    set_bucket(bucket, rate);
+    portEXIT_CRITICAL(&s_lock);
+    return ESP_OK;
+}
+
+uint32_t pkt_filter_get_rate(uint8_t bucket)
+{
+    return bucket < PKT_FILTER_BUCKETS ? s_buckets[bucket].rate : 0;
+}
+
+esp_err_t pkt_filter_init(void)
+{
+    load_rules(s_default_rules, sizeof(s_default_rules) / sizeof(s_default_rules[0]));
+
+    // One second of traffic at the limit may arrive at once
+    set_bucket(BUCKET_MDNS, CONFIG_BRIDGE_FILTER_MDNS_PPS);
+    set_bucket(BUCKET_GROUP, CONFIG_BRIDGE_FILTER_GROUP_PPS);
+    memset(s_bucket_state, 0, sizeof(s_bucket_state));
+
+    ESP_LOGI(TAG, "%d rules; mDNS %lu/s, other multicast %lu/s per direction (0: unlimited)",
+             (int)s_rule_count, (unsigned long)s_buckets[BUCKET_MDNS].rate,
+             (unsigned long)s_buckets[BUCKET_GROUP].rate);
+    return ESP_OK;
+}
@@ -0,0 +1,162 @@
+#ifndef PKT_FILTER_H
+#define PKT_FILTER_H
+
+#include "esp_err.h"
+#include <stdint.h>
+#include <stddef.h>
+
+#include "bridge_stats.h"
+#include "sdkconfig.h"
+
+#define PKT_FILTER_MAX_RULES    16
+#define PKT_FILTER_BUCKETS      4
+
+// Verdicts, also the rule actions
+typedef enum {
+    PKT_FILTER_PASS = 0,
+    PKT_FILTER_DROP,            // matched a drop rule
+    PKT_FILTER_LIMIT,           // rule action: rate limit; verdict: over the limit
+    PKT_FILTER_ARP_PROXY,       // ARP request the bridge may answer itself
+} pkt_filter_verdict_t;
+
+// Destination MAC classes
+#define PKT_FILTER_DST_ANY      0
+#define PKT_FILTER_DST_GROUP    1   // multicast or broadcast
+#define PKT_FILTER_DST_BCAST    2   // ff:ff:ff:ff:ff:ff only
+
+#define PKT_FILTER_DIR(dir)     (1 << (dir))    // bridge_dir_t bit in dirs
+#define PKT_FILTER_DIRS_BOTH    (PKT_FILTER_DIR(BRIDGE_DIR_USB_TO_WIFI) | \
+                                 PKT_FILTER_DIR(BRIDGE_DIR_WIFI_TO_USB))
+
+/**
+ * @brief One filter rule; zero fields match anything
+ *
+ * Rules are tried in order and the first match decides. Frames matching
+ * no rule pass.
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t dirs;           // PKT_FILTER_DIR() bits
+    uint8_t dst;            // PKT_FILTER_DST_*
+    uint16_t ethertype;     // after one VLAN tag
+    uint8_t ip_proto;       // IPv4 protocol or IPv6 next header
+    uint8_t action;         // pkt_filter_verdict_t
+    uint16_t dst_port;      // UDP or TCP destination port
+    uint8_t dst_ip[4];      // IPv4 destination
+    uint8_t bucket;         // PKT_FILTER_LIMIT: token bucket index
+    uint8_t reserved[3];
+} pkt_filter_rule_t;
+
+#if CONFIG_BRIDGE_FILTER
+
+/**
+ * @brief Load the rules and rate limits chosen in the configuration
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t pkt_filter_init(void);
+
+/**
+ * @brief Run a frame through the rule table
+ *
+ * Unicast frames return after one test unless a rule can match them.
+ * Each direction has its own token buckets and must be checked from one
+ * task only (USB to WiFi: the USB RX task; WiFi to USB: the WiFi driver's
+ * RX callback).
+ *
+ * @param dir Direction the frame travels
+ * @param frame Ethernet frame
+ * @param len Frame length
+ * @return Verdict; PKT_FILTER_LIMIT means over the rate limit
+ */
+pkt_filter_verdict_t pkt_filter_check(bridge_dir_t dir, const uint8_t *frame, uint16_t len);
+
+/**
+ * @brief Check rules for pkt_filter_set_rules() without loading them
+ *
+ * @param rules Rules
+ * @param count Number of rules
+ * @return esp_err_t ESP_OK if pkt_filter_set_rules() would accept them,
+ *         ESP_ERR_INVALID_SIZE if there are too many, ESP_ERR_INVALID_ARG
+ *         if a rule has an unknown action, direction or bucket
+ */
+esp_err_t pkt_filter_rules_valid(const pkt_filter_rule_t *rules, size_t count);
+
+/**
+ * @brief Replace the rule table at run time
+ *
+ * @param rules New rules, tried in order
+ * @param count Number of rules, at most PKT_FILTER_MAX_RULES
+ * @return esp_err_t ESP_OK on success, or the error of pkt_filter_rules_valid()
+ */
+esp_err_t pkt_filter_set_rules(const pkt_filter_rule_t *rules, size_t count);
+
+/**
+ * @brief Copy out the rule table
+ *
+ * @param rules Receives the rules
+ * @param max Room in rules
+ * @return Number of rules copied
+ */
+size_t pkt_filter_get_rules(pkt_filter_rule_t *rules, size_t max);
+
+/**
+ * @brief Set the rate of a token bucket; the burst follows it
+ *
+ * Bucket 0 holds the mDNS limit and bucket 1 the limit of other group
+ * traffic in the default rules; the others are free for custom rules.
+ *
+ * @param bucket Bucket index
+ * @param rate Frames per second and direction; 0: unlimited
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t pkt_filter_set_rate(uint8_t bucket, uint32_t rate);
+
+/**
+ * @brief Rate of a token bucket
+ *
+ * @param bucket Bucket index
+ * @return Frames per second; 0: unlimited
+ */
+uint32_t pkt_filter_get_rate(uint8_t bucket);
+
+#else
+
+static inline esp_err_t pkt_filter_init(void)
+{
+    return ESP_OK;
+}
+
+static inline pkt_filter_verdict_t pkt_filter_check(bridge_dir_t dir, const uint8_t *frame,
+                                                    uint16_t len)
+{
+    return PKT_FILTER_PASS;
+}
+
+static inline esp_err_t pkt_filter_rules_valid(const pkt_filter_rule_t *rules, size_t count)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+static inline esp_err_t pkt_filter_set_rules(const pkt_filter_rule_t *rules, size_t count)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+static inline size_t pkt_filter_get_rules(pkt_filter_rule_t *rules, size_t max)
+{
+    return 0;
+}
+
+static inline esp_err_t pkt_filter_set_rate(uint8_t bucket, uint32_t rate)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+static inline uint32_t pkt_filter_get_rate(uint8_t bucket)
+{
+    return 0;
+}
+
+#endif // CONFIG_BRIDGE_FILTER
+
+#endif // PKT_FILTER_H
@@ -0,0 +1,124 @@
+/*
+ * Packet Buffer Pool
+ * Fixed set of preallocated frame buffers shared by the USB and WiFi paths
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_private/wifi.h"
+
+#include "pkt_pool.h"
+
+static const char *TAG = "pkt_pool";
+
+static uint8_t *s_storage = NULL;
+static uint8_t s_free_list[PKT_POOL_NUM_BUFS];
+static uint32_t s_in_use[(PKT_POOL_NUM_BUFS + 31) / 32];   // catches double frees
+static uint16_t s_free_count = 0;
+static uint16_t s_high_water = 0;
+static uint32_t s_alloc_fail = 0;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+_Static_assert(PKT_BUF_SIZE % PKT_BUF_ALIGN == 0, "pool buffers must stay aligned");
+_Static_assert(PKT_POOL_NUM_BUFS <= UINT8_MAX, "free list stores 8-bit indices");
+
+esp_err_t pkt_pool_init(void)
+{
+    if (s_storage != NULL) {
+        return ESP_OK;
+    }
+
+    s_storage = heap_caps_aligned_alloc(PKT_BUF_ALIGN, PKT_POOL_NUM_BUFS * PKT_BUF_SIZE,
+                                        MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+    if (s_storage == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate %d packet buffers", PKT_POOL_NUM_BUFS);
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (int i = 0; i < PKT_POOL_NUM_BUFS; i++) {
+        s_free_list[i] = i;
+    }
+    memset(s_in_use, 0, sizeof(s_in_use));
+    s_free_count = PKT_POOL_NUM_BUFS;
+
+    ESP_LOGI(TAG, "Packet pool: %d x %d bytes", PKT_POOL_NUM_BUFS, PKT_BUF_SIZE);
+    return ESP_OK;
+}
+
+uint8_t *pkt_pool_alloc(void)
+{
+    int index = -1;
+
+    portENTER_CRITICAL_SAFE(&s_lock);
+    if (s_free_count > 0) {
+        index = s_free_list[--s_free_count];
+        s_in_use[index / 32] |= 1u << (index % 32);
+        uint16_t in_use = PKT_POOL_NUM_BUFS - s_free_count;
+        if (in_use > s_high_water) {
+            s_high_water = in_use;
+        }
+    } else {
+        s_alloc_fail++;
+    }
+    portEXIT_CRITICAL_SAFE(&s_lock);
+
+    if (index < 0) {
+        return NULL;
+    }
+    return s_storage + index * PKT_BUF_SIZE + PKT_BUF_HEADROOM;
+}
+
+bool pkt_pool_owns(const uint8_t *data)
+{
+    if (s_storage == NULL || data < s_storage + PKT_BUF_HEADROOM) {
+        return false;
+    }
+    size_t offset = data - s_storage - PKT_BUF_HEADROOM;
+    return offset % PKT_BUF_SIZE == 0 && offset / PKT_BUF_SIZE < PKT_POOL_NUM_BUFS;
+}
+
+void pkt_pool_free(uint8_t *data)
+{
+    if (!pkt_pool_owns(data)) {
+        ESP_LOGE(TAG, "Freeing foreign buffer %p", data);
+        return;
+    }
+
+    uint8_t index = (data - s_storage) / PKT_BUF_SIZE;
+    uint32_t bit = 1u << (index % 32);
+    bool in_use;
+
+    portENTER_CRITICAL_SAFE(&s_lock);
+    in_use = (s_in_use[index / 32] & bit) != 0 && s_free_count < PKT_POOL_NUM_BUFS;
+    if (in_use) {
+        s_in_use[index / 32] &= ~bit;
+        s_free_list[s_free_count++] = index;
+    }
+    portEXIT_CRITICAL_SAFE(&s_lock);
+
+    if (!in_use) {
+        ESP_LOGE(TAG, "Double free of buffer %u", index);
+    }
+}
+
+void pkt_desc_free(const pkt_desc_t *desc)
+{
+    if (desc->flags & PKT_F_WIFI_RX) {
+        esp_wifi_internal_free_rx_buffer(desc->eb);
+    } else {
+        pkt_pool_free(desc->data);
+    }
+}
+
+void pkt_pool_get_stats(pkt_pool_stats_t *stats)
+{
+    portENTER_CRITICAL_SAFE(&s_lock);
+    stats->total = PKT_POOL_NUM_BUFS;
+    stats->in_use = PKT_POOL_NUM_BUFS - s_free_count;
+    stats->high_water = s_high_water;
+    stats->alloc_fail = s_alloc_fail;
+    portEXIT_CRITICAL_SAFE(&s_lock);
+}
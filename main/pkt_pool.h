@@ -0,0 +1,93 @@
+#ifndef PKT_POOL_H
+#define PKT_POOL_H
+
+#include "esp_err.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Each pool buffer holds one Ethernet frame plus a little headroom so a
+// transport header can be prepended in place
+#define PKT_BUF_SIZE        1536
+#define PKT_BUF_HEADROOM    16
+#define PKT_BUF_MAX_FRAME   (PKT_BUF_SIZE - PKT_BUF_HEADROOM)
+#define PKT_BUF_ALIGN       32
+#define PKT_POOL_NUM_BUFS   24
+
+// Descriptor flags
+#define PKT_F_WIFI_RX       (1 << 0)    // data/eb belong to the WiFi driver
+#define PKT_F_NO_NAT        (1 << 1)    // built by the bridge with the STA MAC
+
+/**
+ * @brief Packet descriptor passed through the bridge queues
+ *
+ * Only the descriptor is copied; the frame it points at has a single owner
+ * at any time, and whoever holds the descriptor releases it with
+ * pkt_desc_free().
+ */
+typedef struct {
+    uint8_t *data;      // start of the Ethernet frame
+    uint16_t len;       // frame length in bytes
+    uint16_t flags;     // PKT_F_*
+    void *eb;           // WiFi driver RX handle when PKT_F_WIFI_RX is set
+} pkt_desc_t;
+
+typedef struct {
+    uint16_t total;         // buffers in the pool
+    uint16_t in_use;        // buffers currently allocated
+    uint16_t high_water;    // most buffers ever allocated at once
+    uint32_t alloc_fail;    // allocations refused because the pool was empty
+} pkt_pool_stats_t;
+
+/**
+ * @brief Allocate the DMA-capable buffer pool
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t pkt_pool_init(void);
+
+/**
+ * @brief Take a buffer from the pool
+ *
+ * Never blocks and never falls back to the heap.
+ *
+ * @return Pointer to PKT_BUF_MAX_FRAME bytes of frame space (headroom is
+ *         reserved in front of it), or NULL if the pool is exhausted
+ */
+uint8_t *pkt_pool_alloc(void);
+
+/**
+ * @brief Return a buffer to the pool
+ *
+ * A pointer the pool did not hand out, or a buffer that is already free,
+ * is logged and ignored.
+ *
+ * @param data Pointer returned by pkt_pool_alloc()
+ */
+void pkt_pool_free(uint8_t *data);
+
+/**
+ * @brief Check whether a pointer belongs to the pool
+ *
+ * @param data Pointer to test
+ * @return true if data is the frame start of a pool buffer, as returned
+ *         by pkt_pool_alloc()
+ */
+bool pkt_pool_owns(const uint8_t *data);
+
+/**
+ * @brief Release the frame a descriptor points at
+ *
+ * Returns pool buffers to the pool and driver buffers to the WiFi driver.
+ *
+ * @param desc Descriptor to release
+ */
+void pkt_desc_free(const pkt_desc_t *desc);
+
+/**
+ * @brief Get pool occupancy counters
+ *
+ * @param stats Filled with the current counters
+ */
+void pkt_pool_get_stats(pkt_pool_stats_t *stats);
+
+#endif // PKT_POOL_H
@@ -0,0 +1,133 @@
+/*
+ * Packet Trace Ring
+ * Fixed-size binary records for the per-packet hot path, dumped on demand
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/gpio.h"
+
+#include "pkt_trace.h"
+
+static const char *TAG = "pkt_trace";
+
+#define TRACE_ENTRIES   CONFIG_BRIDGE_PKT_TRACE_ENTRIES
+#define TRACE_MASK      (TRACE_ENTRIES - 1)
+
+_Static_assert((TRACE_ENTRIES & TRACE_MASK) == 0, "Trace ring size must be a power of two");
+_Static_assert(sizeof(pkt_trace_rec_t) == 8, "Trace records are 8 bytes");
+
+// Writers claim a slot with one atomic increment and fill it in without
+// any further synchronisation. A reader racing a writer may see a record
+// half updated; that is accepted for a debugging aid.
+static pkt_trace_rec_t s_ring[TRACE_ENTRIES];
+static uint32_t s_head = 0;
+
+static TaskHandle_t s_dump_task = NULL;
+
+static const char *const s_point_names[] = {
+    [PKT_TRACE_USB_RX]        = "usb_rx",
+    [PKT_TRACE_WIFI_TX_QUEUE] = "wifi_txq",
+    [PKT_TRACE_WIFI_TX]       = "wifi_tx",
+    [PKT_TRACE_WIFI_TX_DROP]  = "wifi_tx_drop",
+    [PKT_TRACE_WIFI_RX]       = "wifi_rx",
+    [PKT_TRACE_WIFI_RX_DROP]  = "wifi_rx_drop",
+    [PKT_TRACE_USB_TX]        = "usb_tx",
+    [PKT_TRACE_USB_FLUSH]     = "usb_flush",
+};
+
+void pkt_trace_record(uint8_t point, uint16_t len, uint32_t depth)
+{
+    uint32_t idx = __atomic_fetch_add(&s_head, 1, __ATOMIC_RELAXED);
+    pkt_trace_rec_t *rec = &s_ring[idx & TRACE_MASK];
+
+    rec->timestamp_us = (uint32_t)esp_timer_get_time();
+    rec->len = len;
+    rec->point = point;
+    rec->depth = depth > UINT8_MAX ? UINT8_MAX : depth;
+}
+
+size_t pkt_trace_snapshot(pkt_trace_rec_t *out, size_t max)
+{
+    uint32_t head = __atomic_load_n(&s_head, __ATOMIC_ACQUIRE);
+    size_t count = head < TRACE_ENTRIES ? head : TRACE_ENTRIES;
+    if (count > max) {
+        count = max;
+    }
+
+    uint32_t start = head - count;
+    for (size_t i = 0; i < count; i++) {
+        out[i] = s_ring[(start + i) & TRACE_MASK];
+    }
+    return count;
+}
+
+void pkt_trace_dump(void)
+{
+    uint32_t head = __atomic_load_n(&s_head, __ATOMIC_ACQUIRE);
+    size_t count = head < TRACE_ENTRIES ? head : TRACE_ENTRIES;
+
+    ESP_LOGI(TAG, "Last %u of %lu records", (unsigned)count, (unsigned long)head);
+
+    // Print straight from the ring to avoid a large copy on the stack
+    uint32_t start = head - count;
+    for (size_t i = 0; i < count; i++) {
+        pkt_trace_rec_t rec = s_ring[(start + i) & TRACE_MASK];
+        const char *name = rec.point < sizeof(s_point_names) / sizeof(s_point_names[0]) ?
+                           s_point_names[rec.point] : "?";
+        printf("%10lu %-12s len=%-5u depth=%u\n",
+               (unsigned long)rec.timestamp_us, name, rec.len, rec.depth);
+    }
+}
+
+#if CONFIG_BRIDGE_PKT_TRACE_DUMP_GPIO >= 0
+static void IRAM_ATTR dump_button_isr(void *arg)
+{
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(s_dump_task, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+static void dump_task(void *arg)
+{
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        pkt_trace_dump();
+        // Crude debounce: ignore presses that arrived during the dump
+        vTaskDelay(pdMS_TO_TICKS(200));
+        ulTaskNotifyTake(pdTRUE, 0);
+    }
+}
+#endif
+
+esp_err_t pkt_trace_init(void)
+{
+#if CONFIG_BRIDGE_PKT_TRACE_DUMP_GPIO >= 0
+    if (xTaskCreate(dump_task, "trace_dump", 3072, NULL, 1, &s_dump_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create dump task");
+        return ESP_FAIL;
+    }
+
+    const gpio_config_t io_conf = {
+        .pin_bit_mask = 1ULL << CONFIG_BRIDGE_PKT_TRACE_DUMP_GPIO,
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_ENABLE,
+        .intr_type = GPIO_INTR_NEGEDGE,
+    };
+    ESP_ERROR_CHECK(gpio_config(&io_conf));
+
+    esp_err_t ret = gpio_install_isr_service(0);
+    if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) {
+        return ret;
+    }
+    ESP_ERROR_CHECK(gpio_isr_handler_add(CONFIG_BRIDGE_PKT_TRACE_DUMP_GPIO, dump_button_isr, NULL));
+    ESP_LOGI(TAG, "Packet trace enabled, press GPIO%d to dump", CONFIG_BRIDGE_PKT_TRACE_DUMP_GPIO);
+#else
+    ESP_LOGI(TAG, "Packet trace enabled");
+#endif
+    return ESP_OK;
+}
@@ -0,0 +1,86 @@
+#ifndef PKT_TRACE_H
+#define PKT_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+// Trace points
+#define PKT_TRACE_USB_RX        0   // frame read from USB
+#define PKT_TRACE_WIFI_TX_QUEUE 1   // frame queued for WiFi TX
+#define PKT_TRACE_WIFI_TX       2   // frame handed to the WiFi driver
+#define PKT_TRACE_WIFI_TX_DROP  3   // frame dropped before WiFi TX
+#define PKT_TRACE_WIFI_RX       4   // frame received from the WiFi driver
+#define PKT_TRACE_WIFI_RX_DROP  5   // frame dropped before USB TX
+#define PKT_TRACE_USB_TX        6   // frame written to USB (or batched)
+#define PKT_TRACE_USB_FLUSH     7   // USB TX batch flushed; len = batch bytes
+
+/**
+ * @brief One fixed-size trace record
+ */
+typedef struct {
+    uint32_t timestamp_us;  // esp_timer time, low 32 bits
+    uint16_t len;           // frame length
+    uint8_t point;          // PKT_TRACE_*
+    uint8_t depth;          // queue depth at the trace point
+} pkt_trace_rec_t;
+
+#if CONFIG_BRIDGE_PKT_TRACE
+
+/**
+ * @brief Set up the on-demand dump trigger
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t pkt_trace_init(void);
+
+/**
+ * @brief Append a record to the trace ring
+ *
+ * Safe from any task; never blocks. Old records are overwritten.
+ *
+ * @param point PKT_TRACE_* trace point
+ * @param len Frame length
+ * @param depth Queue depth (saturated to 255)
+ */
+void pkt_trace_record(uint8_t point, uint16_t len, uint32_t depth);
+
+/**
+ * @brief Copy the most recent records, oldest first
+ *
+ * @param out Destination array
+ * @param max Capacity of out
+ * @return Number of records copied
+ */
+size_t pkt_trace_snapshot(pkt_trace_rec_t *out, size_t max);
+
+/**
+ * @brief Print the trace ring to the log
+ */
+void pkt_trace_dump(void);
+
+#define PKT_TRACE(point, len, depth) pkt_trace_record((point), (len), (depth))
+
+#else
+
+// Compiled out: arguments are not evaluated
+#define PKT_TRACE(point, len, depth) do { } while (0)
+
+static inline esp_err_t pkt_trace_init(void)
+{
+    return ESP_OK;
+}
+
+static inline size_t pkt_trace_snapshot(pkt_trace_rec_t *out, size_t max)
+{
+    return 0;
+}
+
+static inline void pkt_trace_dump(void)
+{
+}
+
+#endif // CONFIG_BRIDGE_PKT_TRACE
+
+#endif // PKT_TRACE_H
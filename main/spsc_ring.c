@@ -0,0 +1,81 @@
+/*
+ * SPSC Descriptor Ring
+ * Lock-free single-producer/single-consumer queue with batched wakeups
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "spsc_ring.h"
+
+esp_err_t spsc_ring_init(spsc_ring_t *ring, pkt_desc_t *slots, uint32_t size)
+{
+    if (slots == NULL || size == 0 || (size & (size - 1)) != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    ring->slots = slots;
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->waiting = 0;
+    ring->consumer = NULL;
+    return ESP_OK;
+}
+
+bool spsc_ring_push(spsc_ring_t *ring, const pkt_desc_t *desc)
+{
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (tail - head > ring->mask) {
+        return false;
+    }
+
+    ring->slots[tail & ring->mask] = *desc;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    // Pairs with the fence in spsc_ring_wait(): either the consumer sees
+    // the new tail before sleeping, or we see it waiting and wake it
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED)) {
+        xTaskNotifyGive(ring->consumer);
+    }
+    return true;
+}
+
+size_t spsc_ring_pop(spsc_ring_t *ring, pkt_desc_t *out, size_t max)
+{
+    uint32_t head = ring->head;
+    uint32_t avail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - head;
+    size_t n = avail < max ? avail : max;
+
+    for (size_t i = 0; i < n; i++) {
+        out[i] = ring->slots[(head + i) & ring->mask];
+    }
+    __atomic_store_n(&ring->head, head + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+bool spsc_ring_wait(spsc_ring_t *ring, TickType_t timeout)
+{
+    if (ring->consumer == NULL) {
+        ring->consumer = xTaskGetCurrentTaskHandle();
+    }
+
+    while (spsc_ring_count(ring) == 0) {
+        __atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (spsc_ring_count(ring) != 0) {
+            __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+            break;
+        }
+
+        uint32_t woken = ulTaskNotifyTake(pdTRUE, timeout);
+        __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+        if (woken == 0) {
+            return spsc_ring_count(ring) != 0;
+        }
+    }
+    return true;
+}
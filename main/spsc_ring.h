@@ -0,0 +1,85 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include "esp_err.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "pkt_pool.h"
+
+/**
+ * @brief Lock-free ring of packet descriptors between exactly one producer
+ * task and one consumer task
+ *
+ * The producer only writes tail and the consumer only writes head, so
+ * neither side takes a lock or enters a critical section. The consumer is
+ * woken with a task notification, and only when it is actually waiting:
+ * a burst costs one wakeup, not one per frame.
+ */
+typedef struct {
+    pkt_desc_t *slots;
+    uint32_t mask;              // size - 1; size is a power of two
+    uint32_t head;              // next slot to read; consumer owned
+    uint32_t tail;              // next slot to write; producer owned
+    uint32_t waiting;           // consumer is blocked in spsc_ring_wait()
+    TaskHandle_t consumer;
+} spsc_ring_t;
+
+/**
+ * @brief Set up a ring over caller-provided storage
+ *
+ * @param ring Ring to initialise
+ * @param slots Descriptor storage
+ * @param size Number of slots; must be a power of two
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t spsc_ring_init(spsc_ring_t *ring, pkt_desc_t *slots, uint32_t size);
+
+/**
+ * @brief Append a descriptor (producer only); never blocks
+ *
+ * @param ring Ring
+ * @param desc Descriptor; copied
+ * @return true if queued, false if the ring is full
+ */
+bool spsc_ring_push(spsc_ring_t *ring, const pkt_desc_t *desc);
+
+/**
+ * @brief Take up to max descriptors, oldest first (consumer only)
+ *
+ * @param ring Ring
+ * @param out Destination array
+ * @param max Capacity of out
+ * @return Number of descriptors taken
+ */
+size_t spsc_ring_pop(spsc_ring_t *ring, pkt_desc_t *out, size_t max);
+
+/**
+ * @brief Wait until the ring is not empty (consumer only)
+ *
+ * The first call records the calling task as the consumer.
+ *
+ * @param ring Ring
+ * @param timeout Ticks to wait
+ * @return true if descriptors are available
+ */
+bool spsc_ring_wait(spsc_ring_t *ring, TickType_t timeout);
+
+/**
+ * @brief Descriptors currently queued
+ *
+ * Exact when called by either end; a snapshot otherwise.
+ *
+ * @param ring Ring
+ * @return Queue depth
+ */
+static inline uint32_t spsc_ring_count(const spsc_ring_t *ring)
+{
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+#endif // SPSC_RING_H
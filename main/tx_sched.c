@@ -0,0 +1,505 @@
+/*
+ * TX Scheduler
+ * Multi-class queue between USB RX and WiFi TX: strict priority for control
+ * and voice traffic, deficit round robin for the rest
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "tx_sched.h"
+#include "bridge_stats.h"
+#include "ack_filter.h"
+
+#define ETH_HDR_LEN         14
+#define ETH_TYPE_IPV4       0x0800
+#define ETH_TYPE_ARP        0x0806
+#define ETH_TYPE_VLAN       0x8100
+#define ETH_TYPE_IPV6       0x86DD
+#define ETH_TYPE_EAPOL      0x888E
+
+#define IP_PROTO_TCP        6
+#define IP_PROTO_UDP        17
+#define IP_PROTO_ICMPV6     58
+
+#define TCP_FIN             0x01
+#define TCP_SYN             0x02
+#define TCP_RST             0x04
+#define TCP_ACK             0x10
+
+// Classes below this one share the link by deficit round robin
+#define TX_CLASS_DRR_FIRST  TX_CLASS_VI
+
+// DRR quantum per visit, in bytes; at least one full frame so every visit
+// sends something. VI:BE:BK get 4:2:1 of the link when all are busy
+#define DRR_QUANTUM_UNIT    1514
+
+typedef struct {
+    pkt_desc_t *slots;
+    ack_filter_key_t *acks;     // per slot, CTRL only; NULL elsewhere
+    uint8_t size;
+    uint8_t limit;              // frames accepted, at most size; tx_sched_set_depth()
+    uint8_t head;
+    uint8_t count;
+    uint32_t quantum;
+    uint32_t deficit;
+} tx_class_queue_t;
+
+static pkt_desc_t s_slots_ctrl[8];
+#if CONFIG_BRIDGE_ACK_FILTER
+static ack_filter_key_t s_acks_ctrl[8];
+#define CTRL_ACKS s_acks_ctrl
+#else
+#define CTRL_ACKS NULL
+#endif
+static pkt_desc_t s_slots_vo[8];
+static pkt_desc_t s_slots_vi[12];
+static pkt_desc_t s_slots_be[TX_SCHED_LIMIT];
+static pkt_desc_t s_slots_bk[TX_SCHED_LIMIT];
+
+#define CLASS_QUEUE(slots, acks, q) \
+    { (slots), (acks), sizeof(slots) / sizeof((slots)[0]), \
+      sizeof(slots) / sizeof((slots)[0]), 0, 0, (q), 0 }
+
+static tx_class_queue_t s_queues[TX_CLASS_MAX] = {
+    [TX_CLASS_CTRL] = CLASS_QUEUE(s_slots_ctrl, CTRL_ACKS, 0),
+    [TX_CLASS_VO]   = CLASS_QUEUE(s_slots_vo, NULL, 0),
+    [TX_CLASS_VI]   = CLASS_QUEUE(s_slots_vi, NULL, 4 * DRR_QUANTUM_UNIT),
+    [TX_CLASS_BE]   = CLASS_QUEUE(s_slots_be, NULL, 2 * DRR_QUANTUM_UNIT),
+    [TX_CLASS_BK]   = CLASS_QUEUE(s_slots_bk, NULL, 1 * DRR_QUANTUM_UNIT),
+};
+
+static const bridge_queue_t s_stats_queue[TX_CLASS_MAX] = {
+    [TX_CLASS_CTRL] = BRIDGE_QUEUE_TX_CTRL,
+    [TX_CLASS_VO]   = BRIDGE_QUEUE_TX_VO,
+    [TX_CLASS_VI]   = BRIDGE_QUEUE_TX_VI,
+    [TX_CLASS_BE]   = BRIDGE_QUEUE_TX_BE,
+    [TX_CLASS_BK]   = BRIDGE_QUEUE_TX_BK,
+};
+
+static uint32_t s_depth = 0;
+static uint8_t s_drr_cur = TX_CLASS_DRR_FIRST;
+static bool s_drr_granted = false;
+static TaskHandle_t s_consumer = NULL;
+static bool s_consumer_waiting = false;    // only then does enqueue notify
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+#if CONFIG_BRIDGE_TX_QOS
+static volatile bool s_qos = true;
+#endif
+
+esp_err_t tx_sched_init(void)
+{
+    for (int c = 0; c < TX_CLASS_MAX; c++) {
+        bridge_stats_queue_init(s_stats_queue[c], s_queues[c].size);
+    }
+    return ESP_OK;
+}
+
+#if CONFIG_BRIDGE_TX_QOS
+
+static inline uint16_t rd16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+/*
+ * DSCP to class, after the RFC 8325 DSCP-to-UP mapping except that AF2x
+ * ("low-latency data", e.g. interactive SSH) is lifted from BE to VI so it
+ * is not queued behind unmarked bulk transfers.
+ */
+static tx_class_t dscp_class(uint8_t dscp)
+{
+    switch (dscp) {
+    case 46:                            // EF
+    case 44:                            // VOICE-ADMIT
+    case 48:                            // CS6
+    case 56:                            // CS7
+        return TX_CLASS_VO;
+    case 40: case 32: case 24:          // CS5, CS4, CS3
+    case 34: case 36: case 38:          // AF4x
+    case 26: case 28: case 30:          // AF3x
+    case 18: case 20: case 22:          // AF2x
+        return TX_CLASS_VI;
+    case 8:                             // CS1
+    case 1:                             // LE
+    case 10: case 12: case 14:          // AF1x
+        return TX_CLASS_BK;
+    default:
+        return TX_CLASS_BE;
+    }
+}
+
+// 802.1D user priority to class, the same table WMM uses for its ACs
+static tx_class_t pcp_class(uint8_t pcp)
+{
+    static const uint8_t map[8] = {
+        TX_CLASS_BE, TX_CLASS_BK, TX_CLASS_BK, TX_CLASS_BE,
+        TX_CLASS_VI, TX_CLASS_VI, TX_CLASS_VO, TX_CLASS_VO,
+    };
+    return map[pcp & 7];
+}
+
+static bool udp_is_ctrl(uint16_t sport, uint16_t dport)
+{
+    static const uint16_t ports[] = { 53, 67, 68, 546, 547 };   // DNS, DHCP, DHCPv6
+
+    for (size_t i = 0; i < sizeof(ports) / sizeof(ports[0]); i++) {
+        if (sport == ports[i] || dport == ports[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+tx_class_t tx_sched_classify(const uint8_t *frame, uint16_t len)
+{
+    uint16_t ethertype = rd16(frame + 12);
+    uint16_t off = ETH_HDR_LEN;
+    int pcp = -1;
+
+    if (!s_qos) {
+        return TX_CLASS_BE;
+    }
+
+    if (ethertype == ETH_TYPE_VLAN && len >= ETH_HDR_LEN + 4) {
+        pcp = frame[14] >> 5;
+        ethertype = rd16(frame + 16);
+        off += 4;
+    }
+
+    const uint8_t *l3 = frame + off;
+    uint16_t l3_len = len - off;
+    const uint8_t *l4 = NULL;
+    uint16_t l4_len = 0;
+    uint8_t dscp = 0;
+    uint8_t proto = 0;
+
+    switch (ethertype) {
+    case ETH_TYPE_ARP:
+    case ETH_TYPE_EAPOL:
+        return TX_CLASS_CTRL;
+
+    case ETH_TYPE_IPV4: {
+        if (l3_len < 20) {
+            return TX_CLASS_BE;
+        }
+        uint16_t ihl = (l3[0] & 0x0f) * 4;
+        uint16_t ip_len = rd16(l3 + 2);
+        if (ihl < 20 || ip_len < ihl || ip_len > l3_len) {
+            return TX_CLASS_BE;
+        }
+        dscp = l3[1] >> 2;
+        proto = l3[9];
+        // Only the first fragment carries the transport header
+        if ((rd16(l3 + 6) & 0x1fff) == 0) {
+            l4 = l3 + ihl;
+            l4_len = ip_len - ihl;
+        }
+        break;
+    }
+
+    case ETH_TYPE_IPV6: {
+        if (l3_len < 40) {
+            return TX_CLASS_BE;
+        }
+        uint16_t payload_len = rd16(l3 + 4);
+        if (payload_len > l3_len - 40) {
+            return TX_CLASS_BE;
+        }
+        dscp = ((l3[0] & 0x0f) << 2) | (l3[1] >> 6);
+        proto = l3[6];      // extension headers are not followed
+        l4 = l3 + 40;
+        l4_len = payload_len;
+        break;
+    }
+
+    default:
+        return pcp >= 0 ? pcp_class(pcp) : TX_CLASS_BE;
+    }
+
+    if (l4 != NULL) {
+        if (proto == IP_PROTO_TCP && l4_len >= 20) {
+            // A pure ACK carries no data and no SYN/FIN/RST. Delaying it
+            // behind full-size frames throttles the opposite direction
+            uint16_t doff = (l4[12] >> 4) * 4;
+            uint8_t flags = l4[13];
+            if (doff == l4_len && (flags & TCP_ACK) &&
+                !(flags & (TCP_SYN | TCP_FIN | TCP_RST))) {
+                return TX_CLASS_CTRL;
+            }
+        } else if (proto == IP_PROTO_UDP && l4_len >= 8) {
+            if (udp_is_ctrl(rd16(l4), rd16(l4 + 2))) {
+                return TX_CLASS_CTRL;
+            }
+        } else if (proto == IP_PROTO_ICMPV6 && l4_len >= 1) {
+            // Router/neighbour solicitation and advertisement, redirect
+            if (l4[0] >= 133 && l4[0] <= 137) {
+                return TX_CLASS_CTRL;
+            }
+        }
+    }
+
+    if (dscp != 0) {
+        return dscp_class(dscp);
+    }
+    return pcp >= 0 ? pcp_class(pcp) : TX_CLASS_BE;
+}
+
+esp_err_t tx_sched_set_qos(bool enable)
+{
+    s_qos = enable;
+    return ESP_OK;
+}
+
+bool tx_sched_qos_enabled(void)
+{
+    return s_qos;
+}
+
+#else
+
+tx_class_t tx_sched_classify(const uint8_t *frame, uint16_t len)
+{
+    return TX_CLASS_BE;
+}
+
+esp_err_t tx_sched_set_qos(bool enable)
+{
+    return enable ? ESP_ERR_NOT_SUPPORTED : ESP_OK;
+}
+
+bool tx_sched_qos_enabled(void)
+{
+    return false;
+}
+
+#endif // CONFIG_BRIDGE_TX_QOS
+
+// Caller holds s_lock
+static void queue_pop_locked(tx_class_queue_t *q, pkt_desc_t *out)
+{
+    *out = q->slots[q->head];
+    q->head = (q->head + 1) % q->size;
+    q->count--;
+    s_depth--;
+}
+
+// Caller holds s_lock
+static void queue_push_locked(tx_class_queue_t *q, const pkt_desc_t *desc,
+                              const ack_filter_key_t *ack)
+{
+    uint8_t slot = (q->head + q->count) % q->size;
+
+    q->slots[slot] = *desc;
+    if (q->acks != NULL) {
+        q->acks[slot] = *ack;
+    }
+    q->count++;
+    s_depth++;
+}
+
+#if CONFIG_BRIDGE_ACK_FILTER
+/*
+ * Caller holds s_lock. Replace the flow's most recently queued ACK with the
+ * new one in place, so the newest acknowledgment leaves at the older one's
+ * position. Only the latest ACK of the flow is considered: merging past a
+ * duplicate ACK would send the acknowledgments out of order.
+ */
+static bool ack_merge_locked(tx_class_queue_t *q, const pkt_desc_t *desc,
+                             const ack_filter_key_t *ack, pkt_desc_t *evicted)
+{
+    for (int i = q->count - 1; i >= 0; i--) {
+        uint8_t slot = (q->head + i) % q->size;
+        if (q->acks[slot].flow != ack->flow) {
+            continue;
+        }
+        if (!ack_filter_supersedes(ack, desc->data, &q->acks[slot], q->slots[slot].data)) {
+            return false;
+        }
+        *evicted = q->slots[slot];
+        q->slots[slot] = *desc;
+        q->acks[slot] = *ack;
+        return true;
+    }
+    return false;
+}
+#endif
+
+/*
+ * Caller holds s_lock. Strict-priority frames may push out any round-robin
+ * class; a round-robin frame only one with a longer queue than its own.
+ * Taking the longest queue keeps a single busy class from holding every
+ * slot and so preserves the DRR shares under overload. Ties go to the
+ * lower-priority class.
+ */
+static int victim_locked(tx_class_t cls)
+{
+    int victim = -1;
+    uint8_t longest = cls < TX_CLASS_DRR_FIRST ? 0 : s_queues[cls].count;
+
+    for (int c = TX_CLASS_MAX - 1; c >= TX_CLASS_DRR_FIRST; c--) {
+        if (c != (int)cls && s_queues[c].count > longest) {
+            longest = s_queues[c].count;
+            victim = c;
+        }
+    }
+    return victim;
+}
+
+esp_err_t tx_sched_enqueue(const pkt_desc_t *desc, tx_class_t cls, pkt_desc_t *evicted)
+{
+    tx_class_queue_t *q = &s_queues[cls];
+    ack_filter_key_t ack = { 0 };
+    bridge_drop_t reason = BRIDGE_DROP_QUEUE_FULL;
+    bool merged = false;
+    esp_err_t ret = ESP_OK;
+
+    evicted->data = NULL;
+
+#if CONFIG_BRIDGE_ACK_FILTER
+    // Parse before taking the lock; only the comparison runs inside it
+    if (cls == TX_CLASS_CTRL) {
+        ack_filter_parse(desc->data, desc->len, &ack);
+    }
+#endif
+
+    portENTER_CRITICAL(&s_lock);
+#if CONFIG_BRIDGE_ACK_FILTER
+    if (ack.flow != 0 && ack_merge_locked(q, desc, &ack, evicted)) {
+        reason = BRIDGE_DROP_ACK_MERGED;
+        merged = true;
+    }
+#endif
+    if (!merged && q->count < q->limit && s_depth >= TX_SCHED_LIMIT) {
+        int victim = victim_locked(cls);
+        if (victim >= 0) {
+            queue_pop_locked(&s_queues[victim], evicted);
+        }
+    }
+    if (!merged && (q->count >= q->limit || s_depth >= TX_SCHED_LIMIT)) {
+#if CONFIG_BRIDGE_TX_DROP_HEAD
+        if (q->count > 0) {
+            queue_pop_locked(q, evicted);
+        } else {
+            ret = ESP_ERR_NO_MEM;
+        }
+#else
+        ret = ESP_ERR_NO_MEM;
+#endif
+    }
+    if (ret == ESP_OK && !merged) {
+        queue_push_locked(q, desc, &ack);
+    }
+    uint32_t class_depth = q->count;
+    uint32_t depth = s_depth;
+    // A running consumer will find the frame itself; a burst costs the
+    // producer one notification, not one per frame
+    TaskHandle_t consumer = s_consumer_waiting ? s_consumer : NULL;
+    s_consumer_waiting = false;
+    portEXIT_CRITICAL(&s_lock);
+
+    if (evicted->data != NULL) {
+        bridge_stats_drop(BRIDGE_DIR_USB_TO_WIFI, reason);
+    }
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    bridge_stats_queue_depth(s_stats_queue[cls], class_depth);
+    bridge_stats_queue_depth(BRIDGE_QUEUE_WIFI_TX, depth);
+    if (consumer != NULL) {
+        xTaskNotifyGive(consumer);
+    }
+    return ESP_OK;
+}
+
+// Caller holds s_lock
+static bool pick_locked(pkt_desc_t *out)
+{
+    if (s_depth == 0) {
+        return false;
+    }
+
+    for (int c = 0; c < TX_CLASS_DRR_FIRST; c++) {
+        if (s_queues[c].count > 0) {
+            queue_pop_locked(&s_queues[c], out);
+            return true;
+        }
+    }
+
+    // At least one DRR class has a frame, and a quantum always covers a
+    // full frame, so this ends within one round
+    while (1) {
+        tx_class_queue_t *q = &s_queues[s_drr_cur];
+        if (q->count > 0) {
+            if (!s_drr_granted) {
+                q->deficit += q->quantum;
+                s_drr_granted = true;
+            }
+            if (q->slots[q->head].len <= q->deficit) {
+                q->deficit -= q->slots[q->head].len;
+                queue_pop_locked(q, out);
+                return true;
+            }
+        } else {
+            // An idle class does not bank credit
+            q->deficit = 0;
+        }
+        s_drr_cur = s_drr_cur + 1 < TX_CLASS_MAX ? s_drr_cur + 1 : TX_CLASS_DRR_FIRST;
+        s_drr_granted = false;
+    }
+}
+
+bool tx_sched_dequeue(pkt_desc_t *desc, TickType_t timeout)
+{
+    if (s_consumer == NULL) {
+        s_consumer = xTaskGetCurrentTaskHandle();
+    }
+
+    while (1) {
+        portENTER_CRITICAL(&s_lock);
+        bool found = pick_locked(desc);
+        // Set under the same lock the empty check used, so an enqueue
+        // after it is sure to notify
+        s_consumer_waiting = !found;
+        portEXIT_CRITICAL(&s_lock);
+
+        if (found) {
+            return true;
+        }
+        if (ulTaskNotifyTake(pdTRUE, timeout) == 0) {
+            portENTER_CRITICAL(&s_lock);
+            s_consumer_waiting = false;
+            found = pick_locked(desc);
+            portEXIT_CRITICAL(&s_lock);
+            return found;
+        }
+    }
+}
+
+uint32_t tx_sched_depth(void)
+{
+    return s_depth;
+}
+
+esp_err_t tx_sched_set_depth(tx_class_t cls, uint8_t depth)
+{
+    if (cls >= TX_CLASS_MAX || depth == 0 || depth > s_queues[cls].size) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Frames above a lowered limit stay queued; new ones wait for the drain
+    portENTER_CRITICAL(&s_lock);
+    s_queues[cls].limit = depth;
+    portEXIT_CRITICAL(&s_lock);
+    bridge_stats_queue_init(s_stats_queue[cls], depth);
+    return ESP_OK;
+}
+
+uint8_t tx_sched_get_depth(tx_class_t cls, uint8_t *max)
+{
+    if (max != NULL) {
+        *max = s_queues[cls].size;
+    }
+    return s_queues[cls].limit;
+}
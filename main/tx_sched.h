@@ -0,0 +1,128 @@
+#ifndef TX_SCHED_H
+#define TX_SCHED_H
+
+#include "esp_err.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+
+#include "pkt_pool.h"
+
+// Frames queued across all classes; the rest of the pool stays free for
+// control responses and new USB frames
+#define TX_SCHED_LIMIT      20
+
+/**
+ * @brief Traffic classes, highest priority first
+ *
+ * VO..BK follow the WMM access categories. CTRL and VO are served by
+ * strict priority, VI/BE/BK by deficit round robin.
+ */
+typedef enum {
+    TX_CLASS_CTRL = 0,  // ARP, DNS, DHCP, neighbour discovery, pure TCP ACKs
+    TX_CLASS_VO,        // voice: EF, CS6/CS7
+    TX_CLASS_VI,        // video and interactive: CS3-CS5, AF2x-AF4x
+    TX_CLASS_BE,        // best effort
+    TX_CLASS_BK,        // background: CS1, LE, AF1x
+    TX_CLASS_MAX
+} tx_class_t;
+
+/**
+ * @brief Register the per-class queues with bridge_stats
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t tx_sched_init(void);
+
+/**
+ * @brief Pick the class of an Ethernet frame
+ *
+ * Looks at the EtherType, the 802.1p priority of a VLAN tag, the IP DSCP
+ * and the transport header. Always TX_CLASS_BE when BRIDGE_TX_QOS is off
+ * or tx_sched_set_qos() turned it off.
+ *
+ * @param frame Ethernet frame
+ * @param len Frame length
+ * @return Traffic class
+ */
+tx_class_t tx_sched_classify(const uint8_t *frame, uint16_t len);
+
+/**
+ * @brief Queue a frame without blocking
+ *
+ * When TX_SCHED_LIMIT frames are queued, the oldest frame of the longest
+ * round-robin class is pushed out to make room (for a round-robin frame,
+ * only if that class is longer than its own). When there is none, or the
+ * frame's own class is full, BRIDGE_TX_DROP_POLICY decides between
+ * rejecting the new frame and pushing out the oldest frame of its own
+ * class.
+ *
+ * @param desc Frame descriptor; copied
+ * @param cls Traffic class from tx_sched_classify()
+ * With BRIDGE_ACK_FILTER a pure ACK instead replaces a queued ACK of the
+ * same flow that it makes redundant (see ack_filter.h).
+ *
+ * Pushed-out and replaced frames are counted in bridge_stats here.
+ *
+ * @param evicted Set to the pushed-out or replaced frame, which the caller
+ *                must free; evicted->data is NULL if there is none
+ * @return esp_err_t ESP_OK if queued; ESP_ERR_NO_MEM if rejected (the
+ *         caller still owns desc)
+ */
+esp_err_t tx_sched_enqueue(const pkt_desc_t *desc, tx_class_t cls, pkt_desc_t *evicted);
+
+/**
+ * @brief Take the next frame to transmit
+ *
+ * Must always be called from the same (single consumer) task.
+ *
+ * @param desc Receives the frame descriptor
+ * @param timeout Ticks to wait for a frame
+ * @return true if a frame was returned
+ */
+bool tx_sched_dequeue(pkt_desc_t *desc, TickType_t timeout);
+
+/**
+ * @brief Frames currently queued across all classes
+ *
+ * @return Queue depth
+ */
+uint32_t tx_sched_depth(void);
+
+/**
+ * @brief Change how many frames a class accepts, at run time
+ *
+ * @param cls Traffic class
+ * @param depth New limit, 1 up to the class's compiled size
+ * @return esp_err_t ESP_OK on success, ESP_ERR_INVALID_ARG if out of range
+ */
+esp_err_t tx_sched_set_depth(tx_class_t cls, uint8_t depth);
+
+/**
+ * @brief Current frame limit of a class
+ *
+ * @param cls Traffic class
+ * @param max If not NULL, receives the largest limit tx_sched_set_depth() accepts
+ * @return Current limit
+ */
+uint8_t tx_sched_get_depth(tx_class_t cls, uint8_t *max);
+
+/**
+ * @brief Turn classification on or off at run time
+ *
+ * While off every frame is best effort, as with BRIDGE_TX_QOS disabled.
+ *
+ * @param enable true to classify
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NOT_SUPPORTED when enabling
+ *         without BRIDGE_TX_QOS
+ */
+esp_err_t tx_sched_set_qos(bool enable);
+
+/**
+ * @brief Whether frames are currently classified
+ *
+ * @return true if tx_sched_classify() looks at the frame
+ */
+bool tx_sched_qos_enabled(void);
+
+#endif // TX_SCHED_H
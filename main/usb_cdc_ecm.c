@@ -6,12 +6,24 @@
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
 #include "esp_log.h"
 #include "esp_err.h"
+#include "esp_timer.h"
+#include "esp_cpu.h"
 #include "driver/usb_serial_jtag.h"
 
 #include "usb_cdc_ecm.h"
 #include "wifi_bridge.h"
+#include "pkt_pool.h"
+#include "frame_proto.h"
+#include "pkt_trace.h"
+#include "pkt_capture.h"
+#include "bench.h"
+#include "bridge_stats.h"
+#include "bridge_tasks.h"
+#include "gso.h"
 
 static const char *TAG = "usb_cdc_ecm";
 
@@ -19,47 +31,310 @@ static const char *TAG = "usb_cdc_ecm";
 // This is a simplified implementation using USB Serial JTAG
 // For full CDC-ECM, you may need to use a custom USB stack or
 // implement it using the USB peripheral directly
+//
+// Ethernet frames are carried in the length-prefixed framing described in
+// frame_proto.h, so frame boundaries survive the byte stream.
 
-static void (*rx_callback)(const uint8_t *data, uint16_t len) = NULL;
+// Once a header has started arriving, the rest of the frame must follow
+// within this time or the partial frame is discarded
+#define USB_RX_FRAME_TIMEOUT_MS 50
+
+// Frames sent in quick succession are packed into one USB write. A multiple
+// of the 64-byte bulk packet size, and large enough for one full frame.
+#define USB_TX_BATCH_SIZE       2048
+#define USB_TX_BATCHES          CONFIG_BRIDGE_USB_TX_BATCHES
+#define USB_TX_NONE             0xff
+
+_Static_assert(USB_TX_BATCH_SIZE >= FRAME_HDR_LEN + PKT_BUF_MAX_FRAME + FRAME_CRC_LEN,
+               "TX batch must fit a full frame");
+
+static void (*rx_callback)(uint8_t *data, uint16_t len) = NULL;
+static void (*ctrl_callback)(uint8_t *data, uint16_t len) = NULL;
 static bool s_ready = false;
 static TaskHandle_t rx_task_handle = NULL;
+static TaskHandle_t tx_task_handle = NULL;
 
-static void usb_rx_task(void *arg)
+// Senders fill one batch while usb_tx_task writes the others to the host;
+// only usb_tx_task ever waits for it. Batches circulate by index between
+// the free and ready queues.
+static SemaphoreHandle_t s_tx_lock = NULL;
+static uint8_t s_tx_batch[USB_TX_BATCHES][USB_TX_BATCH_SIZE];
+static size_t s_tx_batch_len[USB_TX_BATCHES];
+static uint8_t s_tx_fill = USB_TX_NONE;     // batch being filled; under s_tx_lock
+static QueueHandle_t s_tx_free;
+static QueueHandle_t s_tx_ready;            // in submission order
+static uint16_t s_tx_seq = 0;
+
+// Read exactly len bytes; false if the stream stalls for longer than timeout
+static bool usb_read_exact(uint8_t *buf, size_t len, TickType_t timeout)
+{
+    while (len > 0) {
+        int n = usb_serial_jtag_read_bytes(buf, len, timeout);
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void usb_discard(size_t len, TickType_t timeout)
+{
+    uint8_t scratch[64];
+    while (len > 0) {
+        size_t chunk = len < sizeof(scratch) ? len : sizeof(scratch);
+        if (!usb_read_exact(scratch, chunk, timeout)) {
+            return;
+        }
+        len -= chunk;
+    }
+}
+
+#if CONFIG_BRIDGE_GSO
+static bool usb_gso_read(uint8_t *buf, uint16_t len)
+{
+    return usb_read_exact(buf, len, pdMS_TO_TICKS(USB_RX_FRAME_TIMEOUT_MS));
+}
+
+// Every segment is seen by tracing and capture as if the host had sent it
+static esp_err_t usb_gso_out(uint8_t *frame, uint16_t len)
 {
-    uint8_t *data = (uint8_t *)malloc(1024);
-    if (data == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate RX buffer");
-        vTaskDelete(NULL);
+    PKT_TRACE(PKT_TRACE_USB_RX, len, 0);
+    PKT_CAPTURE(PKT_CAPTURE_USB_IN, frame, len);
+    if (rx_callback) {
+        rx_callback(frame, len);
+        return ESP_OK;
+    }
+    return wifi_bridge_send_to_wifi(frame, len);
+}
+
+static void usb_rx_vnet(uint16_t len)
+{
+    const TickType_t timeout = pdMS_TO_TICKS(USB_RX_FRAME_TIMEOUT_MS);
+    gso_vnet_hdr_t vh;
+    uint32_t consumed = 0;
+
+    if (len < sizeof(vh)) {
+        bridge_stats_drop(BRIDGE_DIR_USB_TO_WIFI, BRIDGE_DROP_BAD_SIZE);
+        usb_discard(len, timeout);
+        return;
+    }
+    if (!usb_read_exact((uint8_t *)&vh, sizeof(vh), timeout)) {
+        bridge_stats_drop(BRIDGE_DIR_USB_TO_WIFI, BRIDGE_DROP_BAD_FRAME);
         return;
     }
 
+    len -= sizeof(vh);
+    esp_err_t err = gso_rx(&vh, len, usb_gso_read, usb_gso_out, &consumed);
+    if (err == ESP_ERR_TIMEOUT) {
+        ESP_LOGD(TAG, "Truncated vnet frame (%u of %u bytes)", (unsigned)consumed, len);
+        bridge_stats_drop(BRIDGE_DIR_USB_TO_WIFI, BRIDGE_DROP_BAD_FRAME);
+    } else if (err != ESP_OK) {
+        ESP_LOGD(TAG, "vnet frame rejected: %s (type %u, %u bytes)", esp_err_to_name(err),
+                 vh.gso_type, len);
+        bridge_stats_drop(BRIDGE_DIR_USB_TO_WIFI, BRIDGE_DROP_BAD_SIZE);
+        usb_discard(len - consumed, timeout);
+    }
+}
+#endif
+
+// Block until a valid header has been read, resynchronising on garbage
+static void usb_read_header(uint8_t *type, uint16_t *len, uint16_t *seq)
+{
+    uint8_t hdr[FRAME_HDR_LEN];
+    size_t have = 0;
+    const TickType_t timeout = pdMS_TO_TICKS(USB_RX_FRAME_TIMEOUT_MS);
+
+    while (1) {
+        if (have == 0) {
+            // Hunt for the magic byte; this is where the task idles
+            if (!usb_read_exact(hdr, 1, portMAX_DELAY) || hdr[0] != FRAME_MAGIC) {
+                continue;
+            }
+            have = 1;
+        }
+
+        if (!usb_read_exact(hdr + have, FRAME_HDR_LEN - have, timeout)) {
+            have = 0;
+            continue;
+        }
+
+        if (frame_hdr_parse(hdr, type, len, seq)) {
+            return;
+        }
+
+        // Not a header: restart from the next magic byte already read
+        size_t i = 1;
+        while (i < FRAME_HDR_LEN && hdr[i] != FRAME_MAGIC) {
+            i++;
+        }
+        have = FRAME_HDR_LEN - i;
+        memmove(hdr, hdr + i, have);
+        ESP_LOGD(TAG, "Resynchronising USB stream");
+    }
+}
+
+static void usb_rx_task(void *arg)
+{
+    const TickType_t timeout = pdMS_TO_TICKS(USB_RX_FRAME_TIMEOUT_MS);
+    uint16_t expected_seq = 0;
+    bool seq_valid = false;
+
     ESP_LOGI(TAG, "USB RX task started");
     s_ready = true;
 
     while (1) {
-        int len = usb_serial_jtag_read_bytes(data, 1024, portMAX_DELAY);
-        if (len > 0) {
-            ESP_LOGD(TAG, "Received %d bytes from USB", len);
-            if (rx_callback) {
-                rx_callback(data, len);
+        uint8_t type;
+        uint16_t len;
+        uint16_t seq;
+        usb_read_header(&type, &len, &seq);
+        int64_t rx_start = bench_mode_is(BENCH_MODE_USB_LOOPBACK) ? esp_timer_get_time() : 0;
+
+        size_t trailer = (type & FRAME_F_CRC) ? FRAME_CRC_LEN : 0;
+        uint8_t ftype = type & FRAME_TYPE_MASK;
+#if CONFIG_BRIDGE_GSO
+        // Segments leave before the end of the frame has arrived, so they
+        // cannot wait for a CRC; the host never asks for both
+        if (ftype == FRAME_TYPE_VNET && !trailer) {
+            usb_rx_vnet(len);
+            continue;
+        }
+#endif
+        bool wanted = ftype == FRAME_TYPE_DATA ||
+                      (ftype == FRAME_TYPE_CTRL && ctrl_callback != NULL);
+        if (!wanted || len > PKT_BUF_MAX_FRAME) {
+            // Unknown types and oversized frames are skipped
+            usb_discard(len + trailer, timeout);
+            continue;
+        }
+
+        uint8_t *data;
+        while ((data = pkt_pool_alloc()) == NULL) {
+            // Pool exhausted: leave the bytes in the USB ring so the host
+            // is throttled instead of losing data here
+            vTaskDelay(1);
+        }
+
+        if (!usb_read_exact(data, len, timeout)) {
+            ESP_LOGD(TAG, "Truncated frame (%d bytes)", len);
+            bridge_stats_drop(BRIDGE_DIR_USB_TO_WIFI, BRIDGE_DROP_BAD_FRAME);
+            pkt_pool_free(data);
+            continue;
+        }
+        // Counted from here: waiting for the host's bytes would add the
+        // cycles of whatever ran meanwhile
+        uint32_t rx_cycles = bench_mode_is(BENCH_MODE_CYCLES_USB) ? esp_cpu_get_cycle_count() : 0;
+
+        if (trailer) {
+            uint8_t crc[FRAME_CRC_LEN];
+            if (!usb_read_exact(crc, sizeof(crc), timeout)) {
+                bridge_stats_drop(BRIDGE_DIR_USB_TO_WIFI, BRIDGE_DROP_BAD_FRAME);
+                pkt_pool_free(data);
+                continue;
+            }
+            uint32_t rx_crc = crc[0] | (crc[1] << 8) | (crc[2] << 16) | ((uint32_t)crc[3] << 24);
+            if (rx_crc != frame_crc32(data, len)) {
+                ESP_LOGD(TAG, "CRC mismatch, dropping frame");
+                bridge_stats_drop(BRIDGE_DIR_USB_TO_WIFI, BRIDGE_DROP_BAD_FRAME);
+                pkt_pool_free(data);
+                continue;
+            }
+        }
+
+        if (ftype == FRAME_TYPE_CTRL) {
+            ctrl_callback(data, len);
+            continue;
+        }
+
+        if (seq_valid && seq != expected_seq) {
+            ESP_LOGD(TAG, "Sequence gap: expected %u, got %u", expected_seq, seq);
+        }
+        expected_seq = seq + 1;
+        seq_valid = true;
+
+        PKT_TRACE(PKT_TRACE_USB_RX, len, 0);
+        PKT_CAPTURE(PKT_CAPTURE_USB_IN, data, len);
+        if (bench_mode_is(BENCH_MODE_USB_LOOPBACK)) {
+            // Reflect the frame without touching WiFi
+            esp_err_t err = usb_cdc_ecm_send(data, len);
+            if (err == ESP_OK) {
+                err = usb_cdc_ecm_flush();
             }
+            bench_account(len, err == ESP_OK, (uint32_t)(esp_timer_get_time() - rx_start));
+            pkt_pool_free(data);
+        } else if (rx_callback) {
+            // Buffer ownership moves to the callback
+            rx_callback(data, len);
+        } else {
+            esp_err_t err = wifi_bridge_send_to_wifi(data, len);
+            if (bench_mode_is(BENCH_MODE_CYCLES_USB)) {
+                bench_account(len, err == ESP_OK, esp_cpu_get_cycle_count() - rx_cycles);
+            }
+        }
+    }
+}
+
+static void usb_tx_task(void *arg)
+{
+    uint8_t batch;
+
+    ESP_LOGI(TAG, "USB TX task started");
+
+    while (1) {
+        if (xQueueReceive(s_tx_ready, &batch, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+
+        // A host that stops reading blocks this task only; senders find no
+        // free batch and drop instead of waiting
+        size_t len = s_tx_batch_len[batch];
+        int written = usb_serial_jtag_write_bytes(s_tx_batch[batch], len, portMAX_DELAY);
+        if (written == (int)len) {
+            PKT_TRACE(PKT_TRACE_USB_FLUSH, len, uxQueueMessagesWaiting(s_tx_ready));
+        } else {
+            ESP_LOGE(TAG, "Failed to write all bytes: %d/%d", written, (int)len);
         }
+
+        s_tx_batch_len[batch] = 0;
+        xQueueSend(s_tx_free, &batch, 0);
     }
 }
 
 esp_err_t usb_cdc_ecm_init(void)
 {
-    // Initialize USB Serial JTAG driver
+    // Initialize USB Serial JTAG driver. The TX ring should take a whole
+    // batch, so one write rarely has to wait for the host mid-batch
     const usb_serial_jtag_driver_config_t usb_serial_config = {
-        .rx_buffer_size = 1024,
-        .tx_buffer_size = 1024,
+        .rx_buffer_size = CONFIG_BRIDGE_USB_RX_RING,
+        .tx_buffer_size = CONFIG_BRIDGE_USB_TX_RING,
     };
 
     ESP_ERROR_CHECK(usb_serial_jtag_driver_install(&usb_serial_config));
     ESP_LOGI(TAG, "USB Serial JTAG driver installed");
 
+    s_tx_lock = xSemaphoreCreateMutex();
+    s_tx_free = xQueueCreate(USB_TX_BATCHES, sizeof(uint8_t));
+    s_tx_ready = xQueueCreate(USB_TX_BATCHES, sizeof(uint8_t));
+    if (s_tx_lock == NULL || s_tx_free == NULL || s_tx_ready == NULL) {
+        ESP_LOGE(TAG, "Failed to create TX queues");
+        return ESP_FAIL;
+    }
+    for (uint8_t i = 0; i < USB_TX_BATCHES; i++) {
+        xQueueSend(s_tx_free, &i, 0);
+    }
+    bridge_stats_queue_init(BRIDGE_QUEUE_USB_TX, USB_TX_BATCHES);
+
+    xTaskCreatePinnedToCore(usb_tx_task, "usb_tx", CONFIG_BRIDGE_TASK_USB_TX_STACK, NULL,
+                            CONFIG_BRIDGE_TASK_USB_TX_PRIO, &tx_task_handle, BRIDGE_TASK_CORE);
+    if (tx_task_handle == NULL) {
+        ESP_LOGE(TAG, "Failed to create TX task");
+        return ESP_FAIL;
+    }
+
     // Create RX task
-    xTaskCreate(usb_rx_task, "usb_rx", 4096, NULL, 5, &rx_task_handle);
+    xTaskCreatePinnedToCore(usb_rx_task, "usb_rx", CONFIG_BRIDGE_TASK_USB_RX_STACK, NULL,
+                            CONFIG_BRIDGE_TASK_USB_RX_PRIO, &rx_task_handle, BRIDGE_TASK_CORE);
     if (rx_task_handle == NULL) {
         ESP_LOGE(TAG, "Failed to create RX task");
         return ESP_FAIL;
@@ -69,30 +344,155 @@ esp_err_t usb_cdc_ecm_init(void)
     return ESP_OK;
 }
 
+// Caller holds s_tx_lock. Hands the batch being filled to usb_tx_task
+static void usb_tx_submit_locked(void)
+{
+    if (s_tx_fill == USB_TX_NONE || s_tx_batch_len[s_tx_fill] == 0) {
+        return;
+    }
+
+    // Never full: the ready queue has room for every batch
+    xQueueSend(s_tx_ready, &s_tx_fill, 0);
+    s_tx_fill = USB_TX_NONE;
+    bridge_stats_queue_depth(BRIDGE_QUEUE_USB_TX, uxQueueMessagesWaiting(s_tx_ready));
+}
+
+// Caller holds s_tx_lock. Makes room for framed bytes in the batch being
+// filled; false if every other batch is still waiting for the host
+static bool usb_tx_reserve_locked(size_t framed)
+{
+    if (s_tx_fill != USB_TX_NONE && s_tx_batch_len[s_tx_fill] + framed > USB_TX_BATCH_SIZE) {
+        usb_tx_submit_locked();
+    }
+    if (s_tx_fill == USB_TX_NONE && xQueueReceive(s_tx_free, &s_tx_fill, 0) != pdTRUE) {
+        s_tx_fill = USB_TX_NONE;
+        return false;
+    }
+    return true;
+}
+
+// Caller holds s_tx_lock and has made room for the frame
+static void usb_tx_append_locked(uint8_t type, uint16_t seq, const uint8_t *data, uint16_t len)
+{
+    uint8_t *p = s_tx_batch[s_tx_fill] + s_tx_batch_len[s_tx_fill];
+    frame_hdr_build(p, type, len, seq);
+    memcpy(p + FRAME_HDR_LEN, data, len);
+    size_t framed = FRAME_HDR_LEN + len;
+    if (type & FRAME_F_CRC) {
+        uint32_t crc = frame_crc32(data, len);
+        uint8_t *t = p + framed;
+        t[0] = crc & 0xff;
+        t[1] = (crc >> 8) & 0xff;
+        t[2] = (crc >> 16) & 0xff;
+        t[3] = crc >> 24;
+        framed += FRAME_CRC_LEN;
+    }
+    s_tx_batch_len[s_tx_fill] += framed;
+}
+
+static uint8_t usb_tx_type(uint8_t type)
+{
+#if CONFIG_BRIDGE_FRAME_CRC
+    type |= FRAME_F_CRC;
+#endif
+    return type;
+}
+
+static size_t usb_tx_framed_len(uint8_t type, uint16_t len)
+{
+    return FRAME_HDR_LEN + len + ((type & FRAME_F_CRC) ? FRAME_CRC_LEN : 0);
+}
+
 esp_err_t usb_cdc_ecm_send(const uint8_t *data, uint16_t len)
 {
     if (!s_ready) {
         return ESP_ERR_INVALID_STATE;
     }
 
-    int written = usb_serial_jtag_write_bytes(data, len, portMAX_DELAY);
-    if (written != len) {
-        ESP_LOGE(TAG, "Failed to write all bytes: %d/%d", written, len);
-        return ESP_FAIL;
+    if (len > PKT_BUF_MAX_FRAME) {
+        return ESP_ERR_INVALID_SIZE;
     }
 
-    ESP_LOGD(TAG, "Sent %d bytes to USB", len);
+    uint8_t type = usb_tx_type(FRAME_TYPE_DATA);
+    size_t framed = usb_tx_framed_len(type, len);
+
+    xSemaphoreTake(s_tx_lock, portMAX_DELAY);
+
+    if (!usb_tx_reserve_locked(framed)) {
+        xSemaphoreGive(s_tx_lock);
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Only data frames are sequenced, so the host's gap count is not
+    // disturbed by messages
+    usb_tx_append_locked(type, s_tx_seq++, data, len);
+    PKT_TRACE(PKT_TRACE_USB_TX, len, s_tx_batch_len[s_tx_fill]);
+
+    xSemaphoreGive(s_tx_lock);
+    PKT_CAPTURE(PKT_CAPTURE_USB_OUT, data, len);
+
+    return ESP_OK;
+}
+
+esp_err_t usb_cdc_ecm_send_msg(uint8_t type, const uint8_t *data, uint16_t len)
+{
+    if (!s_ready) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (len > PKT_BUF_MAX_FRAME) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // A task already holding the TX lock is logging from inside this file
+    if (xSemaphoreGetMutexHolder(s_tx_lock) == xTaskGetCurrentTaskHandle()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    type = usb_tx_type(type);
+    size_t framed = usb_tx_framed_len(type, len);
+
+    esp_err_t ret = ESP_ERR_NO_MEM;
+    xSemaphoreTake(s_tx_lock, portMAX_DELAY);
+
+    if (usb_tx_reserve_locked(framed)) {
+        usb_tx_append_locked(type, 0, data, len);
+        // Messages are rare; push them out now rather than waiting for the
+        // data path to flush
+        usb_tx_submit_locked();
+        ret = ESP_OK;
+    }
+
+    xSemaphoreGive(s_tx_lock);
+
+    return ret;
+}
+
+esp_err_t usb_cdc_ecm_flush(void)
+{
+    if (!s_ready) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(s_tx_lock, portMAX_DELAY);
+    usb_tx_submit_locked();
+    xSemaphoreGive(s_tx_lock);
     return ESP_OK;
 }
 
-esp_err_t usb_cdc_ecm_register_rx_callback(void (*callback)(const uint8_t *data, uint16_t len))
+esp_err_t usb_cdc_ecm_register_rx_callback(void (*callback)(uint8_t *data, uint16_t len))
 {
     rx_callback = callback;
     return ESP_OK;
 }
 
+esp_err_t usb_cdc_ecm_register_ctrl_callback(void (*callback)(uint8_t *data, uint16_t len))
+{
+    ctrl_callback = callback;
+    return ESP_OK;
+}
+
 bool usb_cdc_ecm_is_ready(void)
 {
     return s_ready;
 }
-
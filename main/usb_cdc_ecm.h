@@ -15,19 +15,68 @@ esp_err_t usb_cdc_ecm_init(void);
 /**
  * @brief Send data over USB CDC-ECM
  * 
+ * The frame is copied into a batch that the USB TX task writes out; this
+ * never waits for the host.
+ * 
  * @param data Data to send
  * @param len Length of data
- * @return esp_err_t ESP_OK on success
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NO_MEM if the host is not
+ *         keeping up and every batch is waiting for it
  */
 esp_err_t usb_cdc_ecm_send(const uint8_t *data, uint16_t len);
 
+/**
+ * @brief Send a non-Ethernet message to the host
+ * 
+ * Used for log and control messages on transports with a framing layer.
+ * Never waits for the host: fails instead if no batch is free or the
+ * calling task is already inside the USB path.
+ * 
+ * @param type FRAME_TYPE_* other than FRAME_TYPE_DATA
+ * @param data Message payload
+ * @param len Length of data
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NOT_SUPPORTED without framing
+ */
+esp_err_t usb_cdc_ecm_send_msg(uint8_t type, const uint8_t *data, uint16_t len);
+
+/**
+ * @brief Push out frames batched by usb_cdc_ecm_send()
+ * 
+ * usb_cdc_ecm_send() may hold small frames back so several go out in one
+ * USB transfer; callers flush once they have nothing more to send. The
+ * batch is handed to the USB TX task, without waiting for the write.
+ * 
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t usb_cdc_ecm_flush(void);
+
 /**
  * @brief Register callback for received data
  * 
- * @param callback Function to call when data is received
+ * Without a callback, received frames go straight to
+ * wifi_bridge_send_to_wifi(), a direct call on the per-frame path. A
+ * callback replaces that, for tests and other uses off the data path.
+ * 
+ * The callback takes ownership of the buffer, which comes from the packet
+ * pool, and must return it with pkt_pool_free() (directly or by passing it
+ * on); the RX task takes a fresh buffer for the next read.
+ * 
+ * @param callback Function to call when data is received, or NULL for
+ *        the bridge
  * @return esp_err_t ESP_OK on success
  */
-esp_err_t usb_cdc_ecm_register_rx_callback(void (*callback)(const uint8_t *data, uint16_t len));
+esp_err_t usb_cdc_ecm_register_rx_callback(void (*callback)(uint8_t *data, uint16_t len));
+
+/**
+ * @brief Register callback for received control messages
+ * 
+ * Same buffer ownership rules as the data callback. The callback runs in
+ * the USB RX task and must not block.
+ * 
+ * @param callback Function to call with each control message payload
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NOT_SUPPORTED without framing
+ */
+esp_err_t usb_cdc_ecm_register_ctrl_callback(void (*callback)(uint8_t *data, uint16_t len));
 
 /**
  * @brief Check if USB CDC-ECM is ready
@@ -0,0 +1,126 @@
+/*
+ * USB CDC-NCM Implementation
+ * Presents the adapter as a native USB network interface through TinyUSB.
+ * Implements the usb_cdc_ecm.h API so the rest of the bridge is unchanged.
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_mac.h"
+#include "tinyusb.h"
+#include "tinyusb_net.h"
+#include "tusb.h"
+
+#include "usb_cdc_ecm.h"
+#include "wifi_bridge.h"
+#include "pkt_pool.h"
+#include "pkt_trace.h"
+#include "bridge_stats.h"
+
+static const char *TAG = "usb_ncm";
+
+#define USB_NCM_TX_TIMEOUT_MS 100
+
+static void (*rx_callback)(uint8_t *data, uint16_t len) = NULL;
+static bool s_ready = false;
+
+// Called from the TinyUSB task once per datagram unpacked from an NTB.
+// The TinyUSB buffer is recycled on return, so the frame is copied into
+// a pool buffer that the bridge can own.
+static esp_err_t usb_ncm_rx(void *buffer, uint16_t len, void *ctx)
+{
+    if (len > PKT_BUF_MAX_FRAME) {
+        bridge_stats_drop(BRIDGE_DIR_USB_TO_WIFI, BRIDGE_DROP_BAD_SIZE);
+        return ESP_OK;
+    }
+
+    uint8_t *data = pkt_pool_alloc();
+    if (data == NULL) {
+        bridge_stats_drop(BRIDGE_DIR_USB_TO_WIFI, BRIDGE_DROP_NO_BUFFER);
+        return ESP_ERR_NO_MEM;
+    }
+
+    memcpy(data, buffer, len);
+    PKT_TRACE(PKT_TRACE_USB_RX, len, 0);
+    if (rx_callback) {
+        rx_callback(data, len);
+    } else {
+        wifi_bridge_send_to_wifi(data, len);
+    }
+    return ESP_OK;
+}
+
+esp_err_t usb_cdc_ecm_init(void)
+{
+    const tinyusb_config_t tusb_cfg = {
+        .external_phy = false,
+    };
+    ESP_ERROR_CHECK(tinyusb_driver_install(&tusb_cfg));
+
+    tinyusb_net_config_t net_config = {
+        .on_recv_callback = usb_ncm_rx,
+    };
+    // Give the host interface the STA MAC so bridged frames need no
+    // translation in the single-host case
+    ESP_ERROR_CHECK(esp_read_mac(net_config.mac_addr, ESP_MAC_WIFI_STA));
+
+    esp_err_t ret = tinyusb_net_init(TINYUSB_USBDEV_0, &net_config);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to initialize NCM class: %s", esp_err_to_name(ret));
+        return ret;
+    }
+
+    s_ready = true;
+    ESP_LOGI(TAG, "USB CDC-NCM initialized");
+    return ESP_OK;
+}
+
+esp_err_t usb_cdc_ecm_send(const uint8_t *data, uint16_t len)
+{
+    if (!s_ready || !tud_mounted()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // TinyUSB copies the datagram into its NTB before this returns
+    esp_err_t ret = tinyusb_net_send_sync((void *)data, len, NULL,
+                                          pdMS_TO_TICKS(USB_NCM_TX_TIMEOUT_MS));
+    if (ret != ESP_OK) {
+        ESP_LOGD(TAG, "NCM send failed: %s", esp_err_to_name(ret));
+        return ret;
+    }
+
+    PKT_TRACE(PKT_TRACE_USB_TX, len, 0);
+    return ESP_OK;
+}
+
+esp_err_t usb_cdc_ecm_send_msg(uint8_t type, const uint8_t *data, uint16_t len)
+{
+    // NCM carries Ethernet frames only
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t usb_cdc_ecm_flush(void)
+{
+    // NCM aggregates datagrams into NTBs inside TinyUSB
+    return ESP_OK;
+}
+
+esp_err_t usb_cdc_ecm_register_rx_callback(void (*callback)(uint8_t *data, uint16_t len))
+{
+    rx_callback = callback;
+    return ESP_OK;
+}
+
+esp_err_t usb_cdc_ecm_register_ctrl_callback(void (*callback)(uint8_t *data, uint16_t len))
+{
+    // No control channel without the serial framing
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+bool usb_cdc_ecm_is_ready(void)
+{
+    return s_ready && tud_mounted();
+}
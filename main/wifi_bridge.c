@@ -7,46 +7,196 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
-#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_wifi.h"
+#include "esp_private/wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
 #include "esp_netif.h"
-#include "lwip/err.h"
-#include "lwip/sys.h"
-#include "lwip/sockets.h"
-#include "lwip/netdb.h"
-#include "lwip/ip4_addr.h"
+#include "esp_timer.h"
+#include "esp_cpu.h"
+#include "esp_random.h"
 
 #include "wifi_bridge.h"
 #include "usb_cdc_ecm.h"
 #include "wifi_config.h"
+#include "pkt_pool.h"
+#include "pkt_trace.h"
+#include "pkt_capture.h"
+#include "pkt_filter.h"
+#include "bench.h"
+#include "bridge_stats.h"
+#include "tx_sched.h"
+#include "bridge_tasks.h"
+#include "spsc_ring.h"
+#include "wifi_profile.h"
+#include "wifi_fastconn.h"
+#include "wifi_roam.h"
+#if CONFIG_BRIDGE_MODE_ROUTER
+#include "nat_router.h"
+#else
+#include "mac_nat.h"
+#endif
+#if CONFIG_BRIDGE_FLOW_CTRL
+#include "bridge_ctrl.h"
+#endif
 
 static const char *TAG = "wifi_bridge";
 
+// Reconnect state machine: a lost or failed association is retried at
+// once, then with jittered exponential backoff, for as long as the bridge
+// is meant to be connected
+typedef enum {
+    LINK_IDLE = 0,              // no connect requested, or wifi_bridge_disconnect()
+    LINK_CONNECTING,            // association in progress
+    LINK_UP,
+    LINK_BACKOFF,               // waiting for s_retry_timer
+    LINK_ROAMING,               // moving to another AP; s_retry_timer bounds it
+} link_state_t;
+
+#define ROAM_TIMEOUT_MS 2000    // then reconnect to the remembered AP
+
 static EventGroupHandle_t s_wifi_event_group;
-static int s_retry_num = 0;
 static bool s_wifi_connected = false;
+static uint32_t s_backoff_max_ms = WIFI_BACKOFF_MAX_MS;
+// The event loop, the retry timer and the control task (credentials set,
+// roam) all move the state machine, so everything from here to
+// s_fast_attempt is under s_link_lock. It is held across esp_wifi_connect()
+// and esp_wifi_disconnect(), which do not wait for the event loop.
+static SemaphoreHandle_t s_link_lock;
+static int s_retry_num = 0;
+static volatile link_state_t s_link_state;
+static esp_timer_handle_t s_retry_timer;
+static uint32_t s_backoff_ms;               // current backoff step; 0 before the first
+static wifi_config_t s_wifi_config;         // as given to wifi_bridge_connect()
+static bool s_fast_attempt;                 // connecting with the remembered AP and PMK
+#if CONFIG_BRIDGE_OUTAGE_HOLD
+static volatile bool s_tx_hold;             // keep queued frames for the reconnect
+static TickType_t s_hold_start;             // tick of the disconnect
+#endif
+
+static inline bool tx_holding(void)
+{
+#if CONFIG_BRIDGE_OUTAGE_HOLD
+    return s_tx_hold;
+#else
+    return false;
+#endif
+}
+#if !CONFIG_BRIDGE_MODE_PURE_L2
 static esp_netif_t *s_netif_sta = NULL;
-static int s_raw_socket = -1;
-static TaskHandle_t s_wifi_rx_task = NULL;
-static QueueHandle_t s_tx_queue = NULL;
-
-#define TX_QUEUE_SIZE 10
-#define MAX_PACKET_SIZE 1500
-
-typedef struct {
-    uint8_t data[MAX_PACKET_SIZE];
-    uint16_t len;
-} packet_t;
+#endif
+static spsc_ring_t s_rx_ring;
+static uint8_t s_sta_mac[6];
+
+// Queues hold pkt_desc_t descriptors only; frame storage comes from the
+// packet pool (TX, queued in tx_sched) or stays in the WiFi driver's RX
+// buffers (RX)
+#define RX_QUEUE_SIZE 16        // power of two (spsc_ring)
+#define RX_BATCH      8         // frames taken from the RX ring per pass
+
+#define ETH_HDR_LEN     14
+
+#if CONFIG_BRIDGE_FILTER_ARP_PROXY
+#define ARP_LEN         28
+#define ARP_SHA         8
+#define ARP_SPA         14
+#define ARP_THA         18
+#define ARP_TPA         24
+// Only answer for clients that sent something this recently, so an
+// address the host has given up is not held on to
+#define ARP_PROXY_MAX_AGE_MS    60000
+#endif
+
+#if CONFIG_BRIDGE_FLOW_CTRL
+// Pause the host at 3/4 full; resume once the TX task has drained to 1/4
+#define TX_FLOW_PAUSE_DEPTH     (TX_SCHED_LIMIT * 3 / 4)
+#define TX_FLOW_RESUME_DEPTH    (TX_SCHED_LIMIT / 4)
+
+static volatile bool s_tx_paused;       // state the host should be in
+static volatile bool s_tx_paused_sent;  // state the host last received
+static esp_timer_handle_t s_tx_flow_timer;
+#endif
 
 /* Forward declarations */
 static void wifi_event_handler(void* arg, esp_event_base_t event_base,
                               int32_t event_id, void* event_data);
-static void ip_event_handler(void* arg, esp_event_base_t event_base,
-                            int32_t event_id, void* event_data);
+static void wifi_connected_handler(void *arg, esp_event_base_t event_base,
+                                   int32_t event_id, void *event_data);
+static esp_err_t wifi_rx_cb(void *buffer, uint16_t len, void *eb);
+#if CONFIG_BRIDGE_MODE_ROUTER
+static void ip_event_handler(void *arg, esp_event_base_t event_base,
+                             int32_t event_id, void *event_data);
+#endif
 static void wifi_rx_task(void *arg);
 static void wifi_tx_task(void *arg);
+static void retry_timer_cb(void *arg);
+
+#if CONFIG_BRIDGE_FLOW_CTRL
+static uint16_t tx_flow_notifier(uint8_t *body, uint16_t max)
+{
+    ctrl_flow_t flow = {
+        .paused = s_tx_paused,
+        .credits = TX_SCHED_LIMIT - tx_sched_depth(),
+    };
+
+    memcpy(body, &flow, sizeof(flow));
+    return sizeof(flow);
+}
+
+static void tx_flow_sent(const uint8_t *body, uint16_t len)
+{
+    s_tx_paused_sent = ((const ctrl_flow_t *)body)->paused;
+}
+
+static bool tx_flow_settled(void)
+{
+    return !s_tx_paused && !s_tx_paused_sent;
+}
+
+/*
+ * Runs every CTRL_FLOW_REFRESH_MS until the host has been told to resume.
+ * The host lets a pause lapse when the refresh stops, so this keeps it
+ * paused for as long as the queue stays full, including a hold with the
+ * TX task blocked, and resends whatever failed to go out.
+ */
+static void tx_flow_timer_cb(void *arg)
+{
+    if (tx_flow_settled()) {
+        esp_timer_stop(s_tx_flow_timer);
+        // A pause that landed between the check and the stop
+        if (tx_flow_settled()) {
+            return;
+        }
+        esp_timer_start_periodic(s_tx_flow_timer, CTRL_FLOW_REFRESH_MS * 1000);
+    }
+    bridge_ctrl_notify(CTRL_CMD_FLOW);
+}
+#endif
+
+/*
+ * Called with the TX queue depth after every enqueue and dequeue. Telling
+ * the host to pause keeps bursts from reaching the drop policy at all; if
+ * the control queue is full the notification is retried on the next call,
+ * or by the refresh timer.
+ */
+static void tx_flow_update(UBaseType_t depth)
+{
+#if CONFIG_BRIDGE_FLOW_CTRL
+    if (depth >= TX_FLOW_PAUSE_DEPTH) {
+        s_tx_paused = true;
+    } else if (depth <= TX_FLOW_RESUME_DEPTH) {
+        s_tx_paused = false;
+    }
+
+    if (s_tx_paused != s_tx_paused_sent) {
+        bridge_ctrl_notify(CTRL_CMD_FLOW);
+    }
+    if (s_tx_paused && !esp_timer_is_active(s_tx_flow_timer)) {
+        esp_timer_start_periodic(s_tx_flow_timer, CTRL_FLOW_REFRESH_MS * 1000);
+    }
+#endif
+}
 
 esp_err_t wifi_bridge_init(void)
 {
@@ -56,15 +206,41 @@ esp_err_t wifi_bridge_init(void)
         return ESP_FAIL;
     }
 
+#if !CONFIG_BRIDGE_MODE_PURE_L2
     // Create default WiFi station netif
     s_netif_sta = esp_netif_create_default_wifi_sta();
     if (s_netif_sta == NULL) {
         ESP_LOGE(TAG, "Failed to create netif");
         return ESP_FAIL;
     }
+#if CONFIG_BRIDGE_MODE_L2_NETIF
+    // The USB host runs DHCP over the bridged link; a firmware DHCP client
+    // would compete with it for the same STA MAC
+    esp_netif_dhcpc_stop(s_netif_sta);
+#endif
+#endif
+
+    s_link_lock = xSemaphoreCreateMutex();
+    if (s_link_lock == NULL) {
+        ESP_LOGE(TAG, "Failed to create link lock");
+        return ESP_FAIL;
+    }
+
+    const esp_timer_create_args_t retry_timer_args = {
+        .callback = retry_timer_cb,
+        .name = "wifi_retry",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&retry_timer_args, &s_retry_timer));
+
+    ESP_ERROR_CHECK(wifi_roam_init());
+
+    if (wifi_fastconn_init() != ESP_OK) {
+        ESP_LOGW(TAG, "Fast connect record unavailable");
+    }
 
     // Initialize WiFi with default configuration
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    wifi_profile_apply_init(&cfg);
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
     // Register event handlers
@@ -73,20 +249,64 @@ esp_err_t wifi_bridge_init(void)
                                                         &wifi_event_handler,
                                                         NULL,
                                                         NULL));
+    // esp_event runs ANY_ID handlers before the ones for a specific event,
+    // and those in registration order. The default netif registered its
+    // STA_CONNECTED handler, which installs lwIP's RX callback, above;
+    // this one comes after it and takes the STA data path over
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
+                                                        WIFI_EVENT_STA_CONNECTED,
+                                                        &wifi_connected_handler,
+                                                        NULL,
+                                                        NULL));
+#if CONFIG_BRIDGE_MODE_ROUTER
     ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
-                                                        IP_EVENT_STA_GOT_IP,
+                                                        ESP_EVENT_ANY_ID,
                                                         &ip_event_handler,
                                                         NULL,
                                                         NULL));
+#endif
 
     // Set WiFi mode to station
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_start());
+    ESP_ERROR_CHECK(wifi_profile_apply());
+    ESP_ERROR_CHECK(esp_wifi_get_mac(WIFI_IF_STA, s_sta_mac));
+#if CONFIG_BRIDGE_MODE_ROUTER
+    ESP_ERROR_CHECK(nat_router_init(s_sta_mac));
+#else
+    ESP_ERROR_CHECK(mac_nat_init(s_sta_mac));
+#endif
+
+    // Frames from USB wait in the per-class TX scheduler
+    ESP_ERROR_CHECK(tx_sched_init());
+    ESP_ERROR_CHECK(pkt_filter_init());
+    bridge_stats_queue_init(BRIDGE_QUEUE_WIFI_TX, TX_SCHED_LIMIT);
+#if CONFIG_BRIDGE_FLOW_CTRL
+    const esp_timer_create_args_t flow_timer_args = {
+        .callback = tx_flow_timer_cb,
+        .name = "tx_flow",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&flow_timer_args, &s_tx_flow_timer));
+    bridge_ctrl_register_notifier(CTRL_CMD_FLOW, tx_flow_notifier, tx_flow_sent);
+#endif
+
+    // The driver's RX callback is the only producer and wifi_rx_task the
+    // only consumer, so the RX path needs no lock
+    static pkt_desc_t rx_slots[RX_QUEUE_SIZE];
+    ESP_ERROR_CHECK(spsc_ring_init(&s_rx_ring, rx_slots, RX_QUEUE_SIZE));
+    bridge_stats_queue_init(BRIDGE_QUEUE_WIFI_RX, RX_QUEUE_SIZE);
+
+    // Start TX task
+    if (xTaskCreatePinnedToCore(wifi_tx_task, "wifi_tx", CONFIG_BRIDGE_TASK_WIFI_TX_STACK, NULL,
+                                CONFIG_BRIDGE_TASK_WIFI_TX_PRIO, NULL, BRIDGE_TASK_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create TX task");
+        return ESP_FAIL;
+    }
 
-    // Create TX queue for packets to send
-    s_tx_queue = xQueueCreate(TX_QUEUE_SIZE, sizeof(packet_t));
-    if (s_tx_queue == NULL) {
-        ESP_LOGE(TAG, "Failed to create TX queue");
+    // Start RX task
+    if (xTaskCreatePinnedToCore(wifi_rx_task, "wifi_rx", CONFIG_BRIDGE_TASK_WIFI_RX_STACK, NULL,
+                                CONFIG_BRIDGE_TASK_WIFI_RX_PRIO, NULL, BRIDGE_TASK_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create RX task");
         return ESP_FAIL;
     }
 
@@ -94,6 +314,64 @@ esp_err_t wifi_bridge_init(void)
     return ESP_OK;
 }
 
+// Caller holds s_link_lock. Associate with the remembered AP if there is
+// one, else scan
+static esp_err_t link_connect(void)
+{
+    wifi_config_t wifi_config = s_wifi_config;
+
+    s_fast_attempt = wifi_fastconn_prepare(&wifi_config.sta);
+    s_link_state = LINK_CONNECTING;
+
+    esp_err_t ret = esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+    if (ret == ESP_OK) {
+        ret = esp_wifi_connect();
+    }
+    return ret;
+}
+
+// Caller holds s_link_lock
+static void link_backoff(void)
+{
+    if (s_retry_num++ == 0) {
+        // Most drops (a missed beacon, a deauth on AP restart) clear at once
+        if (link_connect() == ESP_OK) {
+            ESP_LOGI(TAG, "Retry to connect to the AP");
+            return;
+        }
+    }
+    if (s_retry_num == WIFI_MAX_RETRY) {
+        xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
+        ESP_LOGW(TAG, "AP unreachable, retrying with backoff");
+    }
+
+    s_backoff_ms = s_backoff_ms == 0 ? WIFI_BACKOFF_MIN_MS : s_backoff_ms * 2;
+    if (s_backoff_ms > s_backoff_max_ms) {
+        s_backoff_ms = s_backoff_max_ms;
+    }
+    // Half the step is random so adapters that lost the same AP do not
+    // come back in lockstep
+    uint32_t delay_ms = s_backoff_ms / 2 + esp_random() % (s_backoff_ms / 2 + 1);
+
+    s_link_state = LINK_BACKOFF;
+    esp_timer_start_once(s_retry_timer, (uint64_t)delay_ms * 1000);
+    ESP_LOGI(TAG, "Reconnecting in %lu ms", (unsigned long)delay_ms);
+}
+
+static void retry_timer_cb(void *arg)
+{
+    // A connect or roam that stopped this timer after it fired has moved
+    // the state on, so the check below skips the stale attempt
+    xSemaphoreTake(s_link_lock, portMAX_DELAY);
+    if (s_link_state == LINK_ROAMING) {
+        ESP_LOGW(TAG, "Roam timed out");
+        link_backoff();
+    } else if (s_link_state == LINK_BACKOFF && link_connect() != ESP_OK) {
+        link_backoff();
+    }
+    xSemaphoreGive(s_link_lock);
+}
+
 esp_err_t wifi_bridge_connect(const char *ssid, const char *password)
 {
     if (ssid == NULL) {
@@ -109,49 +387,158 @@ esp_err_t wifi_bridge_connect(const char *ssid, const char *password)
     wifi_config.sta.threshold.authmode = WIFI_AUTH_WPA2_PSK;
     wifi_config.sta.pmf_cfg.capable = true;
     wifi_config.sta.pmf_cfg.required = false;
+    wifi_roam_config(&wifi_config.sta);
+
+    esp_err_t ret;
+    xSemaphoreTake(s_link_lock, portMAX_DELAY);
+    // Every attempt starts from this; fast connect details are added per
+    // attempt, a full scan uses it as it is
+    s_wifi_config = wifi_config;
+    esp_timer_stop(s_retry_timer);
+    s_retry_num = 0;
+    s_backoff_ms = 0;
+
+    if (s_link_state != LINK_IDLE && s_link_state != LINK_BACKOFF) {
+        // The disconnect event starts the first attempt with the new
+        // configuration
+        ESP_LOGI(TAG, "Leaving the AP to apply new credentials");
+        s_fast_attempt = false;
+        s_link_state = LINK_CONNECTING;
+        ret = esp_wifi_disconnect();
+    } else {
+        ret = link_connect();
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to start connecting: %s", esp_err_to_name(ret));
+        } else {
+            ESP_LOGI(TAG, "WiFi connection initiated");
+        }
+    }
+    xSemaphoreGive(s_link_lock);
+    return ret;
+}
 
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
-    ESP_ERROR_CHECK(esp_wifi_connect());
-
-    ESP_LOGI(TAG, "WiFi connection initiated");
+esp_err_t wifi_bridge_set_backoff_max(uint32_t max_ms)
+{
+    if (max_ms < WIFI_BACKOFF_MIN_MS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_backoff_max_ms = max_ms;
     return ESP_OK;
 }
 
+uint32_t wifi_bridge_get_backoff_max(void)
+{
+    return s_backoff_max_ms;
+}
+
 esp_err_t wifi_bridge_disconnect(void)
 {
+    xSemaphoreTake(s_link_lock, portMAX_DELAY);
+    s_link_state = LINK_IDLE;
+    esp_timer_stop(s_retry_timer);
     ESP_ERROR_CHECK(esp_wifi_disconnect());
+    xSemaphoreGive(s_link_lock);
     s_wifi_connected = false;
     return ESP_OK;
 }
 
+esp_err_t wifi_bridge_roam(const uint8_t bssid[6], uint8_t channel)
+{
+    xSemaphoreTake(s_link_lock, portMAX_DELAY);
+    if (s_link_state != LINK_UP) {
+        xSemaphoreGive(s_link_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    wifi_config_t wifi_config = s_wifi_config;
+
+    // Same network, so the remembered PMK is valid for the new AP too
+    wifi_fastconn_prepare(&wifi_config.sta);
+    memcpy(wifi_config.sta.bssid, bssid, sizeof(wifi_config.sta.bssid));
+    wifi_config.sta.bssid_set = true;
+    wifi_config.sta.channel = channel;
+
+    s_fast_attempt = false;
+    s_link_state = LINK_ROAMING;
+    esp_timer_stop(s_retry_timer);
+    esp_timer_start_once(s_retry_timer, ROAM_TIMEOUT_MS * 1000ULL);
+
+    esp_err_t ret = esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+    if (ret == ESP_OK) {
+        ret = esp_wifi_connect();
+    }
+    if (ret != ESP_OK) {
+        esp_timer_stop(s_retry_timer);
+        s_link_state = LINK_UP;
+    }
+    xSemaphoreGive(s_link_lock);
+    return ret;
+}
+
+static inline bridge_drop_t filter_drop_reason(pkt_filter_verdict_t verdict)
+{
+    return verdict == PKT_FILTER_LIMIT ? BRIDGE_DROP_RATE_LIMIT : BRIDGE_DROP_FILTERED;
+}
+
 bool wifi_bridge_is_connected(void)
 {
     return s_wifi_connected;
 }
 
-esp_err_t wifi_bridge_send_to_wifi(const uint8_t *data, uint16_t len)
+esp_err_t wifi_bridge_send_to_wifi(uint8_t *data, uint16_t len)
 {
-    if (!s_wifi_connected) {
-        ESP_LOGD(TAG, "WiFi not connected, dropping packet");
+#if !CONFIG_BRIDGE_MODE_ROUTER
+    // The router still answers ARP, ping and DHCP while WiFi is down
+    if (!s_wifi_connected && !tx_holding()) {
+        PKT_TRACE(PKT_TRACE_WIFI_TX_DROP, len, 0);
+        bridge_stats_drop(BRIDGE_DIR_USB_TO_WIFI, BRIDGE_DROP_NOT_CONNECTED);
+        pkt_pool_free(data);
         return ESP_ERR_WIFI_NOT_CONNECT;
     }
+#endif
 
-    if (len > MAX_PACKET_SIZE) {
-        ESP_LOGE(TAG, "Packet too large: %d", len);
+    if (len < ETH_HDR_LEN || len > WIFI_BRIDGE_MAX_FRAME) {
+        PKT_TRACE(PKT_TRACE_WIFI_TX_DROP, len, 0);
+        bridge_stats_drop(BRIDGE_DIR_USB_TO_WIFI, BRIDGE_DROP_BAD_SIZE);
+        pkt_pool_free(data);
         return ESP_ERR_INVALID_SIZE;
     }
 
-    // Queue packet for transmission
-    packet_t packet;
-    memcpy(packet.data, data, len);
-    packet.len = len;
+    pkt_filter_verdict_t verdict = pkt_filter_check(BRIDGE_DIR_USB_TO_WIFI, data, len);
+    if (verdict == PKT_FILTER_DROP || verdict == PKT_FILTER_LIMIT) {
+        PKT_TRACE(PKT_TRACE_WIFI_TX_DROP, len, 0);
+        bridge_stats_drop(BRIDGE_DIR_USB_TO_WIFI, filter_drop_reason(verdict));
+        pkt_pool_free(data);
+        return ESP_ERR_NOT_ALLOWED;
+    }
 
-    if (xQueueSend(s_tx_queue, &packet, pdMS_TO_TICKS(100)) != pdTRUE) {
-        ESP_LOGW(TAG, "TX queue full, dropping packet");
-        return ESP_ERR_NO_MEM;
+    // Queue packet for transmission (by reference, no copy)
+    pkt_desc_t desc = {
+        .data = data,
+        .len = len,
+    };
+
+    // Never wait here: this runs in the USB RX task, and stalling it lets
+    // the host overrun the USB RX ring instead
+    pkt_desc_t evicted;
+    esp_err_t ret = tx_sched_enqueue(&desc, tx_sched_classify(data, len), &evicted);
+    uint32_t depth = tx_sched_depth();
+
+    // Already counted by the scheduler
+    if (evicted.data != NULL) {
+        PKT_TRACE(PKT_TRACE_WIFI_TX_DROP, evicted.len, depth);
+        pkt_desc_free(&evicted);
     }
 
-    ESP_LOGD(TAG, "Queued %d bytes for WiFi transmission", len);
+    if (ret != ESP_OK) {
+        PKT_TRACE(PKT_TRACE_WIFI_TX_DROP, len, depth);
+        bridge_stats_drop(BRIDGE_DIR_USB_TO_WIFI, BRIDGE_DROP_QUEUE_FULL);
+        pkt_pool_free(data);
+        tx_flow_update(depth);
+        return ret;
+    }
+
+    PKT_TRACE(PKT_TRACE_WIFI_TX_QUEUE, len, depth);
+    tx_flow_update(depth);
     return ESP_OK;
 }
 
@@ -160,101 +547,369 @@ esp_err_t wifi_bridge_send_to_usb(const uint8_t *data, uint16_t len)
     return usb_cdc_ecm_send(data, len);
 }
 
+// Caller holds s_link_lock
+static void link_disconnected(void)
+{
+#if CONFIG_BRIDGE_OUTAGE_HOLD
+    if (s_link_state == LINK_UP || s_link_state == LINK_ROAMING) {
+        s_hold_start = xTaskGetTickCount();
+        s_tx_hold = true;
+    }
+#endif
+
+    // A roam leaves the old AP first; the new association, or the
+    // timeout, comes next
+    if (s_link_state == LINK_IDLE || s_link_state == LINK_ROAMING) {
+        return;
+    }
+    if (s_fast_attempt) {
+        // The AP moved or the PMK no longer fits: scan with the
+        // passphrase, without spending a retry
+        s_fast_attempt = false;
+        s_link_state = LINK_CONNECTING;
+        ESP_LOGI(TAG, "Fast connect failed, scanning");
+        if (esp_wifi_set_config(WIFI_IF_STA, &s_wifi_config) == ESP_OK &&
+            esp_wifi_connect() == ESP_OK) {
+            return;
+        }
+    }
+    link_backoff();
+}
+
 static void wifi_event_handler(void* arg, esp_event_base_t event_base,
                               int32_t event_id, void* event_data)
 {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
         ESP_LOGI(TAG, "WiFi station started");
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (s_retry_num < WIFI_MAX_RETRY) {
-            esp_wifi_connect();
-            s_retry_num++;
-            ESP_LOGI(TAG, "Retry to connect to the AP");
-        } else {
-            xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
-            ESP_LOGE(TAG, "Connect to the AP failed");
-        }
         s_wifi_connected = false;
+        xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
         ESP_LOGI(TAG, "WiFi disconnected");
-    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
-        ESP_LOGI(TAG, "WiFi connected to AP");
-        s_retry_num = 0;
+        wifi_roam_disconnected();
+        xSemaphoreTake(s_link_lock, portMAX_DELAY);
+        link_disconnected();
+        xSemaphoreGive(s_link_lock);
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_SCAN_DONE) {
+        wifi_roam_scan_done();
     }
 }
 
-static void ip_event_handler(void* arg, esp_event_base_t event_base,
-                            int32_t event_id, void* event_data)
+static void wifi_connected_handler(void *arg, esp_event_base_t event_base,
+                                   int32_t event_id, void *event_data)
+{
+    ESP_LOGI(TAG, "WiFi connected to AP");
+    xSemaphoreTake(s_link_lock, portMAX_DELAY);
+    s_retry_num = 0;
+    s_backoff_ms = 0;
+    s_fast_attempt = false;
+    s_link_state = LINK_UP;
+    esp_timer_stop(s_retry_timer);
+    xSemaphoreGive(s_link_lock);
+#if CONFIG_BRIDGE_OUTAGE_HOLD
+    s_tx_hold = false;
+#endif
+    xEventGroupClearBits(s_wifi_event_group, WIFI_FAIL_BIT);
+    wifi_fastconn_save((const wifi_event_sta_connected_t *)event_data);
+    wifi_roam_connected((const wifi_event_sta_connected_t *)event_data);
+
+    // Received frames go to USB instead of lwIP (in router mode, all but
+    // NAT replies are passed on to lwIP)
+    ESP_ERROR_CHECK(esp_wifi_internal_reg_rxcb(WIFI_IF_STA, wifi_rx_cb));
+    s_wifi_connected = true;
+    xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+}
+
+#if CONFIG_BRIDGE_MODE_ROUTER
+static void ip_event_handler(void *arg, esp_event_base_t event_base,
+                             int32_t event_id, void *event_data)
 {
     if (event_id == IP_EVENT_STA_GOT_IP) {
-        ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-        ESP_LOGI(TAG, "Got IP:" IPSTR, IP2STR(&event->ip_info.ip));
-        s_retry_num = 0;
-        xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
-        s_wifi_connected = true;
-
-        // Create raw socket for packet reception
-        // Note: Raw sockets in lwip have limitations compared to Linux
-        // For now, we'll use a simpler approach with UDP/TCP sockets
-        if (s_raw_socket < 0) {
-            // Using UDP socket for now - raw sockets require special handling in lwip
-            s_raw_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-            if (s_raw_socket >= 0) {
-                
-                // Start RX task
-                if (s_wifi_rx_task == NULL) {
-                    xTaskCreate(wifi_rx_task, "wifi_rx", 4096, NULL, 5, &s_wifi_rx_task);
-                }
-                
-                // Start TX task
-                xTaskCreate(wifi_tx_task, "wifi_tx", 4096, NULL, 5, NULL);
-                
-                ESP_LOGI(TAG, "Raw socket created for packet reception");
-            } else {
-                ESP_LOGE(TAG, "Failed to create raw socket");
-            }
+        const ip_event_got_ip_t *event = (const ip_event_got_ip_t *)event_data;
+        esp_netif_dns_info_t dns = {0};
+
+        if (esp_netif_get_dns_info(s_netif_sta, ESP_NETIF_DNS_MAIN, &dns) != ESP_OK ||
+            dns.ip.type != ESP_IPADDR_TYPE_V4) {
+            dns.ip.u_addr.ip4.addr = 0;
         }
+        nat_router_set_uplink(event->ip_info.ip.addr, event->ip_info.netmask.addr,
+                              event->ip_info.gw.addr, dns.ip.u_addr.ip4.addr);
+        ESP_LOGI(TAG, "Uplink address " IPSTR ", gateway " IPSTR,
+                 IP2STR(&event->ip_info.ip), IP2STR(&event->ip_info.gw));
+    } else if (event_id == IP_EVENT_STA_LOST_IP) {
+        nat_router_set_uplink(0, 0, 0, 0);
+        ESP_LOGI(TAG, "Uplink address lost");
+    }
+}
+#endif
+
+// Hand the 802.3 frame straight to the STA interface. The driver copies it
+// into its own TX buffer while converting to 802.11, so ours can be
+// released as soon as it returns
+static void wifi_tx_frame(const pkt_desc_t *desc)
+{
+    if (esp_wifi_internal_tx(WIFI_IF_STA, desc->data, desc->len) == ESP_OK) {
+        PKT_TRACE(PKT_TRACE_WIFI_TX, desc->len, tx_sched_depth());
+        PKT_CAPTURE(PKT_CAPTURE_WIFI_OUT, desc->data, desc->len);
+        bridge_stats_count(BRIDGE_DIR_USB_TO_WIFI, desc->len);
+    } else {
+        PKT_TRACE(PKT_TRACE_WIFI_TX_DROP, desc->len, tx_sched_depth());
+        bridge_stats_drop(BRIDGE_DIR_USB_TO_WIFI, BRIDGE_DROP_TX_FAIL);
+    }
+}
+
+#if CONFIG_BRIDGE_OUTAGE_HOLD
+// Wait for the reconnect with a frame in hand; the rest stay queued and
+// flow control pauses the host once the queue fills. Past the hold time,
+// counted from the disconnect, the queue drains as drops
+static void tx_hold_wait(void)
+{
+    TickType_t hold = pdMS_TO_TICKS(CONFIG_BRIDGE_OUTAGE_HOLD_MS);
+    TickType_t elapsed = xTaskGetTickCount() - s_hold_start;
+
+    if (elapsed < hold) {
+        xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdTRUE,
+                            hold - elapsed);
+    }
+    if (!s_wifi_connected && s_tx_hold) {
+        s_tx_hold = false;
+        ESP_LOGW(TAG, "Link still down, dropping %lu queued frames",
+                 (unsigned long)tx_sched_depth());
     }
 }
+#else
+static inline void tx_hold_wait(void)
+{
+}
+#endif
+
+#if CONFIG_BRIDGE_MODE_ROUTER
+static void router_tx(pkt_desc_t *desc)
+{
+    nat_router_verdict_t verdict = nat_router_tx(desc->data, &desc->len, PKT_BUF_MAX_FRAME);
+
+    if (verdict == NAT_ROUTER_REPLY) {
+        if (usb_cdc_ecm_send(desc->data, desc->len) == ESP_OK) {
+            usb_cdc_ecm_flush();
+        }
+        return;
+    }
+    if (verdict == NAT_ROUTER_DROP || verdict == NAT_ROUTER_RESOLVE) {
+        PKT_TRACE(PKT_TRACE_WIFI_TX_DROP, desc->len, tx_sched_depth());
+        bridge_stats_drop(BRIDGE_DIR_USB_TO_WIFI, BRIDGE_DROP_NO_ROUTE);
+    }
+    if (verdict == NAT_ROUTER_DROP) {
+        return;
+    }
+    if (!s_wifi_connected) {
+        if (verdict == NAT_ROUTER_FORWARD) {
+            PKT_TRACE(PKT_TRACE_WIFI_TX_DROP, desc->len, tx_sched_depth());
+            bridge_stats_drop(BRIDGE_DIR_USB_TO_WIFI, BRIDGE_DROP_NOT_CONNECTED);
+        }
+        return;
+    }
+
+    if (verdict == NAT_ROUTER_RESOLVE) {
+        // The frame now asks for the next hop's MAC; the original is gone
+        if (esp_wifi_internal_tx(WIFI_IF_STA, desc->data, desc->len) == ESP_OK) {
+            PKT_CAPTURE(PKT_CAPTURE_WIFI_OUT, desc->data, desc->len);
+        }
+        return;
+    }
+    wifi_tx_frame(desc);
+}
+#endif
 
 static void wifi_tx_task(void *arg)
 {
-    packet_t packet;
+    pkt_desc_t desc;
     ESP_LOGI(TAG, "WiFi TX task started");
-    ESP_LOGW(TAG, "Note: Raw packet transmission not fully implemented");
-    
+
     while (1) {
-        if (xQueueReceive(s_tx_queue, &packet, portMAX_DELAY) == pdTRUE) {
+        if (tx_sched_dequeue(&desc, portMAX_DELAY)) {
+            tx_flow_update(tx_sched_depth());
+#if CONFIG_BRIDGE_MODE_ROUTER
+            router_tx(&desc);
+#else
+            if (!s_wifi_connected && tx_holding()) {
+                tx_hold_wait();
+            }
             if (s_wifi_connected) {
-                // For now, log the packet
-                // In a full implementation, we'd parse the Ethernet frame,
-                // extract the IP packet, and send it via the netif layer
-                ESP_LOGD(TAG, "Received packet to send: %d bytes", packet.len);
-                // TODO: Implement proper packet transmission via netif
-                // This requires parsing Ethernet frames and routing IP packets
+                if (!(desc.flags & PKT_F_NO_NAT)) {
+                    mac_nat_tx(desc.data, desc.len);
+                }
+                wifi_tx_frame(&desc);
+            } else {
+                PKT_TRACE(PKT_TRACE_WIFI_TX_DROP, desc.len, tx_sched_depth());
+                bridge_stats_drop(BRIDGE_DIR_USB_TO_WIFI, BRIDGE_DROP_NOT_CONNECTED);
             }
+#endif
+            pkt_desc_free(&desc);
         }
     }
 }
 
-static void wifi_rx_task(void *arg)
+#if CONFIG_BRIDGE_FILTER_ARP_PROXY
+// Answer an ARP request from the WiFi side for a USB client's address the
+// way the client would, without a round trip over USB. The reply carries
+// the STA MAC already. false leaves the request to the host
+static bool arp_proxy_reply(const uint8_t *frame, uint16_t len)
 {
-    uint8_t *buffer = (uint8_t *)malloc(MAX_PACKET_SIZE);
-    if (buffer == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate RX buffer");
-        vTaskDelete(NULL);
-        return;
+    static const uint8_t arp_req_hdr[8] = { 0x00, 0x01, 0x08, 0x00, 6, 4, 0x00, 0x01 };
+    const uint8_t *arp = frame + ETH_HDR_LEN;
+
+    if (len < ETH_HDR_LEN + ARP_LEN || frame[12] != 0x08 || frame[13] != 0x06 ||
+        memcmp(arp, arp_req_hdr, sizeof(arp_req_hdr)) != 0 || !s_wifi_connected) {
+        return false;
+    }
+    // Gratuitous ARP announces the sender; nothing to answer
+    if (memcmp(arp + ARP_SPA, arp + ARP_TPA, 4) == 0 ||
+        !mac_nat_is_client(arp + ARP_TPA, ARP_PROXY_MAX_AGE_MS)) {
+        return false;
     }
 
+    uint8_t *reply = pkt_pool_alloc();
+    if (reply == NULL) {
+        return false;
+    }
+    memcpy(reply, frame + 6, 6);
+    memcpy(reply + 6, s_sta_mac, 6);
+    reply[12] = 0x08;
+    reply[13] = 0x06;
+    uint8_t *r = reply + ETH_HDR_LEN;
+    memcpy(r, arp_req_hdr, 6);
+    r[6] = 0x00;
+    r[7] = 0x02;
+    memcpy(r + ARP_SHA, s_sta_mac, 6);
+    memcpy(r + ARP_SPA, arp + ARP_TPA, 4);
+    memcpy(r + ARP_THA, arp + ARP_SHA, 6);
+    memcpy(r + ARP_TPA, arp + ARP_SPA, 4);
+
+    pkt_desc_t desc = {
+        .data = reply,
+        .len = ETH_HDR_LEN + ARP_LEN,
+        .flags = PKT_F_NO_NAT,
+    };
+    pkt_desc_t evicted;
+    esp_err_t ret = tx_sched_enqueue(&desc, TX_CLASS_CTRL, &evicted);
+    if (evicted.data != NULL) {
+        pkt_desc_free(&evicted);
+    }
+    if (ret != ESP_OK) {
+        pkt_pool_free(reply);
+        return false;
+    }
+    return true;
+}
+#else
+static inline bool arp_proxy_reply(const uint8_t *frame, uint16_t len)
+{
+    return false;
+}
+#endif
+
+/*
+ * Called from the WiFi driver task for every 802.3 frame received on the
+ * STA interface. It must not block: the frame is queued by reference and
+ * dropped if the USB side has fallen behind.
+ */
+static esp_err_t wifi_rx_cb(void *buffer, uint16_t len, void *eb)
+{
+    if (len < ETH_HDR_LEN) {
+        bridge_stats_drop(BRIDGE_DIR_WIFI_TO_USB, BRIDGE_DROP_BAD_SIZE);
+        esp_wifi_internal_free_rx_buffer(eb);
+        return ESP_OK;
+    }
+    PKT_CAPTURE(PKT_CAPTURE_WIFI_IN, buffer, len);
+
+    if (bench_wifi_sink(buffer, len)) {
+        esp_wifi_internal_free_rx_buffer(eb);
+        return ESP_OK;
+    }
+
+#if CONFIG_BRIDGE_MODE_ROUTER
+    // Everything but NAT replies is for the station's own IP stack; the
+    // filter is for what goes on to USB
+    nat_router_snoop(buffer, len);
+    if (!nat_router_rx_match(buffer, len)) {
+        return esp_netif_receive(s_netif_sta, buffer, len, eb);
+    }
+#endif
+
+    pkt_filter_verdict_t verdict = pkt_filter_check(BRIDGE_DIR_WIFI_TO_USB, buffer, len);
+    if (verdict == PKT_FILTER_ARP_PROXY && arp_proxy_reply(buffer, len)) {
+        esp_wifi_internal_free_rx_buffer(eb);
+        return ESP_OK;
+    }
+    if (verdict == PKT_FILTER_DROP || verdict == PKT_FILTER_LIMIT) {
+        PKT_TRACE(PKT_TRACE_WIFI_RX_DROP, len, 0);
+        bridge_stats_drop(BRIDGE_DIR_WIFI_TO_USB, filter_drop_reason(verdict));
+        esp_wifi_internal_free_rx_buffer(eb);
+        return ESP_OK;
+    }
+
+    pkt_desc_t desc = {
+        .data = buffer,
+        .len = len,
+        .flags = PKT_F_WIFI_RX,
+        .eb = eb,
+    };
+
+    if (!spsc_ring_push(&s_rx_ring, &desc)) {
+        PKT_TRACE(PKT_TRACE_WIFI_RX_DROP, len, RX_QUEUE_SIZE);
+        bridge_stats_drop(BRIDGE_DIR_WIFI_TO_USB, BRIDGE_DROP_QUEUE_FULL);
+        esp_wifi_internal_free_rx_buffer(eb);
+        return ESP_OK;
+    }
+
+    uint32_t depth = spsc_ring_count(&s_rx_ring);
+    bridge_stats_queue_depth(BRIDGE_QUEUE_WIFI_RX, depth);
+    PKT_TRACE(PKT_TRACE_WIFI_RX, len, depth);
+    return ESP_OK;
+}
+
+static void wifi_rx_task(void *arg)
+{
+    pkt_desc_t batch[RX_BATCH];
     ESP_LOGI(TAG, "WiFi RX task started");
-    ESP_LOGW(TAG, "Note: WiFi RX via raw sockets not fully implemented - using netif layer");
 
-    // For now, this task is a placeholder
-    // In a full implementation, we'd need to use esp_netif callbacks
-    // or implement proper packet capture
     while (1) {
-        vTaskDelay(pdMS_TO_TICKS(1000));
-        // TODO: Implement proper packet reception from WiFi
-        // This would require using esp_netif callbacks or custom netif hooks
+        if (!spsc_ring_wait(&s_rx_ring, portMAX_DELAY)) {
+            continue;
+        }
+
+        // One wakeup drains everything that arrived meanwhile
+        size_t n;
+        while ((n = spsc_ring_pop(&s_rx_ring, batch, RX_BATCH)) > 0) {
+            for (size_t i = 0; i < n; i++) {
+                pkt_desc_t *desc = &batch[i];
+                uint32_t cycles = bench_mode_is(BENCH_MODE_CYCLES_WIFI) ?
+                                  esp_cpu_get_cycle_count() : 0;
+#if CONFIG_BRIDGE_MODE_ROUTER
+                if (!nat_router_rx(desc->data, desc->len)) {
+                    bridge_stats_drop(BRIDGE_DIR_WIFI_TO_USB, BRIDGE_DROP_NO_ROUTE);
+                    pkt_desc_free(desc);
+                    continue;
+                }
+#else
+                mac_nat_rx(desc->data, desc->len);
+#endif
+                esp_err_t ret = usb_cdc_ecm_send(desc->data, desc->len);
+                if (ret == ESP_OK) {
+                    bridge_stats_count(BRIDGE_DIR_WIFI_TO_USB, desc->len);
+                } else {
+                    // ESP_ERR_NO_MEM: the host is not reading fast enough
+                    PKT_TRACE(PKT_TRACE_WIFI_RX_DROP, desc->len, spsc_ring_count(&s_rx_ring));
+                    bridge_stats_drop(BRIDGE_DIR_WIFI_TO_USB, ret == ESP_ERR_NO_MEM ?
+                                      BRIDGE_DROP_QUEUE_FULL : BRIDGE_DROP_TX_FAIL);
+                }
+                pkt_desc_free(desc);
+                if (bench_mode_is(BENCH_MODE_CYCLES_WIFI)) {
+                    bench_account(desc->len, ret == ESP_OK, esp_cpu_get_cycle_count() - cycles);
+                }
+            }
+        }
+
+        // Let frames that arrived together leave in one USB transfer
+        usb_cdc_ecm_flush();
     }
 }
-
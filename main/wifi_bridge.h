@@ -2,6 +2,11 @@
 #define WIFI_BRIDGE_H
 
 #include "esp_err.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Largest frame wifi_bridge_send_to_wifi() accepts
+#define WIFI_BRIDGE_MAX_FRAME   1514    // Ethernet header + 1500-byte MTU
 
 /**
  * @brief Initialize WiFi bridge module
@@ -13,6 +18,9 @@ esp_err_t wifi_bridge_init(void);
 /**
  * @brief Connect to WiFi network
  * 
+ * While connected or connecting, leaves the current AP first and
+ * reconnects with the new credentials.
+ * 
  * @param ssid WiFi SSID
  * @param password WiFi password
  * @return esp_err_t ESP_OK on success
@@ -26,6 +34,34 @@ esp_err_t wifi_bridge_connect(const char *ssid, const char *password);
  */
 esp_err_t wifi_bridge_disconnect(void);
 
+/**
+ * @brief Set the longest reconnect backoff step
+ * 
+ * @param max_ms Upper bound in milliseconds, at least WIFI_BACKOFF_MIN_MS
+ * @return esp_err_t ESP_OK on success, ESP_ERR_INVALID_ARG if too small
+ */
+esp_err_t wifi_bridge_set_backoff_max(uint32_t max_ms);
+
+/**
+ * @brief Get the longest reconnect backoff step
+ * 
+ * @return Upper bound in milliseconds
+ */
+uint32_t wifi_bridge_get_backoff_max(void);
+
+/**
+ * @brief Move the connection to another AP of the same network
+ * 
+ * Queued frames are kept across the handoff as during a reconnect. If the
+ * new AP has not accepted the station within two seconds, it reconnects
+ * to the remembered one.
+ * 
+ * @param bssid BSSID of the new AP
+ * @param channel Its primary channel
+ * @return esp_err_t ESP_OK if the handoff was started
+ */
+esp_err_t wifi_bridge_roam(const uint8_t bssid[6], uint8_t channel);
+
 /**
  * @brief Get WiFi connection status
  * 
@@ -36,11 +72,14 @@ bool wifi_bridge_is_connected(void);
 /**
  * @brief Send packet from USB to WiFi
  * 
- * @param data Packet data
+ * The frame is queued by reference: ownership of the buffer passes to the
+ * bridge, which returns it to the packet pool after transmission or on error.
+ * 
+ * @param data Ethernet frame in a buffer from pkt_pool_alloc()
  * @param len Packet length
  * @return esp_err_t ESP_OK on success
  */
-esp_err_t wifi_bridge_send_to_wifi(const uint8_t *data, uint16_t len);
+esp_err_t wifi_bridge_send_to_wifi(uint8_t *data, uint16_t len);
 
 /**
  * @brief Send packet from WiFi to USB
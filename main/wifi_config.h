@@ -6,9 +6,14 @@
 #define WIFI_SSID      "zainar_ssid"
 #define WIFI_PASSWORD  "zainar_pswd"
 
-// Maximum retry attempts
+// Failed attempts before WIFI_FAIL_BIT is set; reconnecting never stops
 #define WIFI_MAX_RETRY  5
 
+// Reconnect backoff: doubles from the minimum up to the maximum, with
+// half of each step random
+#define WIFI_BACKOFF_MIN_MS  250
+#define WIFI_BACKOFF_MAX_MS  30000
+
 // WiFi event group bits
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT      BIT1
@@ -0,0 +1,171 @@
+/*
+ * WiFi Fast Connect
+ * Remembers the last AP and the derived PMK so a boot can skip the
+ * all-channel scan and the passphrase derivation
+ */
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "nvs.h"
+#include "mbedtls/pkcs5.h"
+
+#include "wifi_fastconn.h"
+
+static const char *TAG = "wifi_fastconn";
+
+#define NVS_NAMESPACE       "bridge"
+#define NVS_KEY_AP          "fastconn"
+#define RECORD_VERSION      1
+#define PMK_LEN             32
+#define PSK_ITERATIONS      4096    // IEEE 802.11i passphrase-to-PSK mapping
+
+typedef struct {
+    uint8_t version;            // RECORD_VERSION; 0: nothing loaded
+    uint8_t channel;            // 0: no AP remembered
+    uint8_t authmode;           // wifi_auth_mode_t the AP advertised
+    uint8_t pmk_valid;
+    uint32_t cred_hash;         // SSID and password the record belongs to
+    uint8_t bssid[6];
+    uint8_t pmk[PMK_LEN];
+} fastconn_record_t;
+
+static fastconn_record_t s_record;
+static bool s_dirty;            // s_record differs from NVS
+
+// FNV-1a; only tells whether the credentials changed, so this record holds
+// no copy of the password. One saved with CONFIG_SET (bridge_config.c) is
+// in NVS as plain text.
+static uint32_t cred_hash(const uint8_t *ssid, size_t ssid_len,
+                          const uint8_t *password, size_t password_len)
+{
+    uint32_t h = 2166136261u;
+
+    h = (h ^ ssid_len) * 16777619u;
+    for (size_t i = 0; i < ssid_len; i++) {
+        h = (h ^ ssid[i]) * 16777619u;
+    }
+    for (size_t i = 0; i < password_len; i++) {
+        h = (h ^ password[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void record_store(void)
+{
+    nvs_handle_t nvs;
+    esp_err_t ret = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+
+    if (ret == ESP_OK) {
+        ret = nvs_set_blob(nvs, NVS_KEY_AP, &s_record, sizeof(s_record));
+        if (ret == ESP_OK) {
+            ret = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to store AP record: %s", esp_err_to_name(ret));
+        return;
+    }
+    s_dirty = false;
+}
+
+esp_err_t wifi_fastconn_init(void)
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(s_record);
+
+    memset(&s_record, 0, sizeof(s_record));
+    s_dirty = false;
+
+    esp_err_t ret = nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs);
+    if (ret == ESP_ERR_NVS_NOT_FOUND) {
+        return ESP_OK;          // first boot: the namespace is created on store
+    }
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    ret = nvs_get_blob(nvs, NVS_KEY_AP, &s_record, &len);
+    nvs_close(nvs);
+
+    if (ret != ESP_OK || len != sizeof(s_record) || s_record.version != RECORD_VERSION) {
+        memset(&s_record, 0, sizeof(s_record));
+    }
+    return ESP_OK;
+}
+
+bool wifi_fastconn_prepare(wifi_sta_config_t *sta)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t ssid_len = strnlen((const char *)sta->ssid, sizeof(sta->ssid));
+    size_t password_len = strnlen((const char *)sta->password, sizeof(sta->password));
+    uint32_t hash = cred_hash(sta->ssid, ssid_len, sta->password, password_len);
+    bool changed = false;
+
+    if (s_record.version != RECORD_VERSION || s_record.cred_hash != hash) {
+        memset(&s_record, 0, sizeof(s_record));
+        s_record.version = RECORD_VERSION;
+        s_record.cred_hash = hash;
+    }
+
+    if (s_record.channel != 0) {
+        memcpy(sta->bssid, s_record.bssid, sizeof(sta->bssid));
+        sta->bssid_set = true;
+        sta->channel = s_record.channel;
+        changed = true;
+        ESP_LOGI(TAG, "Directed connect to " MACSTR " on channel %d",
+                 MAC2STR(s_record.bssid), s_record.channel);
+    }
+
+    // Only a passphrase maps to a PSK (64 characters already is one), and
+    // SAE needs the passphrase itself
+    if (password_len < 8 || password_len >= 64 || s_record.authmode == WIFI_AUTH_WPA3_PSK) {
+        return changed;
+    }
+
+    if (!s_record.pmk_valid) {
+        int64_t start = esp_timer_get_time();
+        if (mbedtls_pkcs5_pbkdf2_hmac_ext(MBEDTLS_MD_SHA1, sta->password, password_len,
+                                          sta->ssid, ssid_len, PSK_ITERATIONS, PMK_LEN,
+                                          s_record.pmk) != 0) {
+            ESP_LOGW(TAG, "PMK derivation failed");
+            return changed;
+        }
+        // Stored with the AP once the association succeeds
+        s_record.pmk_valid = true;
+        s_dirty = true;
+        ESP_LOGI(TAG, "PMK derived in %d ms", (int)((esp_timer_get_time() - start) / 1000));
+    }
+
+    for (int i = 0; i < PMK_LEN; i++) {
+        sta->password[2 * i] = hex[s_record.pmk[i] >> 4];
+        sta->password[2 * i + 1] = hex[s_record.pmk[i] & 0x0f];
+    }
+    return true;
+}
+
+void wifi_fastconn_save(const wifi_event_sta_connected_t *event)
+{
+    if (s_record.version != RECORD_VERSION) {
+        return;
+    }
+
+    if (s_record.channel != event->channel || s_record.authmode != event->authmode ||
+        memcmp(s_record.bssid, event->bssid, sizeof(s_record.bssid)) != 0) {
+        memcpy(s_record.bssid, event->bssid, sizeof(s_record.bssid));
+        s_record.channel = event->channel;
+        s_record.authmode = event->authmode;
+        s_dirty = true;
+    }
+    if (event->authmode == WIFI_AUTH_WPA3_PSK && s_record.pmk_valid) {
+        memset(s_record.pmk, 0, sizeof(s_record.pmk));
+        s_record.pmk_valid = false;
+        s_dirty = true;
+    }
+
+    if (s_dirty) {
+        record_store();
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef WIFI_FASTCONN_H
+#define WIFI_FASTCONN_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include "esp_wifi.h"
+#include "sdkconfig.h"
+
+#if CONFIG_BRIDGE_FAST_CONNECT
+
+/**
+ * @brief Load the remembered AP and PMK from NVS
+ *
+ * A missing or outdated record is not an error; the first connect then
+ * scans as usual and stores a new one.
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t wifi_fastconn_init(void);
+
+/**
+ * @brief Turn a station config into a fast-connect one
+ *
+ * If the SSID and password match the remembered record, the AP's BSSID and
+ * channel are filled in so the driver probes one channel instead of
+ * scanning all of them. For WPA/WPA2-PSK the passphrase is replaced by the
+ * PMK as 64 hex digits, which skips the 4096-round PBKDF2 derivation; the
+ * first boot derives it here, once.
+ *
+ * @param sta Station config with SSID and password set
+ * @return true if the config was changed; if that attempt fails, connect
+ * again with the original config
+ */
+bool wifi_fastconn_prepare(wifi_sta_config_t *sta);
+
+/**
+ * @brief Remember the AP the station has just associated with
+ *
+ * Writes NVS only when something changed.
+ *
+ * @param event WIFI_EVENT_STA_CONNECTED data
+ */
+void wifi_fastconn_save(const wifi_event_sta_connected_t *event);
+
+#else
+
+static inline esp_err_t wifi_fastconn_init(void)
+{
+    return ESP_OK;
+}
+
+static inline bool wifi_fastconn_prepare(wifi_sta_config_t *sta)
+{
+    return false;
+}
+
+static inline void wifi_fastconn_save(const wifi_event_sta_connected_t *event)
+{
+}
+
+#endif // CONFIG_BRIDGE_FAST_CONNECT
+
+#endif // WIFI_FASTCONN_H
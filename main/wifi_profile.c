@@ -0,0 +1,99 @@
+/*
+ * WiFi Driver Profiles
+ * Named buffer, block ack, bandwidth and power save presets
+ */
+
+#include <stdbool.h>
+#include "esp_log.h"
+#include "esp_wifi.h"
+
+#include "wifi_profile.h"
+
+static const char *TAG = "wifi_profile";
+
+typedef struct {
+    const char *name;
+    int static_rx_buf;
+    int dynamic_rx_buf;
+    int dynamic_tx_buf;
+    bool ampdu_tx;
+    bool ampdu_rx;
+    int rx_ba_win;              // at most 2 * static_rx_buf
+    wifi_bandwidth_t bw;
+} wifi_profile_t;
+
+#if CONFIG_BRIDGE_WIFI_PROFILE_THROUGHPUT
+// Espressif's iperf settings for the ESP32-C3
+static const wifi_profile_t s_profile = {
+    .name = "throughput",
+    .static_rx_buf = 16,
+    .dynamic_rx_buf = 64,
+    .dynamic_tx_buf = 64,
+    .ampdu_tx = true,
+    .ampdu_rx = true,
+    .rx_ba_win = 32,
+    .bw = WIFI_BW_HT40,
+};
+#elif CONFIG_BRIDGE_WIFI_PROFILE_LOW_LATENCY
+// Short aggregates: a lost frame holds back at most a few behind it in the
+// receiver's reorder buffer
+static const wifi_profile_t s_profile = {
+    .name = "low-latency",
+    .static_rx_buf = 10,
+    .dynamic_rx_buf = 32,
+    .dynamic_tx_buf = 32,
+    .ampdu_tx = true,
+    .ampdu_rx = true,
+    .rx_ba_win = 6,
+    .bw = WIFI_BW_HT20,
+};
+#elif CONFIG_BRIDGE_WIFI_PROFILE_LOW_MEMORY
+static const wifi_profile_t s_profile = {
+    .name = "low-memory",
+    .static_rx_buf = 4,
+    .dynamic_rx_buf = 16,
+    .dynamic_tx_buf = 16,
+    .ampdu_tx = false,
+    .ampdu_rx = true,
+    .rx_ba_win = 4,
+    .bw = WIFI_BW_HT20,
+};
+#endif
+
+void wifi_profile_apply_init(wifi_init_config_t *cfg)
+{
+#if !CONFIG_BRIDGE_WIFI_PROFILE_SDKCONFIG
+    cfg->static_rx_buf_num = s_profile.static_rx_buf;
+    cfg->dynamic_rx_buf_num = s_profile.dynamic_rx_buf;
+    // Only the dynamic TX buffer count has an effect with static buffers off
+    cfg->dynamic_tx_buf_num = s_profile.dynamic_tx_buf;
+    cfg->ampdu_tx_enable = s_profile.ampdu_tx;
+    cfg->ampdu_rx_enable = s_profile.ampdu_rx;
+    cfg->rx_ba_win = s_profile.ampdu_rx ? s_profile.rx_ba_win : 0;
+    ESP_LOGI(TAG, "Profile %s: %d+%d RX, %d TX buffers, RX window %d", s_profile.name,
+             cfg->static_rx_buf_num, cfg->dynamic_rx_buf_num, cfg->dynamic_tx_buf_num,
+             cfg->rx_ba_win);
+#else
+    (void)cfg;
+#endif
+}
+
+esp_err_t wifi_profile_apply(void)
+{
+#if !CONFIG_BRIDGE_WIFI_PROFILE_SDKCONFIG
+    // Modem sleep holds frames for the AP's DTIM beacons; every profile
+    // keeps the radio awake
+    esp_err_t ret = esp_wifi_set_ps(WIFI_PS_NONE);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to disable power save: %s", esp_err_to_name(ret));
+        return ret;
+    }
+
+    ret = esp_wifi_set_bandwidth(WIFI_IF_STA, s_profile.bw);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to set bandwidth: %s", esp_err_to_name(ret));
+        return ret;
+    }
+#endif
+    return ESP_OK;
+}
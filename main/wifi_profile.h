@@ -0,0 +1,27 @@
+#ifndef WIFI_PROFILE_H
+#define WIFI_PROFILE_H
+
+#include "esp_err.h"
+#include "esp_wifi.h"
+
+/**
+ * @brief Apply the driver profile's buffer counts and block ack window
+ * to an init config (CONFIG_BRIDGE_WIFI_PROFILE)
+ *
+ * Call on the result of WIFI_INIT_CONFIG_DEFAULT() before esp_wifi_init().
+ * The component defaults profile leaves the config untouched.
+ *
+ * @param cfg WiFi init config
+ */
+void wifi_profile_apply_init(wifi_init_config_t *cfg);
+
+/**
+ * @brief Apply the driver profile's power save mode and STA bandwidth
+ *
+ * Call after esp_wifi_start().
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t wifi_profile_apply(void);
+
+#endif // WIFI_PROFILE_H
@@ -0,0 +1,224 @@
+/*
+ * WiFi Roaming
+ * Moves the station to a stronger AP of the same network
+ */
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "esp_wnm.h"
+
+#include "wifi_roam.h"
+#include "wifi_bridge.h"
+#include "bridge_stats.h"
+
+static const char *TAG = "wifi_roam";
+
+#define ROAM_TICK_MS        2000
+#define ROAM_SETTLE_MS      5000    // after associating, before judging the link
+#define ROAM_COOLDOWN_MS    30000   // after a roam
+#define ROAM_BUSY_PPS       500     // frames/s above which a scan waits
+#define ROAM_MAX_DEFER      3       // ticks a weak link waits for a quiet moment
+#define ROAM_TX_FAIL_PCT    10
+#define ROAM_TX_MIN_FRAMES  50      // sample size for the failure rate
+#define ROAM_SCAN_MIN_MS    10      // off-channel time per probe
+#define ROAM_SCAN_MAX_MS    40
+#define ROAM_MAX_RESULTS    8
+#define ROAM_CHANNEL_MAX    13
+
+// Non-overlapping 2.4 GHz channels, where other APs are most likely;
+// channels seen in scans are added
+#define ROAM_BASE_CHANNELS  ((1 << 1) | (1 << 6) | (1 << 11))
+
+static esp_timer_handle_t s_tick_timer;
+static volatile bool s_active;      // associated
+static volatile bool s_scanning;    // our scan is in progress
+static uint8_t s_ssid[33];
+static uint8_t s_bssid[6];
+static int8_t s_rssi;               // current AP, last tick
+static uint16_t s_channels;         // bit n: probe channel n
+static uint8_t s_scan_channel;
+static uint8_t s_defer;
+static bool s_btm_queried;
+static int64_t s_quiet_until;       // no decision before this, esp_timer time
+static uint32_t s_last_tx;
+static uint32_t s_last_tx_fail;
+static uint32_t s_last_rx;
+
+// Probe the next candidate channel for the current SSID
+static void roam_scan_next(void)
+{
+    for (int i = 0; i < ROAM_CHANNEL_MAX; i++) {
+        s_scan_channel = s_scan_channel % ROAM_CHANNEL_MAX + 1;
+        if (s_channels & (1 << s_scan_channel)) {
+            break;
+        }
+    }
+
+    wifi_scan_config_t scan = {
+        .ssid = s_ssid,
+        .channel = s_scan_channel,
+        .scan_type = WIFI_SCAN_TYPE_ACTIVE,
+        .scan_time.active = {
+            .min = ROAM_SCAN_MIN_MS,
+            .max = ROAM_SCAN_MAX_MS,
+        },
+    };
+
+    s_scanning = true;
+    if (esp_wifi_scan_start(&scan, false) != ESP_OK) {
+        s_scanning = false;
+    }
+}
+
+static void roam_tick(void *arg)
+{
+    wifi_ap_record_t ap;
+    bridge_stats_t stats;
+
+    if (!s_active || s_scanning || esp_wifi_sta_get_ap_info(&ap) != ESP_OK ||
+        bridge_stats_get(&stats) != ESP_OK) {
+        return;
+    }
+
+    uint32_t tx = stats.dir[BRIDGE_DIR_USB_TO_WIFI].packets;
+    uint32_t tx_fail = stats.dir[BRIDGE_DIR_USB_TO_WIFI].drops[BRIDGE_DROP_TX_FAIL];
+    uint32_t rx = stats.dir[BRIDGE_DIR_WIFI_TO_USB].packets;
+    // A host-side reset of the counters reads as a quiet interval
+    uint32_t d_tx = tx >= s_last_tx ? tx - s_last_tx : 0;
+    uint32_t d_tx_fail = tx_fail >= s_last_tx_fail ? tx_fail - s_last_tx_fail : 0;
+    uint32_t d_rx = rx >= s_last_rx ? rx - s_last_rx : 0;
+    s_last_tx = tx;
+    s_last_tx_fail = tx_fail;
+    s_last_rx = rx;
+    s_rssi = ap.rssi;
+
+    // The driver rejects frames when its TX buffers stay full, which on a
+    // weak link means the AP is only reachable at the lowest rates
+    uint32_t attempts = d_tx + d_tx_fail;
+    bool lossy = attempts >= ROAM_TX_MIN_FRAMES &&
+                 d_tx_fail * 100 > attempts * ROAM_TX_FAIL_PCT;
+    bool weak = ap.rssi < CONFIG_BRIDGE_ROAM_RSSI;
+
+    if ((!weak && !lossy) || esp_timer_get_time() < s_quiet_until) {
+        s_defer = 0;
+        return;
+    }
+
+    // With btm_enabled the driver follows the AP's transition request on
+    // its own; the AP knows its neighbours better than a scan does
+    if (!s_btm_queried && esp_wnm_is_btm_supported_connection()) {
+        s_btm_queried = true;
+        ESP_LOGI(TAG, "Weak link (%d dBm), asking the AP for a transition", ap.rssi);
+        esp_wnm_send_bss_transition_mgmt_query(REASON_LOW_RSSI, NULL, 0);
+        return;
+    }
+
+    // Every probe takes the radio off channel; wait for a lull, but not
+    // for ever
+    if ((d_tx + d_rx) * 1000 / ROAM_TICK_MS > ROAM_BUSY_PPS && s_defer < ROAM_MAX_DEFER) {
+        s_defer++;
+        return;
+    }
+    s_defer = 0;
+    roam_scan_next();
+}
+
+esp_err_t wifi_roam_init(void)
+{
+    const esp_timer_create_args_t tick_args = {
+        .callback = roam_tick,
+        .name = "wifi_roam",
+    };
+
+    s_channels = ROAM_BASE_CHANNELS;
+    return esp_timer_create(&tick_args, &s_tick_timer);
+}
+
+void wifi_roam_config(wifi_sta_config_t *sta)
+{
+    sta->rm_enabled = 1;
+    sta->btm_enabled = 1;
+    sta->ft_enabled = 1;
+}
+
+void wifi_roam_connected(const wifi_event_sta_connected_t *event)
+{
+    bridge_stats_t stats;
+    int64_t settle = esp_timer_get_time() + ROAM_SETTLE_MS * 1000LL;
+
+    memset(s_ssid, 0, sizeof(s_ssid));
+    memcpy(s_ssid, event->ssid, event->ssid_len < 32 ? event->ssid_len : 32);
+    memcpy(s_bssid, event->bssid, sizeof(s_bssid));
+    if (event->channel >= 1 && event->channel <= ROAM_CHANNEL_MAX) {
+        s_channels |= 1 << event->channel;
+    }
+    s_btm_queried = false;
+    s_defer = 0;
+    if (s_quiet_until < settle) {
+        s_quiet_until = settle;
+    }
+    if (bridge_stats_get(&stats) == ESP_OK) {
+        s_last_tx = stats.dir[BRIDGE_DIR_USB_TO_WIFI].packets;
+        s_last_tx_fail = stats.dir[BRIDGE_DIR_USB_TO_WIFI].drops[BRIDGE_DROP_TX_FAIL];
+        s_last_rx = stats.dir[BRIDGE_DIR_WIFI_TO_USB].packets;
+    }
+
+    s_active = true;
+    esp_timer_stop(s_tick_timer);
+    esp_timer_start_periodic(s_tick_timer, ROAM_TICK_MS * 1000ULL);
+}
+
+void wifi_roam_disconnected(void)
+{
+    s_active = false;
+    esp_timer_stop(s_tick_timer);
+    if (s_scanning) {
+        esp_wifi_scan_stop();
+        s_scanning = false;
+    }
+}
+
+void wifi_roam_scan_done(void)
+{
+    wifi_ap_record_t records[ROAM_MAX_RESULTS];
+    uint16_t count = ROAM_MAX_RESULTS;
+    const wifi_ap_record_t *best = NULL;
+
+    if (!s_scanning) {
+        return;
+    }
+    s_scanning = false;
+
+    // Also frees the driver's copy of the results
+    if (esp_wifi_scan_get_ap_records(&count, records) != ESP_OK || !s_active) {
+        return;
+    }
+
+    for (uint16_t i = 0; i < count; i++) {
+        const wifi_ap_record_t *r = &records[i];
+        if (strcmp((const char *)r->ssid, (const char *)s_ssid) != 0 ||
+            memcmp(r->bssid, s_bssid, sizeof(s_bssid)) == 0) {
+            continue;
+        }
+        if (r->primary >= 1 && r->primary <= ROAM_CHANNEL_MAX) {
+            s_channels |= 1 << r->primary;
+        }
+        if (best == NULL || r->rssi > best->rssi) {
+            best = r;
+        }
+    }
+
+    if (best == NULL || best->rssi < s_rssi + CONFIG_BRIDGE_ROAM_HYSTERESIS) {
+        return;
+    }
+
+    ESP_LOGI(TAG, "Roaming from %d dBm to " MACSTR " on channel %d at %d dBm",
+             s_rssi, MAC2STR(best->bssid), best->primary, best->rssi);
+    s_quiet_until = esp_timer_get_time() + ROAM_COOLDOWN_MS * 1000LL;
+    if (wifi_bridge_roam(best->bssid, best->primary) != ESP_OK) {
+        ESP_LOGW(TAG, "Roam not started");
+    }
+}
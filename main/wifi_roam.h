@@ -0,0 +1,73 @@
+#ifndef WIFI_ROAM_H
+#define WIFI_ROAM_H
+
+#include "esp_err.h"
+#include "esp_wifi.h"
+#include "sdkconfig.h"
+
+#if CONFIG_BRIDGE_ROAMING
+
+/**
+ * @brief Set up roaming between APs of the same network
+ *
+ * While connected, the link is checked every few seconds. When the RSSI
+ * falls below CONFIG_BRIDGE_ROAM_RSSI or too many frames fail to go out,
+ * the AP is first asked for a BSS transition (802.11v); failing that, the
+ * candidate channels are probed one at a time, in quiet moments between
+ * traffic bursts, and the station moves to an AP of the same SSID that is
+ * at least CONFIG_BRIDGE_ROAM_HYSTERESIS dB stronger.
+ *
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t wifi_roam_init(void);
+
+/**
+ * @brief Enable 802.11k/v/r in a station config
+ *
+ * @param sta Station config
+ */
+void wifi_roam_config(wifi_sta_config_t *sta);
+
+/**
+ * @brief Start watching the link to a newly associated AP
+ *
+ * @param event WIFI_EVENT_STA_CONNECTED data
+ */
+void wifi_roam_connected(const wifi_event_sta_connected_t *event);
+
+/**
+ * @brief Stop watching the link, abandoning any scan
+ */
+void wifi_roam_disconnected(void);
+
+/**
+ * @brief Evaluate the results of a roaming scan (WIFI_EVENT_SCAN_DONE)
+ */
+void wifi_roam_scan_done(void);
+
+#else
+
+static inline esp_err_t wifi_roam_init(void)
+{
+    return ESP_OK;
+}
+
+static inline void wifi_roam_config(wifi_sta_config_t *sta)
+{
+}
+
+static inline void wifi_roam_connected(const wifi_event_sta_connected_t *event)
+{
+}
+
+static inline void wifi_roam_disconnected(void)
+{
+}
+
+static inline void wifi_roam_scan_done(void)
+{
+}
+
+#endif // CONFIG_BRIDGE_ROAMING
+
+#endif // WIFI_ROAM_H